@@ -22,47 +22,268 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/stat.h>
+#endif
 #include "aatr-stdio.h"
 #include "aatr.c"
 
+/* Read-ahead for files too large to load: 256 sectors of 128 bytes. */
+#define AATRStdio_READ_AHEAD  32768
+
+/* Images up to this size are read into memory at once.
+   They are not mapped, because a file truncated by another process
+   while mapped would crash the player instead of failing a read. */
+#define AATRStdio_MAX_LOAD  (16 << 20)
+
+/* Indexes of recently opened images, shared by opens of the same unchanged file. */
+#define AATRStdio_INDEXES  8
+
+typedef struct {
+	char *filename;
+	int64_t size;
+	int64_t mtime;
+	AATRIndex *index;
+	int users;
+	unsigned lastUse;
+} AATRStdioIndex;
+
+static AATRStdioIndex indexes[AATRStdio_INDEXES];
+static unsigned indexesClock = 0;
+
+#ifdef _WIN32
+static SRWLOCK lock = SRWLOCK_INIT;
+#define AATRStdio_Lock()  AcquireSRWLockExclusive(&lock)
+#define AATRStdio_Unlock()  ReleaseSRWLockExclusive(&lock)
+#else
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define AATRStdio_Lock()  pthread_mutex_lock(&lock)
+#define AATRStdio_Unlock()  pthread_mutex_unlock(&lock)
+#endif
+
 typedef struct {
 	AATR base;
+	/* The whole image if loaded, otherwise NULL. */
+	uint8_t *image;
+	int imageLen;
+	/* Fallback for files that are too large to load. */
 	FILE *fp;
+	uint8_t *cache;
+	int cacheOffset;
+	int cacheLen;
+	/* Identifies the file for sharing its index, NULL if unknown. */
+	char *filename;
+	int64_t size;
+	int64_t mtime;
+	/* Set by AATRStdio_GetIndex. */
+	AATRIndex *index;
+	/* Slot in indexes or -1 if the index is owned by this image. */
+	int indexSlot;
 } AATRStdio;
 
 static bool AATRStdio_Read(const AATR *self, int offset, uint8_t *buffer, int length)
 {
-	FILE *fp = ((AATRStdio *) self)->fp;
-	return fseek(fp, offset, SEEK_SET) == 0
-		&& fread(buffer, length, 1, fp) == 1;
+	AATRStdio *me = (AATRStdio *) self;
+	if (me->image != NULL) {
+		if (offset < 0 || length > me->imageLen - offset)
+			return false;
+		memcpy(buffer, me->image + offset, length);
+		return true;
+	}
+	if (offset < me->cacheOffset || offset + length > me->cacheOffset + me->cacheLen) {
+		if (length > AATRStdio_READ_AHEAD) {
+			return fseek(me->fp, offset, SEEK_SET) == 0
+				&& fread(buffer, length, 1, me->fp) == 1;
+		}
+		/* sector chains and directories are mostly read forward */
+		me->cacheLen = 0;
+		if (fseek(me->fp, offset, SEEK_SET) != 0)
+			return false;
+		me->cacheOffset = offset;
+		me->cacheLen = (int) fread(me->cache, 1, AATRStdio_READ_AHEAD, me->fp);
+		if (length > me->cacheLen)
+			return false;
+	}
+	memcpy(buffer, me->cache + offset - me->cacheOffset, length);
+	return true;
+}
+
+static bool AATRStdio_Load(AATRStdio *self, FILE *fp)
+{
+	if (fseek(fp, 0, SEEK_END) != 0)
+		return false;
+	long size = ftell(fp);
+	if (size <= 0 || size > AATRStdio_MAX_LOAD || fseek(fp, 0, SEEK_SET) != 0)
+		return false;
+	self->image = (uint8_t *) malloc(size);
+	if (self->image == NULL)
+		return false;
+	if (fread(self->image, size, 1, fp) != 1) {
+		free(self->image);
+		self->image = NULL;
+		return false;
+	}
+	self->imageLen = (int) size;
+	return true;
+}
+
+static void AATRStdio_ReleaseIndex(AATRStdio *self)
+{
+	if (self->index == NULL)
+		return;
+	if (self->indexSlot < 0)
+		AATRIndex_Delete(self->index);
+	else {
+		AATRStdio_Lock();
+		indexes[self->indexSlot].users--;
+		AATRStdio_Unlock();
+	}
+	self->index = NULL;
+}
+
+static void AATRStdio_Close(AATRStdio *self)
+{
+	AATRStdio_ReleaseIndex(self);
+	free(self->image);
+	if (self->fp != NULL)
+		fclose(self->fp);
+	free(self->cache);
+	free(self->filename);
+	free(self);
+}
+
+static bool AATRStdio_GetFileIdentity(const char *filename, int64_t *size, int64_t *mtime)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &data)
+	 || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		return false;
+	*size = (int64_t) data.nFileSizeHigh << 32 | data.nFileSizeLow;
+	*mtime = (int64_t) data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat st;
+	if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+#endif
+	return true;
 }
 
 AATR *AATRStdio_New(const char *filename)
 {
-	FILE *fp = fopen(filename, "rb");
-	if (fp == NULL)
-		return NULL;
 	AATRStdio *self = (AATRStdio *) calloc(1, sizeof(AATRStdio));
-	if (self == NULL) {
-		fclose(fp);
+	if (self == NULL)
 		return NULL;
-	}
 	static const AATRVtbl vtbl = { AATRStdio_Read };
 	self->base.vtbl = &vtbl;
-	self->fp = fp;
+	self->fp = fopen(filename, "rb");
+	if (self->fp == NULL) {
+		AATRStdio_Close(self);
+		return NULL;
+	}
+	if (AATRStdio_Load(self, self->fp)) {
+		fclose(self->fp);
+		self->fp = NULL;
+	}
+	else {
+		self->cache = (uint8_t *) malloc(AATRStdio_READ_AHEAD);
+		if (self->cache == NULL) {
+			AATRStdio_Close(self);
+			return NULL;
+		}
+	}
 	if (!AATR_Open(&self->base)) {
-		free(self);
-		fclose(fp);
+		AATRStdio_Close(self);
 		return NULL;
 	}
+	if (AATRStdio_GetFileIdentity(filename, &self->size, &self->mtime))
+		self->filename = strdup(filename);
 	return &self->base;
 }
 
 void AATRStdio_Delete(AATR *self)
 {
-	FILE *fp = ((AATRStdio *) self)->fp;
-	free(self);
-	fclose(fp);
+	AATRStdio_Close((AATRStdio *) self);
+}
+
+static int AATRStdio_FindIndex(const AATRStdio *self)
+{
+	for (int i = 0; i < AATRStdio_INDEXES; i++) {
+		if (indexes[i].index != NULL && indexes[i].size == self->size && indexes[i].mtime == self->mtime
+		 && strcmp(indexes[i].filename, self->filename) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const AATRIndex *AATRStdio_GetIndex(AATR *self)
+{
+	AATRStdio *me = (AATRStdio *) self;
+	if (me->index != NULL)
+		return me->index;
+
+	if (me->filename != NULL) {
+		AATRStdio_Lock();
+		int slot = AATRStdio_FindIndex(me);
+		if (slot >= 0) {
+			indexes[slot].users++;
+			indexes[slot].lastUse = ++indexesClock;
+			me->index = indexes[slot].index;
+			me->indexSlot = slot;
+			AATRStdio_Unlock();
+			return me->index;
+		}
+		AATRStdio_Unlock();
+	}
+
+	/* list the files without holding the lock */
+	AATRIndex *index = AATRIndex_New();
+	if (index == NULL)
+		return NULL;
+	AATRIndex_Open(index, self);
+
+	int slot = -1;
+	if (me->filename != NULL) {
+		AATRStdio_Lock();
+		slot = AATRStdio_FindIndex(me);
+		if (slot >= 0) {
+			/* another thread indexed the same image meanwhile */
+			AATRIndex_Delete(index);
+			index = indexes[slot].index;
+		}
+		else {
+			/* replace the least recently used index that is not in use */
+			for (int i = 0; i < AATRStdio_INDEXES; i++) {
+				if (indexes[i].users == 0 && (slot < 0 || indexes[i].lastUse < indexes[slot].lastUse))
+					slot = i;
+			}
+			char *filename = slot >= 0 ? strdup(me->filename) : NULL;
+			if (filename != NULL) {
+				AATRIndex_Delete(indexes[slot].index);
+				free(indexes[slot].filename);
+				indexes[slot].filename = filename;
+				indexes[slot].size = me->size;
+				indexes[slot].mtime = me->mtime;
+				indexes[slot].index = index;
+			}
+			else
+				slot = -1;
+		}
+		if (slot >= 0) {
+			indexes[slot].users++;
+			indexes[slot].lastUse = ++indexesClock;
+		}
+		AATRStdio_Unlock();
+	}
+	me->index = index;
+	me->indexSlot = slot;
+	return index;
 }
 
 #if 0
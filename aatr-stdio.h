@@ -35,6 +35,12 @@ typedef struct AATR AATR;
 AATR *AATRStdio_New(const char *filename);
 void AATRStdio_Delete(AATR *self);
 
+/* Returns the index of all files on the disk image, valid until AATRStdio_Delete.
+   Indexes are shared between opens of the same file with unchanged size and modification time,
+   so opening the same image again doesn't list its files again.
+   Returns NULL if out of memory. */
+const AATRIndex *AATRStdio_GetIndex(AATR *self);
+
 #ifdef __cplusplus
 }
 #endif
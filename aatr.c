@@ -99,6 +99,28 @@ static void AATRFileStream_Construct(AATRFileStream *self);
 
 static void AATRFileStream_Rewind(AATRFileStream *self);
 
+/**
+ * Index of all files on an ATR disk image.
+ * Finds files by path without rescanning the directories.
+ */
+struct AATRIndex {
+	int fileCount;
+	char **paths;
+	int *firstSectors;
+	int *fileTypes;
+	int *lengths;
+	int *hashNext;
+	int hashHeads[1024];
+};
+static void AATRIndex_Construct(AATRIndex *self);
+static void AATRIndex_Destruct(AATRIndex *self);
+
+static int AATRIndex_HashPath(const char *path);
+
+static int AATRIndex_GetFirstSector(const AATRIndex *self, int file);
+
+static int AATRIndex_GetFileType(const AATRIndex *self, int file);
+
 bool AATR_Open(AATR *self)
 {
 	uint8_t header[6];
@@ -397,6 +419,14 @@ void AATRFileStream_Open(AATRFileStream *self, const AATRDirectory *directory)
 	AATRFileStream_Rewind(self);
 }
 
+void AATRFileStream_OpenIndexed(AATRFileStream *self, const AATR *disk, const AATRIndex *index, int file)
+{
+	self->disk = disk;
+	self->firstSector = AATRIndex_GetFirstSector(index, file);
+	self->fileType = AATRIndex_GetFileType(index, file);
+	AATRFileStream_Rewind(self);
+}
+
 int AATRFileStream_Read(AATRFileStream *self, uint8_t *buffer, int offset, int length)
 {
 	int totalRead = 0;
@@ -461,3 +491,135 @@ int AATRFileStream_GetLength(AATRFileStream *self)
 	AATRFileStream_SetPosition(self, position);
 	return length;
 }
+
+static void AATRIndex_Construct(AATRIndex *self)
+{
+	self->paths = NULL;
+	self->firstSectors = NULL;
+	self->fileTypes = NULL;
+	self->lengths = NULL;
+	self->hashNext = NULL;
+	for (int _i0 = 0; _i0 < 1024; _i0++)
+		self->hashHeads[_i0] = -1;
+}
+
+static void AATRIndex_FreePaths(AATRIndex *self)
+{
+	if (self->paths == NULL)
+		return;
+	for (int _i0 = self->fileCount; --_i0 >= 0;)
+		free(self->paths[_i0]);
+	free(self->paths);
+}
+
+static void AATRIndex_Destruct(AATRIndex *self)
+{
+	free(self->hashNext);
+	free(self->lengths);
+	free(self->fileTypes);
+	free(self->firstSectors);
+	AATRIndex_FreePaths(self);
+}
+
+AATRIndex *AATRIndex_New(void)
+{
+	AATRIndex *self = (AATRIndex *) malloc(sizeof(AATRIndex));
+	if (self != NULL)
+		AATRIndex_Construct(self);
+	return self;
+}
+
+void AATRIndex_Delete(AATRIndex *self)
+{
+	if (self == NULL)
+		return;
+	AATRIndex_Destruct(self);
+	free(self);
+}
+
+static int AATRIndex_HashPath(const char *path)
+{
+	int hash = 0;
+	int length = (int) strlen(path);
+	for (int i = 0; i < length; i++)
+		hash = (hash * 31 + path[i]) & 1023;
+	return hash;
+}
+
+void AATRIndex_Open(AATRIndex *self, const AATR *disk)
+{
+	AATRRecursiveLister lister;
+	AATRRecursiveLister_Construct(&lister);
+	AATRRecursiveLister_Open(&lister, disk);
+	int fileCount = 0;
+	while (AATRRecursiveLister_NextFile(&lister) != NULL)
+		fileCount++;
+	AATRIndex_FreePaths(self);
+	self->fileCount = 0;
+	self->paths = (char **) malloc(fileCount * sizeof(char *));
+	free(self->firstSectors);
+	self->firstSectors = (int *) malloc(fileCount * sizeof(int));
+	free(self->fileTypes);
+	self->fileTypes = (int *) malloc(fileCount * sizeof(int));
+	free(self->lengths);
+	self->lengths = (int *) malloc(fileCount * sizeof(int));
+	free(self->hashNext);
+	self->hashNext = (int *) malloc(fileCount * sizeof(int));
+	for (int _i0 = 0; _i0 < 1024; _i0++)
+		self->hashHeads[_i0] = -1;
+	AATRFileStream stream = { 0 };
+	AATRRecursiveLister_Open(&lister, disk);
+	while (self->fileCount < fileCount) {
+		const char *path = AATRRecursiveLister_NextFile(&lister);
+		if (path == NULL)
+			break;
+		int file = self->fileCount;
+		self->paths[file] = _strdup(path);
+		const AATRDirectory *directory = AATRRecursiveLister_GetDirectory(&lister);
+		self->firstSectors[file] = AATRDirectory_GetEntryFirstSector(directory);
+		self->fileTypes[file] = AATRDirectory_GetEntryType(directory) & 6;
+		AATRFileStream_Open(&stream, directory);
+		self->lengths[file] = AATRFileStream_GetLength(&stream);
+		if (AATRIndex_FindFile(self, path) < 0) {
+			int hash = AATRIndex_HashPath(path);
+			self->hashNext[file] = self->hashHeads[hash];
+			self->hashHeads[hash] = file;
+		}
+		self->fileCount++;
+	}
+	AATRRecursiveLister_Destruct(&lister);
+}
+
+int AATRIndex_GetFileCount(const AATRIndex *self)
+{
+	return self->fileCount;
+}
+
+const char *AATRIndex_GetPath(const AATRIndex *self, int file)
+{
+	return self->paths[file];
+}
+
+int AATRIndex_GetLength(const AATRIndex *self, int file)
+{
+	return self->lengths[file];
+}
+
+static int AATRIndex_GetFirstSector(const AATRIndex *self, int file)
+{
+	return self->firstSectors[file];
+}
+
+static int AATRIndex_GetFileType(const AATRIndex *self, int file)
+{
+	return self->fileTypes[file];
+}
+
+int AATRIndex_FindFile(const AATRIndex *self, const char *path)
+{
+	for (int file = self->hashHeads[AATRIndex_HashPath(path)]; file >= 0; file = self->hashNext[file]) {
+		if (strcmp(self->paths[file], path) == 0)
+			return file;
+	}
+	return -1;
+}
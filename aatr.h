@@ -9,6 +9,7 @@ typedef struct AATR AATR;
 typedef struct AATRDirectory AATRDirectory;
 typedef struct AATRRecursiveLister AATRRecursiveLister;
 typedef struct AATRFileStream AATRFileStream;
+typedef struct AATRIndex AATRIndex;
 
 /**
  * Opens an ATR disk image.
@@ -102,6 +103,15 @@ void AATRFileStream_Delete(AATRFileStream *self);
  */
 void AATRFileStream_Open(AATRFileStream *self, const AATRDirectory *directory);
 
+/**
+ * Opens a file found in an index of the disk image.
+ * @param self This <code>AATRFileStream</code>.
+ * @param disk The disk image.
+ * @param index Index of the disk image.
+ * @param file File number in the index.
+ */
+void AATRFileStream_OpenIndexed(AATRFileStream *self, const AATR *disk, const AATRIndex *index, int file);
+
 /**
  * Reads from the open file.
  * Returns the number of bytes read.
@@ -138,6 +148,44 @@ bool AATRFileStream_SetPosition(AATRFileStream *self, int position);
  */
 int AATRFileStream_GetLength(AATRFileStream *self);
 
+AATRIndex *AATRIndex_New(void);
+void AATRIndex_Delete(AATRIndex *self);
+
+/**
+ * Lists all files on the specified disk image.
+ * @param self This <code>AATRIndex</code>.
+ * @param disk The disk image.
+ */
+void AATRIndex_Open(AATRIndex *self, const AATR *disk);
+
+/**
+ * Returns the number of files on the disk image.
+ * @param self This <code>AATRIndex</code>.
+ */
+int AATRIndex_GetFileCount(const AATRIndex *self);
+
+/**
+ * Returns the full path of the specified file.
+ * @param self This <code>AATRIndex</code>.
+ * @param file File number, 0-based.
+ */
+const char *AATRIndex_GetPath(const AATRIndex *self, int file);
+
+/**
+ * Returns the length of the specified file.
+ * @param self This <code>AATRIndex</code>.
+ * @param file File number, 0-based.
+ */
+int AATRIndex_GetLength(const AATRIndex *self, int file);
+
+/**
+ * Finds a file by its full path.
+ * Returns the file number or -1 if not found.
+ * @param self This <code>AATRIndex</code>.
+ * @param path The full path, with subdirectories separated with slashes.
+ */
+int AATRIndex_FindFile(const AATRIndex *self, const char *path);
+
 #ifdef __cplusplus
 }
 #endif
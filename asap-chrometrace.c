@@ -0,0 +1,120 @@
+/*
+ * asap-chrometrace.c - emulation timeline in Chrome trace event format
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "asap-chrometrace.h"
+
+/* Same layout as the virtual method table of ASAPTimelineSink in asap-timeline.c. */
+typedef struct {
+	void (*begin)(ASAPTimelineSink *self, ASAPTimelineStage stage);
+	void (*end)(ASAPTimelineSink *self, ASAPTimelineStage stage);
+} ASAPChromeTraceVtbl;
+
+struct ASAPChromeTrace
+{
+	const ASAPChromeTraceVtbl *vtbl;
+	ASAPChromeTraceWrite write;
+	void *opaque;
+	double startMicroseconds;
+	int frame;
+	bool empty;
+};
+
+static double ASAPChromeTrace_GetMicroseconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart * 1e6 / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#endif
+}
+
+static void ASAPChromeTrace_WriteEvent(ASAPChromeTrace *self, ASAPTimelineStage stage, char phase)
+{
+	static const char * const names[] = { "Frame", "StartFrame", "Cpu", "PokeyWrite", "EndFrame", "Generate" };
+	double ts = ASAPChromeTrace_GetMicroseconds() - self->startMicroseconds;
+	char event[160];
+	int length;
+	if (stage == ASAPTimelineStage_FRAME && phase == 'B') {
+		length = snprintf(event, sizeof(event), "%s{\"name\":\"Frame\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"frame\":%d}}",
+			self->empty ? "" : ",\n", ts, self->frame++);
+	}
+	else {
+		length = snprintf(event, sizeof(event), "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+			self->empty ? "" : ",\n", names[stage], phase, ts);
+	}
+	self->empty = false;
+	self->write(self->opaque, event, length);
+}
+
+static void ASAPChromeTrace_Begin(ASAPTimelineSink *self, ASAPTimelineStage stage)
+{
+	ASAPChromeTrace_WriteEvent((ASAPChromeTrace *) self, stage, 'B');
+}
+
+static void ASAPChromeTrace_End(ASAPTimelineSink *self, ASAPTimelineStage stage)
+{
+	ASAPChromeTrace_WriteEvent((ASAPChromeTrace *) self, stage, 'E');
+}
+
+ASAPChromeTrace *ASAPChromeTrace_New(ASAPChromeTraceWrite write, void *opaque)
+{
+	static const ASAPChromeTraceVtbl vtbl = { ASAPChromeTrace_Begin, ASAPChromeTrace_End };
+	ASAPChromeTrace *self = (ASAPChromeTrace *) malloc(sizeof(ASAPChromeTrace));
+	if (self == NULL)
+		return NULL;
+	self->vtbl = &vtbl;
+	self->write = write;
+	self->opaque = opaque;
+	self->startMicroseconds = ASAPChromeTrace_GetMicroseconds();
+	self->frame = 0;
+	self->empty = true;
+	write(opaque, "[\n", 2);
+	return self;
+}
+
+void ASAPChromeTrace_Delete(ASAPChromeTrace *self)
+{
+	if (self == NULL)
+		return;
+	self->write(self->opaque, "\n]\n", 3);
+	free(self);
+}
+
+ASAPTimelineSink *ASAPChromeTrace_GetSink(ASAPChromeTrace *self)
+{
+	return (ASAPTimelineSink *) self;
+}
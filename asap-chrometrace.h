@@ -0,0 +1,53 @@
+/*
+ * asap-chrometrace.h - emulation timeline in Chrome trace event format
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef _ASAP_CHROMETRACE_H_
+#define _ASAP_CHROMETRACE_H_
+
+#include "asap-timeline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Receives the text of the trace, in pieces. */
+typedef void (*ASAPChromeTraceWrite)(void *opaque, const char *text, int length);
+
+typedef struct ASAPChromeTrace ASAPChromeTrace;
+
+/* Creates a timeline sink writing a JSON array of trace events,
+   to be opened in chrome://tracing, Perfetto or Speedscope.
+   Timestamps are in microseconds since this call. */
+ASAPChromeTrace *ASAPChromeTrace_New(ASAPChromeTraceWrite write, void *opaque);
+
+/* Closes the JSON array. Unregister the sink with ASAP_SetTimelineSink first. */
+void ASAPChromeTrace_Delete(ASAPChromeTrace *self);
+
+/* Returns the sink to pass to ASAP_SetTimelineSink. */
+ASAPTimelineSink *ASAPChromeTrace_GetSink(ASAPChromeTrace *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
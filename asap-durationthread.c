@@ -0,0 +1,165 @@
+/*
+ * asap-durationthread.c - song length detection in the background
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "asap-durationthread.h"
+#include "asap-metacache.h"
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION ASAPDurationThreadMutex;
+#define ASAPDurationThreadMutex_Init(m)     InitializeCriticalSection(m)
+#define ASAPDurationThreadMutex_Destroy(m)  DeleteCriticalSection(m)
+#define ASAPDurationThreadMutex_Lock(m)     EnterCriticalSection(m)
+#define ASAPDurationThreadMutex_Unlock(m)   LeaveCriticalSection(m)
+#else
+typedef pthread_mutex_t ASAPDurationThreadMutex;
+#define ASAPDurationThreadMutex_Init(m)     pthread_mutex_init(m, NULL)
+#define ASAPDurationThreadMutex_Destroy(m)  pthread_mutex_destroy(m)
+#define ASAPDurationThreadMutex_Lock(m)     pthread_mutex_lock(m)
+#define ASAPDurationThreadMutex_Unlock(m)   pthread_mutex_unlock(m)
+#endif
+
+/* Shared by the player and the thread, freed by the one that releases it last. */
+struct ASAPDurationThread
+{
+	ASAPDurationThreadMutex mutex;
+	int references;
+	bool done;
+	int duration;
+	char *filename;
+	bool localFile;
+	uint8_t *module;
+	int moduleLen;
+	int song;
+	int maxSeconds;
+	int silenceSeconds;
+};
+
+static void ASAPDurationThread_Release(ASAPDurationThread *self)
+{
+	ASAPDurationThreadMutex_Lock(&self->mutex);
+	bool last = --self->references == 0;
+	ASAPDurationThreadMutex_Unlock(&self->mutex);
+	if (last) {
+		ASAPDurationThreadMutex_Destroy(&self->mutex);
+		free(self->filename);
+		free(self->module);
+		free(self);
+	}
+}
+
+static void ASAPDurationThread_Run(ASAPDurationThread *self)
+{
+	int duration = -1;
+	ASAP *asap = ASAP_New();
+	if (asap != NULL && ASAP_Load(asap, self->filename, self->module, self->moduleLen)
+	 && ASAP_DetectDuration(asap, self->song, self->maxSeconds, self->silenceSeconds)) {
+		const ASAPInfo *info = ASAP_GetInfo(asap);
+		duration = ASAPInfo_GetDuration(info, self->song);
+		ASAPMetaCache_Put(self->localFile ? self->filename : NULL, self->module, self->moduleLen, info);
+	}
+	ASAP_Delete(asap);
+	ASAPDurationThreadMutex_Lock(&self->mutex);
+	self->done = true;
+	self->duration = duration;
+	ASAPDurationThreadMutex_Unlock(&self->mutex);
+	ASAPDurationThread_Release(self);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ASAPDurationThread_Thread(LPVOID arg)
+{
+	ASAPDurationThread_Run((ASAPDurationThread *) arg);
+	return 0;
+}
+#else
+static void *ASAPDurationThread_Thread(void *arg)
+{
+	ASAPDurationThread_Run((ASAPDurationThread *) arg);
+	return NULL;
+}
+#endif
+
+ASAPDurationThread *ASAPDurationThread_Start(const char *filename, bool localFile, uint8_t const *module, int moduleLen, int song, int maxSeconds, int silenceSeconds)
+{
+	ASAPDurationThread *self = malloc(sizeof(ASAPDurationThread));
+	if (self == NULL)
+		return NULL;
+	self->filename = strdup(filename);
+	self->module = malloc(moduleLen);
+	if (self->filename == NULL || self->module == NULL) {
+		free(self->filename);
+		free(self->module);
+		free(self);
+		return NULL;
+	}
+	memcpy(self->module, module, moduleLen);
+	ASAPDurationThreadMutex_Init(&self->mutex);
+	self->references = 2;
+	self->done = false;
+	self->duration = -1;
+	self->localFile = localFile;
+	self->moduleLen = moduleLen;
+	self->song = song;
+	self->maxSeconds = maxSeconds;
+	self->silenceSeconds = silenceSeconds;
+#ifdef _WIN32
+	HANDLE thread = CreateThread(NULL, 0, ASAPDurationThread_Thread, self, 0, NULL);
+	bool started = thread != NULL;
+	if (started)
+		CloseHandle(thread);
+#else
+	pthread_t thread;
+	bool started = pthread_create(&thread, NULL, ASAPDurationThread_Thread, self) == 0;
+	if (started)
+		pthread_detach(thread);
+#endif
+	if (!started) {
+		self->references = 1;
+		ASAPDurationThread_Release(self);
+		return NULL;
+	}
+	return self;
+}
+
+bool ASAPDurationThread_GetDuration(ASAPDurationThread *self, int *duration)
+{
+	ASAPDurationThreadMutex_Lock(&self->mutex);
+	bool done = self->done;
+	*duration = self->duration;
+	ASAPDurationThreadMutex_Unlock(&self->mutex);
+	return done;
+}
+
+void ASAPDurationThread_Delete(ASAPDurationThread *self)
+{
+	if (self != NULL)
+		ASAPDurationThread_Release(self);
+}
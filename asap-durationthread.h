@@ -0,0 +1,56 @@
+/*
+ * asap-durationthread.h - song length detection in the background
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _ASAP_DURATIONTHREAD_H_
+#define _ASAP_DURATIONTHREAD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "asap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ASAPDurationThread ASAPDurationThread;
+
+/* Starts ASAP_DetectDuration of the song in a separate thread,
+   on its own ASAP loaded from a copy of the module,
+   so that players can start playback without waiting for it.
+   The result is stored with ASAPMetaCache_Put, under filename
+   only if localFile is true. Returns NULL on error. */
+ASAPDurationThread *ASAPDurationThread_Start(const char *filename, bool localFile, uint8_t const *module, int moduleLen, int song, int maxSeconds, int silenceSeconds);
+
+/* Returns true and the detected duration in milliseconds
+   (-1 if no silence or loop was found) once the detection finished,
+   false while it is running. */
+bool ASAPDurationThread_GetDuration(ASAPDurationThread *self, int *duration);
+
+/* Detaches from the detection, which is not waited for.
+   The thread frees the resources when it finishes. */
+void ASAPDurationThread_Delete(ASAPDurationThread *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,882 @@
+/*
+ * asap-flac.c - multithreaded FLAC encoder
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 /* condition variables */
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "asap.h"
+#include "asap-flac.h"
+
+#define ASAPFlac_BLOCK_SIZE 4096
+#define ASAPFlac_MAX_LPC_ORDER 8
+#define ASAPFlac_LPC_PRECISION 12
+#define ASAPFlac_MAX_PARTITION_ORDER 6
+#define ASAPFlac_MAX_RICE_PARAMETER 14 /* 15 is the escape code */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION ASAPFlacMutex;
+typedef CONDITION_VARIABLE ASAPFlacCondition;
+typedef HANDLE ASAPFlacThread;
+#define ASAPFlacMutex_Init(m)         InitializeCriticalSection(m)
+#define ASAPFlacMutex_Destroy(m)      DeleteCriticalSection(m)
+#define ASAPFlacMutex_Lock(m)         EnterCriticalSection(m)
+#define ASAPFlacMutex_Unlock(m)       LeaveCriticalSection(m)
+#define ASAPFlacCondition_Init(c)     InitializeConditionVariable(c)
+#define ASAPFlacCondition_Destroy(c)
+#define ASAPFlacCondition_Wait(c, m)  SleepConditionVariableCS(c, m, INFINITE)
+#define ASAPFlacCondition_Broadcast(c)  WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t ASAPFlacMutex;
+typedef pthread_cond_t ASAPFlacCondition;
+typedef pthread_t ASAPFlacThread;
+#define ASAPFlacMutex_Init(m)         pthread_mutex_init(m, NULL)
+#define ASAPFlacMutex_Destroy(m)      pthread_mutex_destroy(m)
+#define ASAPFlacMutex_Lock(m)         pthread_mutex_lock(m)
+#define ASAPFlacMutex_Unlock(m)       pthread_mutex_unlock(m)
+#define ASAPFlacCondition_Init(c)     pthread_cond_init(c, NULL)
+#define ASAPFlacCondition_Destroy(c)  pthread_cond_destroy(c)
+#define ASAPFlacCondition_Wait(c, m)  pthread_cond_wait(c, m)
+#define ASAPFlacCondition_Broadcast(c)  pthread_cond_broadcast(c)
+#endif
+
+typedef enum {
+	ASAPFlacFrameState_FREE,
+	ASAPFlacFrameState_FILLED,
+	ASAPFlacFrameState_ENCODING,
+	ASAPFlacFrameState_ENCODED
+} ASAPFlacFrameState;
+
+typedef struct {
+	ASAPFlacFrameState state;
+	int64_t number;
+	int blocks;
+	int32_t *samples; /* ASAPFlac_BLOCK_SIZE per channel */
+	uint8_t *output;
+	int outputLength;
+} ASAPFlacFrame;
+
+typedef enum {
+	ASAPFlacSubframeType_CONSTANT,
+	ASAPFlacSubframeType_VERBATIM,
+	ASAPFlacSubframeType_FIXED,
+	ASAPFlacSubframeType_LPC
+} ASAPFlacSubframeType;
+
+typedef struct {
+	ASAPFlacSubframeType type;
+	int order;
+	int shift;
+	int32_t coefs[ASAPFlac_MAX_LPC_ORDER];
+	int partitionOrder;
+	int riceParameters[1 << ASAPFlac_MAX_PARTITION_ORDER];
+	const int32_t *residual;
+	int64_t bits;
+} ASAPFlacSubframe;
+
+/* Scratch buffers of one encoding thread.
+   Signals are left, right, side and mid. */
+typedef struct {
+	struct ASAPFlacEncoder *encoder;
+	int32_t *signals[4];
+	int32_t *residuals[4][2];
+	double *window;
+	double *windowed;
+	int windowBlocks;
+	ASAPFlacSubframe subframes[4];
+	ASAPFlacThread thread;
+} ASAPFlacWorker;
+
+typedef struct {
+	uint8_t *buffer;
+	int length;
+	uint64_t bits;
+	int count;
+} ASAPFlacBitWriter;
+
+struct ASAPFlacEncoder
+{
+	int sampleRate;
+	int channels;
+	int64_t totalSamples;
+	ASAPFlacWrite write;
+	void *opaque;
+
+	uint8_t *comments;
+	int commentsLength;
+	int commentsCount;
+	bool headerWritten;
+
+	uint8_t crc8[256];
+	uint16_t crc16[256];
+
+	ASAPFlacFrame *frames;
+	int framesCount;
+	int outputCapacity;
+	int64_t nextFill;
+	int64_t nextEncode;
+	int64_t nextWrite;
+
+	ASAPFlacMutex mutex;
+	ASAPFlacCondition filled;
+	ASAPFlacCondition encoded;
+	bool quit;
+	ASAPFlacWorker *workers;
+	int workersCount; /* the first one is the calling thread */
+	int threadsStarted;
+};
+
+static void ASAPFlacBitWriter_Put(ASAPFlacBitWriter *self, uint32_t value, int n)
+{
+	if (n == 0)
+		return;
+	self->bits = self->bits << n | (value & (uint32_t) (((uint64_t) 1 << n) - 1));
+	self->count += n;
+	while (self->count >= 8) {
+		self->count -= 8;
+		self->buffer[self->length++] = (uint8_t) (self->bits >> self->count);
+	}
+	self->bits &= (1 << self->count) - 1;
+}
+
+static void ASAPFlacBitWriter_PutRice(ASAPFlacBitWriter *self, int32_t residual, int parameter)
+{
+	uint32_t u = (uint32_t) residual << 1 ^ (uint32_t) (residual >> 31);
+	uint32_t quotient = u >> parameter;
+	for (; quotient >= 16; quotient -= 16)
+		ASAPFlacBitWriter_Put(self, 0, 16);
+	ASAPFlacBitWriter_Put(self, (1 << parameter) | (u & ((1 << parameter) - 1)), quotient + 1 + parameter);
+}
+
+static void ASAPFlacBitWriter_PutUtf8(ASAPFlacBitWriter *self, int64_t value)
+{
+	if (value < 0x80) {
+		ASAPFlacBitWriter_Put(self, (uint32_t) value, 8);
+		return;
+	}
+	int bytes = 2;
+	while (value >= (int64_t) 1 << (5 * bytes + 1))
+		bytes++;
+	ASAPFlacBitWriter_Put(self, (0xff00 >> bytes & 0xff) | (uint32_t) (value >> (6 * (bytes - 1))), 8);
+	while (--bytes > 0)
+		ASAPFlacBitWriter_Put(self, 0x80 | (uint32_t) (value >> (6 * (bytes - 1)) & 0x3f), 8);
+}
+
+static void ASAPFlacBitWriter_Align(ASAPFlacBitWriter *self)
+{
+	if (self->count > 0)
+		ASAPFlacBitWriter_Put(self, 0, 8 - self->count);
+}
+
+/* Chooses the Rice partitioning of residual for samples order..blocks-1
+   and returns its estimated size in bits. */
+static int64_t ASAPFlacSubframe_ChooseRice(ASAPFlacSubframe *self, int blocks)
+{
+	int order = self->order;
+	int maxPartitionOrder = 0;
+	while (maxPartitionOrder < ASAPFlac_MAX_PARTITION_ORDER
+		&& (blocks >> (maxPartitionOrder + 1) << (maxPartitionOrder + 1)) == blocks
+		&& blocks >> (maxPartitionOrder + 1) > order)
+		maxPartitionOrder++;
+
+	uint64_t sums[1 << ASAPFlac_MAX_PARTITION_ORDER];
+	int partitions = 1 << maxPartitionOrder;
+	int partitionBlocks = blocks >> maxPartitionOrder;
+	const int32_t *residual = self->residual;
+	for (int partition = 0, i = order; partition < partitions; partition++) {
+		uint64_t sum = 0;
+		for (int end = (partition + 1) * partitionBlocks; i < end; i++) {
+			int32_t r = residual[i];
+			sum += (uint32_t) r << 1 ^ (uint32_t) (r >> 31);
+		}
+		sums[partition] = sum;
+	}
+
+	int64_t bestBits = INT64_MAX;
+	for (int partitionOrder = maxPartitionOrder; ; partitionOrder--) {
+		partitions = 1 << partitionOrder;
+		partitionBlocks = blocks >> partitionOrder;
+		int64_t bits = 2 + 4;
+		int parameters[1 << ASAPFlac_MAX_PARTITION_ORDER];
+		for (int partition = 0; partition < partitions; partition++) {
+			int n = partition == 0 ? partitionBlocks - order : partitionBlocks;
+			uint64_t sum = sums[partition];
+			int64_t partitionBits = INT64_MAX;
+			for (int parameter = 0; parameter <= ASAPFlac_MAX_RICE_PARAMETER; parameter++) {
+				/* the sum of quotients is at most sum >> parameter */
+				int64_t parameterBits = (int64_t) n * (parameter + 1) + (int64_t) (sum >> parameter);
+				if (partitionBits > parameterBits) {
+					partitionBits = parameterBits;
+					parameters[partition] = parameter;
+				}
+			}
+			bits += 4 + partitionBits;
+		}
+		if (bestBits > bits) {
+			bestBits = bits;
+			self->partitionOrder = partitionOrder;
+			memcpy(self->riceParameters, parameters, partitions * sizeof(int));
+		}
+		if (partitionOrder == 0)
+			break;
+		for (int partition = 0; partition < partitions >> 1; partition++)
+			sums[partition] = sums[2 * partition] + sums[2 * partition + 1];
+	}
+	return bestBits;
+}
+
+static void ASAPFlacSubframe_Fixed(ASAPFlacSubframe *self, const int32_t *signal, int blocks, int bitsPerSample, int32_t *residual)
+{
+	/* pick the order with the smallest sum of absolute residuals */
+	uint64_t sums[5] = { 0, 0, 0, 0, 0 };
+	for (int i = 4; i < blocks; i++) {
+		int32_t e0 = signal[i];
+		int32_t e1 = e0 - signal[i - 1];
+		int32_t e2 = e1 - (signal[i - 1] - signal[i - 2]);
+		int32_t e3 = e2 - (signal[i - 1] - 2 * signal[i - 2] + signal[i - 3]);
+		int32_t e4 = e3 - (signal[i - 1] - 3 * signal[i - 2] + 3 * signal[i - 3] - signal[i - 4]);
+		sums[0] += abs(e0);
+		sums[1] += abs(e1);
+		sums[2] += abs(e2);
+		sums[3] += abs(e3);
+		sums[4] += abs(e4);
+	}
+	int order = 0;
+	for (int i = 1; i < 5 && i < blocks; i++) {
+		if (sums[order] > sums[i])
+			order = i;
+	}
+
+	for (int i = order; i < blocks; i++) {
+		switch (order) {
+		case 0:
+			residual[i] = signal[i];
+			break;
+		case 1:
+			residual[i] = signal[i] - signal[i - 1];
+			break;
+		case 2:
+			residual[i] = signal[i] - 2 * signal[i - 1] + signal[i - 2];
+			break;
+		case 3:
+			residual[i] = signal[i] - 3 * signal[i - 1] + 3 * signal[i - 2] - signal[i - 3];
+			break;
+		default:
+			residual[i] = signal[i] - 4 * signal[i - 1] + 6 * signal[i - 2] - 4 * signal[i - 3] + signal[i - 4];
+			break;
+		}
+	}
+	self->type = ASAPFlacSubframeType_FIXED;
+	self->order = order;
+	self->residual = residual;
+	self->bits = 8 + order * bitsPerSample + ASAPFlacSubframe_ChooseRice(self, blocks);
+}
+
+/* Tukey(0.5) window, as used by the reference encoder. */
+static void ASAPFlacWorker_SetWindow(ASAPFlacWorker *self, int blocks)
+{
+	if (self->windowBlocks == blocks)
+		return;
+	self->windowBlocks = blocks;
+	int taper = blocks / 4;
+	for (int i = 0; i < blocks; i++) {
+		double w = 1;
+		if (i < taper)
+			w = 0.5 - 0.5 * cos(M_PI * i / taper);
+		else if (i >= blocks - taper)
+			w = 0.5 - 0.5 * cos(M_PI * (blocks - 1 - i) / taper);
+		self->window[i] = w;
+	}
+}
+
+static bool ASAPFlacSubframe_Lpc(ASAPFlacSubframe *self, ASAPFlacWorker *worker, const int32_t *signal, int blocks, int bitsPerSample, int32_t *residual)
+{
+	int maxOrder = ASAPFlac_MAX_LPC_ORDER;
+	if (maxOrder >= blocks)
+		maxOrder = blocks - 1;
+	if (maxOrder < 1)
+		return false;
+	ASAPFlacWorker_SetWindow(worker, blocks);
+	double *windowed = worker->windowed;
+	for (int i = 0; i < blocks; i++)
+		windowed[i] = signal[i] * worker->window[i];
+	double autocorrelation[ASAPFlac_MAX_LPC_ORDER + 1];
+	for (int lag = 0; lag <= maxOrder; lag++) {
+		double sum = 0;
+		for (int i = lag; i < blocks; i++)
+			sum += windowed[i] * windowed[i - lag];
+		autocorrelation[lag] = sum;
+	}
+	if (autocorrelation[0] == 0)
+		return false;
+
+	/* Levinson-Durbin recursion, keeping the predictor and the error of each order */
+	double lpc[ASAPFlac_MAX_LPC_ORDER];
+	double coefs[ASAPFlac_MAX_LPC_ORDER][ASAPFlac_MAX_LPC_ORDER];
+	double errors[ASAPFlac_MAX_LPC_ORDER];
+	double error = autocorrelation[0];
+	for (int i = 0; i < maxOrder; i++) {
+		double r = -autocorrelation[i + 1];
+		for (int j = 0; j < i; j++)
+			r -= lpc[j] * autocorrelation[i - j];
+		r /= error;
+		lpc[i] = r;
+		for (int j = 0; j < i >> 1; j++) {
+			double t = lpc[j];
+			lpc[j] += r * lpc[i - 1 - j];
+			lpc[i - 1 - j] += r * t;
+		}
+		if ((i & 1) != 0)
+			lpc[i >> 1] += lpc[i >> 1] * r;
+		error *= 1 - r * r;
+		for (int j = 0; j <= i; j++)
+			coefs[i][j] = -lpc[j];
+		errors[i] = error;
+	}
+
+	/* estimate the residual size from the prediction error */
+	int order = 1;
+	double bestBits = HUGE_VAL;
+	for (int i = 0; i < maxOrder; i++) {
+		double bitsPerResidual = errors[i] > 0 ? 0.5 * log2(errors[i] * 0.5 / blocks) : 0;
+		if (bitsPerResidual < 0)
+			bitsPerResidual = 0;
+		double bits = bitsPerResidual * (blocks - i - 1) + (i + 1) * (ASAPFlac_LPC_PRECISION + bitsPerSample);
+		if (bestBits > bits) {
+			bestBits = bits;
+			order = i + 1;
+		}
+	}
+
+	/* quantize the coefficients, feeding the rounding error forward */
+	double maxCoef = 0;
+	for (int i = 0; i < order; i++) {
+		double c = fabs(coefs[order - 1][i]);
+		if (maxCoef < c)
+			maxCoef = c;
+	}
+	if (maxCoef == 0)
+		return false;
+	int log2MaxCoef;
+	frexp(maxCoef, &log2MaxCoef);
+	int shift = ASAPFlac_LPC_PRECISION - log2MaxCoef - 1;
+	if (shift > 15)
+		shift = 15;
+	if (shift < 0)
+		return false;
+	const int32_t maxQ = (1 << (ASAPFlac_LPC_PRECISION - 1)) - 1;
+	double roundingError = 0;
+	for (int i = 0; i < order; i++) {
+		roundingError += coefs[order - 1][i] * (1 << shift);
+		long q = lround(roundingError);
+		if (q > maxQ)
+			q = maxQ;
+		else if (q < -maxQ - 1)
+			q = -maxQ - 1;
+		roundingError -= q;
+		self->coefs[i] = (int32_t) q;
+	}
+
+	for (int i = order; i < blocks; i++) {
+		int64_t sum = 0;
+		for (int j = 0; j < order; j++)
+			sum += (int64_t) self->coefs[j] * signal[i - 1 - j];
+		residual[i] = signal[i] - (int32_t) (sum >> shift);
+	}
+	self->type = ASAPFlacSubframeType_LPC;
+	self->order = order;
+	self->shift = shift;
+	self->residual = residual;
+	self->bits = 8 + order * bitsPerSample + 4 + 5 + order * ASAPFlac_LPC_PRECISION + ASAPFlacSubframe_ChooseRice(self, blocks);
+	return true;
+}
+
+static void ASAPFlacWorker_Analyze(ASAPFlacWorker *self, int signal, int blocks, int bitsPerSample)
+{
+	ASAPFlacSubframe *subframe = self->subframes + signal;
+	const int32_t *samples = self->signals[signal];
+	int i = 1;
+	while (i < blocks && samples[i] == samples[0])
+		i++;
+	if (i == blocks) {
+		subframe->type = ASAPFlacSubframeType_CONSTANT;
+		subframe->bits = 8 + bitsPerSample;
+		return;
+	}
+
+	ASAPFlacSubframe_Fixed(subframe, samples, blocks, bitsPerSample, self->residuals[signal][0]);
+	ASAPFlacSubframe lpc;
+	if (ASAPFlacSubframe_Lpc(&lpc, self, samples, blocks, bitsPerSample, self->residuals[signal][1]) && lpc.bits < subframe->bits)
+		*subframe = lpc;
+	if (subframe->bits >= 8 + (int64_t) blocks * bitsPerSample) {
+		subframe->type = ASAPFlacSubframeType_VERBATIM;
+		subframe->bits = 8 + (int64_t) blocks * bitsPerSample;
+	}
+}
+
+static void ASAPFlacWorker_PutSubframe(ASAPFlacWorker *self, ASAPFlacBitWriter *w, int signal, int blocks, int bitsPerSample)
+{
+	const ASAPFlacSubframe *subframe = self->subframes + signal;
+	const int32_t *samples = self->signals[signal];
+	switch (subframe->type) {
+	case ASAPFlacSubframeType_CONSTANT:
+		ASAPFlacBitWriter_Put(w, 0, 8);
+		ASAPFlacBitWriter_Put(w, (uint32_t) samples[0], bitsPerSample);
+		return;
+	case ASAPFlacSubframeType_VERBATIM:
+		ASAPFlacBitWriter_Put(w, 1 << 1, 8);
+		for (int i = 0; i < blocks; i++)
+			ASAPFlacBitWriter_Put(w, (uint32_t) samples[i], bitsPerSample);
+		return;
+	case ASAPFlacSubframeType_FIXED:
+		ASAPFlacBitWriter_Put(w, (8 + subframe->order) << 1, 8);
+		break;
+	case ASAPFlacSubframeType_LPC:
+		ASAPFlacBitWriter_Put(w, (32 + subframe->order - 1) << 1, 8);
+		break;
+	}
+	for (int i = 0; i < subframe->order; i++)
+		ASAPFlacBitWriter_Put(w, (uint32_t) samples[i], bitsPerSample);
+	if (subframe->type == ASAPFlacSubframeType_LPC) {
+		ASAPFlacBitWriter_Put(w, ASAPFlac_LPC_PRECISION - 1, 4);
+		ASAPFlacBitWriter_Put(w, subframe->shift, 5);
+		for (int i = 0; i < subframe->order; i++)
+			ASAPFlacBitWriter_Put(w, (uint32_t) subframe->coefs[i], ASAPFlac_LPC_PRECISION);
+	}
+
+	ASAPFlacBitWriter_Put(w, 0, 2); /* 4-bit Rice parameters */
+	ASAPFlacBitWriter_Put(w, subframe->partitionOrder, 4);
+	int partitions = 1 << subframe->partitionOrder;
+	int partitionBlocks = blocks >> subframe->partitionOrder;
+	for (int partition = 0, i = subframe->order; partition < partitions; partition++) {
+		int parameter = subframe->riceParameters[partition];
+		ASAPFlacBitWriter_Put(w, parameter, 4);
+		for (int end = (partition + 1) * partitionBlocks; i < end; i++)
+			ASAPFlacBitWriter_PutRice(w, subframe->residual[i], parameter);
+	}
+}
+
+static void ASAPFlacWorker_Encode(ASAPFlacWorker *self, ASAPFlacFrame *frame)
+{
+	const ASAPFlacEncoder *encoder = self->encoder;
+	int blocks = frame->blocks;
+	int channels = encoder->channels;
+	for (int c = 0; c < channels; c++)
+		memcpy(self->signals[c], frame->samples + c * ASAPFlac_BLOCK_SIZE, blocks * sizeof(int32_t));
+	for (int c = 0; c < channels; c++)
+		ASAPFlacWorker_Analyze(self, c, blocks, 16);
+
+	/* channel assignment: independent, left/side, right/side or mid/side */
+	int assignment = channels - 1;
+	if (channels == 2) {
+		const int32_t *left = self->signals[0];
+		const int32_t *right = self->signals[1];
+		int32_t *side = self->signals[2];
+		int32_t *mid = self->signals[3];
+		for (int i = 0; i < blocks; i++) {
+			side[i] = left[i] - right[i];
+			mid[i] = (left[i] + right[i]) >> 1;
+		}
+		ASAPFlacWorker_Analyze(self, 2, blocks, 17);
+		ASAPFlacWorker_Analyze(self, 3, blocks, 16);
+		int64_t bestBits = self->subframes[0].bits + self->subframes[1].bits;
+		int64_t bits = self->subframes[0].bits + self->subframes[2].bits;
+		if (bestBits > bits) {
+			bestBits = bits;
+			assignment = 8;
+		}
+		bits = self->subframes[2].bits + self->subframes[1].bits;
+		if (bestBits > bits) {
+			bestBits = bits;
+			assignment = 9;
+		}
+		bits = self->subframes[3].bits + self->subframes[2].bits;
+		if (bestBits > bits)
+			assignment = 10;
+	}
+
+	ASAPFlacBitWriter w = { frame->output, 0, 0, 0 };
+	ASAPFlacBitWriter_Put(&w, 0xfff8, 16); /* sync code, fixed block size */
+	int blockSizeCode = blocks == ASAPFlac_BLOCK_SIZE ? 12 : 7;
+	int sampleRateCode;
+	switch (encoder->sampleRate) {
+	case 8000: sampleRateCode = 4; break;
+	case 16000: sampleRateCode = 5; break;
+	case 22050: sampleRateCode = 6; break;
+	case 24000: sampleRateCode = 7; break;
+	case 32000: sampleRateCode = 8; break;
+	case 44100: sampleRateCode = 9; break;
+	case 48000: sampleRateCode = 10; break;
+	case 96000: sampleRateCode = 11; break;
+	default: sampleRateCode = encoder->sampleRate < 65536 ? 13 : 0; break;
+	}
+	ASAPFlacBitWriter_Put(&w, blockSizeCode << 4 | sampleRateCode, 8);
+	ASAPFlacBitWriter_Put(&w, assignment << 4 | 4 << 1, 8); /* 16 bits per sample */
+	ASAPFlacBitWriter_PutUtf8(&w, frame->number);
+	if (blockSizeCode == 7)
+		ASAPFlacBitWriter_Put(&w, blocks - 1, 16);
+	if (sampleRateCode == 13)
+		ASAPFlacBitWriter_Put(&w, encoder->sampleRate, 16);
+	uint8_t crc8 = 0;
+	for (int i = 0; i < w.length; i++)
+		crc8 = encoder->crc8[crc8 ^ w.buffer[i]];
+	ASAPFlacBitWriter_Put(&w, crc8, 8);
+
+	switch (assignment) {
+	case 8:
+		ASAPFlacWorker_PutSubframe(self, &w, 0, blocks, 16);
+		ASAPFlacWorker_PutSubframe(self, &w, 2, blocks, 17);
+		break;
+	case 9:
+		ASAPFlacWorker_PutSubframe(self, &w, 2, blocks, 17);
+		ASAPFlacWorker_PutSubframe(self, &w, 1, blocks, 16);
+		break;
+	case 10:
+		ASAPFlacWorker_PutSubframe(self, &w, 3, blocks, 16);
+		ASAPFlacWorker_PutSubframe(self, &w, 2, blocks, 17);
+		break;
+	default:
+		for (int c = 0; c < channels; c++)
+			ASAPFlacWorker_PutSubframe(self, &w, c, blocks, 16);
+		break;
+	}
+	ASAPFlacBitWriter_Align(&w);
+	uint16_t crc16 = 0;
+	for (int i = 0; i < w.length; i++)
+		crc16 = (uint16_t) (crc16 << 8) ^ encoder->crc16[crc16 >> 8 ^ w.buffer[i]];
+	ASAPFlacBitWriter_Put(&w, crc16, 16);
+	frame->outputLength = w.length;
+}
+
+/* Encodes the oldest filled frame. Called and returns with the mutex locked. */
+static bool ASAPFlacEncoder_EncodeNext(ASAPFlacEncoder *self, ASAPFlacWorker *worker)
+{
+	if (self->nextEncode >= self->nextFill)
+		return false;
+	ASAPFlacFrame *frame = self->frames + self->nextEncode++ % self->framesCount;
+	frame->state = ASAPFlacFrameState_ENCODING;
+	ASAPFlacMutex_Unlock(&self->mutex);
+	ASAPFlacWorker_Encode(worker, frame);
+	ASAPFlacMutex_Lock(&self->mutex);
+	frame->state = ASAPFlacFrameState_ENCODED;
+	ASAPFlacCondition_Broadcast(&self->encoded);
+	return true;
+}
+
+static void ASAPFlacEncoder_Work(ASAPFlacWorker *worker)
+{
+	ASAPFlacEncoder *self = worker->encoder;
+	ASAPFlacMutex_Lock(&self->mutex);
+	while (!self->quit) {
+		if (!ASAPFlacEncoder_EncodeNext(self, worker))
+			ASAPFlacCondition_Wait(&self->filled, &self->mutex);
+	}
+	ASAPFlacMutex_Unlock(&self->mutex);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ASAPFlacEncoder_Thread(LPVOID arg)
+{
+	ASAPFlacEncoder_Work((ASAPFlacWorker *) arg);
+	return 0;
+}
+#else
+static void *ASAPFlacEncoder_Thread(void *arg)
+{
+	ASAPFlacEncoder_Work((ASAPFlacWorker *) arg);
+	return NULL;
+}
+#endif
+
+static int ASAPFlacEncoder_GetProcessors(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (int) si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+#endif
+}
+
+static bool ASAPFlacWorker_Init(ASAPFlacWorker *self, ASAPFlacEncoder *encoder)
+{
+	self->encoder = encoder;
+	self->windowBlocks = 0;
+	bool ok = true;
+	for (int i = 0; i < 4; i++) {
+		ok &= (self->signals[i] = malloc(ASAPFlac_BLOCK_SIZE * sizeof(int32_t))) != NULL;
+		ok &= (self->residuals[i][0] = malloc(ASAPFlac_BLOCK_SIZE * sizeof(int32_t))) != NULL;
+		ok &= (self->residuals[i][1] = malloc(ASAPFlac_BLOCK_SIZE * sizeof(int32_t))) != NULL;
+	}
+	ok &= (self->window = malloc(ASAPFlac_BLOCK_SIZE * sizeof(double))) != NULL;
+	ok &= (self->windowed = malloc(ASAPFlac_BLOCK_SIZE * sizeof(double))) != NULL;
+	return ok;
+}
+
+static void ASAPFlacWorker_Free(ASAPFlacWorker *self)
+{
+	free(self->windowed);
+	free(self->window);
+	for (int i = 0; i < 4; i++) {
+		free(self->residuals[i][1]);
+		free(self->residuals[i][0]);
+		free(self->signals[i]);
+	}
+}
+
+static void ASAPFlacEncoder_Free(ASAPFlacEncoder *self)
+{
+	for (int i = 1; i <= self->threadsStarted; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(self->workers[i].thread, INFINITE);
+		CloseHandle(self->workers[i].thread);
+#else
+		pthread_join(self->workers[i].thread, NULL);
+#endif
+	}
+	ASAPFlacCondition_Destroy(&self->encoded);
+	ASAPFlacCondition_Destroy(&self->filled);
+	ASAPFlacMutex_Destroy(&self->mutex);
+	for (int i = 0; i < self->workersCount; i++)
+		ASAPFlacWorker_Free(self->workers + i);
+	free(self->workers);
+	if (self->frames != NULL) {
+		for (int i = 0; i < self->framesCount; i++) {
+			free(self->frames[i].output);
+			free(self->frames[i].samples);
+		}
+		free(self->frames);
+	}
+	free(self->comments);
+	free(self);
+}
+
+ASAPFlacEncoder *ASAPFlacEncoder_New(int sampleRate, int channels, int64_t totalSamples, int threads, ASAPFlacWrite write, void *opaque)
+{
+	if (threads <= 0)
+		threads = ASAPFlacEncoder_GetProcessors();
+	ASAPFlacEncoder *self = calloc(1, sizeof(ASAPFlacEncoder));
+	if (self == NULL)
+		return NULL;
+	self->sampleRate = sampleRate;
+	self->channels = channels;
+	self->totalSamples = totalSamples;
+	self->write = write;
+	self->opaque = opaque;
+
+	for (int i = 0; i < 256; i++) {
+		int crc8 = i;
+		int crc16 = i << 8;
+		for (int j = 0; j < 8; j++) {
+			crc8 = (crc8 << 1 ^ ((crc8 & 0x80) != 0 ? 0x07 : 0)) & 0xff;
+			crc16 = (crc16 << 1 ^ ((crc16 & 0x8000) != 0 ? 0x8005 : 0)) & 0xffff;
+		}
+		self->crc8[i] = (uint8_t) crc8;
+		self->crc16[i] = (uint16_t) crc16;
+	}
+
+	/* Twice as many frames as threads, so that the caller fills some while others are encoded. */
+	self->framesCount = 2 * threads + 1;
+	self->frames = calloc(self->framesCount, sizeof(ASAPFlacFrame));
+	self->workers = calloc(threads, sizeof(ASAPFlacWorker));
+	bool ok = self->frames != NULL && self->workers != NULL;
+	/* header, subframes up to 17-bit verbatim samples, CRC */
+	self->outputCapacity = 16 + channels * (1 + (ASAPFlac_BLOCK_SIZE * 17 + 7) / 8) + 2;
+	for (int i = 0; ok && i < self->framesCount; i++) {
+		ok &= (self->frames[i].samples = malloc(channels * ASAPFlac_BLOCK_SIZE * sizeof(int32_t))) != NULL;
+		ok &= (self->frames[i].output = malloc(self->outputCapacity)) != NULL;
+	}
+	for (int i = 0; ok && i < threads; i++) {
+		ok = ASAPFlacWorker_Init(self->workers + i, self);
+		self->workersCount = i + 1;
+	}
+	ASAPFlacMutex_Init(&self->mutex);
+	ASAPFlacCondition_Init(&self->filled);
+	ASAPFlacCondition_Init(&self->encoded);
+	if (!ok) {
+		ASAPFlacEncoder_Free(self);
+		return NULL;
+	}
+	for (int i = 1; i < threads; i++) {
+		ASAPFlacWorker *worker = self->workers + i;
+#ifdef _WIN32
+		worker->thread = CreateThread(NULL, 0, ASAPFlacEncoder_Thread, worker, 0, NULL);
+		if (worker->thread == NULL)
+			break;
+#else
+		if (pthread_create(&worker->thread, NULL, ASAPFlacEncoder_Thread, worker) != 0)
+			break;
+#endif
+		self->threadsStarted++;
+	}
+	return self;
+}
+
+bool ASAPFlacEncoder_AddComment(ASAPFlacEncoder *self, const char *name, const char *value)
+{
+	int nameLength = (int) strlen(name);
+	int valueLength = (int) strlen(value);
+	int length = nameLength + 1 + valueLength;
+	uint8_t *comments = realloc(self->comments, self->commentsLength + 4 + length);
+	if (comments == NULL)
+		return false;
+	uint8_t *p = comments + self->commentsLength;
+	p[0] = (uint8_t) length;
+	p[1] = (uint8_t) (length >> 8);
+	p[2] = (uint8_t) (length >> 16);
+	p[3] = (uint8_t) (length >> 24);
+	memcpy(p + 4, name, nameLength);
+	p[4 + nameLength] = '=';
+	memcpy(p + 5 + nameLength, value, valueLength);
+	self->comments = comments;
+	self->commentsLength += 4 + length;
+	self->commentsCount++;
+	return true;
+}
+
+static void ASAPFlacEncoder_WriteHeader(ASAPFlacEncoder *self)
+{
+	self->headerWritten = true;
+	static const char vendor[] = "ASAP " ASAPInfo_VERSION;
+	int vendorLength = sizeof(vendor) - 1;
+	int commentBlockLength = 4 + vendorLength + 4 + self->commentsLength;
+	uint8_t header[4 + 4 + 34 + 4 + 4 + sizeof(vendor) + 4];
+	int blockSize = ASAPFlac_BLOCK_SIZE;
+	int64_t totalSamples = self->totalSamples;
+	uint8_t streamInfo[4 + 4 + 34 + 4] = {
+		'f', 'L', 'a', 'C',
+		0, 0, 0, 34, /* STREAMINFO */
+		(uint8_t) (blockSize >> 8), (uint8_t) blockSize,
+		(uint8_t) (blockSize >> 8), (uint8_t) blockSize,
+		0, 0, 0, 0, 0, 0, /* unknown frame sizes */
+		(uint8_t) (self->sampleRate >> 12), (uint8_t) (self->sampleRate >> 4),
+		(uint8_t) (self->sampleRate << 4 | (self->channels - 1) << 1 | (16 - 1) >> 4),
+		(uint8_t) ((16 - 1) << 4 | (int) (totalSamples >> 32 & 0xf)),
+		(uint8_t) (totalSamples >> 24), (uint8_t) (totalSamples >> 16), (uint8_t) (totalSamples >> 8), (uint8_t) totalSamples,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* no MD5 */
+		0x84, (uint8_t) (commentBlockLength >> 16), (uint8_t) (commentBlockLength >> 8), (uint8_t) commentBlockLength /* last: VORBIS_COMMENT */
+	};
+	memcpy(header, streamInfo, sizeof(streamInfo));
+	uint8_t *p = header + sizeof(streamInfo);
+	*p++ = (uint8_t) vendorLength;
+	*p++ = (uint8_t) (vendorLength >> 8);
+	*p++ = 0;
+	*p++ = 0;
+	memcpy(p, vendor, vendorLength);
+	p += vendorLength;
+	*p++ = (uint8_t) self->commentsCount;
+	*p++ = (uint8_t) (self->commentsCount >> 8);
+	*p++ = (uint8_t) (self->commentsCount >> 16);
+	*p++ = (uint8_t) (self->commentsCount >> 24);
+	self->write(self->opaque, header, (int) (p - header));
+	if (self->commentsLength > 0)
+		self->write(self->opaque, self->comments, self->commentsLength);
+}
+
+/* Writes the oldest frame once it is encoded, encoding it here if no thread picked it up.
+   Called and returns with the mutex locked. */
+static void ASAPFlacEncoder_WriteNext(ASAPFlacEncoder *self)
+{
+	ASAPFlacFrame *frame = self->frames + self->nextWrite % self->framesCount;
+	while (frame->state != ASAPFlacFrameState_ENCODED) {
+		if (!ASAPFlacEncoder_EncodeNext(self, self->workers))
+			ASAPFlacCondition_Wait(&self->encoded, &self->mutex);
+	}
+	ASAPFlacMutex_Unlock(&self->mutex);
+	self->write(self->opaque, frame->output, frame->outputLength);
+	ASAPFlacMutex_Lock(&self->mutex);
+	frame->state = ASAPFlacFrameState_FREE;
+	self->nextWrite++;
+}
+
+static void ASAPFlacEncoder_Submit(ASAPFlacEncoder *self)
+{
+	ASAPFlacMutex_Lock(&self->mutex);
+	self->frames[self->nextFill % self->framesCount].state = ASAPFlacFrameState_FILLED;
+	self->nextFill++;
+	ASAPFlacCondition_Broadcast(&self->filled);
+	/* make room for the next frame */
+	while (self->nextFill - self->nextWrite >= self->framesCount)
+		ASAPFlacEncoder_WriteNext(self);
+	ASAPFlacMutex_Unlock(&self->mutex);
+	ASAPFlacFrame *frame = self->frames + self->nextFill % self->framesCount;
+	frame->number = self->nextFill;
+	frame->blocks = 0;
+}
+
+void ASAPFlacEncoder_Write(ASAPFlacEncoder *self, const uint8_t *buffer, int length)
+{
+	if (!self->headerWritten)
+		ASAPFlacEncoder_WriteHeader(self);
+	int channels = self->channels;
+	int blocks = length >> channels;
+	for (int i = 0; i < blocks; ) {
+		ASAPFlacFrame *frame = self->frames + self->nextFill % self->framesCount;
+		int n = ASAPFlac_BLOCK_SIZE - frame->blocks;
+		if (n > blocks - i)
+			n = blocks - i;
+		for (int c = 0; c < channels; c++) {
+			int32_t *samples = frame->samples + c * ASAPFlac_BLOCK_SIZE + frame->blocks;
+			const uint8_t *p = buffer + (i * channels + c) * 2;
+			for (int j = 0; j < n; j++) {
+				samples[j] = (int16_t) (p[0] | p[1] << 8);
+				p += channels * 2;
+			}
+		}
+		frame->blocks += n;
+		i += n;
+		if (frame->blocks == ASAPFlac_BLOCK_SIZE)
+			ASAPFlacEncoder_Submit(self);
+	}
+}
+
+void ASAPFlacEncoder_Delete(ASAPFlacEncoder *self)
+{
+	if (!self->headerWritten)
+		ASAPFlacEncoder_WriteHeader(self);
+	if (self->frames[self->nextFill % self->framesCount].blocks > 0)
+		ASAPFlacEncoder_Submit(self);
+	ASAPFlacMutex_Lock(&self->mutex);
+	while (self->nextWrite < self->nextFill)
+		ASAPFlacEncoder_WriteNext(self);
+	self->quit = true;
+	ASAPFlacCondition_Broadcast(&self->filled);
+	ASAPFlacMutex_Unlock(&self->mutex);
+	ASAPFlacEncoder_Free(self);
+}
@@ -0,0 +1,62 @@
+/*
+ * asap-flac.h - multithreaded FLAC encoder
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _ASAP_FLAC_H_
+#define _ASAP_FLAC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Receives the encoded stream, in order. */
+typedef void (*ASAPFlacWrite)(void *opaque, const uint8_t *buffer, int length);
+
+typedef struct ASAPFlacEncoder ASAPFlacEncoder;
+
+/* Creates an encoder of 16-bit mono or stereo audio.
+   totalSamples is the exact number of samples per channel
+   that will be passed to ASAPFlacEncoder_Write, as stored in STREAMINFO.
+   Frames are encoded by threads threads; 0 means one per processor.
+   Returns NULL if out of memory. */
+ASAPFlacEncoder *ASAPFlacEncoder_New(int sampleRate, int channels, int64_t totalSamples, int threads, ASAPFlacWrite write, void *opaque);
+
+/* Adds a Vorbis comment, such as "TITLE" and the title.
+   Must be called before the first ASAPFlacEncoder_Write.
+   Returns false if out of memory. */
+bool ASAPFlacEncoder_AddComment(ASAPFlacEncoder *self, const char *name, const char *value);
+
+/* Encodes interleaved samples in the ASAPSampleFormat_S16_L_E format.
+   The stream header is written on the first call.
+   Full frames are encoded in the background while the caller generates more samples. */
+void ASAPFlacEncoder_Write(ASAPFlacEncoder *self, const uint8_t *buffer, int length);
+
+/* Encodes the remaining samples, writes all frames and frees the encoder. */
+void ASAPFlacEncoder_Delete(ASAPFlacEncoder *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
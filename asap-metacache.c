@@ -0,0 +1,588 @@
+/*
+ * asap-metacache.c - persistent cache of module metadata
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "asap-metacache.h"
+
+/* The cache file is a header followed by two open-addressing indexes
+   (file name hash -> record, module contents hash -> record) of the same capacity,
+   an append-only array of records, at most half the capacity,
+   and an append-only area of the file names, verified on lookup.
+   It is mapped into memory and locked for the duration of each call.
+   The file never shrinks, because Windows cannot resize it
+   while another process has it mapped. */
+
+#define ASAPMetaCache_MAGIC  "ASAPMC2"
+#define ASAPMetaCache_INITIAL_CAPACITY  1024
+#define ASAPMetaCache_NAME_BYTES_PER_PATH  256
+
+typedef struct
+{
+	char magic[8];
+	uint32_t recordSize;
+	uint32_t capacity;
+	uint32_t pathCount;
+	uint32_t recordCount;
+	uint32_t namesSize;
+	uint32_t reserved;
+} ASAPMetaCacheHeader;
+
+typedef struct
+{
+	uint64_t pathHash;
+	int64_t mtime;
+	int64_t size;
+	uint32_t record; /* index + 1, zero for an empty slot */
+	uint32_t name; /* offset in the names area */
+} ASAPMetaCachePath;
+
+typedef struct
+{
+	uint64_t contentHash;
+	uint32_t record; /* index + 1, zero for an empty slot */
+	uint32_t reserved;
+} ASAPMetaCacheModule;
+
+typedef struct
+{
+	uint64_t contentHash;
+	ASAPMetadata metadata;
+} ASAPMetaCacheRecord;
+
+#ifdef _WIN32
+static SRWLOCK lock = SRWLOCK_INIT;
+#define ASAPMetaCache_Lock()  AcquireSRWLockExclusive(&lock)
+#define ASAPMetaCache_Unlock()  ReleaseSRWLockExclusive(&lock)
+static HANDLE file = INVALID_HANDLE_VALUE;
+static HANDLE mapping = NULL;
+#else
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define ASAPMetaCache_Lock()  pthread_mutex_lock(&lock)
+#define ASAPMetaCache_Unlock()  pthread_mutex_unlock(&lock)
+static int file = -1;
+#endif
+
+static char *cachePath = NULL;
+static bool pathSet = false;
+static bool openFailed = false;
+static ASAPMetaCacheHeader *header = NULL;
+static size_t mappedSize = 0;
+
+static uint64_t ASAPMetaCache_Hash(uint8_t const *data, size_t length)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static size_t ASAPMetaCache_GetNamesCapacity(uint32_t capacity)
+{
+	return (size_t) capacity / 2 * ASAPMetaCache_NAME_BYTES_PER_PATH;
+}
+
+static size_t ASAPMetaCache_GetFileSize(uint32_t capacity)
+{
+	return sizeof(ASAPMetaCacheHeader)
+		+ capacity * (sizeof(ASAPMetaCachePath) + sizeof(ASAPMetaCacheModule))
+		+ capacity / 2 * sizeof(ASAPMetaCacheRecord)
+		+ ASAPMetaCache_GetNamesCapacity(capacity);
+}
+
+static ASAPMetaCachePath *ASAPMetaCache_GetPaths(void)
+{
+	return (ASAPMetaCachePath *) (header + 1);
+}
+
+static ASAPMetaCacheModule *ASAPMetaCache_GetModules(void)
+{
+	return (ASAPMetaCacheModule *) (ASAPMetaCache_GetPaths() + header->capacity);
+}
+
+static ASAPMetaCacheRecord *ASAPMetaCache_GetRecords(void)
+{
+	return (ASAPMetaCacheRecord *) (ASAPMetaCache_GetModules() + header->capacity);
+}
+
+static char *ASAPMetaCache_GetNames(void)
+{
+	return (char *) (ASAPMetaCache_GetRecords() + header->capacity / 2);
+}
+
+static void ASAPMetaCache_Unmap(void)
+{
+	if (header == NULL)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(header);
+	CloseHandle(mapping);
+	mapping = NULL;
+#else
+	munmap(header, mappedSize);
+#endif
+	header = NULL;
+	mappedSize = 0;
+}
+
+static void ASAPMetaCache_Close(void)
+{
+	ASAPMetaCache_Unmap();
+#ifdef _WIN32
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+#else
+	if (file >= 0) {
+		close(file);
+		file = -1;
+	}
+#endif
+}
+
+static void ASAPMetaCache_ChangePath(const char *path)
+{
+	ASAPMetaCache_Close();
+	free(cachePath);
+	cachePath = path != NULL && path[0] != '\0' ? strdup(path) : NULL;
+	pathSet = true;
+	openFailed = false;
+}
+
+static void ASAPMetaCache_SetDefaultPath(void)
+{
+	const char *path = getenv("ASAP_METADATA_CACHE");
+	if (path != NULL) {
+		ASAPMetaCache_ChangePath(path);
+		return;
+	}
+	char buffer[FILENAME_MAX];
+#ifdef _WIN32
+	const char *dir = getenv("LOCALAPPDATA");
+	if (dir == NULL) {
+		ASAPMetaCache_ChangePath(NULL);
+		return;
+	}
+	snprintf(buffer, sizeof(buffer), "%s\\asap-metadata.cache", dir);
+#else
+	const char *dir = getenv("XDG_CACHE_HOME");
+	if (dir != NULL && dir[0] != '\0')
+		snprintf(buffer, sizeof(buffer), "%s/asap-metadata.cache", dir);
+	else {
+		dir = getenv("HOME");
+		if (dir == NULL) {
+			ASAPMetaCache_ChangePath(NULL);
+			return;
+		}
+		snprintf(buffer, sizeof(buffer), "%s/.cache", dir);
+		mkdir(buffer, 0700);
+		snprintf(buffer, sizeof(buffer), "%s/.cache/asap-metadata.cache", dir);
+	}
+#endif
+	ASAPMetaCache_ChangePath(buffer);
+}
+
+static bool ASAPMetaCache_LockFile(void)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = { 0 };
+	return LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped) != 0;
+#else
+	return flock(file, LOCK_EX) == 0;
+#endif
+}
+
+static void ASAPMetaCache_UnlockFile(void)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = { 0 };
+	UnlockFileEx(file, 0, 1, 0, &overlapped);
+#else
+	flock(file, LOCK_UN);
+#endif
+}
+
+static bool ASAPMetaCache_GetSize(size_t *size)
+{
+#ifdef _WIN32
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+		return false;
+	*size = (size_t) fileSize.QuadPart;
+#else
+	struct stat st;
+	if (fstat(file, &st) != 0)
+		return false;
+	*size = (size_t) st.st_size;
+#endif
+	return true;
+}
+
+/* Extends the file. */
+static bool ASAPMetaCache_Extend(size_t size)
+{
+#ifdef _WIN32
+	/* unlike SetEndOfFile, works while another process has the file mapped */
+	HANDLE newMapping = CreateFileMapping(file, NULL, PAGE_READWRITE, (DWORD) ((uint64_t) size >> 32), (DWORD) size, NULL);
+	if (newMapping == NULL)
+		return false;
+	CloseHandle(newMapping);
+	return true;
+#else
+	return ftruncate(file, (off_t) size) == 0;
+#endif
+}
+
+static bool ASAPMetaCache_MapSize(size_t size)
+{
+#ifdef _WIN32
+	mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+	if (mapping == NULL)
+		return false;
+	header = (ASAPMetaCacheHeader *) MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (header == NULL) {
+		CloseHandle(mapping);
+		mapping = NULL;
+		return false;
+	}
+#else
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (p == MAP_FAILED)
+		return false;
+	header = (ASAPMetaCacheHeader *) p;
+#endif
+	mappedSize = size;
+	return true;
+}
+
+/* Maps the whole file, which another process may have grown since. */
+static bool ASAPMetaCache_Map(void)
+{
+	size_t size;
+	if (!ASAPMetaCache_GetSize(&size))
+		return false;
+	if (header != NULL && size == mappedSize)
+		return true;
+	ASAPMetaCache_Unmap();
+	if (size < sizeof(ASAPMetaCacheHeader) || !ASAPMetaCache_MapSize(size))
+		return false;
+	if (memcmp(header->magic, ASAPMetaCache_MAGIC, sizeof(header->magic)) != 0
+	 || header->recordSize != sizeof(ASAPMetaCacheRecord)
+	 || ASAPMetaCache_GetFileSize(header->capacity) > size
+	 || header->namesSize > ASAPMetaCache_GetNamesCapacity(header->capacity)) {
+		ASAPMetaCache_Unmap();
+		return false;
+	}
+	return true;
+}
+
+/* Starts an empty cache, overwriting the file. */
+static bool ASAPMetaCache_Create(uint32_t capacity)
+{
+	size_t size = ASAPMetaCache_GetFileSize(capacity);
+	size_t fileSize;
+	if (!ASAPMetaCache_GetSize(&fileSize))
+		return false;
+	ASAPMetaCache_Unmap();
+	if (fileSize < size) {
+		if (!ASAPMetaCache_Extend(size))
+			return false;
+		fileSize = size;
+	}
+	if (!ASAPMetaCache_MapSize(fileSize))
+		return false;
+	memset(header, 0, size);
+	memcpy(header->magic, ASAPMetaCache_MAGIC, sizeof(header->magic));
+	header->recordSize = sizeof(ASAPMetaCacheRecord);
+	header->capacity = capacity;
+	return true;
+}
+
+/* Opens the cache if needed and locks it. */
+static bool ASAPMetaCache_Begin(void)
+{
+	ASAPMetaCache_Lock();
+	if (!pathSet)
+		ASAPMetaCache_SetDefaultPath();
+	if (cachePath == NULL || openFailed) {
+		ASAPMetaCache_Unlock();
+		return false;
+	}
+#ifdef _WIN32
+	if (file == INVALID_HANDLE_VALUE) {
+		file = CreateFileA(cachePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			openFailed = true;
+			ASAPMetaCache_Unlock();
+			return false;
+		}
+	}
+#else
+	if (file < 0) {
+		file = open(cachePath, O_RDWR | O_CREAT, 0644);
+		if (file < 0) {
+			openFailed = true;
+			ASAPMetaCache_Unlock();
+			return false;
+		}
+	}
+#endif
+	if (!ASAPMetaCache_LockFile()) {
+		ASAPMetaCache_Unlock();
+		return false;
+	}
+	if (!ASAPMetaCache_Map() && !ASAPMetaCache_Create(ASAPMetaCache_INITIAL_CAPACITY)) {
+		ASAPMetaCache_UnlockFile();
+		ASAPMetaCache_Close();
+		openFailed = true;
+		ASAPMetaCache_Unlock();
+		return false;
+	}
+	return true;
+}
+
+static void ASAPMetaCache_End(void)
+{
+	ASAPMetaCache_UnlockFile();
+	ASAPMetaCache_Unlock();
+}
+
+static bool ASAPMetaCache_IsName(uint32_t name, const char *filename, size_t filenameLen)
+{
+	return name < header->namesSize && header->namesSize - name > filenameLen
+		&& memcmp(ASAPMetaCache_GetNames() + name, filename, filenameLen + 1) == 0;
+}
+
+static ASAPMetaCachePath *ASAPMetaCache_FindPath(uint64_t pathHash, const char *filename, size_t filenameLen)
+{
+	ASAPMetaCachePath *paths = ASAPMetaCache_GetPaths();
+	uint32_t mask = header->capacity - 1;
+	for (uint32_t i = (uint32_t) pathHash & mask; ; i = (i + 1) & mask) {
+		if (paths[i].record == 0
+		 || (paths[i].pathHash == pathHash && ASAPMetaCache_IsName(paths[i].name, filename, filenameLen)))
+			return paths + i;
+	}
+}
+
+static ASAPMetaCacheModule *ASAPMetaCache_FindModule(uint64_t contentHash)
+{
+	ASAPMetaCacheModule *modules = ASAPMetaCache_GetModules();
+	uint32_t mask = header->capacity - 1;
+	for (uint32_t i = (uint32_t) contentHash & mask; ; i = (i + 1) & mask) {
+		if (modules[i].record == 0 || modules[i].contentHash == contentHash)
+			return modules + i;
+	}
+}
+
+static bool ASAPMetaCache_Grow(void)
+{
+	uint32_t capacity = header->capacity;
+	uint32_t pathCount = header->pathCount;
+	uint32_t recordCount = header->recordCount;
+	uint32_t namesSize = header->namesSize;
+	ASAPMetaCachePath *paths = (ASAPMetaCachePath *) malloc(capacity * sizeof(ASAPMetaCachePath));
+	ASAPMetaCacheRecord *records = (ASAPMetaCacheRecord *) malloc(recordCount * sizeof(ASAPMetaCacheRecord) + 1);
+	char *names = (char *) malloc(namesSize + 1);
+	if (paths == NULL || records == NULL || names == NULL) {
+		free(paths);
+		free(records);
+		free(names);
+		return false;
+	}
+	memcpy(paths, ASAPMetaCache_GetPaths(), capacity * sizeof(ASAPMetaCachePath));
+	memcpy(records, ASAPMetaCache_GetRecords(), recordCount * sizeof(ASAPMetaCacheRecord));
+	memcpy(names, ASAPMetaCache_GetNames(), namesSize);
+	bool ok = ASAPMetaCache_Create(capacity * 2);
+	if (ok) {
+		memcpy(ASAPMetaCache_GetNames(), names, namesSize);
+		header->namesSize = namesSize;
+		for (uint32_t i = 0; i < capacity; i++) {
+			if (paths[i].record != 0) {
+				const char *filename = names + paths[i].name;
+				*ASAPMetaCache_FindPath(paths[i].pathHash, filename, strlen(filename)) = paths[i];
+			}
+		}
+		header->pathCount = pathCount;
+		memcpy(ASAPMetaCache_GetRecords(), records, recordCount * sizeof(ASAPMetaCacheRecord));
+		for (uint32_t i = 0; i < recordCount; i++) {
+			ASAPMetaCacheModule *module = ASAPMetaCache_FindModule(records[i].contentHash);
+			module->contentHash = records[i].contentHash;
+			module->record = i + 1;
+		}
+		header->recordCount = recordCount;
+	}
+	free(paths);
+	free(records);
+	free(names);
+	return ok;
+}
+
+static bool ASAPMetaCache_GetFileStat(const char *filename, int64_t *mtime, int64_t *size)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(filename, &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(filename, &st) != 0)
+		return false;
+#endif
+	*mtime = (int64_t) st.st_mtime;
+	*size = (int64_t) st.st_size;
+	return true;
+}
+
+void ASAPMetaCache_SetPath(const char *path)
+{
+	ASAPMetaCache_Lock();
+	ASAPMetaCache_ChangePath(path);
+	ASAPMetaCache_Unlock();
+}
+
+bool ASAPMetaCache_GetFile(const char *filename, ASAPMetadata *metadata)
+{
+	int64_t mtime;
+	int64_t size;
+	if (!ASAPMetaCache_GetFileStat(filename, &mtime, &size) || !ASAPMetaCache_Begin())
+		return false;
+	size_t filenameLen = strlen(filename);
+	const ASAPMetaCachePath *path = ASAPMetaCache_FindPath(ASAPMetaCache_Hash((uint8_t const *) filename, filenameLen), filename, filenameLen);
+	bool found = path->record != 0 && path->mtime == mtime && path->size == size;
+	if (found)
+		*metadata = ASAPMetaCache_GetRecords()[path->record - 1].metadata;
+	ASAPMetaCache_End();
+	return found;
+}
+
+bool ASAPMetaCache_GetModule(uint8_t const *module, int moduleLen, ASAPMetadata *metadata)
+{
+	uint64_t contentHash = ASAPMetaCache_Hash(module, moduleLen);
+	if (!ASAPMetaCache_Begin())
+		return false;
+	const ASAPMetaCacheModule *entry = ASAPMetaCache_FindModule(contentHash);
+	bool found = entry->record != 0;
+	if (found)
+		*metadata = ASAPMetaCache_GetRecords()[entry->record - 1].metadata;
+	ASAPMetaCache_End();
+	return found;
+}
+
+void ASAPMetadata_SetInfo(ASAPMetadata *metadata, const ASAPInfo *info)
+{
+	memset(metadata, 0, sizeof(ASAPMetadata));
+	strcpy(metadata->title, ASAPInfo_GetTitle(info));
+	strcpy(metadata->author, ASAPInfo_GetAuthor(info));
+	strcpy(metadata->date, ASAPInfo_GetDate(info));
+	metadata->year = ASAPInfo_GetYear(info);
+	metadata->channels = ASAPInfo_GetChannels(info);
+	metadata->songs = ASAPInfo_GetSongs(info);
+	metadata->defaultSong = ASAPInfo_GetDefaultSong(info);
+	metadata->ntsc = ASAPInfo_IsNtsc(info);
+	for (int song = 0; song < ASAPInfo_MAX_SONGS; song++) {
+		if (song < metadata->songs) {
+			metadata->durations[song] = ASAPInfo_GetDuration(info, song);
+			metadata->loops[song] = ASAPInfo_GetLoop(info, song);
+		}
+		else
+			metadata->durations[song] = -1;
+	}
+}
+
+/* Returns the record for the contents, adding it if needed.
+   Makes room for another file name of nameBytes, too. Called with the cache locked. */
+static ASAPMetaCacheModule *ASAPMetaCache_AddModule(uint64_t contentHash, size_t nameBytes)
+{
+	if ((header->recordCount >= header->capacity / 2 || header->pathCount >= header->capacity / 2
+	  || header->namesSize + nameBytes > ASAPMetaCache_GetNamesCapacity(header->capacity))
+	 && !ASAPMetaCache_Grow())
+		return NULL;
+	ASAPMetaCacheModule *entry = ASAPMetaCache_FindModule(contentHash);
+	if (entry->record != 0)
+		return entry;
+	ASAPMetaCacheRecord *record = ASAPMetaCache_GetRecords() + header->recordCount;
+	record->contentHash = contentHash;
+	memset(&record->metadata, 0, sizeof(ASAPMetadata));
+	for (int song = 0; song < ASAPInfo_MAX_SONGS; song++)
+		record->metadata.durations[song] = -1;
+	entry->contentHash = contentHash;
+	entry->record = ++header->recordCount;
+	return entry;
+}
+
+void ASAPMetaCache_Put(const char *filename, uint8_t const *module, int moduleLen, const ASAPInfo *info)
+{
+	int64_t mtime = 0;
+	int64_t size = 0;
+	if (filename != NULL && !ASAPMetaCache_GetFileStat(filename, &mtime, &size))
+		filename = NULL;
+	ASAPMetadata metadata;
+	ASAPMetadata_SetInfo(&metadata, info);
+	uint64_t contentHash = ASAPMetaCache_Hash(module, moduleLen);
+	size_t filenameLen = filename != NULL ? strlen(filename) : 0;
+	if (!ASAPMetaCache_Begin())
+		return;
+	const ASAPMetaCacheModule *entry = ASAPMetaCache_AddModule(contentHash, filename != NULL ? filenameLen + 1 : 0);
+	if (entry != NULL) {
+		/* keep durations detected earlier for the same contents */
+		ASAPMetaCacheRecord *record = ASAPMetaCache_GetRecords() + entry->record - 1;
+		for (int song = 0; song < metadata.songs; song++) {
+			if (metadata.durations[song] < 0 && song < record->metadata.songs) {
+				metadata.durations[song] = record->metadata.durations[song];
+				metadata.loops[song] = record->metadata.loops[song];
+			}
+		}
+		record->metadata = metadata;
+		if (filename != NULL) {
+			uint64_t pathHash = ASAPMetaCache_Hash((uint8_t const *) filename, filenameLen);
+			ASAPMetaCachePath *path = ASAPMetaCache_FindPath(pathHash, filename, filenameLen);
+			if (path->record == 0) {
+				header->pathCount++;
+				path->name = header->namesSize;
+				memcpy(ASAPMetaCache_GetNames() + header->namesSize, filename, filenameLen + 1);
+				header->namesSize += (uint32_t) filenameLen + 1;
+			}
+			path->pathHash = pathHash;
+			path->mtime = mtime;
+			path->size = size;
+			path->record = entry->record;
+		}
+	}
+	ASAPMetaCache_End();
+}
@@ -0,0 +1,76 @@
+/*
+ * asap-metacache.h - persistent cache of module metadata
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _ASAP_METACACHE_H_
+#define _ASAP_METACACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "asap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Metadata of a module, as parsed by ASAPInfo_Load.
+   Durations of songs without TIME are filled in if emulation detected them.
+   After ASAPInfo_LoadMetadata only the analyzed songs have durations. */
+typedef struct
+{
+	char title[ASAPInfo_MAX_TEXT_LENGTH + 1];
+	char author[ASAPInfo_MAX_TEXT_LENGTH + 1];
+	char date[ASAPInfo_MAX_TEXT_LENGTH + 1];
+	int year;
+	int channels;
+	int songs;
+	int defaultSong;
+	bool ntsc;
+	int durations[ASAPInfo_MAX_SONGS];
+	bool loops[ASAPInfo_MAX_SONGS];
+} ASAPMetadata;
+
+/* Selects the cache file, shared by all processes using it.
+   By default it is $ASAP_METADATA_CACHE or asap-metadata.cache
+   in the user's cache directory. NULL or an empty string disables the cache. */
+void ASAPMetaCache_SetPath(const char *path);
+
+/* Looks up a local file by its name, size and modification time.
+   Doesn't read the file. */
+bool ASAPMetaCache_GetFile(const char *filename, ASAPMetadata *metadata);
+
+/* Looks up module contents, for modules that are not local files. */
+bool ASAPMetaCache_GetModule(uint8_t const *module, int moduleLen, ASAPMetadata *metadata);
+
+/* Stores metadata of the module loaded with ASAPInfo_Load,
+   ASAPInfo_LoadMetadata or ASAP_Load, including durations found
+   by ASAP_DetectDuration. Durations stored earlier
+   for the same contents are kept for songs that have none now.
+   Pass NULL filename if the module is not a local file. */
+void ASAPMetaCache_Put(const char *filename, uint8_t const *module, int moduleLen, const ASAPInfo *info);
+
+void ASAPMetadata_SetInfo(ASAPMetadata *metadata, const ASAPInfo *info);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
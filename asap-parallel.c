@@ -0,0 +1,442 @@
+/*
+ * asap-parallel.c - rendering segments of a song in parallel
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 /* condition variables */
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "asap.h"
+#include "asap-parallel.h"
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION ASAPParallelMutex;
+typedef CONDITION_VARIABLE ASAPParallelCondition;
+typedef HANDLE ASAPParallelThread;
+#define ASAPParallelMutex_Init(m)         InitializeCriticalSection(m)
+#define ASAPParallelMutex_Destroy(m)      DeleteCriticalSection(m)
+#define ASAPParallelMutex_Lock(m)         EnterCriticalSection(m)
+#define ASAPParallelMutex_Unlock(m)       LeaveCriticalSection(m)
+#define ASAPParallelCondition_Init(c)     InitializeConditionVariable(c)
+#define ASAPParallelCondition_Destroy(c)
+#define ASAPParallelCondition_Wait(c, m)  SleepConditionVariableCS(c, m, INFINITE)
+#define ASAPParallelCondition_Broadcast(c)  WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t ASAPParallelMutex;
+typedef pthread_cond_t ASAPParallelCondition;
+typedef pthread_t ASAPParallelThread;
+#define ASAPParallelMutex_Init(m)         pthread_mutex_init(m, NULL)
+#define ASAPParallelMutex_Destroy(m)      pthread_mutex_destroy(m)
+#define ASAPParallelMutex_Lock(m)         pthread_mutex_lock(m)
+#define ASAPParallelMutex_Unlock(m)       pthread_mutex_unlock(m)
+#define ASAPParallelCondition_Init(c)     pthread_cond_init(c, NULL)
+#define ASAPParallelCondition_Destroy(c)  pthread_cond_destroy(c)
+#define ASAPParallelCondition_Wait(c, m)  pthread_cond_wait(c, m)
+#define ASAPParallelCondition_Broadcast(c)  pthread_cond_broadcast(c)
+#endif
+
+typedef enum {
+	ASAPParallelSegmentState_QUEUED,
+	ASAPParallelSegmentState_RENDERING,
+	ASAPParallelSegmentState_RENDERED
+} ASAPParallelSegmentState;
+
+typedef struct {
+	ASAPParallelSegmentState state;
+	ASAPFrameState *start; /* freed once rendered */
+	int blocks;
+	int *deltas; /* GenerateDeltas output, freed once filtered */
+} ASAPParallelSegment;
+
+typedef struct {
+	struct ASAPParallel *parallel;
+	ASAP *asap;
+	ASAPParallelThread thread;
+} ASAPParallelWorker;
+
+struct ASAPParallel
+{
+	ASAP *asap; /* runs the fast pass */
+	ASAP *filter; /* runs the final filter */
+	int channels;
+	int segmentSeconds;
+	ASAPParallelSegment *firstSegment; /* until the fast pass starts */
+
+	/* Segments with known length, in order. */
+	ASAPParallelSegment **segments;
+	int segmentsCount;
+	int segmentsCapacity;
+	int nextRender;
+	int nextRead;
+	int readBlocks; /* of the nextRead segment */
+	int maxRenderedAhead; /* once the fast pass is done */
+
+	ASAPParallelMutex mutex;
+	ASAPParallelCondition queued;
+	ASAPParallelCondition rendered;
+	bool quit;
+	bool fastPassDone;
+	ASAPParallelThread fastPassThread;
+	bool fastPassStarted;
+	ASAPParallelWorker *workers;
+	int workersCount; /* the first one is the calling thread */
+	int threadsStarted;
+};
+
+static void ASAPParallelSegment_Delete(ASAPParallelSegment *self)
+{
+	ASAPFrameState_Delete(self->start);
+	free(self->deltas);
+	free(self);
+}
+
+/* Emulates a segment from its start state.
+   The filter is applied later in order, because it depends on all previous samples. */
+static void ASAPParallelWorker_Render(ASAPParallelWorker *self, ASAPParallelSegment *segment)
+{
+	int length = segment->blocks * self->parallel->channels;
+	segment->deltas = malloc(length * sizeof(int));
+	if (segment->deltas == NULL)
+		return;
+	int rendered = 0;
+	if (ASAP_RestoreFrameState(self->asap, segment->start, -1))
+		rendered = ASAP_GenerateDeltas(self->asap, segment->deltas, length);
+	memset(segment->deltas + rendered, 0, (length - rendered) * sizeof(int));
+}
+
+/* Renders the oldest queued segment.
+   While the fast pass runs, it is the bottleneck, so the workers keep up with it.
+   Afterwards they stop when too far ahead of ASAPParallel_Generate.
+   Called and returns with the mutex locked. */
+static bool ASAPParallel_RenderNext(ASAPParallel *self, ASAPParallelWorker *worker)
+{
+	if (self->nextRender >= self->segmentsCount
+	 || (self->fastPassDone && self->nextRender >= self->nextRead + self->maxRenderedAhead))
+		return false;
+	ASAPParallelSegment *segment = self->segments[self->nextRender++];
+	segment->state = ASAPParallelSegmentState_RENDERING;
+	ASAPParallelMutex_Unlock(&self->mutex);
+	ASAPParallelWorker_Render(worker, segment);
+	ASAPFrameState_Delete(segment->start);
+	segment->start = NULL;
+	ASAPParallelMutex_Lock(&self->mutex);
+	segment->state = ASAPParallelSegmentState_RENDERED;
+	ASAPParallelCondition_Broadcast(&self->rendered);
+	return true;
+}
+
+static void ASAPParallel_Work(ASAPParallelWorker *worker)
+{
+	ASAPParallel *self = worker->parallel;
+	ASAPParallelMutex_Lock(&self->mutex);
+	while (!self->quit) {
+		if (!ASAPParallel_RenderNext(self, worker))
+			ASAPParallelCondition_Wait(&self->queued, &self->mutex);
+	}
+	ASAPParallelMutex_Unlock(&self->mutex);
+}
+
+static void ASAPParallel_FastPass(ASAPParallel *self);
+
+#ifdef _WIN32
+static DWORD WINAPI ASAPParallel_Thread(LPVOID arg)
+{
+	ASAPParallel_Work((ASAPParallelWorker *) arg);
+	return 0;
+}
+
+static DWORD WINAPI ASAPParallel_FastPassThread(LPVOID arg)
+{
+	ASAPParallel_FastPass((ASAPParallel *) arg);
+	return 0;
+}
+#else
+static void *ASAPParallel_Thread(void *arg)
+{
+	ASAPParallel_Work((ASAPParallelWorker *) arg);
+	return NULL;
+}
+
+static void *ASAPParallel_FastPassThread(void *arg)
+{
+	ASAPParallel_FastPass((ASAPParallel *) arg);
+	return NULL;
+}
+#endif
+
+static int ASAPParallel_GetProcessors(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (int) si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+#endif
+}
+
+/* Starts a segment at the current position of the fast pass. */
+static ASAPParallelSegment *ASAPParallel_StartSegment(ASAPParallel *self)
+{
+	if (self->segmentsCount == self->segmentsCapacity) {
+		/* the other threads access the array with the mutex locked */
+		ASAPParallelMutex_Lock(&self->mutex);
+		int capacity = self->segmentsCapacity == 0 ? 64 : self->segmentsCapacity * 2;
+		ASAPParallelSegment **segments = realloc(self->segments, capacity * sizeof(ASAPParallelSegment *));
+		if (segments != NULL) {
+			self->segments = segments;
+			self->segmentsCapacity = capacity;
+		}
+		ASAPParallelMutex_Unlock(&self->mutex);
+		if (segments == NULL)
+			return NULL;
+	}
+	ASAPParallelSegment *segment = calloc(1, sizeof(ASAPParallelSegment));
+	if (segment == NULL)
+		return NULL;
+	segment->start = ASAPFrameState_New();
+	if (segment->start == NULL || !ASAP_SaveFrameState(self->asap, segment->start)) {
+		ASAPParallelSegment_Delete(segment);
+		return NULL;
+	}
+	return segment;
+}
+
+/* Makes the segment available to the threads once its length is known.
+   Returns false if ASAPParallel_Delete is waiting for the fast pass. */
+static bool ASAPParallel_QueueSegment(ASAPParallel *self, ASAPParallelSegment *segment, int blocks)
+{
+	segment->blocks = blocks;
+	ASAPParallelMutex_Lock(&self->mutex);
+	self->segments[self->segmentsCount++] = segment;
+	ASAPParallelCondition_Broadcast(&self->queued);
+	bool quit = self->quit;
+	ASAPParallelMutex_Unlock(&self->mutex);
+	return !quit;
+}
+
+/* Skips through the song in its own thread, saving the state at segment starts.
+   Each segment is queued as soon as the next one starts, so the workers
+   and ASAPParallel_Generate proceed while the pass continues.
+   POKEY output of each sample spreads over the next few dozen samples,
+   so the frames shortly before a segment start are emulated with sound,
+   for the saved state to include the output extending into the segment.
+   On out of memory, the song ends after the last queued segment. */
+static void ASAPParallel_FastPass(ASAPParallel *self)
+{
+	int sampleRate = ASAP_GetSampleRate(self->asap);
+	int64_t segmentBlocks = (int64_t) self->segmentSeconds * sampleRate;
+	int soundBlocks = sampleRate / 25 + 64; /* two frames and the spread */
+	ASAPParallelSegment *segment = self->firstSegment;
+	self->firstSegment = NULL;
+	int segmentStart = 0;
+	int64_t nextStart = segmentBlocks;
+	for (;;) {
+		int blocksPlayed = ASAP_GetBlocksPlayed(self->asap);
+		int blocks = ASAP_SkipFrame(self->asap, blocksPlayed + soundBlocks >= nextStart);
+		if (blocks == 0)
+			break;
+		blocksPlayed += blocks;
+		if (blocksPlayed >= nextStart) {
+			ASAPParallelSegment *next = ASAPParallel_StartSegment(self);
+			if (next == NULL) {
+				/* the song ended within the frame, or out of memory */
+				if (ASAP_SkipFrame(self->asap, false) != 0) {
+					ASAPParallelSegment_Delete(segment);
+					segment = NULL;
+				}
+				break;
+			}
+			if (!ASAPParallel_QueueSegment(self, segment, blocksPlayed - segmentStart)) {
+				ASAPParallelSegment_Delete(next);
+				segment = NULL;
+				break;
+			}
+			segment = next;
+			segmentStart = blocksPlayed;
+			nextStart += segmentBlocks;
+		}
+	}
+	if (segment != NULL) {
+		int blocksPlayed = ASAP_GetBlocksPlayed(self->asap);
+		if (blocksPlayed > segmentStart)
+			ASAPParallel_QueueSegment(self, segment, blocksPlayed - segmentStart);
+		else
+			ASAPParallelSegment_Delete(segment);
+	}
+	ASAPParallelMutex_Lock(&self->mutex);
+	self->fastPassDone = true;
+	ASAPParallelCondition_Broadcast(&self->queued);
+	ASAPParallelMutex_Unlock(&self->mutex);
+}
+
+ASAPParallel *ASAPParallel_New(ASAP *asap, const char *filename, const ASAPFileLoader *loader, int segmentSeconds, int threads)
+{
+	if (segmentSeconds <= 0)
+		return NULL;
+	if (threads <= 0)
+		threads = ASAPParallel_GetProcessors();
+	ASAPParallel *self = calloc(1, sizeof(ASAPParallel));
+	if (self == NULL)
+		return NULL;
+	self->asap = asap;
+	self->channels = ASAPInfo_GetChannels(ASAP_GetInfo(asap));
+	self->segmentSeconds = segmentSeconds;
+	/* Twice as many segments as threads, so that some are ready while others are filtered. */
+	self->maxRenderedAhead = 2 * threads;
+	ASAPParallelMutex_Init(&self->mutex);
+	ASAPParallelCondition_Init(&self->queued);
+	ASAPParallelCondition_Init(&self->rendered);
+	self->firstSegment = ASAPParallel_StartSegment(self);
+	/* The filter continues from the state of the ASAP passed. */
+	self->filter = ASAP_New();
+	bool ok = self->firstSegment != NULL && self->filter != NULL;
+	if (ok) {
+		ASAP_SetSampleRate(self->filter, ASAP_GetSampleRate(asap));
+		ok = ASAP_LoadFiles(self->filter, filename, loader)
+			&& ASAP_RestoreFrameState(self->filter, self->firstSegment->start, -1);
+	}
+	self->workers = ok ? calloc(threads, sizeof(ASAPParallelWorker)) : NULL;
+	ok = self->workers != NULL;
+	for (int i = 0; ok && i < threads; i++) {
+		ASAPParallelWorker *worker = self->workers + i;
+		worker->parallel = self;
+		worker->asap = ASAP_New();
+		self->workersCount = i + 1;
+		ok = worker->asap != NULL;
+		if (ok) {
+			ASAP_SetSampleRate(worker->asap, ASAP_GetSampleRate(asap));
+			ok = ASAP_LoadFiles(worker->asap, filename, loader);
+		}
+	}
+	if (ok) {
+#ifdef _WIN32
+		self->fastPassThread = CreateThread(NULL, 0, ASAPParallel_FastPassThread, self, 0, NULL);
+		self->fastPassStarted = self->fastPassThread != NULL;
+#else
+		self->fastPassStarted = pthread_create(&self->fastPassThread, NULL, ASAPParallel_FastPassThread, self) == 0;
+#endif
+	}
+	if (!self->fastPassStarted) {
+		ASAPParallel_Delete(self);
+		return NULL;
+	}
+	for (int i = 1; i < threads; i++) {
+		ASAPParallelWorker *worker = self->workers + i;
+#ifdef _WIN32
+		worker->thread = CreateThread(NULL, 0, ASAPParallel_Thread, worker, 0, NULL);
+		if (worker->thread == NULL)
+			break;
+#else
+		if (pthread_create(&worker->thread, NULL, ASAPParallel_Thread, worker) != 0)
+			break;
+#endif
+		self->threadsStarted++;
+	}
+	return self;
+}
+
+int ASAPParallel_Generate(ASAPParallel *self, uint8_t *buffer, int bufferLen, ASAPSampleFormat format)
+{
+	int blockShift = self->channels - (format == ASAPSampleFormat_U8 ? 1 : 0);
+	int bufferBlocks = bufferLen >> blockShift;
+	int block = 0;
+	while (block < bufferBlocks) {
+		ASAPParallelMutex_Lock(&self->mutex);
+		while (self->nextRead >= self->segmentsCount && !self->fastPassDone)
+			ASAPParallelCondition_Wait(&self->queued, &self->mutex);
+		if (self->nextRead >= self->segmentsCount) {
+			ASAPParallelMutex_Unlock(&self->mutex);
+			break;
+		}
+		ASAPParallelSegment *segment = self->segments[self->nextRead];
+		while (segment->state != ASAPParallelSegmentState_RENDERED) {
+			if (!ASAPParallel_RenderNext(self, self->workers))
+				ASAPParallelCondition_Wait(&self->rendered, &self->mutex);
+		}
+		ASAPParallelMutex_Unlock(&self->mutex);
+		if (segment->deltas == NULL)
+			break; /* out of memory */
+		int blocks = segment->blocks - self->readBlocks;
+		if (blocks > bufferBlocks - block)
+			blocks = bufferBlocks - block;
+		ASAP_FilterDeltas(self->filter, segment->deltas + self->readBlocks * self->channels, blocks * self->channels, buffer + (block << blockShift), format);
+		block += blocks;
+		self->readBlocks += blocks;
+		if (self->readBlocks == segment->blocks) {
+			ASAPParallelMutex_Lock(&self->mutex);
+			self->segments[self->nextRead++] = NULL;
+			self->readBlocks = 0;
+			ASAPParallelCondition_Broadcast(&self->queued);
+			ASAPParallelMutex_Unlock(&self->mutex);
+			ASAPParallelSegment_Delete(segment);
+		}
+	}
+	return block << blockShift;
+}
+
+void ASAPParallel_Delete(ASAPParallel *self)
+{
+	ASAPParallelMutex_Lock(&self->mutex);
+	self->quit = true;
+	ASAPParallelCondition_Broadcast(&self->queued);
+	ASAPParallelMutex_Unlock(&self->mutex);
+	if (self->fastPassStarted) {
+#ifdef _WIN32
+		WaitForSingleObject(self->fastPassThread, INFINITE);
+		CloseHandle(self->fastPassThread);
+#else
+		pthread_join(self->fastPassThread, NULL);
+#endif
+	}
+	else if (self->firstSegment != NULL)
+		ASAPParallelSegment_Delete(self->firstSegment);
+	for (int i = 1; i <= self->threadsStarted; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(self->workers[i].thread, INFINITE);
+		CloseHandle(self->workers[i].thread);
+#else
+		pthread_join(self->workers[i].thread, NULL);
+#endif
+	}
+	ASAPParallelCondition_Destroy(&self->rendered);
+	ASAPParallelCondition_Destroy(&self->queued);
+	ASAPParallelMutex_Destroy(&self->mutex);
+	ASAP_Delete(self->filter);
+	for (int i = 0; i < self->workersCount; i++)
+		ASAP_Delete(self->workers[i].asap);
+	free(self->workers);
+	for (int i = self->nextRead; i < self->segmentsCount; i++)
+		ASAPParallelSegment_Delete(self->segments[i]);
+	free(self->segments);
+	free(self);
+}
@@ -0,0 +1,55 @@
+/*
+ * asap-parallel.h - rendering segments of a song in parallel
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _ASAP_PARALLEL_H_
+#define _ASAP_PARALLEL_H_
+
+#include <stdint.h>
+#include "asap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ASAPParallel ASAPParallel;
+
+/* Prepares rendering of the song set up with ASAP_PlaySong and ASAP_MutePokeyChannels,
+   which must have a positive duration or silence detection.
+   A fast pass over the song without sound saves the emulator state every segmentSeconds.
+   Meanwhile the segments are emulated by threads threads (0 means one per processor),
+   each with its own ASAP loaded from filename with loader.
+   The fast pass runs in a separate thread on the ASAP passed,
+   which must not be used until ASAPParallel_Delete. Returns NULL on error. */
+ASAPParallel *ASAPParallel_New(ASAP *asap, const char *filename, const ASAPFileLoader *loader, int segmentSeconds, int threads);
+
+/* Like ASAP_Generate on the ASAP passed to ASAPParallel_New.
+   The output is identical to rendering the song in one thread. */
+int ASAPParallel_Generate(ASAPParallel *self, uint8_t *buffer, int bufferLen, ASAPSampleFormat format);
+
+/* Stops the threads and frees the renderer. Doesn't delete the ASAP. */
+void ASAPParallel_Delete(ASAPParallel *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,764 @@
+/*
+ * asap-pcmcache.c - persistent cache of rendered audio
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+#include "asap-pcmcache.h"
+
+/* Every song is a separate file, named after the hash of the module contents
+   and the playback parameters. The file is a header, an index of chunks
+   of a fixed number of blocks and the chunks, appended as they are emulated.
+   A chunk is either raw samples or, for each channel, the residuals
+   of the second-order prediction in Rice codes with a parameter per partition.
+   Chunks don't depend on each other, so seeking reads just one.
+   The modification time of a file is its last use, for the size limit. */
+
+#define ASAPPcmCache_MAGIC  "ASAPPC2"
+#define ASAPPcmCache_CHUNK_BLOCKS  8192
+#define ASAPPcmCache_PARTITION_SAMPLES  256
+#define ASAPPcmCache_MAX_RICE_PARAMETER  17
+#define ASAPPcmCache_DEFAULT_MAX_SIZE  ((int64_t) 256 << 20)
+
+typedef struct
+{
+	char magic[8];
+	uint64_t contentHash;
+	int32_t song;
+	int32_t sampleRate;
+	int32_t format;
+	int32_t muteMask;
+	int32_t duration;
+	uint32_t chunkCount;
+	/* the same bytes can be loaded as different formats, e.g. CMC and CMR */
+	char type[4];
+} ASAPPcmCacheHeader;
+
+typedef struct
+{
+	uint32_t offset; /* zero if not cached yet */
+	uint32_t length;
+} ASAPPcmCacheChunk;
+
+enum
+{
+	ASAPPcmCache_RAW,
+	ASAPPcmCache_RICE
+};
+
+struct ASAPPcmCache
+{
+	ASAP *asap;
+	int song;
+	int duration;
+	int muteMask;
+	ASAPSampleFormat format;
+	int channels;
+	int blockSize;
+	bool playing; /* ASAP_PlaySong called */
+	bool added;
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int file;
+#endif
+	ASAPPcmCacheChunk *index; /* NULL if not cached */
+	int totalBlocks;
+	int position;
+	int chunk; /* in pcm, -1 if none */
+	int chunkBlocks;
+	uint8_t *pcm;
+	uint8_t *packed;
+};
+
+typedef struct
+{
+	uint8_t *data;
+	int capacity;
+	int length;
+	uint64_t bits;
+	int bitCount;
+} ASAPPcmCacheBitWriter;
+
+typedef struct
+{
+	uint8_t const *data;
+	int length;
+	int offset;
+	uint64_t bits;
+	int bitCount;
+} ASAPPcmCacheBitReader;
+
+typedef struct
+{
+	char name[32];
+	int64_t mtime;
+	int64_t size;
+} ASAPPcmCacheFile;
+
+#ifdef _WIN32
+static SRWLOCK lock = SRWLOCK_INIT;
+#define ASAPPcmCache_Lock()  AcquireSRWLockExclusive(&lock)
+#define ASAPPcmCache_Unlock()  ReleaseSRWLockExclusive(&lock)
+#define ASAPPcmCache_IsOpen(self)  ((self)->file != INVALID_HANDLE_VALUE)
+#else
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define ASAPPcmCache_Lock()  pthread_mutex_lock(&lock)
+#define ASAPPcmCache_Unlock()  pthread_mutex_unlock(&lock)
+#define ASAPPcmCache_IsOpen(self)  ((self)->file >= 0)
+#endif
+
+static char *cacheDir = NULL;
+static bool pathSet = false;
+static int64_t maxSize = ASAPPcmCache_DEFAULT_MAX_SIZE;
+
+static uint64_t ASAPPcmCache_Hash(uint64_t hash, void const *data, size_t length)
+{
+	/* FNV-1a */
+	uint8_t const *bytes = (uint8_t const *) data;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void ASAPPcmCache_ChangePath(const char *path)
+{
+	free(cacheDir);
+	cacheDir = path != NULL && path[0] != '\0' ? strdup(path) : NULL;
+	pathSet = true;
+}
+
+void ASAPPcmCache_SetPath(const char *path)
+{
+	ASAPPcmCache_Lock();
+	ASAPPcmCache_ChangePath(path);
+	ASAPPcmCache_Unlock();
+}
+
+void ASAPPcmCache_SetMaxSize(int64_t maxBytes)
+{
+	ASAPPcmCache_Lock();
+	maxSize = maxBytes;
+	ASAPPcmCache_Unlock();
+}
+
+static bool ASAPPcmCache_ReadAt(const ASAPPcmCache *self, void *buffer, uint32_t length, uint32_t offset)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = { 0 };
+	overlapped.Offset = offset;
+	DWORD read;
+	return ReadFile(self->file, buffer, length, &read, &overlapped) && read == length;
+#else
+	return pread(self->file, buffer, length, offset) == (ssize_t) length;
+#endif
+}
+
+static bool ASAPPcmCache_WriteAt(const ASAPPcmCache *self, void const *buffer, uint32_t length, uint32_t offset)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = { 0 };
+	overlapped.Offset = offset;
+	DWORD written;
+	return WriteFile(self->file, buffer, length, &written, &overlapped) && written == length;
+#else
+	return pwrite(self->file, buffer, length, offset) == (ssize_t) length;
+#endif
+}
+
+static int64_t ASAPPcmCache_GetFileSize(const ASAPPcmCache *self)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	return GetFileSizeEx(self->file, &size) ? size.QuadPart : -1;
+#else
+	struct stat st;
+	return fstat(self->file, &st) == 0 ? (int64_t) st.st_size : -1;
+#endif
+}
+
+/* Locks the file against other processes appending chunks. */
+static bool ASAPPcmCache_LockFile(const ASAPPcmCache *self)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = { 0 };
+	return LockFileEx(self->file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped) != 0;
+#else
+	return flock(self->file, LOCK_EX) == 0;
+#endif
+}
+
+static void ASAPPcmCache_UnlockFile(const ASAPPcmCache *self)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = { 0 };
+	UnlockFileEx(self->file, 0, 1, 0, &overlapped);
+#else
+	flock(self->file, LOCK_UN);
+#endif
+}
+
+/* Marks the file as recently used. */
+static void ASAPPcmCache_TouchFile(const ASAPPcmCache *self)
+{
+#ifdef _WIN32
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	SetFileTime(self->file, NULL, NULL, &now);
+#else
+	futimens(self->file, NULL);
+#endif
+}
+
+static void ASAPPcmCache_CloseFile(ASAPPcmCache *self)
+{
+#ifdef _WIN32
+	if (self->file != INVALID_HANDLE_VALUE) {
+		CloseHandle(self->file);
+		self->file = INVALID_HANDLE_VALUE;
+	}
+#else
+	if (self->file >= 0) {
+		close(self->file);
+		self->file = -1;
+	}
+#endif
+}
+
+/* Opens or creates the file for the header and reads its index. */
+static bool ASAPPcmCache_OpenFile(ASAPPcmCache *self, const ASAPPcmCacheHeader *header)
+{
+	ASAPPcmCache_Lock();
+	if (!pathSet)
+		ASAPPcmCache_ChangePath(getenv("ASAP_PCM_CACHE"));
+	if (cacheDir == NULL) {
+		ASAPPcmCache_Unlock();
+		return false;
+	}
+	char filename[FILENAME_MAX];
+	unsigned long long key = ASAPPcmCache_Hash(0xcbf29ce484222325ULL, header, sizeof(ASAPPcmCacheHeader));
+#ifdef _WIN32
+	CreateDirectoryA(cacheDir, NULL);
+	snprintf(filename, sizeof(filename), "%s\\%016llx.pcm", cacheDir, key);
+	self->file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+	mkdir(cacheDir, 0700);
+	snprintf(filename, sizeof(filename), "%s/%016llx.pcm", cacheDir, key);
+	self->file = open(filename, O_RDWR | O_CREAT, 0644);
+#endif
+	ASAPPcmCache_Unlock();
+	if (!ASAPPcmCache_IsOpen(self))
+		return false;
+
+	uint32_t indexLength = header->chunkCount * sizeof(ASAPPcmCacheChunk);
+	self->index = (ASAPPcmCacheChunk *) calloc(header->chunkCount, sizeof(ASAPPcmCacheChunk));
+	if (self->index == NULL || !ASAPPcmCache_LockFile(self)) {
+		ASAPPcmCache_CloseFile(self);
+		return false;
+	}
+	bool ok;
+	if (ASAPPcmCache_GetFileSize(self) == 0)
+		ok = ASAPPcmCache_WriteAt(self, header, sizeof(ASAPPcmCacheHeader), 0)
+			&& ASAPPcmCache_WriteAt(self, self->index, indexLength, sizeof(ASAPPcmCacheHeader));
+	else {
+		/* a different song with the same hash or a damaged file: don't touch it */
+		ASAPPcmCacheHeader fileHeader;
+		ok = ASAPPcmCache_ReadAt(self, &fileHeader, sizeof(fileHeader), 0)
+			&& memcmp(&fileHeader, header, sizeof(fileHeader)) == 0
+			&& ASAPPcmCache_ReadAt(self, self->index, indexLength, sizeof(ASAPPcmCacheHeader));
+	}
+	ASAPPcmCache_UnlockFile(self);
+	if (!ok) {
+		ASAPPcmCache_CloseFile(self);
+		return false;
+	}
+	ASAPPcmCache_TouchFile(self);
+	return true;
+}
+
+static bool ASAPPcmCache_AddFile(ASAPPcmCacheFile **files, int *count, int *capacity, const char *name, int64_t mtime, int64_t size)
+{
+	if (strlen(name) != 20 || strcmp(name + 16, ".pcm") != 0)
+		return true;
+	if (*count >= *capacity) {
+		int newCapacity = *capacity == 0 ? 64 : *capacity * 2;
+		ASAPPcmCacheFile *newFiles = (ASAPPcmCacheFile *) realloc(*files, newCapacity * sizeof(ASAPPcmCacheFile));
+		if (newFiles == NULL)
+			return false;
+		*files = newFiles;
+		*capacity = newCapacity;
+	}
+	ASAPPcmCacheFile *file = *files + (*count)++;
+	strcpy(file->name, name);
+	file->mtime = mtime;
+	file->size = size;
+	return true;
+}
+
+static int ASAPPcmCache_CompareAge(const void *a, const void *b)
+{
+	int64_t x = ((const ASAPPcmCacheFile *) a)->mtime;
+	int64_t y = ((const ASAPPcmCacheFile *) b)->mtime;
+	return x < y ? -1 : x > y;
+}
+
+/* Removes the least recently used files above the size limit.
+   Called with the lock held. */
+static void ASAPPcmCache_Trim(void)
+{
+	ASAPPcmCacheFile *files = NULL;
+	int count = 0;
+	int capacity = 0;
+	bool ok = true;
+	char path[FILENAME_MAX];
+#ifdef _WIN32
+	snprintf(path, sizeof(path), "%s\\*.pcm", cacheDir);
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileA(path, &data);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		ok = ASAPPcmCache_AddFile(&files, &count, &capacity, data.cFileName,
+			(int64_t) data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime,
+			(int64_t) data.nFileSizeHigh << 32 | data.nFileSizeLow);
+	} while (ok && FindNextFileA(find, &data));
+	FindClose(find);
+#else
+	DIR *dir = opendir(cacheDir);
+	if (dir == NULL)
+		return;
+	const struct dirent *entry;
+	while (ok && (entry = readdir(dir)) != NULL) {
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", cacheDir, entry->d_name);
+		if (stat(path, &st) == 0)
+			ok = ASAPPcmCache_AddFile(&files, &count, &capacity, entry->d_name, (int64_t) st.st_mtime, (int64_t) st.st_size);
+	}
+	closedir(dir);
+#endif
+	if (ok) {
+		int64_t totalSize = 0;
+		for (int i = 0; i < count; i++)
+			totalSize += files[i].size;
+		qsort(files, count, sizeof(ASAPPcmCacheFile), ASAPPcmCache_CompareAge);
+		for (int i = 0; i < count && totalSize > maxSize; i++) {
+#ifdef _WIN32
+			snprintf(path, sizeof(path), "%s\\%s", cacheDir, files[i].name);
+			if (DeleteFileA(path))
+#else
+			snprintf(path, sizeof(path), "%s/%s", cacheDir, files[i].name);
+			if (unlink(path) == 0)
+#endif
+				totalSize -= files[i].size;
+		}
+	}
+	free(files);
+}
+
+static int ASAPPcmCache_GetSample(const ASAPPcmCache *self, int i)
+{
+	uint8_t const *pcm = self->pcm;
+	switch (self->format) {
+	case ASAPSampleFormat_U8:
+		return pcm[i];
+	case ASAPSampleFormat_S16_L_E:
+		return (int16_t) (pcm[i * 2] | pcm[i * 2 + 1] << 8);
+	default:
+		return (int16_t) (pcm[i * 2] << 8 | pcm[i * 2 + 1]);
+	}
+}
+
+static void ASAPPcmCache_SetSample(ASAPPcmCache *self, int i, int sample)
+{
+	uint8_t *pcm = self->pcm;
+	switch (self->format) {
+	case ASAPSampleFormat_U8:
+		pcm[i] = (uint8_t) sample;
+		break;
+	case ASAPSampleFormat_S16_L_E:
+		pcm[i * 2] = (uint8_t) sample;
+		pcm[i * 2 + 1] = (uint8_t) (sample >> 8);
+		break;
+	default:
+		pcm[i * 2] = (uint8_t) (sample >> 8);
+		pcm[i * 2 + 1] = (uint8_t) sample;
+		break;
+	}
+}
+
+static void ASAPPcmCacheBitWriter_Write(ASAPPcmCacheBitWriter *self, uint32_t value, int count)
+{
+	self->bits = self->bits << count | value;
+	self->bitCount += count;
+	while (self->bitCount >= 8) {
+		self->bitCount -= 8;
+		if (self->length < self->capacity)
+			self->data[self->length] = (uint8_t) (self->bits >> self->bitCount);
+		self->length++;
+	}
+}
+
+static void ASAPPcmCacheBitWriter_WriteRice(ASAPPcmCacheBitWriter *self, uint32_t value, int k)
+{
+	uint32_t q = value >> k;
+	for (; q >= 32; q -= 32)
+		ASAPPcmCacheBitWriter_Write(self, 0xffffffff, 32);
+	ASAPPcmCacheBitWriter_Write(self, ((1U << q) - 1) << 1, q + 1);
+	ASAPPcmCacheBitWriter_Write(self, value & ((1U << k) - 1), k);
+}
+
+static uint32_t ASAPPcmCacheBitReader_Read(ASAPPcmCacheBitReader *self, int count)
+{
+	while (self->bitCount < count) {
+		/* past the end reads zeros and is reported by the caller */
+		self->bits = self->bits << 8 | (self->offset < self->length ? self->data[self->offset] : 0);
+		self->offset++;
+		self->bitCount += 8;
+	}
+	self->bitCount -= count;
+	return (uint32_t) (self->bits >> self->bitCount) & (uint32_t) (((uint64_t) 1 << count) - 1);
+}
+
+/* Compresses the samples in pcm to packed. Returns the length. */
+static uint32_t ASAPPcmCache_Pack(ASAPPcmCache *self, int blocks)
+{
+	int rawLength = blocks * self->blockSize;
+	ASAPPcmCacheBitWriter writer = { self->packed + 1, rawLength, 0, 0, 0 };
+	uint32_t residuals[ASAPPcmCache_PARTITION_SAMPLES];
+	for (int channel = 0; channel < self->channels; channel++) {
+		int previous = 0;
+		int beforePrevious = 0;
+		for (int start = 0; start < blocks && writer.length < rawLength; start += ASAPPcmCache_PARTITION_SAMPLES) {
+			int n = blocks - start;
+			if (n > ASAPPcmCache_PARTITION_SAMPLES)
+				n = ASAPPcmCache_PARTITION_SAMPLES;
+			for (int i = 0; i < n; i++) {
+				int sample = ASAPPcmCache_GetSample(self, (start + i) * self->channels + channel);
+				int residual = sample - 2 * previous + beforePrevious;
+				residuals[i] = residual >= 0 ? (uint32_t) residual << 1 : ((uint32_t) -residual << 1) - 1;
+				beforePrevious = previous;
+				previous = sample;
+			}
+			int bestK = 0;
+			int64_t bestBits = INT64_MAX;
+			for (int k = 0; k <= ASAPPcmCache_MAX_RICE_PARAMETER; k++) {
+				int64_t bits = (int64_t) n * (k + 1);
+				for (int i = 0; i < n; i++)
+					bits += residuals[i] >> k;
+				if (bits < bestBits) {
+					bestBits = bits;
+					bestK = k;
+				}
+			}
+			ASAPPcmCacheBitWriter_Write(&writer, bestK, 5);
+			for (int i = 0; i < n; i++)
+				ASAPPcmCacheBitWriter_WriteRice(&writer, residuals[i], bestK);
+		}
+	}
+	ASAPPcmCacheBitWriter_Write(&writer, 0, (8 - writer.bitCount) & 7);
+	if (writer.length >= rawLength) {
+		self->packed[0] = ASAPPcmCache_RAW;
+		memcpy(self->packed + 1, self->pcm, rawLength);
+		return 1 + rawLength;
+	}
+	self->packed[0] = ASAPPcmCache_RICE;
+	return 1 + writer.length;
+}
+
+/* Decompresses packed to pcm. Returns false if the data is damaged. */
+static bool ASAPPcmCache_Unpack(ASAPPcmCache *self, uint32_t length, int blocks)
+{
+	int rawLength = blocks * self->blockSize;
+	if (self->packed[0] == ASAPPcmCache_RAW) {
+		if (length != 1 + (uint32_t) rawLength)
+			return false;
+		memcpy(self->pcm, self->packed + 1, rawLength);
+		return true;
+	}
+	if (self->packed[0] != ASAPPcmCache_RICE)
+		return false;
+	ASAPPcmCacheBitReader reader = { self->packed + 1, (int) length - 1, 0, 0, 0 };
+	for (int channel = 0; channel < self->channels; channel++) {
+		int previous = 0;
+		int beforePrevious = 0;
+		for (int start = 0; start < blocks; start += ASAPPcmCache_PARTITION_SAMPLES) {
+			int n = blocks - start;
+			if (n > ASAPPcmCache_PARTITION_SAMPLES)
+				n = ASAPPcmCache_PARTITION_SAMPLES;
+			int k = (int) ASAPPcmCacheBitReader_Read(&reader, 5);
+			if (k > ASAPPcmCache_MAX_RICE_PARAMETER)
+				return false;
+			for (int i = 0; i < n; i++) {
+				uint32_t q = 0;
+				while (ASAPPcmCacheBitReader_Read(&reader, 1) != 0) {
+					if (++q > 1 << 20 || reader.offset > reader.length)
+						return false;
+				}
+				uint32_t value = q << k | ASAPPcmCacheBitReader_Read(&reader, k);
+				int residual = (value & 1) != 0 ? -(int) (value >> 1) - 1 : (int) (value >> 1);
+				int sample = residual + 2 * previous - beforePrevious;
+				ASAPPcmCache_SetSample(self, (start + i) * self->channels + channel, sample);
+				beforePrevious = previous;
+				previous = sample;
+			}
+		}
+	}
+	return reader.offset <= reader.length;
+}
+
+static uint32_t ASAPPcmCache_GetIndexOffset(int chunk)
+{
+	return sizeof(ASAPPcmCacheHeader) + chunk * sizeof(ASAPPcmCacheChunk);
+}
+
+static bool ASAPPcmCache_ReadChunk(ASAPPcmCache *self, int chunk, int blocks)
+{
+	ASAPPcmCacheChunk *entry = self->index + chunk;
+	if (entry->offset == 0) {
+		/* another process may have emulated it since we opened the file */
+		ASAPPcmCacheChunk fileEntry;
+		if (!ASAPPcmCache_ReadAt(self, &fileEntry, sizeof(fileEntry), ASAPPcmCache_GetIndexOffset(chunk)))
+			return false;
+		*entry = fileEntry;
+		if (entry->offset == 0)
+			return false;
+	}
+	return entry->length <= (uint32_t) (1 + ASAPPcmCache_CHUNK_BLOCKS * self->blockSize)
+		&& ASAPPcmCache_ReadAt(self, self->packed, entry->length, entry->offset)
+		&& ASAPPcmCache_Unpack(self, entry->length, blocks);
+}
+
+static void ASAPPcmCache_WriteChunk(ASAPPcmCache *self, int chunk, int blocks)
+{
+	uint32_t length = ASAPPcmCache_Pack(self, blocks);
+	if (!ASAPPcmCache_LockFile(self))
+		return;
+	uint32_t indexOffset = ASAPPcmCache_GetIndexOffset(chunk);
+	ASAPPcmCacheChunk entry;
+	if (ASAPPcmCache_ReadAt(self, &entry, sizeof(entry), indexOffset)) {
+		int64_t fileSize = ASAPPcmCache_GetFileSize(self);
+		if (entry.offset == 0 && fileSize > 0 && fileSize + length <= UINT32_MAX) {
+			/* write the index entry last, so that readers never see an incomplete chunk */
+			entry.offset = (uint32_t) fileSize;
+			entry.length = length;
+			if (ASAPPcmCache_WriteAt(self, self->packed, length, entry.offset)
+			 && ASAPPcmCache_WriteAt(self, &entry, sizeof(entry), indexOffset))
+				self->added = true;
+			else
+				entry.offset = 0;
+		}
+		self->index[chunk] = entry;
+	}
+	ASAPPcmCache_UnlockFile(self);
+}
+
+static bool ASAPPcmCache_StartEmulation(ASAPPcmCache *self)
+{
+	if (!ASAP_PlaySong(self->asap, self->song, self->duration))
+		return false;
+	ASAP_MutePokeyChannels(self->asap, self->muteMask);
+	self->playing = true;
+	return true;
+}
+
+static int ASAPPcmCache_GetChunkBlocks(const ASAPPcmCache *self, int chunk)
+{
+	int blocks = self->totalBlocks - chunk * ASAPPcmCache_CHUNK_BLOCKS;
+	return blocks < ASAPPcmCache_CHUNK_BLOCKS ? blocks : ASAPPcmCache_CHUNK_BLOCKS;
+}
+
+/* Emulates the chunk that starts at the current position of ASAP and stores it. */
+static bool ASAPPcmCache_EmulateChunk(ASAPPcmCache *self)
+{
+	int start = ASAP_GetBlocksPlayed(self->asap);
+	int chunk = start / ASAPPcmCache_CHUNK_BLOCKS;
+	int blocks = ASAPPcmCache_GetChunkBlocks(self, chunk);
+	self->chunk = chunk;
+	self->chunkBlocks = ASAP_Generate(self->asap, self->pcm, blocks * self->blockSize, self->format) / self->blockSize;
+	if (self->chunkBlocks == blocks) {
+		ASAPPcmCache_WriteChunk(self, chunk, blocks);
+		return true;
+	}
+	/* silence detection ended the song */
+	self->totalBlocks = start + self->chunkBlocks;
+	return false;
+}
+
+/* Reads the chunk from the file or emulates it. */
+static bool ASAPPcmCache_LoadChunk(ASAPPcmCache *self, int chunk)
+{
+	int blocks = ASAPPcmCache_GetChunkBlocks(self, chunk);
+	if (ASAPPcmCache_ReadChunk(self, chunk, blocks)) {
+		self->chunk = chunk;
+		self->chunkBlocks = blocks;
+		return true;
+	}
+	/* ASAP_SeekSample doesn't filter the skipped samples, which changes the following ones,
+	   so play from the start, adding the skipped chunks to the cache */
+	int start = chunk * ASAPPcmCache_CHUNK_BLOCKS;
+	if ((!self->playing || ASAP_GetBlocksPlayed(self->asap) > start)
+	 && !ASAPPcmCache_StartEmulation(self)) {
+		self->chunk = -1;
+		return false;
+	}
+	while (ASAP_GetBlocksPlayed(self->asap) < start) {
+		if (!ASAPPcmCache_EmulateChunk(self)) {
+			/* the song ended before this chunk */
+			self->chunk = -1;
+			return false;
+		}
+	}
+	ASAPPcmCache_EmulateChunk(self);
+	return true;
+}
+
+ASAPPcmCache *ASAPPcmCache_PlaySong(ASAP *asap, uint8_t const *module, int moduleLen, int song, int duration, int muteMask, ASAPSampleFormat format)
+{
+	const ASAPInfo *info = ASAP_GetInfo(asap);
+	if (song < 0 || song >= ASAPInfo_GetSongs(info))
+		return NULL;
+	ASAPPcmCache *self = (ASAPPcmCache *) malloc(sizeof(ASAPPcmCache));
+	if (self == NULL)
+		return NULL;
+	self->asap = asap;
+	self->song = song;
+	self->duration = duration;
+	self->muteMask = muteMask;
+	self->format = format;
+	self->channels = ASAPInfo_GetChannels(info);
+	self->blockSize = format == ASAPSampleFormat_U8 ? self->channels : self->channels * 2;
+	self->playing = false;
+	self->added = false;
+#ifdef _WIN32
+	self->file = INVALID_HANDLE_VALUE;
+#else
+	self->file = -1;
+#endif
+	self->index = NULL;
+	int sampleRate = ASAP_GetSampleRate(asap);
+	self->totalBlocks = (int) ((int64_t) duration * sampleRate / 1000);
+	self->position = 0;
+	self->chunk = -1;
+	self->chunkBlocks = 0;
+	self->pcm = NULL;
+	self->packed = NULL;
+
+	if (self->totalBlocks > 0) {
+		ASAPPcmCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, ASAPPcmCache_MAGIC, sizeof(header.magic));
+		header.contentHash = ASAPPcmCache_Hash(0xcbf29ce484222325ULL, module, moduleLen);
+		const char *type = ASAPInfo_GetOriginalModuleExt(ASAP_GetInfo(asap));
+		if (type != NULL)
+			strncpy(header.type, type, sizeof(header.type) - 1);
+		header.song = song;
+		header.sampleRate = sampleRate;
+		header.format = format;
+		header.muteMask = muteMask;
+		header.duration = duration;
+		header.chunkCount = (self->totalBlocks + ASAPPcmCache_CHUNK_BLOCKS - 1) / ASAPPcmCache_CHUNK_BLOCKS;
+		self->pcm = (uint8_t *) malloc(ASAPPcmCache_CHUNK_BLOCKS * self->blockSize);
+		self->packed = (uint8_t *) malloc(1 + ASAPPcmCache_CHUNK_BLOCKS * self->blockSize);
+		if (self->pcm != NULL && self->packed != NULL && ASAPPcmCache_OpenFile(self, &header))
+			return self;
+		free(self->index);
+		self->index = NULL;
+	}
+
+	/* not cached: just play */
+	if (!ASAPPcmCache_StartEmulation(self)) {
+		ASAPPcmCache_Delete(self);
+		return NULL;
+	}
+	return self;
+}
+
+int ASAPPcmCache_Generate(ASAPPcmCache *self, uint8_t *buffer, int bufferLen)
+{
+	if (self->index == NULL)
+		return ASAP_Generate(self->asap, buffer, bufferLen, self->format);
+	int blocks = bufferLen / self->blockSize;
+	int done = 0;
+	while (done < blocks && self->position < self->totalBlocks) {
+		int chunk = self->position / ASAPPcmCache_CHUNK_BLOCKS;
+		if (chunk != self->chunk && !ASAPPcmCache_LoadChunk(self, chunk))
+			break;
+		int offset = self->position - chunk * ASAPPcmCache_CHUNK_BLOCKS;
+		int n = self->chunkBlocks - offset;
+		if (n <= 0)
+			break;
+		if (n > blocks - done)
+			n = blocks - done;
+		memcpy(buffer + done * self->blockSize, self->pcm + offset * self->blockSize, n * self->blockSize);
+		done += n;
+		self->position += n;
+	}
+	return done * self->blockSize;
+}
+
+bool ASAPPcmCache_SeekSample(ASAPPcmCache *self, int block)
+{
+	if (self->index == NULL)
+		return ASAP_SeekSample(self->asap, block);
+	if (block < 0)
+		block = 0;
+	self->position = block < self->totalBlocks ? block : self->totalBlocks;
+	return true;
+}
+
+bool ASAPPcmCache_Seek(ASAPPcmCache *self, int position)
+{
+	if (self->index == NULL)
+		return ASAP_Seek(self->asap, position);
+	return ASAPPcmCache_SeekSample(self, (int) ((int64_t) position * ASAP_GetSampleRate(self->asap) / 1000));
+}
+
+void ASAPPcmCache_Delete(ASAPPcmCache *self)
+{
+	if (self == NULL)
+		return;
+	ASAPPcmCache_CloseFile(self);
+	if (self->added) {
+		ASAPPcmCache_Lock();
+		if (cacheDir != NULL)
+			ASAPPcmCache_Trim();
+		ASAPPcmCache_Unlock();
+	}
+	free(self->index);
+	free(self->pcm);
+	free(self->packed);
+	free(self);
+}
@@ -0,0 +1,69 @@
+/*
+ * asap-pcmcache.h - persistent cache of rendered audio
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _ASAP_PCMCACHE_H_
+#define _ASAP_PCMCACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "asap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ASAPPcmCache ASAPPcmCache;
+
+/* Selects the cache directory, shared by all processes using it.
+   By default it is $ASAP_PCM_CACHE. If that is not set, the cache is disabled.
+   NULL or an empty string disables the cache. */
+void ASAPPcmCache_SetPath(const char *path);
+
+/* Limits the total size of the cache files, 256 MB by default.
+   Songs played least recently are removed when a song that added audio is closed. */
+void ASAPPcmCache_SetMaxSize(int64_t maxBytes);
+
+/* Starts playback of a song, like ASAP_PlaySong followed by ASAP_MutePokeyChannels.
+   Audio is read from the cache where available and emulated elsewhere,
+   storing it for the next time. A fully cached song is not emulated at all.
+   The module must have been loaded with ASAP_Load from the passed contents
+   and the sample rate set beforehand. Songs without a positive duration
+   are not cached. Returns NULL on error. */
+ASAPPcmCache *ASAPPcmCache_PlaySong(ASAP *asap, uint8_t const *module, int moduleLen, int song, int duration, int muteMask, ASAPSampleFormat format);
+
+/* Like ASAP_Generate in the format passed to ASAPPcmCache_PlaySong. */
+int ASAPPcmCache_Generate(ASAPPcmCache *self, uint8_t *buffer, int bufferLen);
+
+/* Like ASAP_SeekSample. Cached positions are reached without emulation. */
+bool ASAPPcmCache_SeekSample(ASAPPcmCache *self, int block);
+
+/* Like ASAP_Seek. */
+bool ASAPPcmCache_Seek(ASAPPcmCache *self, int position);
+
+/* Closes the cache file. Doesn't delete the ASAP. */
+void ASAPPcmCache_Delete(ASAPPcmCache *self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
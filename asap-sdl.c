@@ -1,7 +1,7 @@
 /*
  * asap-sdl.c - simple SDL ASAP player
  *
- * Copyright (C) 2010-2019  Piotr Fusik
+ * Copyright (C) 2010-2024  Piotr Fusik
  *
  * This file is part of ASAP (Another Slight Atari Player),
  * see http://asap.sourceforge.net
@@ -21,12 +21,17 @@
  * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <SDL.h>
+#include <SDL_thread.h>
 
 #include "asap.h"
 
 static int song = -1;
+static int buffer_samples = 1024;
+static int latency_ms = 200;
 
 static void print_help(void)
 {
@@ -36,6 +41,8 @@ static void print_help(void)
 		"SAP, CMC, CM3, CMR, CMS, DMC, DLT, MPT, MPD, RMT, TMC, TM8, TM2 or FC.\n"
 		"Options:\n"
 		"-s SONG     --song=SONG        Select subsong number (zero-based)\n"
+		"-b SAMPLES  --buffer=SAMPLES   Set audio device buffer size (default: 1024)\n"
+		"-l MS       --latency=MS       Set how far ahead to render (default: 200)\n"
 		"-h          --help             Display this information\n"
 		"-v          --version          Display version information\n"
 	);
@@ -57,16 +64,24 @@ static void sdl_error(const char *fun)
 	fatal_error("%s failed: %s", fun, SDL_GetError());
 }
 
-static void set_song(const char *s)
+static int parse_int(const char *s, const char *name, int min, int max)
 {
-	song = 0;
+	int value = 0;
 	do {
 		if (*s < '0' || *s > '9')
-			fatal_error("subsong number must be an integer");
-		song = 10 * song + *s++ - '0';
-		if (song >= ASAPInfo_MAX_SONGS)
-			fatal_error("maximum subsong number is %d", ASAPInfo_MAX_SONGS - 1);
+			fatal_error("%s must be an integer", name);
+		value = 10 * value + *s++ - '0';
+		if (value > max)
+			fatal_error("maximum %s is %d", name, max);
 	} while (*s != '\0');
+	if (value < min)
+		fatal_error("minimum %s is %d", name, min);
+	return value;
+}
+
+static void set_song(const char *s)
+{
+	song = parse_int(s, "subsong number", 0, ASAPInfo_MAX_SONGS - 1);
 }
 
 static void print_header(const char *name, const char *value)
@@ -75,9 +90,67 @@ static void print_header(const char *name, const char *value)
 		printf("%s: %s\n", name, value);
 }
 
+/* Single-producer single-consumer ring of rendered audio.
+   The producer thread emulates ahead, so that the audio callback only copies. */
+typedef struct {
+	ASAP *asap;
+	Uint8 *data;
+	unsigned mask; /* size in bytes minus one, size is a power of two */
+	/* free-running byte counters, written by one thread each */
+	atomic_uint write_pos;
+	atomic_uint read_pos;
+	atomic_bool quit;
+	atomic_int underruns;
+	SDL_sem *space; /* posted by the callback after consuming */
+} Ring;
+
+/* Renders into the free part of the ring. Returns false if there was none. */
+static bool ring_fill(Ring *ring)
+{
+	unsigned write_pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+	unsigned read_pos = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+	unsigned offset = write_pos & ring->mask;
+	unsigned len = ring->mask + 1 - (write_pos - read_pos);
+	if (len == 0)
+		return false;
+	if (len > ring->mask + 1 - offset)
+		len = ring->mask + 1 - offset; /* up to the end, wrap on the next call */
+	int generated = ASAP_Generate(ring->asap, ring->data + offset, len, ASAPSampleFormat_S16_L_E);
+	/* silence after the end of the song */
+	memset(ring->data + offset + generated, 0, len - generated);
+	atomic_store_explicit(&ring->write_pos, write_pos + len, memory_order_release);
+	return true;
+}
+
+static int producer_thread(void *data)
+{
+	Ring *ring = (Ring *) data;
+	while (!atomic_load_explicit(&ring->quit, memory_order_relaxed)) {
+		if (!ring_fill(ring))
+			SDL_SemWait(ring->space);
+	}
+	return 0;
+}
+
 static void audio_callback(void *userdata, Uint8 *stream, int len)
 {
-	ASAP_Generate((ASAP *) userdata, stream, len, ASAPSampleFormat_S16_L_E);
+	Ring *ring = (Ring *) userdata;
+	unsigned read_pos = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+	unsigned available = atomic_load_explicit(&ring->write_pos, memory_order_acquire) - read_pos;
+	unsigned copy_len = (unsigned) len;
+	if (copy_len > available) {
+		copy_len = available;
+		memset(stream + copy_len, 0, len - copy_len);
+		atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+	}
+	unsigned offset = read_pos & ring->mask;
+	unsigned first_len = ring->mask + 1 - offset;
+	if (first_len > copy_len)
+		first_len = copy_len;
+	memcpy(stream, ring->data + offset, first_len);
+	memcpy(stream + first_len, ring->data, copy_len - first_len);
+	atomic_store_explicit(&ring->read_pos, read_pos + copy_len, memory_order_release);
+	SDL_SemPost(ring->space);
 }
 
 static void process_file(const char *input_file)
@@ -103,19 +176,61 @@ static void process_file(const char *input_file)
 
 	if (SDL_Init(SDL_INIT_AUDIO) != 0)
 		sdl_error("SDL_Init");
+	static Ring ring;
 	SDL_AudioSpec desired;
 	desired.freq = ASAP_SAMPLE_RATE;
 	desired.format = AUDIO_S16LSB;
 	desired.channels = ASAPInfo_GetChannels(info);
-	desired.samples = 4096;
+	desired.samples = buffer_samples;
 	desired.callback = audio_callback;
-	desired.userdata = asap;
+	desired.userdata = &ring;
+	/* without the obtained spec, SDL converts to the device format */
 	if (SDL_OpenAudio(&desired, NULL) != 0)
 		sdl_error("SDL_OpenAudio");
+
+	/* the ring holds the latency plus one callback buffer, at least twice the buffer.
+	   Its size is a power of two, whatever buffer size was requested. */
+	int block_size = desired.channels << 1;
+	int callback_samples = desired.size / block_size;
+	unsigned ring_len = (unsigned) (callback_samples + (int64_t) ASAP_SAMPLE_RATE * latency_ms / 1000) * block_size;
+	unsigned ring_size = 1;
+	while (ring_size < ring_len || ring_size < 2u * callback_samples * block_size)
+		ring_size <<= 1;
+	ring.asap = asap;
+	ring.data = (Uint8 *) malloc(ring_size);
+	if (ring.data == NULL)
+		fatal_error("out of memory");
+	ring.mask = ring_size - 1;
+	atomic_init(&ring.write_pos, 0);
+	atomic_init(&ring.read_pos, 0);
+	atomic_init(&ring.quit, false);
+	atomic_init(&ring.underruns, 0);
+	ring.space = SDL_CreateSemaphore(0);
+	if (ring.space == NULL)
+		sdl_error("SDL_CreateSemaphore");
+	ring_fill(&ring);
+#if SDL_MAJOR_VERSION >= 2
+	SDL_Thread *producer = SDL_CreateThread(producer_thread, "asap-producer", &ring);
+#else
+	SDL_Thread *producer = SDL_CreateThread(producer_thread, &ring);
+#endif
+	if (producer == NULL)
+		sdl_error("SDL_CreateThread");
 	SDL_PauseAudio(0);
-	printf(" playing - press Enter to quit\n");
+	printf(" playing %d-sample buffers, %d ms ahead - press Enter to quit\n",
+		callback_samples, (int) ((int64_t) (ring_size / block_size - callback_samples) * 1000 / ASAP_SAMPLE_RATE));
 	getchar();
+	SDL_CloseAudio();
+	atomic_store(&ring.quit, true);
+	SDL_SemPost(ring.space);
+	SDL_WaitThread(producer, NULL);
+	SDL_DestroySemaphore(ring.space);
 	SDL_Quit();
+	int underruns = atomic_load(&ring.underruns);
+	if (underruns > 0)
+		printf("%d buffer underruns\n", underruns);
+	free(ring.data);
+	ASAP_Delete(asap);
 }
 
 int main(int argc, char *argv[])
@@ -134,6 +249,14 @@ int main(int argc, char *argv[])
 			set_song(argv[++i]);
 		else if (strncmp(arg, "--song=", 7) == 0)
 			set_song(arg + 7);
+		else if (is_opt('b'))
+			buffer_samples = parse_int(argv[++i], "buffer size", 64, 32768);
+		else if (strncmp(arg, "--buffer=", 9) == 0)
+			buffer_samples = parse_int(arg + 9, "buffer size", 64, 32768);
+		else if (is_opt('l'))
+			latency_ms = parse_int(argv[++i], "latency", 0, 10000);
+		else if (strncmp(arg, "--latency=", 10) == 0)
+			latency_ms = parse_int(arg + 10, "latency", 0, 10000);
 		else if (is_opt('h') || strcmp(arg, "--help") == 0) {
 			print_help();
 			options_error = NULL;
@@ -0,0 +1,253 @@
+/*
+ * asap-tracecache.c - in-process memo of POKEY register traces
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "asap-tracecache.h"
+
+#define ASAPTraceCache_DEFAULT_MAX_SIZE  ((int64_t) 64 << 20)
+
+typedef struct
+{
+	uint64_t moduleHash;
+	int moduleLen;
+	/* the same bytes can be loaded as different formats, e.g. CMC and CMR */
+	const char *type;
+	int song;
+	bool ntsc;
+	int sampleRate;
+	int coveredBlocks;
+	unsigned lastUse;
+	uint8_t *data;
+	int dataLen;
+} ASAPTraceCacheEntry;
+
+struct ASAPTraceCache
+{
+	ASAP *asap;
+	ASAPTrace *trace;
+	bool recording;
+	uint64_t moduleHash;
+	int moduleLen;
+	const char *type;
+	int song;
+	bool ntsc;
+	int sampleRate;
+};
+
+#ifdef _WIN32
+static SRWLOCK lock = SRWLOCK_INIT;
+#define ASAPTraceCache_Lock()  AcquireSRWLockExclusive(&lock)
+#define ASAPTraceCache_Unlock()  ReleaseSRWLockExclusive(&lock)
+#else
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define ASAPTraceCache_Lock()  pthread_mutex_lock(&lock)
+#define ASAPTraceCache_Unlock()  pthread_mutex_unlock(&lock)
+#endif
+
+static ASAPTraceCacheEntry *entries = NULL;
+static int entriesCount = 0;
+static int entriesCapacity = 0;
+static int64_t totalSize = 0;
+static int64_t maxSize = ASAPTraceCache_DEFAULT_MAX_SIZE;
+static unsigned useCounter = 0;
+
+static uint64_t ASAPTraceCache_Hash(uint8_t const *module, int moduleLen)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < moduleLen; i++) {
+		hash ^= module[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static bool ASAPTraceCache_SameType(const char *type1, const char *type2)
+{
+	return type1 == type2 || (type1 != NULL && type2 != NULL && strcmp(type1, type2) == 0);
+}
+
+static ASAPTraceCacheEntry *ASAPTraceCache_Find(const ASAPTraceCache *self)
+{
+	for (int i = 0; i < entriesCount; i++) {
+		ASAPTraceCacheEntry *entry = entries + i;
+		if (entry->moduleHash == self->moduleHash && entry->moduleLen == self->moduleLen && ASAPTraceCache_SameType(entry->type, self->type)
+		 && entry->song == self->song && entry->ntsc == self->ntsc && entry->sampleRate == self->sampleRate)
+			return entry;
+	}
+	return NULL;
+}
+
+static void ASAPTraceCache_Remove(ASAPTraceCacheEntry *entry)
+{
+	totalSize -= entry->dataLen;
+	free(entry->data);
+	*entry = entries[--entriesCount];
+}
+
+static void ASAPTraceCache_Trim(int64_t size)
+{
+	while (totalSize > size) {
+		int lru = 0;
+		for (int i = 1; i < entriesCount; i++) {
+			if (useCounter - entries[i].lastUse > useCounter - entries[lru].lastUse)
+				lru = i;
+		}
+		ASAPTraceCache_Remove(entries + lru);
+	}
+	if (entriesCount == 0) {
+		free(entries);
+		entries = NULL;
+		entriesCapacity = 0;
+	}
+}
+
+static bool ASAPTraceCache_CanCache(const ASAP *asap)
+{
+	/* MD1 and MD2 use samples loaded from extra files, which are not hashed */
+	const char *ext = ASAPInfo_GetOriginalModuleExt(ASAP_GetInfo(asap));
+	return ext == NULL || (strcmp(ext, "md1") != 0 && strcmp(ext, "md2") != 0);
+}
+
+/* Loads the cached trace covering the duration, if any.
+   Coverage is measured in samples, because the number of frames
+   needed for a duration depends on the rounding to the sample rate. */
+static bool ASAPTraceCache_Load(ASAPTraceCache *self, int duration)
+{
+	bool ok = false;
+	ASAPTraceCache_Lock();
+	ASAPTraceCacheEntry *entry = ASAPTraceCache_Find(self);
+	if (entry != NULL && (int64_t) duration * self->sampleRate / 1000 <= entry->coveredBlocks) {
+		entry->lastUse = ++useCounter;
+		ok = ASAPTrace_Load(self->trace, entry->data, entry->dataLen);
+	}
+	ASAPTraceCache_Unlock();
+	return ok;
+}
+
+ASAPTraceCache *ASAPTraceCache_PlaySong(ASAP *asap, uint8_t const *module, int moduleLen, int song, int duration)
+{
+	ASAPTraceCache *self = (ASAPTraceCache *) malloc(sizeof(ASAPTraceCache));
+	if (self == NULL)
+		return NULL;
+	self->asap = asap;
+	self->trace = NULL;
+	self->recording = false;
+	if (duration > 0 && ASAPTraceCache_CanCache(asap)) {
+		self->trace = ASAPTrace_New();
+		self->moduleHash = ASAPTraceCache_Hash(module, moduleLen);
+		self->moduleLen = moduleLen;
+		self->type = ASAPInfo_GetOriginalModuleExt(ASAP_GetInfo(asap));
+		self->song = song;
+		self->ntsc = ASAPInfo_IsNtsc(ASAP_GetInfo(asap));
+		self->sampleRate = ASAP_GetSampleRate(asap);
+	}
+	if (self->trace != NULL && ASAPTraceCache_Load(self, duration) && ASAP_PlayTrace(asap, self->trace, duration))
+		return self;
+
+	self->recording = self->trace != NULL;
+	ASAP_RecordTrace(asap, self->trace);
+	if (!ASAP_PlaySong(asap, song, duration)) {
+		ASAP_RecordTrace(asap, NULL);
+		ASAPTrace_Delete(self->trace);
+		free(self);
+		return NULL;
+	}
+	return self;
+}
+
+void ASAPTraceCache_Delete(ASAPTraceCache *self)
+{
+	if (self == NULL)
+		return;
+	if (self->recording) {
+		ASAP_RecordTrace(self->asap, NULL);
+		int coveredBlocks = ASAP_GetBlocksPlayed(self->asap);
+		int dataLen = ASAPTrace_GetSaveLength(self->trace);
+		uint8_t *data = coveredBlocks > 0 ? (uint8_t *) malloc(dataLen) : NULL;
+		if (data != NULL) {
+			ASAPTrace_Save(self->trace, data);
+			ASAPTraceCache_Lock();
+			ASAPTraceCacheEntry *entry = ASAPTraceCache_Find(self);
+			if (entry != NULL && entry->coveredBlocks < coveredBlocks)
+				ASAPTraceCache_Remove(entry);
+			else if (entry != NULL) {
+				/* keep the longer trace */
+				entry->lastUse = ++useCounter;
+				dataLen = 0;
+			}
+			if (dataLen > 0 && dataLen <= maxSize) {
+				ASAPTraceCache_Trim(maxSize - dataLen);
+				if (entriesCount == entriesCapacity) {
+					int capacity = entriesCapacity == 0 ? 16 : entriesCapacity * 2;
+					ASAPTraceCacheEntry *newEntries = (ASAPTraceCacheEntry *) realloc(entries, capacity * sizeof(ASAPTraceCacheEntry));
+					if (newEntries != NULL) {
+						entries = newEntries;
+						entriesCapacity = capacity;
+					}
+				}
+				if (entriesCount < entriesCapacity) {
+					entry = entries + entriesCount++;
+					entry->moduleHash = self->moduleHash;
+					entry->moduleLen = self->moduleLen;
+					entry->type = self->type;
+					entry->song = self->song;
+					entry->ntsc = self->ntsc;
+					entry->sampleRate = self->sampleRate;
+					entry->coveredBlocks = coveredBlocks;
+					entry->lastUse = ++useCounter;
+					entry->data = data;
+					entry->dataLen = dataLen;
+					totalSize += dataLen;
+					data = NULL;
+				}
+			}
+			ASAPTraceCache_Unlock();
+			free(data);
+		}
+	}
+	ASAPTrace_Delete(self->trace);
+	free(self);
+}
+
+void ASAPTraceCache_SetMaxSize(int64_t maxBytes)
+{
+	ASAPTraceCache_Lock();
+	maxSize = maxBytes < 0 ? 0 : maxBytes;
+	ASAPTraceCache_Trim(maxSize);
+	ASAPTraceCache_Unlock();
+}
+
+void ASAPTraceCache_Clear(void)
+{
+	ASAPTraceCache_Lock();
+	ASAPTraceCache_Trim(0);
+	ASAPTraceCache_Unlock();
+}
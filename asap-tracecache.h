@@ -0,0 +1,54 @@
+/*
+ * asap-tracecache.h - in-process memo of POKEY register traces
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _ASAP_TRACECACHE_H_
+#define _ASAP_TRACECACHE_H_
+
+#include <stdint.h>
+#include "asap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ASAPTraceCache ASAPTraceCache;
+
+/* Like ASAP_PlaySong, but if the song was played at least as long before
+   in this process with the same sample rate, replays its POKEY writes
+   instead of emulating the 6502.
+   Otherwise records the writes, stored when the handle is deleted.
+   The module must have been loaded with ASAP_Load from the passed contents.
+   Songs without a positive duration are played, but not cached.
+   Safe to call from multiple threads as long as each uses its own ASAP.
+   Returns NULL on error. */
+ASAPTraceCache *ASAPTraceCache_PlaySong(ASAP *asap, uint8_t const *module, int moduleLen, int song, int duration);
+/* Stores the recorded trace and frees the handle. Call it before ASAP_Delete. */
+void ASAPTraceCache_Delete(ASAPTraceCache *self);
+/* Limits the total size of cached traces, 64 MB by default. Zero disables caching. */
+void ASAPTraceCache_SetMaxSize(int64_t maxBytes);
+void ASAPTraceCache_Clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -55,6 +55,8 @@ static char *FuString_Format(const char *format, ...)
 }
 typedef struct ASAPModuleTransfer ASAPModuleTransfer;
 typedef struct ASAPMptSamples ASAPMptSamples;
+typedef struct ASAPInitState ASAPInitState;
+typedef struct LoopDetector LoopDetector;
 
 typedef enum {
 	NmiStatus_RESET,
@@ -159,6 +161,8 @@ struct Cpu6502 {
 
 static void Cpu6502_Reset(Cpu6502 *self);
 
+static void Cpu6502_CopyStateFrom(Cpu6502 *self, const Cpu6502 *source);
+
 static int Cpu6502_Peek(const Cpu6502 *self, int addr);
 
 static void Cpu6502_Poke(Cpu6502 *self, int addr, int data);
@@ -233,6 +237,14 @@ static void PokeyChannel_SetAudc(PokeyChannel *self, Pokey *pokey, const PokeyPa
 
 static void PokeyChannel_EndFrame(PokeyChannel *self, int cycle);
 
+static void PokeyChannel_CopyStateFrom(PokeyChannel *self, const PokeyChannel *source);
+
+static void PokeyChannel_SaveSoundState(const PokeyChannel *self, int *state, int offset);
+
+static bool PokeyChannel_IsValidSoundState(int const *state, int offset);
+
+static void PokeyChannel_RestoreSoundState(PokeyChannel *self, int const *state, int offset);
+
 struct Pokey {
 	PokeyChannel channels[4];
 	int audctl;
@@ -288,8 +300,33 @@ static int Pokey_CheckIrq(Pokey *self, int cycle, int nextEventCycle);
 
 static int Pokey_StoreSample(Pokey *self, uint8_t *buffer, int bufferOffset, int i, ASAPSampleFormat format);
 
+static int Pokey_StoreFiltered(Pokey *self, uint8_t *buffer, int bufferOffset, int delta, ASAPSampleFormat format);
+
+static int Pokey_StoreDelta(const Pokey *self, int *buffer, int bufferOffset, int i);
+
 static void Pokey_AccumulateTrailing(Pokey *self, int i);
 
+static void Pokey_CopyStateFrom(Pokey *self, const Pokey *source);
+
+/**
+ * Stores what determines the sound generated from now on,
+ * except user muting, in <code>SoundStateLength</code> integers.
+ * @param self This <code>Pokey</code>.
+ */
+static void Pokey_SaveSoundState(const Pokey *self, int *state, int offset);
+
+/**
+ * Checks a state from an untrusted source, so that restoring it cannot cause out-of-bounds accesses.
+ */
+static bool Pokey_IsValidSoundState(int const *state, int offset);
+
+/**
+ * Restores the state stored by <code>SaveSoundState</code>.
+ * Clears the sound generated before.
+ * @param self This <code>Pokey</code>.
+ */
+static void Pokey_RestoreSoundState(Pokey *self, int const *state, int offset);
+
 struct PokeyPair {
 	uint8_t poly9Lookup[511];
 	uint8_t poly17Lookup[16385];
@@ -302,6 +339,7 @@ struct PokeyPair {
 	int sampleOffset;
 	int readySamplesStart;
 	int readySamplesEnd;
+	bool skipSynthesis;
 };
 static void PokeyPair_Construct(PokeyPair *self);
 static void PokeyPair_Destruct(PokeyPair *self);
@@ -324,6 +362,18 @@ static int PokeyPair_EndFrame(PokeyPair *self, int cycle);
  */
 static int PokeyPair_Generate(PokeyPair *self, uint8_t *buffer, int bufferOffset, int blocks, ASAPSampleFormat format);
 
+/**
+ * Discards up to <code>blocks</code> samples from <code>DeltaBuffer</code>.
+ * @param self This <code>PokeyPair</code>.
+ */
+static int PokeyPair_SkipSamples(PokeyPair *self, int blocks);
+
+/**
+ * Fills buffer with unfiltered samples from <code>DeltaBuffer</code>.
+ * @param self This <code>PokeyPair</code>.
+ */
+static int PokeyPair_GenerateDeltas(PokeyPair *self, int *buffer, int bufferOffset, int blocks);
+
 static bool PokeyPair_IsSilent(const PokeyPair *self);
 
 /**
@@ -339,6 +389,7 @@ struct ASAPInfo {
 	int defaultSong;
 	int durations[32];
 	bool loops[32];
+	int loopStarts[32];
 	bool ntsc;
 	ASAPModuleType type;
 	ASAPModuleType originalType;
@@ -350,6 +401,8 @@ struct ASAPInfo {
 	int headerLen;
 	int mptSongBugExtra;
 	uint8_t songPos[32];
+	int songStart[32];
+	bool durationPending[32];
 };
 static void ASAPInfo_Construct(ASAPInfo *self);
 static void ASAPInfo_Destruct(ASAPInfo *self);
@@ -360,9 +413,13 @@ static int ASAPInfo_GetWord(uint8_t const *array, int i);
 
 static bool ASAPInfo_ParseModule(ASAPInfo *self, uint8_t const *module, int moduleLen);
 
+static void ASAPInfo_SetSongDuration(ASAPInfo *self, int song, int playerCalls, int fastplay);
+
 static void ASAPInfo_AddSong(ASAPInfo *self, int playerCalls);
 
-static void ASAPInfo_ParseCmcSong(ASAPInfo *self, uint8_t const *module, int pos);
+static void ASAPInfo_AddPendingSong(ASAPInfo *self, int pos);
+
+static void ASAPInfo_ParseCmcSong(ASAPInfo *self, uint8_t const *module, int song);
 
 static bool ASAPInfo_ParseCmc(ASAPInfo *self, uint8_t const *module, int moduleLen, ASAPModuleType type);
 
@@ -392,13 +449,13 @@ static bool ASAPInfo_ValidateRmt(uint8_t const *module, int moduleLen);
 
 static bool ASAPInfo_ParseRmt(ASAPInfo *self, uint8_t const *module, int moduleLen);
 
-static void ASAPInfo_ParseTmcSong(ASAPInfo *self, uint8_t const *module, int pos);
+static void ASAPInfo_ParseTmcSong(ASAPInfo *self, uint8_t const *module, int song);
 
 static int ASAPInfo_ParseTmcTitle(uint8_t *title, int titleLen, uint8_t const *module, int moduleOffset);
 
 static bool ASAPInfo_ParseTmc(ASAPInfo *self, uint8_t const *module, int moduleLen);
 
-static void ASAPInfo_ParseTm2Song(ASAPInfo *self, uint8_t const *module, int pos);
+static void ASAPInfo_ParseTm2Song(ASAPInfo *self, uint8_t const *module, int song);
 
 static bool ASAPInfo_ParseTm2(ASAPInfo *self, uint8_t const *module, int moduleLen);
 
@@ -444,6 +501,137 @@ static int ASAPInfo_CheckDate(const ASAPInfo *self);
 
 static int ASAPInfo_GetTwoDateDigits(const ASAPInfo *self, int i);
 
+static void ASAPInfo_AnalyzePendingSong(ASAPInfo *self, uint8_t const *module, int song);
+
+static int ASAPInfo_ConvertNtsc(int64_t milliseconds, bool ntsc);
+
+/**
+ * Emulator state of a song, without the playback position.
+ */
+struct ASAPInitState {
+	int song;
+	bool ntsc;
+	int sampleRate;
+	Cpu6502 cpu;
+	NmiStatus nmist;
+	int consol;
+	uint8_t covox[4];
+	int mptSamplesCurrentAddress;
+	bool mptSamplesSecondNibble;
+	int tmcPerFrameCounter;
+	Pokey basePokey;
+	Pokey extraPokey;
+};
+static void ASAPInitState_Construct(ASAPInitState *self);
+static void ASAPInitState_Destruct(ASAPInitState *self);
+
+/**
+ * Emulator state between two frames of a song.
+ * Lets another <code>ASAP</code> object continue the playback,
+ * for example to render segments of a long song in parallel.
+ */
+struct ASAPFrameState {
+	ASAPInitState init;
+	int blocksPlayed;
+	int nextPlayerCycle;
+	int silenceCyclesCounter;
+	int sampleOffset;
+};
+static void ASAPFrameState_Construct(ASAPFrameState *self);
+static void ASAPFrameState_Destruct(ASAPFrameState *self);
+
+/**
+ * POKEY, GTIA and COVOX writes of the 6502 while playing a song,
+ * recorded by <code>ASAP.RecordTrace</code>.
+ * <code>ASAP.PlayTrace</code> replays them without emulating the 6502,
+ * generating the same sound at any sample rate.
+ */
+struct ASAPTrace {
+	uint8_t *events;
+	int eventsCapacity;
+	int eventsLength;
+	int lastCycle;
+	int *index;
+	int indexCapacity;
+	int indexEntries;
+	int song;
+	bool ntsc;
+	bool stereo;
+	int initFrames;
+	int frames;
+	int muteMask;
+};
+static void ASAPTrace_Construct(ASAPTrace *self);
+static void ASAPTrace_Destruct(ASAPTrace *self);
+
+static void ASAPTrace_Start(ASAPTrace *self, int song, bool ntsc, bool stereo);
+
+static void ASAPTrace_WriteByte(ASAPTrace *self, int value);
+
+static void ASAPTrace_Write(ASAPTrace *self, int reg, int data, int cycle);
+
+static void ASAPTrace_EndFrame(ASAPTrace *self);
+
+static void ASAPTrace_EndInit(ASAPTrace *self, int muteMask);
+
+static void ASAPTrace_SetMuteMask(ASAPTrace *self, int mask);
+
+static void ASAPTrace_StartFrame(ASAPTrace *self, const PokeyPair *pokeys, int consol, uint8_t const *covox);
+
+/**
+ * Replays the writes of the frame at <code>offset</code>.
+ * Returns the offset of the next frame.
+ * @param self This <code>ASAPTrace</code>.
+ */
+static int ASAPTrace_ReplayFrame(const ASAPTrace *self, ASAP *asap, int offset);
+
+static int ASAPTrace_GetFrameCycles(bool ntsc);
+
+static int ASAPTrace_GetLittleEndian(uint8_t const *buffer, int offset);
+
+/**
+ * Finds repeating sequences of POKEY register values, for <code>ASAP.DetectDuration</code>.
+ */
+struct LoopDetector {
+	uint8_t *registers;
+	int *windowHashes;
+	int *hashNext;
+	int *hashFirst;
+	int *hashLast;
+	int capacity;
+	int hashMask;
+	int windowFrames;
+	int windowHash;
+	int removePower;
+	bool loop;
+	int loopStartFrame;
+	int loopEndFrame;
+};
+static void LoopDetector_Construct(LoopDetector *self);
+static void LoopDetector_Destruct(LoopDetector *self);
+
+static void LoopDetector_Start(LoopDetector *self, int frames, int windowFrames);
+
+static bool LoopDetector_StorePokey(LoopDetector *self, int offset, const Pokey *pokey);
+
+/**
+ * Stores POKEY registers at the end of the given frame.
+ * Returns <code>true</code> on silence.
+ * @param self This <code>LoopDetector</code>.
+ */
+static bool LoopDetector_StoreFrame(LoopDetector *self, int frame, const PokeyPair *pokeys);
+
+static int LoopDetector_GetFrameHash(const LoopDetector *self, int frame);
+
+static bool LoopDetector_IsRepeated(const LoopDetector *self, int firstFrame, int secondFrame);
+
+/**
+ * Looks up the <code>WindowFrames</code> frames before <code>frame</code> among the earlier windows.
+ * Returns the frame where the song should end or -1 if it goes on.
+ * @param self This <code>LoopDetector</code>.
+ */
+static int LoopDetector_FindLoop(LoopDetector *self, int frame, int minLoopFrames);
+
 /**
  * Atari 8-bit chip music emulator.
  * This class performs no I/O operations - all music data must be passed in byte arrays.
@@ -469,6 +657,14 @@ struct ASAP {
 	int silenceCycles;
 	int silenceCyclesCounter;
 	bool gtiaOrCovoxPlayedThisFrame;
+	LoopDetector detector;
+	int loopSong;
+	int loopStartFrame;
+	int loopEndFrame;
+	ASAPTrace *recordingTrace;
+	const ASAPTrace *playingTrace;
+	int playingTraceOffset;
+	int playingTraceFrame;
 	int currentSampleRate;
 };
 static void ASAP_Construct(ASAP *self);
@@ -476,6 +672,10 @@ static void ASAP_Destruct(ASAP *self);
 
 static int ASAP_PeekHardware(const ASAP *self, int addr);
 
+static void ASAP_PokeCovox(ASAP *self, int channel, int data, int cycle);
+
+static void ASAP_PokeConsol(ASAP *self, int data, int cycle);
+
 static void ASAP_PokeHardware(ASAP *self, int addr, int data);
 
 static void ASAP_StoreJsr(ASAP *self, int addr, int target);
@@ -492,12 +692,38 @@ static void ASAP_HandleEvent(ASAP *self);
 
 static int ASAP_Do6502Frame(ASAP *self);
 
+static void ASAP_EndPokeyTimers(ASAP *self, int cycles);
+
+/**
+ * Replays a write recorded in <code>ASAPTrace</code>.
+ * @param self This <code>ASAP</code>.
+ */
+static void ASAP_PokeTraced(ASAP *self, int reg, int data, int cycle);
+
+/**
+ * Replays the next frame of <code>PlayingTrace</code> instead of <code>Do6502Frame</code>.
+ * After the end of the trace, POKEYs continue with the last values written.
+ * @param self This <code>ASAP</code>.
+ */
+static int ASAP_ReplayFrame(ASAP *self);
+
 static int ASAP_DoFrame(ASAP *self);
 
 static bool ASAP_Do6502Init(ASAP *self, int pc, int a, int x, int y);
 
 static bool ASAP_RestartSong(ASAP *self, int muteMask);
 
+/**
+ * Jumps to the last indexed frame of <code>PlayingTrace</code> at least one frame before <code>block</code>,
+ * unless it is before the current position.
+ * @param self This <code>ASAP</code>.
+ */
+static void ASAP_SeekTrace(ASAP *self, int block);
+
+static void ASAP_SaveState(const ASAP *self, ASAPInitState *state);
+
+static bool ASAP_RestoreState(ASAP *self, const ASAPInitState *state, int duration);
+
 static int ASAP_MillisecondsToBlocks(const ASAP *self, int milliseconds);
 
 static void ASAP_PutLittleEndian(uint8_t *buffer, int offset, int value);
@@ -506,8 +732,36 @@ static void ASAP_PutLittleEndians(uint8_t *buffer, int offset, int value1, int v
 
 static int ASAP_PutWavMetadata(uint8_t *buffer, int offset, int fourCC, const char *value);
 
+/**
+ * Writes the <code>smpl</code> chunk with the loop of the current song, if known and within the output.
+ * @param self This <code>ASAP</code>.
+ */
+static int ASAP_PutWavLoop(const ASAP *self, uint8_t *buffer, int offset, int totalBlocks);
+
+/**
+ * Emulates one frame for the output.
+ * Returns <code>false</code> if silence detection stops playback.
+ * @param self This <code>ASAP</code>.
+ */
+static bool ASAP_DoFrameUnlessSilent(ASAP *self);
+
 static int ASAP_GenerateAt(ASAP *self, uint8_t *buffer, int bufferOffset, int bufferLen, ASAPSampleFormat format);
 
+static int ASAP_GetMainClock(const ASAP *self);
+
+static int ASAP_SecondsToFrames(const ASAP *self, int seconds);
+
+static int ASAP_FramesToBlocks(const ASAP *self, int frames);
+
+/**
+ * Rounds up, so that playing for the returned time reaches
+ * the first block of the frame, as counted by <code>FramesToBlocks</code>.
+ * @param self This <code>ASAP</code>.
+ */
+static int ASAP_FramesToMilliseconds(const ASAP *self, int frames);
+
+static int ASAP_RunDurationDetection(ASAP *self, int maxSeconds, int silenceSeconds);
+
 static uint8_t const *ASAP6502_GetPlayerRoutine(const ASAPInfo *info);
 
 struct DurationParser {
@@ -633,8 +887,6 @@ static void FlashPack_PutItems(FlashPack *self);
 
 static void FlashPack_PutItem(FlashPack *self, FlashPackItemType type, int value);
 
-static bool FlashPack_IsLiteralPreferred(const FlashPack *self);
-
 static void FlashPack_CompressMemoryArea(FlashPack *self, int startAddress, int endAddress);
 
 static void FlashPack_PutPoke(FlashPack *self, int address, int value);
@@ -2489,10 +2741,444 @@ static void ASAPMptSamples_Relocate(ASAPMptSamples *self, int music, int musicLa
 	}
 }
 
+static void ASAPInitState_Construct(ASAPInitState *self)
+{
+	Pokey_Construct(&self->basePokey);
+	Pokey_Construct(&self->extraPokey);
+}
+
+static void ASAPInitState_Destruct(ASAPInitState *self)
+{
+	Pokey_Destruct(&self->extraPokey);
+	Pokey_Destruct(&self->basePokey);
+}
+
+static void ASAPFrameState_Construct(ASAPFrameState *self)
+{
+	ASAPInitState_Construct(&self->init);
+}
+
+static void ASAPFrameState_Destruct(ASAPFrameState *self)
+{
+	ASAPInitState_Destruct(&self->init);
+}
+
+ASAPFrameState *ASAPFrameState_New(void)
+{
+	ASAPFrameState *self = (ASAPFrameState *) calloc(1, sizeof(ASAPFrameState));
+	if (self != NULL)
+		ASAPFrameState_Construct(self);
+	return self;
+}
+
+void ASAPFrameState_Delete(ASAPFrameState *self)
+{
+	if (self == NULL)
+		return;
+	ASAPFrameState_Destruct(self);
+	free(self);
+}
+
+static void ASAPTrace_Construct(ASAPTrace *self)
+{
+	self->events = NULL;
+	self->eventsCapacity = 0;
+	self->eventsLength = 0;
+	self->index = NULL;
+	self->indexCapacity = 0;
+	self->indexEntries = 0;
+}
+
+static void ASAPTrace_Destruct(ASAPTrace *self)
+{
+	free(self->index);
+	free(self->events);
+}
+
+ASAPTrace *ASAPTrace_New(void)
+{
+	ASAPTrace *self = (ASAPTrace *) calloc(1, sizeof(ASAPTrace));
+	if (self != NULL)
+		ASAPTrace_Construct(self);
+	return self;
+}
+
+void ASAPTrace_Delete(ASAPTrace *self)
+{
+	if (self == NULL)
+		return;
+	ASAPTrace_Destruct(self);
+	free(self);
+}
+
+static void ASAPTrace_Start(ASAPTrace *self, int song, bool ntsc, bool stereo)
+{
+	self->eventsLength = 0;
+	self->lastCycle = 0;
+	self->indexEntries = 0;
+	self->song = song;
+	self->ntsc = ntsc;
+	self->stereo = stereo;
+	self->initFrames = 0;
+	self->frames = 0;
+	self->muteMask = -1;
+}
+
+static void ASAPTrace_WriteByte(ASAPTrace *self, int value)
+{
+	if (self->eventsLength == self->eventsCapacity) {
+		int capacity = self->eventsCapacity == 0 ? 65536 : self->eventsCapacity * 2;
+		uint8_t *events = (uint8_t *) malloc(capacity);
+		if (self->eventsLength > 0)
+			memcpy(events, self->events, self->eventsLength);
+		free(self->events);
+		self->events = events;
+		self->eventsCapacity = capacity;
+	}
+	self->events[self->eventsLength++] = (uint8_t) value;
+}
+
+static void ASAPTrace_Write(ASAPTrace *self, int reg, int data, int cycle)
+{
+	ASAPTrace_WriteByte(self, reg);
+	int delta = cycle - self->lastCycle;
+	self->lastCycle = cycle;
+	delta = delta >= 0 ? delta << 1 : ~delta << 1 | 1;
+	while (delta >= 128) {
+		ASAPTrace_WriteByte(self, (delta & 127) | 128);
+		delta >>= 7;
+	}
+	ASAPTrace_WriteByte(self, delta);
+	ASAPTrace_WriteByte(self, data);
+}
+
+static void ASAPTrace_EndFrame(ASAPTrace *self)
+{
+	ASAPTrace_WriteByte(self, 255);
+	self->lastCycle = 0;
+	self->frames++;
+}
+
+static void ASAPTrace_EndInit(ASAPTrace *self, int muteMask)
+{
+	self->initFrames = self->frames;
+	self->muteMask = muteMask;
+}
+
+static void ASAPTrace_SetMuteMask(ASAPTrace *self, int mask)
+{
+	if (self->frames == self->initFrames)
+		self->muteMask = mask;
+	else if (self->muteMask != mask)
+		self->muteMask = -1;
+}
+
+static void ASAPTrace_StartFrame(ASAPTrace *self, const PokeyPair *pokeys, int consol, uint8_t const *covox)
+{
+	int frame = self->frames - self->initFrames;
+	if (frame == 0 || frame % 256 != 0)
+		return;
+	if (self->indexEntries == self->indexCapacity) {
+		int capacity = self->indexCapacity == 0 ? 64 : self->indexCapacity * 2;
+		int *index = (int *) malloc(capacity * 80 * sizeof(int));
+		if (self->indexEntries > 0)
+			memcpy(index, self->index, self->indexEntries * 80 * sizeof(int));
+		free(self->index);
+		self->index = index;
+		self->indexCapacity = capacity;
+	}
+	int offset = self->indexEntries++ * 80;
+	self->index[offset] = self->eventsLength;
+	self->index[offset + 1] = consol;
+	for (int i = 0; i < 4; i++)
+		self->index[offset + 2 + i] = covox[i];
+	Pokey_SaveSoundState(&pokeys->basePokey, self->index, offset + 6);
+	Pokey_SaveSoundState(&pokeys->extraPokey, self->index, offset + 43);
+}
+
+static int ASAPTrace_ReplayFrame(const ASAPTrace *self, ASAP *asap, int offset)
+{
+	int cycle = 0;
+	for (;;) {
+		int reg = self->events[offset++];
+		if (reg == 255)
+			return offset;
+		int delta = 0;
+		for (int shift = 0;; shift += 7) {
+			int b = self->events[offset++];
+			delta |= (b & 127) << shift;
+			if (b < 128)
+				break;
+		}
+		cycle += delta >> 1 ^ -(delta & 1);
+		ASAP_PokeTraced(asap, reg, self->events[offset++], cycle);
+	}
+}
+
+static int ASAPTrace_GetFrameCycles(bool ntsc)
+{
+	return ntsc ? 29868 : 35568;
+}
+
+int ASAPTrace_GetDuration(const ASAPTrace *self)
+{
+	int64_t frames = self->frames - self->initFrames;
+	return (int) (frames * ASAPTrace_GetFrameCycles(self->ntsc) * 1000 / (self->ntsc ? 1789772 : 1773447));
+}
+
+int ASAPTrace_GetSaveLength(const ASAPTrace *self)
+{
+	return 24 + self->eventsLength + self->indexEntries * 80 * 4;
+}
+
+static int ASAPTrace_GetLittleEndian(uint8_t const *buffer, int offset)
+{
+	return buffer[offset] | buffer[offset + 1] << 8 | buffer[offset + 2] << 16 | buffer[offset + 3] << 24;
+}
+
+int ASAPTrace_Save(const ASAPTrace *self, uint8_t *buffer)
+{
+	buffer[0] = 'A';
+	buffer[1] = 'T';
+	buffer[2] = 'R';
+	buffer[3] = 'C';
+	buffer[4] = 1;
+	buffer[5] = (uint8_t) ((self->ntsc ? 1 : 0) | (self->stereo ? 2 : 0) | (self->muteMask >= 0 ? 4 : 0));
+	buffer[6] = (uint8_t) self->song;
+	buffer[7] = (uint8_t) (self->muteMask & 255);
+	ASAP_PutLittleEndian(buffer, 8, self->initFrames);
+	ASAP_PutLittleEndian(buffer, 12, self->frames);
+	ASAP_PutLittleEndian(buffer, 16, self->eventsLength);
+	ASAP_PutLittleEndian(buffer, 20, self->indexEntries);
+	if (self->eventsLength > 0)
+		memcpy(buffer + 24, self->events, self->eventsLength);
+	int offset = 24 + self->eventsLength;
+	for (int i = 0; i < self->indexEntries * 80; i++) {
+		ASAP_PutLittleEndian(buffer, offset, self->index[i]);
+		offset += 4;
+	}
+	return offset;
+}
+
+bool ASAPTrace_Load(ASAPTrace *self, uint8_t const *data, int dataLen)
+{
+	self->eventsLength = 0;
+	self->indexEntries = 0;
+	self->initFrames = 0;
+	self->frames = 0;
+	if (dataLen < 24 || data[0] != 'A' || data[1] != 'T' || data[2] != 'R' || data[3] != 'C' || data[4] != 1)
+		return false;
+	int flags = data[5];
+	int initFrames = ASAPTrace_GetLittleEndian(data, 8);
+	int frames = ASAPTrace_GetLittleEndian(data, 12);
+	int eventsLength = ASAPTrace_GetLittleEndian(data, 16);
+	int indexEntries = ASAPTrace_GetLittleEndian(data, 20);
+	if (initFrames < 0 || frames < initFrames || eventsLength < frames || indexEntries < 0 || indexEntries > (frames - initFrames - 1) / 256 || dataLen != 24 + eventsLength + indexEntries * 80 * 4)
+		return false;
+	self->ntsc = (flags & 1) != 0;
+	self->stereo = (flags & 2) != 0;
+	self->muteMask = (flags & 4) != 0 ? data[7] : -1;
+	self->song = data[6];
+	if (self->eventsCapacity < eventsLength) {
+		free(self->events);
+		self->events = (uint8_t *) malloc(eventsLength);
+		self->eventsCapacity = eventsLength;
+	}
+	if (eventsLength > 0)
+		memcpy(self->events, data + 24, eventsLength);
+	if (self->indexCapacity < indexEntries) {
+		free(self->index);
+		self->index = (int *) malloc(indexEntries * 80 * sizeof(int));
+		self->indexCapacity = indexEntries;
+	}
+	for (int i = 0; i < indexEntries * 80; i++)
+		self->index[i] = ASAPTrace_GetLittleEndian(data, 24 + eventsLength + i * 4);
+	int maxCycle = ASAPTrace_GetFrameCycles(self->ntsc) + 32;
+	int frame = 0;
+	int offset = 0;
+	while (offset < eventsLength) {
+		if (frame > initFrames && (frame - initFrames) % 256 == 0) {
+			int entry = (frame - initFrames) / 256 - 1;
+			if (entry < indexEntries) {
+				int entryOffset = entry * 80;
+				if (self->index[entryOffset] != offset || self->index[entryOffset + 1] < 0 || self->index[entryOffset + 1] > 255)
+					return false;
+				for (int i = 0; i < 4; i++) {
+					if (self->index[entryOffset + 2 + i] < 0 || self->index[entryOffset + 2 + i] > 255)
+						return false;
+				}
+				if (!Pokey_IsValidSoundState(self->index, entryOffset + 6) || !Pokey_IsValidSoundState(self->index, entryOffset + 43))
+					return false;
+			}
+		}
+		int cycle = 0;
+		for (;;) {
+			if (offset >= eventsLength)
+				return false;
+			int reg = self->events[offset++];
+			if (reg == 255)
+				break;
+			if (reg > 36)
+				return false;
+			int delta = 0;
+			for (int shift = 0;; shift += 7) {
+				if (offset >= eventsLength || shift > 14)
+					return false;
+				int b = self->events[offset++];
+				delta |= (b & 127) << shift;
+				if (b < 128)
+					break;
+			}
+			cycle += delta >> 1 ^ -(delta & 1);
+			if (cycle < 0 || cycle > maxCycle || offset >= eventsLength)
+				return false;
+			offset++;
+		}
+		frame++;
+	}
+	if (frame != frames)
+		return false;
+	self->eventsLength = eventsLength;
+	self->indexEntries = indexEntries;
+	self->initFrames = initFrames;
+	self->frames = frames;
+	return true;
+}
+
+static void LoopDetector_Construct(LoopDetector *self)
+{
+	self->registers = NULL;
+	self->windowHashes = NULL;
+	self->hashNext = NULL;
+	self->hashFirst = NULL;
+	self->hashLast = NULL;
+	self->capacity = 0;
+}
+
+static void LoopDetector_Destruct(LoopDetector *self)
+{
+	free(self->hashLast);
+	free(self->hashFirst);
+	free(self->hashNext);
+	free(self->windowHashes);
+	free(self->registers);
+}
+
+static void LoopDetector_Start(LoopDetector *self, int frames, int windowFrames)
+{
+	if (self->capacity < frames) {
+		self->capacity = frames;
+		free(self->registers);
+		self->registers = (uint8_t *) malloc(frames * 18);
+		free(self->windowHashes);
+		self->windowHashes = (int *) malloc(frames * sizeof(int));
+		free(self->hashNext);
+		self->hashNext = (int *) malloc(frames * sizeof(int));
+		int hashSize = 1;
+		while (hashSize < frames)
+			hashSize <<= 1;
+		free(self->hashFirst);
+		self->hashFirst = (int *) malloc(hashSize * sizeof(int));
+		free(self->hashLast);
+		self->hashLast = (int *) malloc(hashSize * sizeof(int));
+		self->hashMask = hashSize - 1;
+	}
+	for (int _i = 0; _i < self->hashMask + 1; _i++)
+		self->hashFirst[_i] = -1;
+	self->windowFrames = windowFrames;
+	self->windowHash = 0;
+	int64_t power = 1;
+	for (int i = 1; i < windowFrames; i++)
+		power = power * 16777619 % 67108859;
+	self->removePower = (int) power;
+	self->loop = false;
+}
+
+static bool LoopDetector_StorePokey(LoopDetector *self, int offset, const Pokey *pokey)
+{
+	bool silence = true;
+	for (int i = 0; i < 4; i++) {
+		int audc = pokey->channels[i].audc;
+		if ((audc & 15) != 0) {
+			silence = false;
+			if ((audc & 224) == 224)
+				audc &= 191;
+			self->registers[offset + i * 2] = (uint8_t) pokey->channels[i].audf;
+			self->registers[offset + i * 2 + 1] = (uint8_t) audc;
+		}
+		else {
+			self->registers[offset + i * 2] = 0;
+			self->registers[offset + i * 2 + 1] = 0;
+		}
+	}
+	self->registers[offset + 8] = (uint8_t) pokey->audctl;
+	return silence;
+}
+
+static bool LoopDetector_StoreFrame(LoopDetector *self, int frame, const PokeyPair *pokeys)
+{
+	bool silence = LoopDetector_StorePokey(self, frame * 18, &pokeys->basePokey);
+	return LoopDetector_StorePokey(self, frame * 18 + 9, &pokeys->extraPokey) && silence;
+}
+
+static int LoopDetector_GetFrameHash(const LoopDetector *self, int frame)
+{
+	int64_t hash = 0;
+	for (int i = frame * 18; i < frame * 18 + 18; i++)
+		hash = (hash * 256 + self->registers[i]) % 67108859;
+	return (int) hash;
+}
+
+static bool LoopDetector_IsRepeated(const LoopDetector *self, int firstFrame, int secondFrame)
+{
+	for (int i = 0; i < self->windowFrames * 18; i++) {
+		if (self->registers[firstFrame * 18 + i] != self->registers[secondFrame * 18 + i])
+			return false;
+	}
+	return true;
+}
+
+static int LoopDetector_FindLoop(LoopDetector *self, int frame, int minLoopFrames)
+{
+	if (frame >= self->windowFrames) {
+		int secondFrame = frame - self->windowFrames;
+		int bucket = self->windowHash & self->hashMask;
+		for (int firstFrame = self->hashFirst[bucket]; firstFrame >= 0; firstFrame = self->hashNext[firstFrame]) {
+			if (self->windowHashes[firstFrame] == self->windowHash && LoopDetector_IsRepeated(self, firstFrame, secondFrame)) {
+				int loopFrames = secondFrame - firstFrame;
+				if (loopFrames >= minLoopFrames) {
+					self->loop = true;
+					self->loopStartFrame = firstFrame;
+					self->loopEndFrame = secondFrame;
+					return secondFrame;
+				}
+				if (loopFrames == 1)
+					return firstFrame;
+			}
+		}
+		self->windowHashes[secondFrame] = self->windowHash;
+		if (self->hashFirst[bucket] >= 0)
+			self->hashNext[self->hashLast[bucket]] = secondFrame;
+		else
+			self->hashFirst[bucket] = secondFrame;
+		self->hashNext[secondFrame] = -1;
+		self->hashLast[bucket] = secondFrame;
+		int64_t removed = self->removePower;
+		self->windowHash = (int) ((self->windowHash + 67108859 - removed * LoopDetector_GetFrameHash(self, secondFrame) % 67108859) % 67108859);
+	}
+	int64_t hash = self->windowHash;
+	self->windowHash = (int) ((hash * 16777619 + LoopDetector_GetFrameHash(self, frame)) % 67108859);
+	return -1;
+}
+
 static void ASAP_Construct(ASAP *self)
 {
 	PokeyPair_Construct(&self->pokeys);
 	ASAPInfo_Construct(&self->moduleInfo);
+	LoopDetector_Construct(&self->detector);
+	self->loopSong = -1;
+	self->recordingTrace = NULL;
+	self->playingTrace = NULL;
 	self->currentSampleRate = 44100;
 	self->silenceCycles = 0;
 	self->cpu.asap = self;
@@ -2500,6 +3186,7 @@ static void ASAP_Construct(ASAP *self)
 
 static void ASAP_Destruct(ASAP *self)
 {
+	LoopDetector_Destruct(&self->detector);
 	ASAPInfo_Destruct(&self->moduleInfo);
 	PokeyPair_Destruct(&self->pokeys);
 }
@@ -2574,9 +3261,33 @@ static int ASAP_PeekHardware(const ASAP *self, int addr)
 	}
 }
 
+static void ASAP_PokeCovox(ASAP *self, int channel, int data, int cycle)
+{
+	Pokey *pokey = channel == 0 || channel == 3 ? &self->pokeys.basePokey : &self->pokeys.extraPokey;
+	int delta = data - self->covox[channel];
+	if (delta != 0) {
+		Pokey_AddExternalDelta(pokey, &self->pokeys, cycle, delta << 17);
+		self->covox[channel] = (uint8_t) data;
+		self->gtiaOrCovoxPlayedThisFrame = true;
+	}
+}
+
+static void ASAP_PokeConsol(ASAP *self, int data, int cycle)
+{
+	int delta = ((self->consol & 8) - (data & 8)) << 20;
+	if (delta != 0) {
+		Pokey_AddExternalDelta(&self->pokeys.basePokey, &self->pokeys, cycle, delta);
+		Pokey_AddExternalDelta(&self->pokeys.extraPokey, &self->pokeys, cycle, delta);
+		self->gtiaOrCovoxPlayedThisFrame = true;
+	}
+	self->consol = data;
+}
+
 static void ASAP_PokeHardware(ASAP *self, int addr, int data)
 {
 	if (addr >> 8 == 210) {
+		if (self->recordingTrace != NULL)
+			ASAPTrace_Write(self->recordingTrace, addr & 31, data, self->cpu.cycle);
 		int t = PokeyPair_Poke(&self->pokeys, addr, data, self->cpu.cycle);
 		if (self->nextEventCycle > t)
 			self->nextEventCycle = t;
@@ -2590,23 +3301,14 @@ static void ASAP_PokeHardware(ASAP *self, int addr, int data)
 	}
 	else if ((addr & 65280) == ASAPInfo_GetCovoxAddress(&self->moduleInfo)) {
 		addr &= 3;
-		Pokey *pokey = addr == 0 || addr == 3 ? &self->pokeys.basePokey : &self->pokeys.extraPokey;
-		int delta = data - self->covox[addr];
-		if (delta != 0) {
-			Pokey_AddExternalDelta(pokey, &self->pokeys, self->cpu.cycle, delta << 17);
-			self->covox[addr] = (uint8_t) data;
-			self->gtiaOrCovoxPlayedThisFrame = true;
-		}
+		if (self->recordingTrace != NULL && data != self->covox[addr])
+			ASAPTrace_Write(self->recordingTrace, 32 + addr, data, self->cpu.cycle);
+		ASAP_PokeCovox(self, addr, data, self->cpu.cycle);
 	}
 	else if ((addr & 65311) == 53279) {
-		int delta = ((self->consol & 8) - (data & 8)) << 20;
-		if (delta != 0) {
-			int cycle = self->cpu.cycle;
-			Pokey_AddExternalDelta(&self->pokeys.basePokey, &self->pokeys, cycle, delta);
-			Pokey_AddExternalDelta(&self->pokeys.extraPokey, &self->pokeys, cycle, delta);
-			self->gtiaOrCovoxPlayedThisFrame = true;
-		}
-		self->consol = data;
+		if (self->recordingTrace != NULL && ((data ^ self->consol) & 8) != 0)
+			ASAPTrace_Write(self->recordingTrace, 36, data, self->cpu.cycle);
+		ASAP_PokeConsol(self, data, self->cpu.cycle);
 	}
 	else
 		self->cpu.memory[addr] = (uint8_t) data;
@@ -2703,6 +3405,8 @@ static void ASAP_Call6502Player(ASAP *self)
 			b >>= 4;
 			self->mptSamplesSecondNibble = true;
 		}
+		if (self->recordingTrace != NULL)
+			ASAPTrace_Write(self->recordingTrace, 1, b | 240, self->cpu.cycle);
 		PokeyPair_Poke(&self->pokeys, 53761, b | 240, self->cpu.cycle);
 		break;
 	}
@@ -2741,20 +3445,50 @@ static int ASAP_Do6502Frame(ASAP *self)
 	self->cpu.cycle -= cycles;
 	if (self->nextPlayerCycle != 8388608)
 		self->nextPlayerCycle -= cycles;
+	ASAP_EndPokeyTimers(self, cycles);
+	if (self->recordingTrace != NULL)
+		ASAPTrace_EndFrame(self->recordingTrace);
+	return cycles;
+}
+
+static void ASAP_EndPokeyTimers(ASAP *self, int cycles)
+{
 	for (int i = 3;; i >>= 1) {
 		PokeyChannel_EndFrame(&self->pokeys.basePokey.channels[i], cycles);
 		PokeyChannel_EndFrame(&self->pokeys.extraPokey.channels[i], cycles);
 		if (i == 0)
 			break;
 	}
+}
+
+static void ASAP_PokeTraced(ASAP *self, int reg, int data, int cycle)
+{
+	if (reg < 32)
+		PokeyPair_Poke(&self->pokeys, 53760 + reg, data, cycle);
+	else if (reg < 36)
+		ASAP_PokeCovox(self, reg - 32, data, cycle);
+	else
+		ASAP_PokeConsol(self, data, cycle);
+}
+
+static int ASAP_ReplayFrame(ASAP *self)
+{
+	if (self->playingTraceFrame < self->playingTrace->frames) {
+		self->playingTraceOffset = ASAPTrace_ReplayFrame(self->playingTrace, self, self->playingTraceOffset);
+		self->playingTraceFrame++;
+	}
+	int cycles = ASAPTrace_GetFrameCycles(ASAPInfo_IsNtsc(&self->moduleInfo));
+	ASAP_EndPokeyTimers(self, cycles);
 	return cycles;
 }
 
 static int ASAP_DoFrame(ASAP *self)
 {
 	self->gtiaOrCovoxPlayedThisFrame = false;
+	if (self->recordingTrace != NULL)
+		ASAPTrace_StartFrame(self->recordingTrace, &self->pokeys, self->consol, self->covox);
 	PokeyPair_StartFrame(&self->pokeys);
-	int cycles = ASAP_Do6502Frame(self);
+	int cycles = self->playingTrace != NULL ? ASAP_ReplayFrame(self) : ASAP_Do6502Frame(self);
 	PokeyPair_EndFrame(&self->pokeys, cycles);
 	return cycles;
 }
@@ -2777,6 +3511,7 @@ bool ASAP_LoadWithExtraFiles(ASAP *self, const char *filename, uint8_t const *mo
 {
 	if (!ASAPInfo_Load(&self->moduleInfo, filename, module, moduleLen))
 		return false;
+	self->loopSong = -1;
 	memset(self->cpu.memory, 0, sizeof(self->cpu.memory));
 	int music = self->moduleInfo.music;
 	if (self->moduleInfo.type == ASAPModuleType_D15) {
@@ -2860,6 +3595,8 @@ void ASAP_MutePokeyChannels(ASAP *self, int mask)
 {
 	Pokey_Mute(&self->pokeys.basePokey, mask);
 	Pokey_Mute(&self->pokeys.extraPokey, mask >> 4);
+	if (self->recordingTrace != NULL)
+		ASAPTrace_SetMuteMask(self->recordingTrace, mask);
 }
 
 static bool ASAP_RestartSong(ASAP *self, int muteMask)
@@ -2876,6 +3613,17 @@ static bool ASAP_RestartSong(ASAP *self, int muteMask)
 	self->covox[3] = 128;
 	PokeyPair_Initialize(&self->pokeys, ASAPInfo_IsNtsc(&self->moduleInfo), ASAPInfo_GetChannels(&self->moduleInfo) > 1, self->currentSampleRate);
 	ASAP_MutePokeyChannels(self, 255);
+	if (self->playingTrace != NULL) {
+		self->playingTraceOffset = 0;
+		self->playingTraceFrame = 0;
+		while (self->playingTraceFrame < self->playingTrace->initFrames)
+			ASAP_ReplayFrame(self);
+		ASAP_MutePokeyChannels(self, muteMask);
+		self->nextPlayerCycle = 0;
+		return true;
+	}
+	if (self->recordingTrace != NULL)
+		ASAPTrace_Start(self->recordingTrace, self->currentSong, ASAPInfo_IsNtsc(&self->moduleInfo), ASAPInfo_GetChannels(&self->moduleInfo) > 1);
 	int player = self->moduleInfo.player;
 	int music = self->moduleInfo.music;
 	switch (self->moduleInfo.type) {
@@ -2946,18 +3694,143 @@ static bool ASAP_RestartSong(ASAP *self, int muteMask)
 		self->cpu.pc = 53760;
 		break;
 	}
-	ASAP_MutePokeyChannels(self, muteMask);
-	self->nextPlayerCycle = 0;
-	return true;
+	ASAP_MutePokeyChannels(self, muteMask);
+	if (self->recordingTrace != NULL)
+		ASAPTrace_EndInit(self->recordingTrace, muteMask);
+	self->nextPlayerCycle = 0;
+	return true;
+}
+
+bool ASAP_PlaySong(ASAP *self, int song, int duration)
+{
+	if (song < 0 || song >= ASAPInfo_GetSongs(&self->moduleInfo))
+		return false;
+	self->currentSong = song;
+	self->currentDuration = duration;
+	self->playingTrace = NULL;
+	return ASAP_RestartSong(self, 0);
+}
+
+void ASAP_RecordTrace(ASAP *self, ASAPTrace *trace)
+{
+	self->recordingTrace = trace;
+}
+
+bool ASAP_PlayTrace(ASAP *self, const ASAPTrace *trace, int duration)
+{
+	if (trace->song >= ASAPInfo_GetSongs(&self->moduleInfo) || trace->ntsc != ASAPInfo_IsNtsc(&self->moduleInfo) || trace->stereo != (ASAPInfo_GetChannels(&self->moduleInfo) > 1))
+		return false;
+	self->recordingTrace = NULL;
+	self->playingTrace = trace;
+	self->currentSong = trace->song;
+	self->currentDuration = duration;
+	return ASAP_RestartSong(self, 0);
+}
+
+static void ASAP_SeekTrace(ASAP *self, int block)
+{
+	if (self->playingTrace->muteMask != (Pokey_GetMute(&self->pokeys.basePokey) | Pokey_GetMute(&self->pokeys.extraPokey) << 4))
+		return;
+	int64_t frameFactor = ASAPTrace_GetFrameCycles(ASAPInfo_IsNtsc(&self->moduleInfo)) * self->pokeys.sampleFactor;
+	int blockOffset = self->blocksPlayed + self->pokeys.readySamplesEnd - (int) ((self->playingTraceFrame - self->playingTrace->initFrames) * frameFactor >> 18);
+	for (int entry = self->playingTrace->indexEntries - 1; entry >= 0; entry--) {
+		int frame = (entry + 1) * 256;
+		if (self->playingTrace->initFrames + frame <= self->playingTraceFrame)
+			break;
+		int64_t position = frame * frameFactor;
+		if (blockOffset + (int) ((position + frameFactor) >> 18) <= block) {
+			int offset = entry * 80;
+			self->playingTraceOffset = self->playingTrace->index[offset];
+			self->playingTraceFrame = self->playingTrace->initFrames + frame;
+			self->consol = self->playingTrace->index[offset + 1];
+			for (int i = 0; i < 4; i++)
+				self->covox[i] = (uint8_t) self->playingTrace->index[offset + 2 + i];
+			Pokey_RestoreSoundState(&self->pokeys.basePokey, self->playingTrace->index, offset + 6);
+			Pokey_RestoreSoundState(&self->pokeys.extraPokey, self->playingTrace->index, offset + 43);
+			self->blocksPlayed = blockOffset + (int) (position >> 18);
+			self->pokeys.sampleOffset = (int) position & 262143;
+			self->pokeys.readySamplesStart = 0;
+			self->pokeys.readySamplesEnd = 0;
+			return;
+		}
+	}
 }
 
-bool ASAP_PlaySong(ASAP *self, int song, int duration)
+static void ASAP_SaveState(const ASAP *self, ASAPInitState *state)
 {
-	if (song < 0 || song >= ASAPInfo_GetSongs(&self->moduleInfo))
+	state->song = self->currentSong;
+	state->ntsc = ASAPInfo_IsNtsc(&self->moduleInfo);
+	state->sampleRate = self->currentSampleRate;
+	Cpu6502_CopyStateFrom(&state->cpu, &self->cpu);
+	state->nmist = self->nmist;
+	state->consol = self->consol;
+	memcpy(state->covox, self->covox, 4);
+	state->mptSamplesCurrentAddress = self->mptSamplesCurrentAddress;
+	state->mptSamplesSecondNibble = self->mptSamplesSecondNibble;
+	state->tmcPerFrameCounter = self->tmcPerFrameCounter;
+	Pokey_CopyStateFrom(&state->basePokey, &self->pokeys.basePokey);
+	Pokey_CopyStateFrom(&state->extraPokey, &self->pokeys.extraPokey);
+}
+
+static bool ASAP_RestoreState(ASAP *self, const ASAPInitState *state, int duration)
+{
+	if (state->song >= ASAPInfo_GetSongs(&self->moduleInfo) || state->ntsc != ASAPInfo_IsNtsc(&self->moduleInfo) || state->sampleRate != self->currentSampleRate)
 		return false;
-	self->currentSong = song;
+	self->currentSong = state->song;
 	self->currentDuration = duration;
-	return ASAP_RestartSong(self, 0);
+	Cpu6502_CopyStateFrom(&self->cpu, &state->cpu);
+	self->nmist = state->nmist;
+	self->consol = state->consol;
+	memcpy(self->covox, state->covox, 4);
+	self->mptSamplesCurrentAddress = state->mptSamplesCurrentAddress;
+	self->mptSamplesSecondNibble = state->mptSamplesSecondNibble;
+	self->tmcPerFrameCounter = state->tmcPerFrameCounter;
+	PokeyPair_Initialize(&self->pokeys, ASAPInfo_IsNtsc(&self->moduleInfo), ASAPInfo_GetChannels(&self->moduleInfo) > 1, self->currentSampleRate);
+	Pokey_CopyStateFrom(&self->pokeys.basePokey, &state->basePokey);
+	Pokey_CopyStateFrom(&self->pokeys.extraPokey, &state->extraPokey);
+	return true;
+}
+
+int ASAP_SkipFrame(ASAP *self, bool sound)
+{
+	if (self->silenceCycles > 0 && self->silenceCyclesCounter <= 0)
+		return 0;
+	int totalBlocks = self->currentDuration > 0 ? ASAP_MillisecondsToBlocks(self, self->currentDuration) : -1;
+	if (totalBlocks >= 0 && self->blocksPlayed >= totalBlocks)
+		return 0;
+	if (self->pokeys.readySamplesStart == self->pokeys.readySamplesEnd) {
+		self->pokeys.skipSynthesis = !sound;
+		bool playing = ASAP_DoFrameUnlessSilent(self);
+		self->pokeys.skipSynthesis = false;
+		if (!playing)
+			return 0;
+	}
+	int blocks = PokeyPair_SkipSamples(&self->pokeys, totalBlocks >= 0 ? totalBlocks - self->blocksPlayed : self->pokeys.readySamplesEnd);
+	self->blocksPlayed += blocks;
+	return blocks;
+}
+
+bool ASAP_SaveFrameState(const ASAP *self, ASAPFrameState *state)
+{
+	if (self->pokeys.readySamplesStart != self->pokeys.readySamplesEnd)
+		return false;
+	ASAP_SaveState(self, &state->init);
+	state->blocksPlayed = self->blocksPlayed;
+	state->nextPlayerCycle = self->nextPlayerCycle;
+	state->silenceCyclesCounter = self->silenceCyclesCounter;
+	state->sampleOffset = self->pokeys.sampleOffset;
+	return true;
+}
+
+bool ASAP_RestoreFrameState(ASAP *self, const ASAPFrameState *state, int duration)
+{
+	if (!ASAP_RestoreState(self, &state->init, duration))
+		return false;
+	self->blocksPlayed = state->blocksPlayed;
+	self->nextPlayerCycle = state->nextPlayerCycle;
+	self->silenceCyclesCounter = state->silenceCyclesCounter;
+	self->pokeys.sampleOffset = state->sampleOffset;
+	return true;
 }
 
 int ASAP_GetBlocksPlayed(const ASAP *self)
@@ -2982,6 +3855,8 @@ bool ASAP_SeekSample(ASAP *self, int block)
 		if (!ASAP_RestartSong(self, Pokey_GetMute(&self->pokeys.basePokey) | Pokey_GetMute(&self->pokeys.extraPokey) << 4))
 			return false;
 	}
+	if (self->playingTrace != NULL)
+		ASAP_SeekTrace(self, block);
 	while (self->blocksPlayed + self->pokeys.readySamplesEnd < block) {
 		self->blocksPlayed += self->pokeys.readySamplesEnd;
 		ASAP_DoFrame(self);
@@ -3025,6 +3900,26 @@ static int ASAP_PutWavMetadata(uint8_t *buffer, int offset, int fourCC, const ch
 	return offset;
 }
 
+static int ASAP_PutWavLoop(const ASAP *self, uint8_t *buffer, int offset, int totalBlocks)
+{
+	if (self->loopSong != self->currentSong)
+		return offset;
+	int startBlock = ASAP_GetLoopStartBlock(self) - self->blocksPlayed;
+	int endBlock = ASAP_GetLoopEndBlock(self) - self->blocksPlayed;
+	if (startBlock < 0 || startBlock >= endBlock || endBlock > totalBlocks - self->blocksPlayed)
+		return offset;
+	ASAP_PutLittleEndians(buffer, offset, 1819307379, 60);
+	ASAP_PutLittleEndians(buffer, offset + 8, 0, 0);
+	ASAP_PutLittleEndians(buffer, offset + 16, 1000000000 / self->currentSampleRate, 60);
+	ASAP_PutLittleEndians(buffer, offset + 24, 0, 0);
+	ASAP_PutLittleEndians(buffer, offset + 32, 0, 1);
+	ASAP_PutLittleEndians(buffer, offset + 40, 0, 0);
+	ASAP_PutLittleEndians(buffer, offset + 48, 0, startBlock);
+	ASAP_PutLittleEndians(buffer, offset + 56, endBlock - 1, 0);
+	ASAP_PutLittleEndian(buffer, offset + 64, 0);
+	return offset + 68;
+}
+
 int ASAP_GetWavHeader(const ASAP *self, uint8_t *buffer, ASAPSampleFormat format, bool metadata)
 {
 	int use16bit = format != ASAPSampleFormat_U8 ? 1 : 0;
@@ -3063,11 +3958,29 @@ int ASAP_GetWavHeader(const ASAP *self, uint8_t *buffer, ASAPSampleFormat format
 			ASAP_PutLittleEndians(buffer, 36, 1414744396, i - 44);
 		}
 	}
+	i = ASAP_PutWavLoop(self, buffer, i, totalBlocks);
 	ASAP_PutLittleEndians(buffer, 0, 1179011410, i + nBytes);
 	ASAP_PutLittleEndians(buffer, i, 1635017060, nBytes);
 	return i + 8;
 }
 
+static bool ASAP_DoFrameUnlessSilent(ASAP *self)
+{
+	if (self->playingTrace != NULL && self->currentDuration <= 0 && self->playingTraceFrame >= self->playingTrace->frames)
+		return false;
+	int cycles = ASAP_DoFrame(self);
+	if (self->silenceCycles > 0) {
+		if (PokeyPair_IsSilent(&self->pokeys) && !self->gtiaOrCovoxPlayedThisFrame) {
+			self->silenceCyclesCounter -= cycles;
+			if (self->silenceCyclesCounter <= 0)
+				return false;
+		}
+		else
+			self->silenceCyclesCounter = self->silenceCycles;
+	}
+	return true;
+}
+
 static int ASAP_GenerateAt(ASAP *self, uint8_t *buffer, int bufferOffset, int bufferLen, ASAPSampleFormat format)
 {
 	if (self->silenceCycles > 0 && self->silenceCyclesCounter <= 0)
@@ -3084,18 +3997,8 @@ static int ASAP_GenerateAt(ASAP *self, uint8_t *buffer, int bufferOffset, int bu
 		int blocks = PokeyPair_Generate(&self->pokeys, buffer, bufferOffset + (block << blockShift), bufferBlocks - block, format);
 		self->blocksPlayed += blocks;
 		block += blocks;
-		if (block >= bufferBlocks)
+		if (block >= bufferBlocks || !ASAP_DoFrameUnlessSilent(self))
 			break;
-		int cycles = ASAP_DoFrame(self);
-		if (self->silenceCycles > 0) {
-			if (PokeyPair_IsSilent(&self->pokeys) && !self->gtiaOrCovoxPlayedThisFrame) {
-				self->silenceCyclesCounter -= cycles;
-				if (self->silenceCyclesCounter <= 0)
-					break;
-			}
-			else
-				self->silenceCyclesCounter = self->silenceCycles;
-		}
 	}
 	return block << blockShift;
 }
@@ -3105,12 +4008,119 @@ int ASAP_Generate(ASAP *self, uint8_t *buffer, int bufferLen, ASAPSampleFormat f
 	return ASAP_GenerateAt(self, buffer, 0, bufferLen, format);
 }
 
+int ASAP_GenerateDeltas(ASAP *self, int *buffer, int bufferLen)
+{
+	if (self->silenceCycles > 0 && self->silenceCyclesCounter <= 0)
+		return 0;
+	int blockShift = ASAPInfo_GetChannels(&self->moduleInfo) - 1;
+	int bufferBlocks = bufferLen >> blockShift;
+	if (self->currentDuration > 0) {
+		int remainingBlocks = ASAP_MillisecondsToBlocks(self, self->currentDuration) - self->blocksPlayed;
+		if (bufferBlocks > remainingBlocks)
+			bufferBlocks = remainingBlocks;
+	}
+	int block = 0;
+	for (;;) {
+		int blocks = PokeyPair_GenerateDeltas(&self->pokeys, buffer, block << blockShift, bufferBlocks - block);
+		self->blocksPlayed += blocks;
+		block += blocks;
+		if (block >= bufferBlocks || !ASAP_DoFrameUnlessSilent(self))
+			break;
+	}
+	return block << blockShift;
+}
+
+int ASAP_FilterDeltas(ASAP *self, int const *deltas, int deltasLen, uint8_t *buffer, ASAPSampleFormat format)
+{
+	int stereo = ASAPInfo_GetChannels(&self->moduleInfo) - 1;
+	int offset = 0;
+	for (int i = 0; i + stereo < deltasLen; i += 1 + stereo) {
+		offset = Pokey_StoreFiltered(&self->pokeys.basePokey, buffer, offset, deltas[i], format);
+		if (stereo != 0)
+			offset = Pokey_StoreFiltered(&self->pokeys.extraPokey, buffer, offset, deltas[i + 1], format);
+	}
+	return offset;
+}
+
 int ASAP_GetPokeyChannelVolume(const ASAP *self, int channel)
 {
 	const Pokey *pokey = (channel & 4) == 0 ? &self->pokeys.basePokey : &self->pokeys.extraPokey;
 	return pokey->channels[channel & 3].audc & 15;
 }
 
+static int ASAP_GetMainClock(const ASAP *self)
+{
+	return ASAPInfo_IsNtsc(&self->moduleInfo) ? 1789772 : 1773447;
+}
+
+static int ASAP_SecondsToFrames(const ASAP *self, int seconds)
+{
+	int64_t cycles = seconds;
+	return (int) (cycles * ASAP_GetMainClock(self) / (ASAPInfo_IsNtsc(&self->moduleInfo) ? 29868 : 35568));
+}
+
+static int ASAP_FramesToBlocks(const ASAP *self, int frames)
+{
+	int64_t frameFactor = ASAPTrace_GetFrameCycles(ASAPInfo_IsNtsc(&self->moduleInfo)) * self->pokeys.sampleFactor;
+	return (int) (frames * frameFactor >> 18);
+}
+
+static int ASAP_FramesToMilliseconds(const ASAP *self, int frames)
+{
+	int64_t blocks = ASAP_FramesToBlocks(self, frames);
+	return (int) ((blocks * 1000 + self->currentSampleRate - 1) / self->currentSampleRate);
+}
+
+static int ASAP_RunDurationDetection(ASAP *self, int maxSeconds, int silenceSeconds)
+{
+	int frames = ASAP_SecondsToFrames(self, maxSeconds);
+	int silenceFrames = ASAP_SecondsToFrames(self, silenceSeconds);
+	int loopMinFrames = ASAP_SecondsToFrames(self, 5);
+	LoopDetector_Start(&self->detector, frames, ASAP_SecondsToFrames(self, 180));
+	int silenceRun = 0;
+	for (int frame = 0; frame < frames; frame++) {
+		ASAP_Do6502Frame(self);
+		if (LoopDetector_StoreFrame(&self->detector, frame, &self->pokeys)) {
+			if (++silenceRun >= silenceFrames && silenceFrames > 0 && silenceRun < frame)
+				return ASAP_FramesToMilliseconds(self, frame + 1 - silenceRun);
+		}
+		else
+			silenceRun = 0;
+		int endFrame = LoopDetector_FindLoop(&self->detector, frame, loopMinFrames);
+		if (endFrame >= 0)
+			return ASAP_FramesToMilliseconds(self, endFrame);
+	}
+	return -1;
+}
+
+bool ASAP_DetectDuration(ASAP *self, int song, int maxSeconds, int silenceSeconds)
+{
+	if (maxSeconds <= 0)
+		return false;
+	if (!ASAP_PlaySong(self, song, -1))
+		return false;
+	if (!ASAPInfo_SetDuration(&self->moduleInfo, song, ASAP_RunDurationDetection(self, maxSeconds, silenceSeconds)))
+		return false;
+	if (!ASAPInfo_SetLoop(&self->moduleInfo, song, self->detector.loop))
+		return false;
+	if (!ASAPInfo_SetLoopStart(&self->moduleInfo, song, self->detector.loop ? ASAP_FramesToMilliseconds(self, self->detector.loopStartFrame) : -1))
+		return false;
+	self->loopSong = self->detector.loop ? song : -1;
+	self->loopStartFrame = self->detector.loopStartFrame;
+	self->loopEndFrame = self->detector.loopEndFrame;
+	return true;
+}
+
+int ASAP_GetLoopStartBlock(const ASAP *self)
+{
+	return self->loopSong == self->currentSong ? ASAP_FramesToBlocks(self, self->loopStartFrame) : -1;
+}
+
+int ASAP_GetLoopEndBlock(const ASAP *self)
+{
+	return self->loopSong == self->currentSong ? ASAP_FramesToBlocks(self, self->loopEndFrame) : -1;
+}
+
 static uint8_t const *ASAP6502_GetPlayerRoutine(const ASAPInfo *info)
 {
 	switch (info->type) {
@@ -3261,14 +4271,26 @@ static bool ASAPInfo_ParseModule(ASAPInfo *self, uint8_t const *module, int modu
 	return true;
 }
 
+static void ASAPInfo_SetSongDuration(ASAPInfo *self, int song, int playerCalls, int fastplay)
+{
+	int64_t scanlines = playerCalls * fastplay;
+	self->durations[song] = (int) (scanlines * 38000 / 591149);
+}
+
 static void ASAPInfo_AddSong(ASAPInfo *self, int playerCalls)
 {
-	int64_t scanlines = playerCalls * self->fastplay;
-	self->durations[self->songs++] = (int) (scanlines * 38000 / 591149);
+	ASAPInfo_SetSongDuration(self, self->songs++, playerCalls, self->fastplay);
+}
+
+static void ASAPInfo_AddPendingSong(ASAPInfo *self, int pos)
+{
+	self->songStart[self->songs] = pos;
+	self->durationPending[self->songs++] = true;
 }
 
-static void ASAPInfo_ParseCmcSong(ASAPInfo *self, uint8_t const *module, int pos)
+static void ASAPInfo_ParseCmcSong(ASAPInfo *self, uint8_t const *module, int song)
 {
+	int pos = self->songStart[song];
 	int tempo = module[25];
 	int playerCalls = 0;
 	int repStartPos = 0;
@@ -3285,7 +4307,7 @@ static void ASAPInfo_ParseCmcSong(ASAPInfo *self, uint8_t const *module, int pos
 		}
 		if (seen[pos] != 0) {
 			if (seen[pos] != 1)
-				self->loops[self->songs] = true;
+				self->loops[song] = true;
 			break;
 		}
 		seen[pos] = 1;
@@ -3337,7 +4359,7 @@ static void ASAPInfo_ParseCmcSong(ASAPInfo *self, uint8_t const *module, int pos
 			repTimes = p3 - 1;
 			break;
 		case 239:
-			self->loops[self->songs] = true;
+			self->loops[song] = true;
 			pos = -1;
 			break;
 		default:
@@ -3350,7 +4372,7 @@ static void ASAPInfo_ParseCmcSong(ASAPInfo *self, uint8_t const *module, int pos
 			break;
 		}
 	}
-	ASAPInfo_AddSong(self, playerCalls);
+	ASAPInfo_SetSongDuration(self, song, playerCalls, self->fastplay);
 }
 
 static bool ASAPInfo_ParseCmc(ASAPInfo *self, uint8_t const *module, int moduleLen, ASAPModuleType type)
@@ -3370,10 +4392,10 @@ static bool ASAPInfo_ParseCmc(ASAPInfo *self, uint8_t const *module, int moduleL
 		}
 	}
 	self->songs = 0;
-	ASAPInfo_ParseCmcSong(self, module, 0);
+	ASAPInfo_AddPendingSong(self, 0);
 	for (int pos = 0; pos < lastPos && self->songs < 32; pos++)
 		if (module[518 + pos] == 143 || module[518 + pos] == 239)
-			ASAPInfo_ParseCmcSong(self, module, pos + 1);
+			ASAPInfo_AddPendingSong(self, pos + 1);
 	return true;
 }
 
@@ -3800,8 +4822,9 @@ static bool ASAPInfo_ParseRmt(ASAPInfo *self, uint8_t const *module, int moduleL
 	return true;
 }
 
-static void ASAPInfo_ParseTmcSong(ASAPInfo *self, uint8_t const *module, int pos)
+static void ASAPInfo_ParseTmcSong(ASAPInfo *self, uint8_t const *module, int song)
 {
+	int pos = self->songStart[song];
 	int addrToOffset = ASAPInfo_GetWord(module, 2) - 6;
 	int tempo = module[36] + 1;
 	int frames = 0;
@@ -3853,8 +4876,8 @@ static void ASAPInfo_ParseTmcSong(ASAPInfo *self, uint8_t const *module, int pos
 		pos += 16;
 	}
 	if (module[436 + pos] < 128)
-		self->loops[self->songs] = true;
-	ASAPInfo_AddSong(self, frames);
+		self->loops[song] = true;
+	ASAPInfo_SetSongDuration(self, song, frames, 312);
 }
 
 static int ASAPInfo_ParseTmcTitle(uint8_t *title, int titleLen, uint8_t const *module, int moduleOffset)
@@ -3921,10 +4944,10 @@ static bool ASAPInfo_ParseTmc(ASAPInfo *self, uint8_t const *module, int moduleL
 	}
 	while (module[437 + lastPos] >= 128);
 	self->songs = 0;
-	ASAPInfo_ParseTmcSong(self, module, 0);
+	ASAPInfo_AddPendingSong(self, 0);
 	for (i = 0; i < lastPos && self->songs < 32; i += 16)
 		if (module[437 + i] >= 128)
-			ASAPInfo_ParseTmcSong(self, module, i + 16);
+			ASAPInfo_AddPendingSong(self, i + 16);
 	i = module[37];
 	if (i < 1 || i > 4)
 		return false;
@@ -3935,8 +4958,9 @@ static bool ASAPInfo_ParseTmc(ASAPInfo *self, uint8_t const *module, int moduleL
 	return true;
 }
 
-static void ASAPInfo_ParseTm2Song(ASAPInfo *self, uint8_t const *module, int pos)
+static void ASAPInfo_ParseTm2Song(ASAPInfo *self, uint8_t const *module, int song)
 {
+	int pos = self->songStart[song];
 	int addrToOffset = ASAPInfo_GetWord(module, 2) - 6;
 	int tempo = module[36] + 1;
 	int playerCalls = 0;
@@ -3947,7 +4971,7 @@ static void ASAPInfo_ParseTm2Song(ASAPInfo *self, uint8_t const *module, int pos
 		if (patternRows == 0)
 			break;
 		if (patternRows >= 128) {
-			self->loops[self->songs] = true;
+			self->loops[song] = true;
 			break;
 		}
 		for (int ch = 7; ch >= 0; ch--) {
@@ -4004,7 +5028,7 @@ static void ASAPInfo_ParseTm2Song(ASAPInfo *self, uint8_t const *module, int pos
 		}
 		pos += 17;
 	}
-	ASAPInfo_AddSong(self, playerCalls);
+	ASAPInfo_SetSongDuration(self, song, playerCalls, self->fastplay);
 }
 
 static bool ASAPInfo_ParseTm2(ASAPInfo *self, uint8_t const *module, int moduleLen)
@@ -4044,11 +5068,11 @@ static bool ASAPInfo_ParseTm2(ASAPInfo *self, uint8_t const *module, int moduleL
 	}
 	while (c == 0 || c >= 128);
 	self->songs = 0;
-	ASAPInfo_ParseTm2Song(self, module, 0);
+	ASAPInfo_AddPendingSong(self, 0);
 	for (i = 0; i < lastPos && self->songs < 32; i += 17) {
 		c = module[918 + i];
 		if (c == 0 || c >= 128)
-			ASAPInfo_ParseTm2Song(self, module, i + 17);
+			ASAPInfo_AddPendingSong(self, i + 17);
 	}
 	uint8_t title[127];
 	int titleLen = ASAPInfo_ParseTmcTitle(title, 0, module, 39);
@@ -4537,6 +5561,15 @@ static int ASAPInfo_GuessPackedExt(uint8_t const *module, int moduleLen)
 }
 
 bool ASAPInfo_Load(ASAPInfo *self, const char *filename, uint8_t const *module, int moduleLen)
+{
+	if (!ASAPInfo_LoadMetadata(self, filename, module, moduleLen))
+		return false;
+	for (int song = 0; song < self->songs; song++)
+		ASAPInfo_AnalyzePendingSong(self, module, song);
+	return true;
+}
+
+bool ASAPInfo_LoadMetadata(ASAPInfo *self, const char *filename, uint8_t const *module, int moduleLen)
 {
 	int ext;
 	if (filename != NULL) {
@@ -4571,6 +5604,8 @@ bool ASAPInfo_Load(ASAPInfo *self, const char *filename, uint8_t const *module,
 	for (int i = 0; i < 32; i++) {
 		self->durations[i] = -1;
 		self->loops[i] = false;
+		self->loopStarts[i] = -1;
+		self->durationPending[i] = false;
 	}
 	self->ntsc = false;
 	self->fastplay = 312;
@@ -4754,6 +5789,37 @@ bool ASAPInfo_SetDefaultSong(ASAPInfo *self, int song)
 	return true;
 }
 
+static void ASAPInfo_AnalyzePendingSong(ASAPInfo *self, uint8_t const *module, int song)
+{
+	if (!self->durationPending[song])
+		return;
+	self->durationPending[song] = false;
+	switch (self->type) {
+	case ASAPModuleType_CMC:
+	case ASAPModuleType_CM3:
+	case ASAPModuleType_CMR:
+	case ASAPModuleType_CMS:
+		ASAPInfo_ParseCmcSong(self, module, song);
+		break;
+	case ASAPModuleType_TMC:
+		ASAPInfo_ParseTmcSong(self, module, song);
+		break;
+	case ASAPModuleType_TM2:
+		ASAPInfo_ParseTm2Song(self, module, song);
+		break;
+	default:
+		break;
+	}
+}
+
+bool ASAPInfo_AnalyzeSong(ASAPInfo *self, uint8_t const *module, int song)
+{
+	if (song < 0 || song >= self->songs)
+		return false;
+	ASAPInfo_AnalyzePendingSong(self, module, song);
+	return true;
+}
+
 int ASAPInfo_GetDuration(const ASAPInfo *self, int song)
 {
 	return self->durations[song];
@@ -4764,6 +5830,7 @@ bool ASAPInfo_SetDuration(ASAPInfo *self, int song, int duration)
 	if (song < 0 || song >= self->songs)
 		return false;
 	self->durations[song] = duration;
+	self->durationPending[song] = false;
 	return true;
 }
 
@@ -4780,6 +5847,19 @@ bool ASAPInfo_SetLoop(ASAPInfo *self, int song, bool loop)
 	return true;
 }
 
+int ASAPInfo_GetLoopStart(const ASAPInfo *self, int song)
+{
+	return self->loopStarts[song];
+}
+
+bool ASAPInfo_SetLoopStart(ASAPInfo *self, int song, int position)
+{
+	if (song < 0 || song >= self->songs)
+		return false;
+	self->loopStarts[song] = position;
+	return true;
+}
+
 bool ASAPInfo_IsNtsc(const ASAPInfo *self)
 {
 	return self->ntsc;
@@ -4795,13 +5875,18 @@ void ASAPInfo_SetNtsc(ASAPInfo *self, bool ntsc)
 	self->ntsc = ntsc;
 	self->fastplay = ntsc ? 262 : 312;
 	for (int song = 0; song < self->songs; song++) {
-		int64_t duration = self->durations[song];
-		if (duration > 0) {
-			self->durations[song] = (int) (ntsc ? duration * 5956963 / 7159090 : duration * 7159090 / 5956963);
-		}
+		self->durations[song] = ASAPInfo_ConvertNtsc(self->durations[song], ntsc);
+		self->loopStarts[song] = ASAPInfo_ConvertNtsc(self->loopStarts[song], ntsc);
 	}
 }
 
+static int ASAPInfo_ConvertNtsc(int64_t milliseconds, bool ntsc)
+{
+	if (milliseconds <= 0)
+		return (int) milliseconds;
+	return (int) (ntsc ? milliseconds * 5956963 / 7159090 : milliseconds * 7159090 / 5956963);
+}
+
 int ASAPInfo_GetTypeLetter(const ASAPInfo *self)
 {
 	switch (self->type) {
@@ -6080,6 +7165,20 @@ static void Cpu6502_Reset(Cpu6502 *self)
 	self->vdi = 0;
 }
 
+static void Cpu6502_CopyStateFrom(Cpu6502 *self, const Cpu6502 *source)
+{
+	memcpy(self->memory, source->memory, 65536);
+	self->cycle = source->cycle;
+	self->pc = source->pc;
+	self->a = source->a;
+	self->x = source->x;
+	self->y = source->y;
+	self->s = source->s;
+	self->nz = source->nz;
+	self->c = source->c;
+	self->vdi = source->vdi;
+}
+
 static int Cpu6502_Peek(const Cpu6502 *self, int addr)
 {
 	if ((addr & 63744) == 53248)
@@ -7121,114 +8220,98 @@ static void FlashPack_PutItem(FlashPack *self, FlashPackItemType type, int value
 	self->itemsCount++;
 }
 
-static bool FlashPack_IsLiteralPreferred(const FlashPack *self)
-{
-	return (self->itemsCount & 7) == 7 && FlashPack_GetInnerFlags(self, self->itemsCount - 7) == 0;
-}
-
 static void FlashPack_CompressMemoryArea(FlashPack *self, int startAddress, int endAddress)
 {
-	int lastDistance = -1;
+	int areaLength = endAddress - startAddress + 2;
+	int *costs = (int *) malloc(areaLength * sizeof(int));
+	uint8_t *steps = (uint8_t *) malloc(areaLength);
+	uint8_t *distances = (uint8_t *) malloc(areaLength);
+	int matchLengths[128];
+	int lastDistance = 0;
 	for (int address = startAddress; address <= endAddress;) {
-		while (self->memory[address] < 0)
-			if (++address > endAddress)
-				return;
+		if (self->memory[address] < 0) {
+			address++;
+			continue;
+		}
 		FlashPack_PutItem(self, FlashPackItemType_SET_ADDRESS, address);
-		while (address <= endAddress && self->memory[address] >= 0) {
-			int bestMatch = 0;
-			int bestDistance = -1;
-			for (int backAddress = address - 1; backAddress >= startAddress && address - backAddress < 128; backAddress--) {
-				int match;
-				for (match = 0; address + match <= endAddress; match++) {
-					int data = self->memory[address + match];
-					if (data < 0 || data != self->memory[backAddress + match])
-						break;
+		int length = 0;
+		while (address + length <= endAddress && self->memory[address + length] >= 0)
+			length++;
+		memset(matchLengths, 0, sizeof(matchLengths));
+		costs[0] = 0;
+		distances[0] = (uint8_t) lastDistance;
+		for (int i = 1; i <= length; i++)
+			costs[i] = 2147483647;
+		for (int i = 0; i < length; i++) {
+			int current = address + i;
+			int bestDistance = 0;
+			for (int distance = 1; distance < 128 && current - distance >= startAddress; distance++) {
+				int match = matchLengths[distance];
+				if (match > 0)
+					match--;
+				else {
+					while (i + match < length && self->memory[current + match] == self->memory[current - distance + match])
+						match++;
 				}
-				if (bestMatch < match) {
-					bestMatch = match;
-					bestDistance = address - backAddress;
+				matchLengths[distance] = match;
+				if (matchLengths[bestDistance] < match)
+					bestDistance = distance;
+			}
+			int cost = costs[i] + 9;
+			if (costs[i + 1] > cost) {
+				costs[i + 1] = cost;
+				steps[i + 1] = 1;
+				distances[i + 1] = distances[i];
+			}
+			cost = costs[i] + 9;
+			for (int step = 2; step <= 3 && step <= matchLengths[bestDistance]; step++) {
+				if (costs[i + step] > cost) {
+					costs[i + step] = cost;
+					steps[i + step] = (uint8_t) step;
+					distances[i + step] = (uint8_t) bestDistance;
+				}
+			}
+			int step = matchLengths[distances[i]];
+			if (step >= 4) {
+				if (step > 255)
+					step = 255;
+				cost = costs[i] + 17;
+				if (costs[i + step] > cost) {
+					costs[i + step] = cost;
+					steps[i + step] = (uint8_t) step;
+					distances[i + step] = distances[i];
 				}
-				else if (bestMatch == match && address - backAddress == lastDistance)
-					bestDistance = lastDistance;
 			}
-			switch (bestMatch) {
-			case 0:
+		}
+		for (int i = length; i > 0;) {
+			int step = steps[i];
+			i -= step;
+			costs[i] = step;
+		}
+		for (int i = 0; i < length;) {
+			int step = costs[i];
+			switch (step) {
 			case 1:
-				FlashPack_PutItem(self, FlashPackItemType_LITERAL, self->memory[address++]);
-				continue;
+				FlashPack_PutItem(self, FlashPackItemType_LITERAL, self->memory[address + i]);
+				break;
 			case 2:
-				FlashPack_PutItem(self, FlashPackItemType_COPY_TWO_BYTES, bestDistance);
+				FlashPack_PutItem(self, FlashPackItemType_COPY_TWO_BYTES, distances[i + 2]);
 				break;
 			case 3:
-				FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, bestDistance);
-				break;
-			case 4:
-				if (bestDistance == lastDistance)
-					FlashPack_PutItem(self, FlashPackItemType_COPY_MANY_BYTES, 4);
-				else if (FlashPack_IsLiteralPreferred(self)) {
-					FlashPack_PutItem(self, FlashPackItemType_LITERAL, self->memory[address]);
-					FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, bestDistance);
-				}
-				else {
-					FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, bestDistance);
-					FlashPack_PutItem(self, FlashPackItemType_LITERAL, self->memory[address + 3]);
-				}
-				break;
-			case 5:
-				if (bestDistance == lastDistance)
-					FlashPack_PutItem(self, FlashPackItemType_COPY_MANY_BYTES, 5);
-				else {
-					FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, bestDistance);
-					FlashPack_PutItem(self, FlashPackItemType_COPY_TWO_BYTES, bestDistance);
-				}
-				break;
-			case 6:
-				if (bestDistance == lastDistance)
-					FlashPack_PutItem(self, FlashPackItemType_COPY_MANY_BYTES, 6);
-				else {
-					FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, bestDistance);
-					FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, bestDistance);
-				}
+				FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, distances[i + 3]);
 				break;
 			default:
-				;
-				int length = bestMatch;
-				if (bestDistance != lastDistance) {
-					if (FlashPack_IsLiteralPreferred(self) && length % 255 == 4) {
-						FlashPack_PutItem(self, FlashPackItemType_LITERAL, self->memory[address]);
-						length--;
-					}
-					FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, bestDistance);
-					length -= 3;
-				}
-				else if (FlashPack_IsLiteralPreferred(self) && length % 255 == 1) {
-					FlashPack_PutItem(self, FlashPackItemType_LITERAL, self->memory[address]);
-					length--;
-				}
-				for (; length > 255; length -= 255)
-					FlashPack_PutItem(self, FlashPackItemType_COPY_MANY_BYTES, 255);
-				switch (length) {
-				case 0:
-					break;
-				case 1:
-					FlashPack_PutItem(self, FlashPackItemType_LITERAL, self->memory[address + bestMatch - 1]);
-					break;
-				case 2:
-					FlashPack_PutItem(self, FlashPackItemType_COPY_TWO_BYTES, bestDistance);
-					break;
-				case 3:
-					FlashPack_PutItem(self, FlashPackItemType_COPY_THREE_BYTES, bestDistance);
-					break;
-				default:
-					FlashPack_PutItem(self, FlashPackItemType_COPY_MANY_BYTES, length);
-					break;
-				}
+				FlashPack_PutItem(self, FlashPackItemType_COPY_MANY_BYTES, step);
 				break;
 			}
-			address += bestMatch;
-			lastDistance = bestDistance;
+			i += step;
 		}
+		address += length;
+		lastDistance = distances[length];
 	}
+	free(distances);
+	free(steps);
+	free(costs);
 }
 
 static void FlashPack_PutPoke(FlashPack *self, int address, int value)
@@ -7573,6 +8656,45 @@ static void PokeyChannel_EndFrame(PokeyChannel *self, int cycle)
 		self->timerCycle -= cycle;
 }
 
+static void PokeyChannel_CopyStateFrom(PokeyChannel *self, const PokeyChannel *source)
+{
+	self->audf = source->audf;
+	self->audc = source->audc;
+	self->periodCycles = source->periodCycles;
+	self->tickCycle = source->tickCycle;
+	self->timerCycle = source->timerCycle;
+	self->mute = source->mute;
+	self->out = source->out;
+	self->delta = source->delta;
+}
+
+static void PokeyChannel_SaveSoundState(const PokeyChannel *self, int *state, int offset)
+{
+	state[offset] = self->audf;
+	state[offset + 1] = self->audc;
+	state[offset + 2] = self->periodCycles;
+	state[offset + 3] = self->tickCycle;
+	state[offset + 4] = self->mute;
+	state[offset + 5] = self->out;
+	state[offset + 6] = self->delta;
+}
+
+static bool PokeyChannel_IsValidSoundState(int const *state, int offset)
+{
+	return state[offset] >= 0 && state[offset] <= 255 && state[offset + 1] >= 0 && state[offset + 1] <= 255 && state[offset + 2] > 0 && state[offset + 3] >= 0 && state[offset + 3] <= 8388608 && state[offset + 4] >= 0 && state[offset + 4] <= 7 && state[offset + 5] >= 0 && state[offset + 5] <= 1 && state[offset + 6] >= -15 && state[offset + 6] <= 15;
+}
+
+static void PokeyChannel_RestoreSoundState(PokeyChannel *self, int const *state, int offset)
+{
+	self->audf = state[offset];
+	self->audc = state[offset + 1];
+	self->periodCycles = state[offset + 2];
+	self->tickCycle = state[offset + 3];
+	self->mute = state[offset + 4];
+	self->out = state[offset + 5];
+	self->delta = state[offset + 6];
+}
+
 static void Pokey_Construct(Pokey *self)
 {
 	self->deltaBuffer = NULL;
@@ -7625,7 +8747,7 @@ static void Pokey_AddDelta(Pokey *self, const PokeyPair *pokeys, int cycle, int
 
 static void Pokey_AddExternalDelta(Pokey *self, const PokeyPair *pokeys, int cycle, int delta)
 {
-	if (delta == 0)
+	if (delta == 0 || pokeys->skipSynthesis)
 		return;
 	int i = cycle * pokeys->sampleFactor + pokeys->sampleOffset;
 	int fraction = i >> 8 & 1023;
@@ -7939,7 +9061,12 @@ static int Pokey_CheckIrq(Pokey *self, int cycle, int nextEventCycle)
 
 static int Pokey_StoreSample(Pokey *self, uint8_t *buffer, int bufferOffset, int i, ASAPSampleFormat format)
 {
-	self->iirAcc += self->deltaBuffer[i] - (self->iirRate * self->iirAcc >> 11);
+	return Pokey_StoreFiltered(self, buffer, bufferOffset, self->deltaBuffer[i], format);
+}
+
+static int Pokey_StoreFiltered(Pokey *self, uint8_t *buffer, int bufferOffset, int delta, ASAPSampleFormat format)
+{
+	self->iirAcc += delta - (self->iirRate * self->iirAcc >> 11);
 	int sample = self->iirAcc >> 11;
 	if (sample < -32767)
 		sample = -32767;
@@ -7961,11 +9088,90 @@ static int Pokey_StoreSample(Pokey *self, uint8_t *buffer, int bufferOffset, int
 	return bufferOffset;
 }
 
+static int Pokey_StoreDelta(const Pokey *self, int *buffer, int bufferOffset, int i)
+{
+	buffer[bufferOffset] = self->deltaBuffer[i];
+	return bufferOffset + 1;
+}
+
 static void Pokey_AccumulateTrailing(Pokey *self, int i)
 {
 	self->trailing = i;
 }
 
+static void Pokey_CopyStateFrom(Pokey *self, const Pokey *source)
+{
+	for (int i = 0; i < 4; i++)
+		PokeyChannel_CopyStateFrom(&self->channels[i], &source->channels[i]);
+	self->audctl = source->audctl;
+	self->skctl = source->skctl;
+	self->irqst = source->irqst;
+	self->init = source->init;
+	self->divCycles = source->divCycles;
+	self->reloadCycles1 = source->reloadCycles1;
+	self->reloadCycles3 = source->reloadCycles3;
+	self->polyIndex = source->polyIndex;
+	if (self->deltaBufferLength != source->deltaBufferLength) {
+		self->deltaBufferLength = source->deltaBufferLength;
+		free(self->deltaBuffer);
+		self->deltaBuffer = (int *) malloc(self->deltaBufferLength * sizeof(int));
+	}
+	memcpy(self->deltaBuffer, source->deltaBuffer, self->deltaBufferLength * sizeof(int));
+	self->sumDACInputs = source->sumDACInputs;
+	self->sumDACOutputs = source->sumDACOutputs;
+	self->iirRate = source->iirRate;
+	self->iirAcc = source->iirAcc;
+	self->trailing = source->trailing;
+}
+
+static void Pokey_SaveSoundState(const Pokey *self, int *state, int offset)
+{
+	for (int i = 0; i < 4; i++)
+		PokeyChannel_SaveSoundState(&self->channels[i], state, offset + i * 7);
+	offset += 28;
+	state[offset] = self->audctl;
+	state[offset + 1] = self->skctl;
+	state[offset + 2] = self->init ? 1 : 0;
+	state[offset + 3] = self->divCycles;
+	state[offset + 4] = self->reloadCycles1;
+	state[offset + 5] = self->reloadCycles3;
+	state[offset + 6] = self->polyIndex;
+	state[offset + 7] = self->sumDACInputs;
+	state[offset + 8] = self->sumDACOutputs;
+}
+
+static bool Pokey_IsValidSoundState(int const *state, int offset)
+{
+	int sumDACInputs = 0;
+	for (int i = 0; i < 4; i++) {
+		if (!PokeyChannel_IsValidSoundState(state, offset + i * 7))
+			return false;
+		int delta = state[offset + i * 7 + 6];
+		if (delta > 0)
+			sumDACInputs += delta;
+	}
+	offset += 28;
+	return state[offset] >= 0 && state[offset] <= 255 && state[offset + 1] >= 0 && state[offset + 1] <= 255 && state[offset + 2] >= 0 && state[offset + 2] <= 1 && state[offset + 3] > 0 && state[offset + 4] > 0 && state[offset + 5] > 0 && state[offset + 6] >= 0 && state[offset + 6] < 121896030 && state[offset + 7] == sumDACInputs;
+}
+
+static void Pokey_RestoreSoundState(Pokey *self, int const *state, int offset)
+{
+	for (int i = 0; i < 4; i++)
+		PokeyChannel_RestoreSoundState(&self->channels[i], state, offset + i * 7);
+	offset += 28;
+	self->audctl = state[offset];
+	self->skctl = state[offset + 1];
+	self->init = state[offset + 2] != 0;
+	self->divCycles = state[offset + 3];
+	self->reloadCycles1 = state[offset + 4];
+	self->reloadCycles3 = state[offset + 5];
+	self->polyIndex = state[offset + 6];
+	self->sumDACInputs = state[offset + 7];
+	self->sumDACOutputs = state[offset + 8];
+	self->trailing = self->deltaBufferLength;
+	Pokey_StartFrame(self);
+}
+
 static void PokeyPair_Construct(PokeyPair *self)
 {
 	Pokey_Construct(&self->basePokey);
@@ -8095,6 +9301,43 @@ static int PokeyPair_Generate(PokeyPair *self, uint8_t *buffer, int bufferOffset
 	return blocks;
 }
 
+static int PokeyPair_SkipSamples(PokeyPair *self, int blocks)
+{
+	int i = self->readySamplesEnd;
+	if (blocks < i - self->readySamplesStart)
+		i = self->readySamplesStart + blocks;
+	else {
+		blocks = i - self->readySamplesStart;
+		Pokey_AccumulateTrailing(&self->basePokey, i);
+		Pokey_AccumulateTrailing(&self->extraPokey, i);
+	}
+	self->readySamplesStart = i;
+	return blocks;
+}
+
+static int PokeyPair_GenerateDeltas(PokeyPair *self, int *buffer, int bufferOffset, int blocks)
+{
+	int i = self->readySamplesStart;
+	int samplesEnd = self->readySamplesEnd;
+	if (blocks < samplesEnd - i)
+		samplesEnd = i + blocks;
+	else
+		blocks = samplesEnd - i;
+	if (blocks > 0) {
+		for (; i < samplesEnd; i++) {
+			bufferOffset = Pokey_StoreDelta(&self->basePokey, buffer, bufferOffset, i);
+			if (self->extraPokeyMask != 0)
+				bufferOffset = Pokey_StoreDelta(&self->extraPokey, buffer, bufferOffset, i);
+		}
+		if (i == self->readySamplesEnd) {
+			Pokey_AccumulateTrailing(&self->basePokey, i);
+			Pokey_AccumulateTrailing(&self->extraPokey, i);
+		}
+		self->readySamplesStart = i;
+	}
+	return blocks;
+}
+
 static bool PokeyPair_IsSilent(const PokeyPair *self)
 {
 	return Pokey_IsSilent(&self->basePokey) && Pokey_IsSilent(&self->extraPokey);
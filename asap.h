@@ -6,6 +6,8 @@
 extern "C" {
 #endif
 typedef struct ASAPFileLoader ASAPFileLoader;
+typedef struct ASAPFrameState ASAPFrameState;
+typedef struct ASAPTrace ASAPTrace;
 typedef struct ASAP ASAP;
 typedef struct ASAPInfo ASAPInfo;
 typedef struct ASAPWriter ASAPWriter;
@@ -28,6 +30,41 @@ typedef enum {
 	ASAPSampleFormat_S16_B_E
 } ASAPSampleFormat;
 
+ASAPFrameState *ASAPFrameState_New(void);
+void ASAPFrameState_Delete(ASAPFrameState *self);
+
+ASAPTrace *ASAPTrace_New(void);
+void ASAPTrace_Delete(ASAPTrace *self);
+
+/**
+ * Returns the length of the recorded playback in milliseconds.
+ * @param self This <code>ASAPTrace</code>.
+ */
+int ASAPTrace_GetDuration(const ASAPTrace *self);
+
+/**
+ * Returns the number of bytes written by <code>Save</code>.
+ * @param self This <code>ASAPTrace</code>.
+ */
+int ASAPTrace_GetSaveLength(const ASAPTrace *self);
+
+/**
+ * Writes the trace to a buffer of <code>GetSaveLength</code> bytes, in a format for <code>Load</code>.
+ * Returns the number of bytes written.
+ * @param self This <code>ASAPTrace</code>.
+ * @param buffer The destination buffer.
+ */
+int ASAPTrace_Save(const ASAPTrace *self, uint8_t *buffer);
+
+/**
+ * Loads a trace written by <code>Save</code>.
+ * @param self This <code>ASAPTrace</code>.
+ * @param data Contents of the file.
+ * @param dataLen Length of the file.
+ * @return <code>false</code> on error.
+ */
+bool ASAPTrace_Load(ASAPTrace *self, uint8_t const *data, int dataLen);
+
 ASAP *ASAP_New(void);
 void ASAP_Delete(ASAP *self);
 
@@ -108,6 +145,60 @@ void ASAP_MutePokeyChannels(ASAP *self, int mask);
  */
 bool ASAP_PlaySong(ASAP *self, int song, int duration);
 
+/**
+ * Starts recording POKEY, GTIA and COVOX writes to the given trace.
+ * Recording starts with the next <code>PlaySong</code> and <code>Seek</code> back restarts it.
+ * @param self This <code>ASAP</code>.
+ * @param trace The trace or <code>NULL</code> to stop recording.
+ */
+void ASAP_RecordTrace(ASAP *self, ASAPTrace *trace);
+
+/**
+ * Prepares playback like <code>PlaySong</code>, but replays the writes recorded in the trace
+ * instead of emulating the 6502. The same module must be loaded.
+ * Without a positive duration, playback ends where the recording ended.
+ * Otherwise POKEY keeps the last registers after the end of the trace. Stops recording.
+ * @param self This <code>ASAP</code>.
+ * @param trace The recorded writes. Must not be changed during playback.
+ * @param duration Playback time in milliseconds, -1 means the whole trace.
+ * @return <code>false</code> on error.
+ */
+bool ASAP_PlayTrace(ASAP *self, const ASAPTrace *trace, int duration);
+
+/**
+ * Advances playback like <code>Generate</code>, without returning the samples,
+ * to the end of the current frame or, if it has been played, of the next one.
+ * Without <code>sound</code>, POKEY output is not synthesized at all, which is much faster,
+ * but the first samples generated afterwards are inexact.
+ * Returns the number of blocks skipped, zero at the end of the song.
+ * @param self This <code>ASAP</code>.
+ * @param sound Synthesize POKEY output, as needed before <code>SaveFrameState</code>.
+ */
+int ASAP_SkipFrame(ASAP *self, bool sound);
+
+/**
+ * Saves the state between two frames of the current song.
+ * Call it when a whole frame has been played, for example after <code>SkipFrame</code>.
+ * If the last frames were skipped with <code>sound</code>, the state includes
+ * the POKEY output that extends into the next frame.
+ * @param self This <code>ASAP</code>.
+ * @param state Receives the state.
+ * @return <code>false</code> on error.
+ */
+bool ASAP_SaveFrameState(const ASAP *self, ASAPFrameState *state);
+
+/**
+ * Prepares playback like <code>PlaySong</code>, but continues from the state
+ * saved by <code>SaveFrameState</code>, with the same POKEY channels muted.
+ * The state must come from the same module, loaded with the same sample rate.
+ * <code>GenerateDeltas</code> continues exactly like in the saved <code>ASAP</code>.
+ * @param self This <code>ASAP</code>.
+ * @param state The saved state.
+ * @param duration Playback time in milliseconds, -1 means infinity.
+ * @return <code>false</code> on error.
+ */
+bool ASAP_RestoreFrameState(ASAP *self, const ASAPFrameState *state, int duration);
+
 /**
  * Returns current playback position in blocks.
  * A block is one sample or a pair of samples for stereo.
@@ -139,6 +230,7 @@ bool ASAP_Seek(ASAP *self, int position);
 
 /**
  * Fills leading bytes of the specified buffer with WAV file header.
+ * Includes the <code>smpl</code> chunk with the loop found by <code>DetectDuration</code>.
  * Returns the number of changed bytes.
  * @param self This <code>ASAP</code>.
  * @param buffer The destination buffer.
@@ -156,6 +248,29 @@ int ASAP_GetWavHeader(const ASAP *self, uint8_t *buffer, ASAPSampleFormat format
  */
 int ASAP_Generate(ASAP *self, uint8_t *buffer, int bufferLen, ASAPSampleFormat format);
 
+/**
+ * Fills the specified buffer with POKEY output before the final filter.
+ * Each sample is one <code>int</code> per channel.
+ * This lets segments rendered in parallel be filtered later, in order.
+ * @param self This <code>ASAP</code>.
+ * @param buffer The destination buffer.
+ * @param bufferLen Number of <code>int</code>s to fill.
+ */
+int ASAP_GenerateDeltas(ASAP *self, int *buffer, int bufferLen);
+
+/**
+ * Converts POKEY output from <code>GenerateDeltas</code> to samples,
+ * applying the final filter like <code>Generate</code> does.
+ * The filter state carries over between calls and is reset by <code>PlaySong</code>.
+ * Returns the number of bytes written.
+ * @param self This <code>ASAP</code>.
+ * @param deltas POKEY output, one <code>int</code> per channel for each sample.
+ * @param deltasLen Number of <code>int</code>s to convert.
+ * @param buffer The destination buffer.
+ * @param format Format of samples.
+ */
+int ASAP_FilterDeltas(ASAP *self, int const *deltas, int deltasLen, uint8_t *buffer, ASAPSampleFormat format);
+
 /**
  * Returns POKEY channel volume - an integer between 0 and 15.
  * @param self This <code>ASAP</code>.
@@ -163,6 +278,41 @@ int ASAP_Generate(ASAP *self, uint8_t *buffer, int bufferLen, ASAPSampleFormat f
  */
 int ASAP_GetPokeyChannelVolume(const ASAP *self, int channel);
 
+/**
+ * Detects duration of the specified song by emulation
+ * and stores it in the module information, see <code>ASAPInfo.GetDuration</code>, <code>ASAPInfo.GetLoop</code>
+ * and <code>ASAPInfo.GetLoopStart</code>.
+ * This is the algorithm of <code>asapscan -t</code>: the song ends at a silence
+ * or where POKEY registers repeat for several minutes.
+ * Only 6502 and POKEY registers are emulated, no sound is generated.
+ * The duration becomes -1 if neither silence nor loop was found.
+ * Interrupts playback: call <code>PlaySong</code> afterwards.
+ * @param self This <code>ASAP</code>.
+ * @param song Zero-based song index.
+ * @param maxSeconds Maximum emulated time in seconds. Loops are looked for only in songs longer than three minutes.
+ * @param silenceSeconds Length of silence which ends the song. Zero disables silence detection.
+ * @return <code>false</code> on error.
+ */
+bool ASAP_DetectDuration(ASAP *self, int song, int maxSeconds, int silenceSeconds);
+
+/**
+ * Returns the block where the loop of the current song starts, as found by <code>DetectDuration</code>.
+ * Unlike <code>ASAPInfo.GetLoopStart</code> in milliseconds, this is exact
+ * for the sample rate set at <code>PlaySong</code>.
+ * -1 if <code>DetectDuration</code> found no loop in the current song.
+ * @param self This <code>ASAP</code>.
+ */
+int ASAP_GetLoopStartBlock(const ASAP *self);
+
+/**
+ * Returns the block where the loop of the current song ends, as found by <code>DetectDuration</code>.
+ * The loop repeats from <code>GetLoopStartBlock</code> at this block.
+ * The duration stored by <code>DetectDuration</code> ends less than a millisecond after it.
+ * -1 if <code>DetectDuration</code> found no loop in the current song.
+ * @param self This <code>ASAP</code>.
+ */
+int ASAP_GetLoopEndBlock(const ASAP *self);
+
 ASAPInfo *ASAPInfo_New(void);
 void ASAPInfo_Delete(ASAPInfo *self);
 
@@ -254,6 +404,20 @@ bool ASAPInfo_IsOurExt(const char *ext);
  */
 bool ASAPInfo_Load(ASAPInfo *self, const char *filename, uint8_t const *module, int moduleLen);
 
+/**
+ * Loads file information, deferring the analysis of song lengths.
+ * For CMC, CM3, CMR, CMS, DMC, TMC and TM2 modules
+ * song lengths are -1 until <code>AnalyzeSong</code> is called.
+ * This is faster than <code>Load</code> if only the text metadata
+ * or some of the songs are needed.
+ * @param self This <code>ASAPInfo</code>.
+ * @param filename Filename, used to determine the format.
+ * @param module Contents of the file.
+ * @param moduleLen Length of the file.
+ * @return <code>false</code> on error.
+ */
+bool ASAPInfo_LoadMetadata(ASAPInfo *self, const char *filename, uint8_t const *module, int moduleLen);
+
 /**
  * Returns author's name.
  * A nickname may be included in parentheses after the real name.
@@ -377,6 +541,16 @@ int ASAPInfo_GetDefaultSong(const ASAPInfo *self);
  */
 bool ASAPInfo_SetDefaultSong(ASAPInfo *self, int song);
 
+/**
+ * Computes length of the specified song if <code>LoadMetadata</code> deferred it.
+ * The result is kept, so calling this again for the same song does nothing.
+ * @param self This <code>ASAPInfo</code>.
+ * @param module Contents of the file, the same as passed to <code>LoadMetadata</code>.
+ * @param song Song to analyze, 0-based.
+ * @return <code>false</code> on error.
+ */
+bool ASAPInfo_AnalyzeSong(ASAPInfo *self, uint8_t const *module, int song);
+
 /**
  * Returns length of the specified song.
  * The length is specified in milliseconds. -1 means the length is indeterminate.
@@ -423,6 +597,26 @@ bool ASAPInfo_GetLoop(const ASAPInfo *self, int song);
  */
 bool ASAPInfo_SetLoop(ASAPInfo *self, int song, bool loop);
 
+/**
+ * Returns position of the specified song where its loop starts.
+ * The loop ends at the song's duration.
+ * The position is specified in milliseconds. -1 means the position is unknown.
+ * Module files don't store loop starts, they are found by <code>ASAP.DetectDuration</code>.
+ * @param self This <code>ASAPInfo</code>.
+ * @param song Song to get loop start of, 0-based.
+ */
+int ASAPInfo_GetLoopStart(const ASAPInfo *self, int song);
+
+/**
+ * Sets position of the specified song where its loop starts.
+ * The position is specified in milliseconds. -1 means the position is unknown.
+ * @param self This <code>ASAPInfo</code>.
+ * @param song Song to set loop start of, 0-based.
+ * @param position New loop start in milliseconds.
+ * @return <code>false</code> on error.
+ */
+bool ASAPInfo_SetLoopStart(ASAPInfo *self, int song, int position);
+
 /**
  * Returns <code>true</code> for an NTSC song and <code>false</code> for a PAL song.
  * @param self This <code>ASAPInfo</code>.
@@ -36,15 +36,26 @@
 #endif
 
 #ifdef HAVE_LIBMP3LAME
-#define SAMPLE_FORMATS "WAV, RAW or MP3"
+#define SAMPLE_FORMATS "WAV, RAW, FLAC or MP3"
 #ifndef HAVE_LIBMP3LAME_DLL
 #include <lame.h>
 #endif
+#ifdef _WIN32
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 /* condition variables */
+#endif
+#include <windows.h>
 #else
-#define SAMPLE_FORMATS "WAV or RAW"
+#include <pthread.h>
+#endif
+#else
+#define SAMPLE_FORMATS "WAV, RAW or FLAC"
 #endif
 
 #include "asap.h"
+#include "asap-flac.h"
+#include "asap-parallel.h"
 #include "asap-stdio.h"
 
 /* parsed command line */
@@ -58,8 +69,11 @@ static const char *arg_author = NULL;
 static const char *arg_name = NULL;
 static const char *arg_date = NULL;
 static bool arg_tag = false;
+static bool arg_loop = false;
 static int arg_ntsc = -1;
 static int arg_music_address = -1;
+static int arg_threads = 0;
+static int arg_segment = 0;
 
 static int current_song;
 static char output_file[FILENAME_MAX];
@@ -71,7 +85,7 @@ static void print_help(void)
 		"Each INPUTFILE must be in a supported format:\n"
 		"SAP, CMC, CM3, CMR, CMS, DMC, DLT, MPT, MD1, MD2, MPD,\n"
 		"RMT, TMC, TM8, TM2, FC, D15 or D8.\n"
-		"Output EXT must be one of the above or XEX, " SAMPLE_FORMATS ".\n"
+		"Output EXT must be one of the above or XEX, TRACE, " SAMPLE_FORMATS ".\n"
 		"Options:\n"
 		"-o FILE.EXT --output=FILE.EXT  Write to the specified file\n"
 		"-o .EXT     --output=.EXT      Use input file path and name\n"
@@ -88,18 +102,23 @@ static void print_help(void)
 		"%%d                             Music creation date\n"
 		"%%e                             Original extension (e.g. \"cmc\")\n"
 		"%%s                             Subsong number (1-based), one file per subsong\n"
-		"Options for XEX, " SAMPLE_FORMATS " output:\n"
+		"Options for XEX, TRACE, " SAMPLE_FORMATS " output:\n"
 		"-s SONG     --song=SONG        Select subsong number (zero-based)\n"
 		"-t TIME     --time=TIME        Set output length (MM:SS format)\n"
-		"Options for XEX, WAV "
+		"Options for XEX, WAV, FLAC "
 #ifdef HAVE_LIBMP3LAME
-		                "or MP3 "
+		                      "or MP3 "
 #endif
-		                       "output:\n"
+		                             "output:\n"
 		"            --tag              Include metadata in the output file\n"
+		"Options for WAV or FLAC output:\n"
+		"            --loop             Detect the loop and mark it in the output file\n"
 		"Options for " SAMPLE_FORMATS " output:\n"
 		"-R RATE     --sample-rate=RATE Set output sample rate to RATE Hz\n"
 		"-m CHANNELS --mute=CHANNELS    Mute POKEY channels (1-8, comma-separated)\n"
+		"            --segment=SECONDS  Emulate SECONDS-long parts in parallel\n"
+		"-j THREADS  --threads=THREADS  Use THREADS threads for --segment and FLAC\n"
+		"                               (default: one per CPU)\n"
 #ifdef HAVE_LIBMP3LAME
 		"Options for WAV or RAW output:\n"
 #endif
@@ -163,6 +182,16 @@ static void set_mute_mask(const char *s)
 	}
 }
 
+static void set_threads(const char *s)
+{
+	arg_threads = parse_int(s, 10, "number of threads", 256);
+}
+
+static void set_segment(const char *s)
+{
+	arg_segment = parse_int(s, 10, "segment length", 3600);
+}
+
 static void set_music_address(const char *s)
 {
 	if (s[0] == '$')
@@ -335,18 +364,51 @@ static FILE *open_output_file(const char *input_file, const ASAPInfo *info, bool
 
 static int play_song(const char *input_file, ASAP *asap)
 {
+	ASAPInfo *info = (ASAPInfo *) ASAP_GetInfo(asap); /* FIXME: avoid cast */
 	int duration = arg_duration;
-	if (duration < 0) {
-		duration = ASAPInfo_GetDuration(ASAP_GetInfo(asap), current_song);
-		if (duration < 0)
-			duration = 180 * 1000;
+	if (duration < 0)
+		duration = ASAPInfo_GetDuration(info, current_song);
+	if (arg_loop) {
+		/* the detected loop ends the song, unless it is longer than 30 minutes */
+		int tagged_duration = ASAPInfo_GetDuration(info, current_song);
+		bool tagged_loop = ASAPInfo_GetLoop(info, current_song);
+		int tagged_loop_start = ASAPInfo_GetLoopStart(info, current_song);
+		if (!ASAP_DetectDuration(asap, current_song, 30 * 60, 0))
+			fatal_error("%s: DetectDuration failed", input_file);
+		if (tagged_duration >= 0) {
+			/* TIME tags take precedence, the loop is marked if it fits */
+			ASAPInfo_SetDuration(info, current_song, tagged_duration);
+			ASAPInfo_SetLoop(info, current_song, tagged_loop);
+			ASAPInfo_SetLoopStart(info, current_song, tagged_loop_start);
+		}
+		else if (arg_duration < 0)
+			duration = ASAPInfo_GetDuration(info, current_song);
 	}
+	if (duration < 0)
+		duration = 180 * 1000;
 	if (!ASAP_PlaySong(asap, current_song, duration))
 		fatal_error("%s: PlaySong failed", input_file);
 	ASAP_MutePokeyChannels(asap, arg_mute_mask);
 	return duration;
 }
 
+static ASAPParallel *start_parallel(const char *input_file, ASAP *asap)
+{
+	if (arg_segment == 0)
+		return NULL;
+	ASAPParallel *parallel = ASAPParallel_New(asap, input_file, ASAPFileLoader_GetStdio(), arg_segment, arg_threads);
+	if (parallel == NULL)
+		fatal_error("%s: cannot emulate in parallel", input_file);
+	return parallel;
+}
+
+static int generate(ASAP *asap, ASAPParallel *parallel, uint8_t *buffer, int bufferLen, ASAPSampleFormat format)
+{
+	if (parallel != NULL)
+		return ASAPParallel_Generate(parallel, buffer, bufferLen, format);
+	return ASAP_Generate(asap, buffer, bufferLen, format);
+}
+
 static void write_output_file(FILE *fp, const uint8_t *buffer, int n_bytes)
 {
 	if (fwrite(buffer, 1, n_bytes, fp) != n_bytes) {
@@ -375,10 +437,111 @@ static void convert_to_wav(const char *input_file, bool output_header)
 			n_bytes = ASAP_GetWavHeader(asap, buffer, arg_sample_format, arg_tag);
 			fwrite(buffer, 1, n_bytes, fp);
 		}
+		ASAPParallel *parallel = start_parallel(input_file, asap);
 		do {
-			n_bytes = ASAP_Generate(asap, buffer, sizeof(buffer), arg_sample_format);
+			n_bytes = generate(asap, parallel, buffer, sizeof(buffer), arg_sample_format);
 			write_output_file(fp, buffer, n_bytes);
 		} while (n_bytes == sizeof(buffer));
+		if (parallel != NULL)
+			ASAPParallel_Delete(parallel);
+		close_output_file(fp);
+	}
+
+	ASAP_Delete(asap);
+}
+
+static void convert_to_trace(const char *input_file)
+{
+	ASAP *asap = load_module(input_file);
+	ASAPTrace *trace = ASAPTrace_New();
+	if (trace == NULL)
+		fatal_error("out of memory");
+	FILE *fp;
+
+	while ((fp = open_output_file(input_file, ASAP_GetInfo(asap), true)) != NULL) {
+		ASAP_RecordTrace(asap, trace);
+		play_song(input_file, asap);
+		/* synthesize, so that the seek index holds the POKEY state */
+		while (ASAP_SkipFrame(asap, true) > 0);
+		ASAP_RecordTrace(asap, NULL);
+		int n_bytes = ASAPTrace_GetSaveLength(trace);
+		uint8_t *buffer = (uint8_t *) malloc(n_bytes);
+		if (buffer == NULL)
+			fatal_error("out of memory");
+		ASAPTrace_Save(trace, buffer);
+		write_output_file(fp, buffer, n_bytes);
+		free(buffer);
+		close_output_file(fp);
+	}
+
+	ASAPTrace_Delete(trace);
+	ASAP_Delete(asap);
+}
+
+static void write_flac(void *opaque, const uint8_t *buffer, int length)
+{
+	write_output_file((FILE *) opaque, buffer, length);
+}
+
+static void add_flac_comment(ASAPFlacEncoder *flac, const char *name, const char *value)
+{
+	if (value[0] != '\0' && !ASAPFlacEncoder_AddComment(flac, name, value))
+		fatal_error("out of memory");
+}
+
+static void convert_to_flac(const char *input_file)
+{
+	ASAP *asap = load_module(input_file);
+	const ASAPInfo *info = ASAP_GetInfo(asap);
+	int channels = ASAPInfo_GetChannels(info);
+	FILE *fp;
+
+	while ((fp = open_output_file(input_file, info, true)) != NULL) {
+		int duration = play_song(input_file, asap);
+		/* same as the number of samples ASAP_Generate returns */
+		int64_t samples = (int64_t) duration * arg_sample_rate / 1000;
+		ASAPFlacEncoder *flac = ASAPFlacEncoder_New(arg_sample_rate, channels, samples, arg_threads, write_flac, fp);
+		if (flac == NULL)
+			fatal_error("out of memory");
+		if (arg_tag) {
+			add_flac_comment(flac, "TITLE", ASAPInfo_GetTitle(info));
+			add_flac_comment(flac, "ARTIST", ASAPInfo_GetAuthor(info));
+			int year = ASAPInfo_GetYear(info);
+			if (year > 0) {
+				char date[32];
+				int month = ASAPInfo_GetMonth(info);
+				int day = ASAPInfo_GetDayOfMonth(info);
+				if (day > 0)
+					snprintf(date, sizeof(date), "%04d-%02d-%02d", year, month, day);
+				else if (month > 0)
+					snprintf(date, sizeof(date), "%04d-%02d", year, month);
+				else
+					snprintf(date, sizeof(date), "%04d", year);
+				add_flac_comment(flac, "DATE", date);
+			}
+			add_flac_comment(flac, "GENRE", "Electronic");
+		}
+		/* in samples, like the WAV smpl chunk */
+		int loop_start_sample = ASAP_GetLoopStartBlock(asap);
+		int loop_end_sample = ASAP_GetLoopEndBlock(asap);
+		if (loop_start_sample >= 0 && loop_end_sample <= samples) {
+			char samples_text[16];
+			snprintf(samples_text, sizeof(samples_text), "%d", loop_start_sample);
+			add_flac_comment(flac, "LOOPSTART", samples_text);
+			snprintf(samples_text, sizeof(samples_text), "%d", loop_end_sample - loop_start_sample);
+			add_flac_comment(flac, "LOOPLENGTH", samples_text);
+		}
+
+		ASAPParallel *parallel = start_parallel(input_file, asap);
+		uint8_t buffer[8192];
+		int n_bytes;
+		do {
+			n_bytes = generate(asap, parallel, buffer, sizeof(buffer), ASAPSampleFormat_S16_L_E);
+			ASAPFlacEncoder_Write(flac, buffer, n_bytes);
+		} while (n_bytes == sizeof(buffer));
+		if (parallel != NULL)
+			ASAPParallel_Delete(parallel);
+		ASAPFlacEncoder_Delete(flac);
 		close_output_file(fp);
 	}
 
@@ -389,14 +552,13 @@ static void convert_to_wav(const char *input_file, bool output_header)
 
 #ifdef HAVE_LIBMP3LAME_DLL
 
-#include <windows.h>
-
 typedef struct lame_global_struct *lame_global_flags;
 typedef lame_global_flags *(*plame_init)(void);
 typedef int (*plame_set_num_samples)(lame_global_flags *, unsigned long);
 typedef int (*plame_set_in_samplerate)(lame_global_flags *, int);
 typedef int (*plame_set_num_channels)(lame_global_flags *, int);
 typedef int (*plame_init_params)(lame_global_flags *);
+typedef int (*plame_encode_buffer)(lame_global_flags *, const short int[], const short int[], int, uint8_t *, int);
 typedef int (*plame_encode_buffer_interleaved)(lame_global_flags *, short int[], int, uint8_t *, int);
 typedef int (*plame_encode_flush)(lame_global_flags *, uint8_t *, int);
 typedef int (*plame_close)(lame_global_flags *);
@@ -434,6 +596,71 @@ static FARPROC lame_proc(HMODULE lame_dll, const char *name)
 
 #endif
 
+/* Emulation runs in its own thread, up to PCM_RING_BLOCKS blocks ahead of the encoder. */
+#define PCM_RING_BLOCKS 16
+
+static struct {
+	ASAP *asap;
+	ASAPParallel *parallel;
+	ASAPSampleFormat format;
+	short pcm[PCM_RING_BLOCKS][4096];
+	int n_bytes[PCM_RING_BLOCKS];
+	int generated;
+	int encoded;
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE changed;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+#endif
+} pcm_ring;
+
+#ifdef _WIN32
+#define lock_pcm_ring()    EnterCriticalSection(&pcm_ring.lock)
+#define unlock_pcm_ring()  LeaveCriticalSection(&pcm_ring.lock)
+#define wait_pcm_ring()    SleepConditionVariableCS(&pcm_ring.changed, &pcm_ring.lock, INFINITE)
+#define wake_pcm_ring()    WakeConditionVariable(&pcm_ring.changed)
+#else
+#define lock_pcm_ring()    pthread_mutex_lock(&pcm_ring.lock)
+#define unlock_pcm_ring()  pthread_mutex_unlock(&pcm_ring.lock)
+#define wait_pcm_ring()    pthread_cond_wait(&pcm_ring.changed, &pcm_ring.lock)
+#define wake_pcm_ring()    pthread_cond_signal(&pcm_ring.changed)
+#endif
+
+static void generate_pcm_ring(void)
+{
+	int n_bytes;
+	do {
+		lock_pcm_ring();
+		while (pcm_ring.generated - pcm_ring.encoded == PCM_RING_BLOCKS)
+			wait_pcm_ring();
+		unlock_pcm_ring();
+		/* the encoder doesn't touch this block until generated is incremented */
+		int i = pcm_ring.generated % PCM_RING_BLOCKS;
+		n_bytes = generate(pcm_ring.asap, pcm_ring.parallel, (uint8_t *) pcm_ring.pcm[i], sizeof(pcm_ring.pcm[i]), pcm_ring.format);
+		pcm_ring.n_bytes[i] = n_bytes;
+		lock_pcm_ring();
+		pcm_ring.generated++;
+		wake_pcm_ring();
+		unlock_pcm_ring();
+	} while (n_bytes == sizeof(pcm_ring.pcm[0]));
+}
+
+#ifdef _WIN32
+static DWORD WINAPI pcm_ring_thread(LPVOID arg)
+{
+	generate_pcm_ring();
+	return 0;
+}
+#else
+static void *pcm_ring_thread(void *arg)
+{
+	generate_pcm_ring();
+	return NULL;
+}
+#endif
+
 static void convert_to_mp3(const char *input_file)
 {
 	ASAP *asap = load_module(input_file);
@@ -447,6 +674,7 @@ static void convert_to_mp3(const char *input_file)
 	LAME_FUNC(lame_set_in_samplerate);
 	LAME_FUNC(lame_set_num_channels);
 	LAME_FUNC(lame_init_params);
+	LAME_FUNC(lame_encode_buffer);
 	LAME_FUNC(lame_encode_buffer_interleaved);
 	LAME_FUNC(lame_encode_flush);
 	LAME_FUNC(lame_close);
@@ -489,26 +717,63 @@ static void convert_to_mp3(const char *input_file)
 			id3tag_set_genre(lame, "Electronic");
 		}
 
-		uint8_t buffer[8192];
-		int n_bytes;
-		uint8_t mp3buf[4096 * 5 / 4 + 7200]; /* it would be possible to reuse "buffer" instead */
+		uint8_t mp3buf[4096 * 5 / 4 + 7200];
 		int mp3_bytes;
 
+		pcm_ring.asap = asap;
+		pcm_ring.parallel = start_parallel(input_file, asap);
+		const uint16_t one = 1;
+		pcm_ring.format = *(const uint8_t *) &one != 0 ? ASAPSampleFormat_S16_L_E : ASAPSampleFormat_S16_B_E;
+		pcm_ring.generated = 0;
+		pcm_ring.encoded = 0;
+#ifdef _WIN32
+		InitializeCriticalSection(&pcm_ring.lock);
+		InitializeConditionVariable(&pcm_ring.changed);
+		HANDLE thread = CreateThread(NULL, 0, pcm_ring_thread, NULL, 0, NULL);
+		if (thread == NULL)
+			fatal_error("cannot create thread");
+#else
+		pthread_mutex_init(&pcm_ring.lock, NULL);
+		pthread_cond_init(&pcm_ring.changed, NULL);
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, pcm_ring_thread, NULL) != 0)
+			fatal_error("cannot create thread");
+#endif
+
+		int n_bytes;
 		do {
-			short pcm[8192];
-			short *p = pcm;
-			n_bytes = ASAP_Generate(asap, buffer, sizeof(buffer), ASAPSampleFormat_S16_L_E);
-			for (int i = 0; i < n_bytes; i += 2) {
-				*p++ = buffer[i] + (buffer[i + 1] << 8);
-				if (channels == 1)
-					p++;
-			}
-			mp3_bytes = lame_encode_buffer_interleaved(lame, pcm, n_bytes >> channels, mp3buf, sizeof(mp3buf));
+			lock_pcm_ring();
+			while (pcm_ring.encoded == pcm_ring.generated)
+				wait_pcm_ring();
+			unlock_pcm_ring();
+			int i = pcm_ring.encoded % PCM_RING_BLOCKS;
+			short *pcm = pcm_ring.pcm[i];
+			n_bytes = pcm_ring.n_bytes[i];
+			if (channels == 1)
+				mp3_bytes = lame_encode_buffer(lame, pcm, pcm, n_bytes >> 1, mp3buf, sizeof(mp3buf));
+			else
+				mp3_bytes = lame_encode_buffer_interleaved(lame, pcm, n_bytes >> 2, mp3buf, sizeof(mp3buf));
 			if (mp3_bytes < 0)
-				fatal_error("lame_encode_buffer_interleaved failed");
+				fatal_error("lame_encode_buffer failed");
 			write_output_file(fp, mp3buf, mp3_bytes);
-		} while (n_bytes == sizeof(buffer));
+			lock_pcm_ring();
+			pcm_ring.encoded++;
+			wake_pcm_ring();
+			unlock_pcm_ring();
+		} while (n_bytes == sizeof(pcm_ring.pcm[0]));
+
+#ifdef _WIN32
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+		DeleteCriticalSection(&pcm_ring.lock);
+#else
+		pthread_join(thread, NULL);
+		pthread_cond_destroy(&pcm_ring.changed);
+		pthread_mutex_destroy(&pcm_ring.lock);
+#endif
 
+		if (pcm_ring.parallel != NULL)
+			ASAPParallel_Delete(pcm_ring.parallel);
 		mp3_bytes = lame_encode_flush(lame, mp3buf, sizeof(mp3buf));
 		if (mp3_bytes < 0)
 			fatal_error("lame_encode_flush failed");
@@ -671,6 +936,10 @@ static void process_file(const char *input_file)
 		convert_to_wav(input_file, true);
 	else if (strcasecmp(output_ext, "raw") == 0)
 		convert_to_wav(input_file, false);
+	else if (strcasecmp(output_ext, "trace") == 0)
+		convert_to_trace(input_file);
+	else if (strcasecmp(output_ext, "flac") == 0)
+		convert_to_flac(input_file);
 	else if (strcasecmp(output_ext, "mp3") == 0) {
 #ifdef HAVE_LIBMP3LAME
 		convert_to_mp3(input_file);
@@ -736,10 +1005,18 @@ int main(int argc, char *argv[])
 			arg_date = arg + 7;
 		else if (strcmp(arg, "--tag") == 0)
 			arg_tag = true;
+		else if (strcmp(arg, "--loop") == 0)
+			arg_loop = true;
 		else if (strcmp(arg, "--ntsc") == 0)
 			arg_ntsc = 1;
 		else if (strcmp(arg, "--pal") == 0)
 			arg_ntsc = 0;
+		else if (is_opt('j'))
+			set_threads(argv[++i]);
+		else if (strncmp(arg, "--threads=", 10) == 0)
+			set_threads(arg + 10);
+		else if (strncmp(arg, "--segment=", 10) == 0)
+			set_segment(arg + 10);
 		else if (strncmp(arg, "--address=", 10) == 0)
 			set_music_address(arg + 10);
 		else if (is_opt('h') || strcmp(arg, "--help") == 0) {
@@ -23,29 +23,42 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef _WIN32
 #include <windows.h>
+#ifdef _MSC_VER
+#define strcasecmp _stricmp
+#endif
+#else
+#include <pthread.h>
+#include <sys/stat.h>
 #endif
 
 #include "asap-asapscan.h"
 #include "asap-stdio.h"
 
+/* Scanning state is per thread, so that -j N workers don't share it. */
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 static bool detect_time = false;
-static int scan_frames;
-static int silence_frames;
-static int loop_check_frames;
-static int loop_min_frames;
-static int frame;
-static unsigned char *registers_dump;
-#define HASH_BITS  8
-static int hash_first[1 << HASH_BITS];
-static int *hash_next;
-static int hash_last[1 << HASH_BITS];
-
-static ASAP *asap;
+static int scan_seconds = 15 * 60;
+static int silence_seconds = 5;
+static int loop_check_seconds = 3 * 60;
+static int loop_min_seconds = 5;
+static THREAD_LOCAL int scan_frames;
+static THREAD_LOCAL int silence_frames;
+static THREAD_LOCAL int loop_check_frames;
+static THREAD_LOCAL int loop_min_frames;
+static THREAD_LOCAL int frame;
+
+static THREAD_LOCAL ASAP *asap;
 static bool dump = false;
 static bool fingerprint = false;
 static bool long_fingerprint = false;
@@ -61,6 +74,7 @@ static int features = 0;
 #define CPU_TRACE_PRINT        1
 #define CPU_TRACE_UNOFFICIAL   2
 #define CPU_TRACE_PC_TIME      4
+#define CPU_TRACE_PROFILE      8
 static int cpu_trace = 0;
 static void trace_cpu(void);
 
@@ -69,6 +83,52 @@ static int print_time_at_pc = -1;
 static bool acid = false;
 static int exit_code = 0;
 
+/* Batch mode: many files and/or -j N threads, results printed in input order. */
+typedef struct {
+	int file;
+	int song;
+	bool done;
+	bool failed;
+	int duration;
+	bool loop;
+	char *fingerprint;
+	uint32_t *minhash;
+} ScanJob;
+static const char **input_files;
+static int input_files_count = 0;
+static ScanJob *jobs;
+static int jobs_count = 0;
+static int jobs_next = 0;
+static int jobs_printed = 0;
+static bool json = false;
+static bool write_back = false;
+
+/* Similarity index: each subsong is a set of shingles (SHINGLE_FRAMES consecutive
+   distinct frames of POKEY registers), summarized by MINHASH_COUNT MinHash values.
+   Locality-sensitive hashing on MINHASH_BANDS bands of these values finds candidates
+   without comparing every pair. */
+#define SHINGLE_FRAMES    4
+#define MINHASH_COUNT     64
+#define MINHASH_BANDS     16
+#define MINHASH_ROWS      (MINHASH_COUNT / MINHASH_BANDS)
+#define MINHASH_THRESHOLD 32 /* report at least 50% estimated similarity */
+#define HASH_BASE         0x100000001b3ULL
+typedef struct {
+	char *file;
+	int song;
+	uint32_t minhash[MINHASH_COUNT];
+} IndexEntry;
+typedef struct {
+	uint64_t key;
+	int entry;
+} IndexBucket;
+static FILE *index_fp = NULL;
+static IndexEntry *index_entries = NULL;
+static int index_count = 0;
+static IndexBucket *index_buckets[MINHASH_BANDS];
+static int *index_matched = NULL;
+static THREAD_LOCAL ScanJob *current_job = NULL;
+
 #include "asap-asapscan.c"
 
 #define CYCLES_PER_FRAME (asap->moduleInfo.ntsc ? 262 * 114 : 312 * 114)
@@ -84,10 +144,22 @@ static int frames_to_milliseconds(int frames)
 	return (int) ceil(frames * 1000.0 * CYCLES_PER_FRAME / MAIN_CLOCK);
 }
 
+static void print_duration(int duration)
+{
+	printf("%02d:%02d.%02d", duration / 60000, duration / 1000 % 60, duration / 10 % 100);
+}
+
 static void print_time(int frames, bool loop)
 {
 	int duration = frames_to_milliseconds(frames);
-	printf("TIME %02d:%02d.%02d%s\n", duration / 60000, duration / 1000 % 60, duration / 10 % 100, loop ? " LOOP" : "");
+	if (current_job != NULL) {
+		current_job->duration = duration;
+		current_job->loop = loop;
+		return;
+	}
+	printf("TIME ");
+	print_duration(duration);
+	printf("%s\n", loop ? " LOOP" : "");
 }
 
 static const char cpu_mnemonics[256][10] = {
@@ -179,6 +251,252 @@ static void show_instruction(int pc)
 	printf("%04X: %02X        %s\n", addr, opcode, mnemonic);
 }
 
+/* Profiler: 6502 cycles per instruction and per call stack of subroutines. */
+#define PROFILE_IRQ        0x10000 /* set in ProfileNode.addr of interrupt handlers */
+#define PROFILE_MAX_DEPTH  64
+typedef struct {
+	int addr;
+	int parent;
+	int first_child;
+	int next_sibling;
+	uint64_t calls;
+	uint64_t cycles; /* excluding callees */
+} ProfileNode;
+static bool profile_collapsed = false;
+static uint64_t profile_pc_cycles[0x10000];
+static uint64_t profile_pc_count[0x10000];
+static ProfileNode *profile_nodes = NULL;
+static int profile_nodes_count = 0;
+static int profile_node = 0;
+static int profile_depth = 0;
+static int profile_lost_depth = 0; /* calls deeper than PROFILE_MAX_DEPTH */
+static int profile_last_pc = -1;
+static int profile_last_opcode;
+static int profile_last_operand;
+static int profile_last_cycle;
+
+static void out_of_memory(void);
+
+static int get_instruction_length(int opcode)
+{
+	for (const char *p = cpu_mnemonics[opcode] + 3; *p != '\0'; p++) {
+		if (*p == '0' || *p == '1')
+			return 2;
+		if (*p == '2')
+			return 3;
+	}
+	return 1;
+}
+
+static void profile_call(int addr)
+{
+	if (profile_depth >= PROFILE_MAX_DEPTH) {
+		profile_lost_depth++;
+		return;
+	}
+	int node;
+	for (node = profile_nodes[profile_node].first_child; node >= 0; node = profile_nodes[node].next_sibling) {
+		if (profile_nodes[node].addr == addr)
+			break;
+	}
+	if (node < 0) {
+		node = profile_nodes_count++;
+		profile_nodes = realloc(profile_nodes, profile_nodes_count * sizeof(ProfileNode));
+		if (profile_nodes == NULL)
+			out_of_memory();
+		ProfileNode *p = profile_nodes + node;
+		p->addr = addr;
+		p->parent = profile_node;
+		p->first_child = -1;
+		p->next_sibling = profile_nodes[profile_node].first_child;
+		p->calls = 0;
+		p->cycles = 0;
+		profile_nodes[profile_node].first_child = node;
+	}
+	profile_nodes[node].calls++;
+	profile_node = node;
+	profile_depth++;
+}
+
+static void profile_return(bool irq)
+{
+	if (profile_lost_depth > 0)
+		profile_lost_depth--;
+	else if (profile_depth > 0 && ((profile_nodes[profile_node].addr & PROFILE_IRQ) != 0) == irq) {
+		profile_node = profile_nodes[profile_node].parent;
+		profile_depth--;
+	}
+}
+
+static void profile_instruction(int pc)
+{
+	if (profile_nodes == NULL) {
+		/* root: the code of Call6502, which calls the player routine */
+		profile_nodes = malloc(sizeof(ProfileNode));
+		if (profile_nodes == NULL)
+			out_of_memory();
+		profile_nodes[0].addr = -1;
+		profile_nodes[0].parent = -1;
+		profile_nodes[0].first_child = -1;
+		profile_nodes[0].next_sibling = -1;
+		profile_nodes[0].calls = 0;
+		profile_nodes[0].cycles = 0;
+		profile_nodes_count = 1;
+	}
+	int cycle = asap->cpu.cycle;
+	if (profile_last_pc >= 0 && strcmp(cpu_mnemonics[profile_last_opcode], "CIM") != 0) {
+		/* includes ANTIC DMA cycles, WSYNC waits and the IRQ sequence that followed */
+		int cycles = cycle - profile_last_cycle;
+		if (cycles < 0)
+			cycles += CYCLES_PER_FRAME;
+		profile_pc_cycles[profile_last_pc] += cycles;
+		profile_pc_count[profile_last_pc]++;
+		profile_nodes[profile_node].cycles += cycles;
+
+		int next_pc = (profile_last_pc + get_instruction_length(profile_last_opcode)) & 0xffff;
+		switch (profile_last_opcode) {
+		case 0x20: /* JSR */
+			profile_call(pc);
+			break;
+		case 0x60: /* RTS */
+			profile_return(false);
+			break;
+		case 0x40: /* RTI */
+			profile_return(true);
+			break;
+		case 0x6c: /* JMP (abcd) */
+			break;
+		case 0x00: /* BRK */
+			profile_call(pc | PROFILE_IRQ);
+			break;
+		default:
+			if (pc == next_pc)
+				break;
+			if (profile_last_opcode == 0x4c) /* JMP abcd */
+				next_pc = profile_last_operand;
+			else if ((profile_last_opcode & 0x1f) == 0x10) /* branch */
+				next_pc = (next_pc + (signed char) profile_last_operand) & 0xffff;
+			if (pc != next_pc)
+				profile_call(pc | PROFILE_IRQ);
+			break;
+		}
+	}
+	if (pc == 0xd200) {
+		profile_node = 0;
+		profile_depth = 0;
+		profile_lost_depth = 0;
+	}
+	profile_last_pc = pc;
+	profile_last_opcode = asap->cpu.memory[pc];
+	profile_last_operand = asap->cpu.memory[(pc + 1) & 0xffff] | asap->cpu.memory[(pc + 2) & 0xffff] << 8;
+	if (get_instruction_length(profile_last_opcode) == 2)
+		profile_last_operand &= 0xff;
+	profile_last_cycle = cycle;
+}
+
+static const char *get_profile_name(int addr)
+{
+	static char name[16];
+	if (addr < 0)
+		return "player";
+	sprintf(name, "%s$%04X", (addr & PROFILE_IRQ) != 0 ? "IRQ_" : "", addr & 0xffff);
+	return name;
+}
+
+static void print_profile_stack(int node)
+{
+	if (node > 0) {
+		print_profile_stack(profile_nodes[node].parent);
+		putchar(';');
+	}
+	printf("%s", get_profile_name(profile_nodes[node].addr));
+}
+
+static uint64_t *profile_sort_keys;
+
+static int compare_profile_keys(const void *a, const void *b)
+{
+	uint64_t x = profile_sort_keys[*(const int *) a];
+	uint64_t y = profile_sort_keys[*(const int *) b];
+	return x < y ? 1 : x > y ? -1 : *(const int *) a - *(const int *) b;
+}
+
+static void print_profile(void)
+{
+	if (profile_nodes == NULL)
+		return;
+	if (profile_collapsed) {
+		/* input for flamegraph.pl and compatible viewers */
+		for (int node = 0; node < profile_nodes_count; node++) {
+			if (profile_nodes[node].cycles > 0) {
+				print_profile_stack(node);
+				printf(" %llu\n", (unsigned long long) profile_nodes[node].cycles);
+			}
+		}
+		return;
+	}
+
+	/* Children are created after their parents, so accumulate backwards. */
+	uint64_t *node_totals = malloc(profile_nodes_count * sizeof(uint64_t));
+	uint64_t *self_cycles = calloc(PROFILE_IRQ * 2 + 1, sizeof(uint64_t)); /* indexed by addr + 1 */
+	uint64_t *total_cycles = calloc(PROFILE_IRQ * 2 + 1, sizeof(uint64_t));
+	uint64_t *calls = calloc(PROFILE_IRQ * 2 + 1, sizeof(uint64_t));
+	int *subroutines = malloc((PROFILE_IRQ * 2 + 1) * sizeof(int));
+	if (node_totals == NULL || self_cycles == NULL || total_cycles == NULL || calls == NULL || subroutines == NULL)
+		out_of_memory();
+	for (int node = 0; node < profile_nodes_count; node++)
+		node_totals[node] = profile_nodes[node].cycles;
+	for (int node = profile_nodes_count; --node > 0; )
+		node_totals[profile_nodes[node].parent] += node_totals[node];
+	for (int node = 0; node < profile_nodes_count; node++) {
+		const ProfileNode *p = profile_nodes + node;
+		self_cycles[p->addr + 1] += p->cycles;
+		calls[p->addr + 1] += p->calls;
+		/* don't count recursive calls twice */
+		int ancestor;
+		for (ancestor = p->parent; ancestor >= 0 && profile_nodes[ancestor].addr != p->addr; ancestor = profile_nodes[ancestor].parent) {
+		}
+		if (ancestor < 0)
+			total_cycles[p->addr + 1] += node_totals[node];
+	}
+	uint64_t total = node_totals[0];
+	if (total == 0)
+		total = 1;
+
+	int subroutines_count = 0;
+	for (int i = 0; i < PROFILE_IRQ * 2 + 1; i++) {
+		if (total_cycles[i] > 0)
+			subroutines[subroutines_count++] = i;
+	}
+	profile_sort_keys = total_cycles;
+	qsort(subroutines, subroutines_count, sizeof(int), compare_profile_keys);
+	printf("Subroutine       Calls        Total cycles         Self cycles\n");
+	for (int i = 0; i < subroutines_count; i++) {
+		int addr = subroutines[i];
+		printf("%-10s %10llu %12llu %6.2f%% %12llu %6.2f%%\n", get_profile_name(addr - 1), (unsigned long long) calls[addr],
+			(unsigned long long) total_cycles[addr], total_cycles[addr] * 100.0 / total,
+			(unsigned long long) self_cycles[addr], self_cycles[addr] * 100.0 / total);
+	}
+
+	printf("\n      Cycles       %%  Executed\n");
+	int next_pc = -1;
+	for (int pc = 0; pc < 0x10000; pc++) {
+		if (profile_pc_count[pc] == 0)
+			continue;
+		if (next_pc >= 0 && pc != next_pc)
+			printf("\n");
+		printf("%12llu %6.2f%% %9llu  ", (unsigned long long) profile_pc_cycles[pc],
+			profile_pc_cycles[pc] * 100.0 / total, (unsigned long long) profile_pc_count[pc]);
+		show_instruction(pc);
+		next_pc = pc + get_instruction_length(asap->cpu.memory[pc]);
+	}
+	free(subroutines);
+	free(calls);
+	free(total_cycles);
+	free(self_cycles);
+	free(node_totals);
+}
+
 static void trace_cpu(void)
 {
 	int pc = asap->cpu.pc;
@@ -194,6 +512,8 @@ static void trace_cpu(void)
 	}
 	if (pc == print_time_at_pc)
 		print_time(frame, true);
+	if ((cpu_trace & CPU_TRACE_PROFILE) != 0)
+		profile_instruction(pc);
 	if (pc != 0xd200 && pc != 0xd203) /* don't count 0xd2 used by Do6502Init() and Call6502() */
 		cpu_opcodes[asap->cpu.memory[pc]] |= CPU_OPCODE_USED;
 }
@@ -218,65 +538,63 @@ static void print_unofficial_mnemonic(int opcode)
 static void print_help(void)
 {
 	printf(
-		"Usage: asapscan COMMAND [OPTIONS] INPUTFILE\n"
+		"Usage: asapscan COMMAND [OPTIONS] INPUTFILE...\n"
 		"Commands:\n"
 		"-d          Dump POKEY registers\n"
 		"-f          List POKEY features used\n"
 		"-t          Detect silence and loops\n"
 		"-p          Calculate fingerprint\n"
 		"-l          Calculate hash representation (fingerprint is a substring of this)\n"
+		"-i INDEX    Add fingerprints to the similarity index file\n"
+		"-m INDEX    List similar tunes from the index file\n"
 		"-c          Dump 6502 trace\n"
 		"-u          List used unofficial 6502 instructions and BRK\n"
 		"-b HEXADDR  Print time the given instruction reached\n"
+		"-P          Profile 6502 cycles per subroutine and instruction\n"
+		"-F          Profile 6502 cycles as collapsed stacks for flame graphs\n"
 		"-a          Run Acid800 test\n"
 		"-v          Display version information\n"
 		"Options:\n"
 		"-s SONG     Process the specified subsong (zero-based)\n"
+		"Options for -t, -p, -l, -i and -m:\n"
+		"-j THREADS  Scan files and subsongs in parallel\n"
+		"-J          Output JSON lines\n"
+		"-w          Write detected TIME tags back to SAP files\n"
 	);
 }
 
-static bool store_pokey(unsigned char *p, Pokey *pokey)
+static void out_of_memory(void)
 {
-	bool is_silence = true;
-	for (int i = 0; i < 4; i++) {
-		if ((pokey->channels[i].audc & 0xf) != 0) {
-			is_silence = false;
-			p[i * 2] = pokey->channels[i].audf;
-			p[i * 2 + 1] = pokey->channels[i].audc;
-		}
-		else {
-			p[i * 2] = 0;
-			p[i * 2 + 1] = 0;
-		}
-	}
-	p[8] = pokey->audctl;
-	return is_silence;
+	fprintf(stderr, "asapscan: out of memory\n");
+	exit(1);
 }
 
-static bool store_pokeys(int frame)
+static void start_scan(void)
 {
-	unsigned char *p = registers_dump + 18 * frame;
-	bool is_silence = store_pokey(p, &asap->pokeys.basePokey);
-	is_silence &= store_pokey(p + 9, &asap->pokeys.extraPokey);
-	return is_silence;
+	scan_frames = seconds_to_frames(scan_seconds);
+	silence_frames = seconds_to_frames(silence_seconds);
+	loop_check_frames = seconds_to_frames(loop_check_seconds);
+	loop_min_frames = seconds_to_frames(loop_min_seconds);
 }
 
-static bool has_loop_at(int first_frame, int second_frame)
-{
-	return memcmp(registers_dump + 18 * first_frame, registers_dump + 18 * second_frame, 18 * loop_check_frames) == 0;
-}
+/* POKEY registers of each frame, as stored by the loop detector of ASAP_DetectDuration. */
+#define REGISTERS_DUMP (asap->detector.registers)
 
 static int get_hash(int player_call)
 {
-	for (int i = 1; i < 9; i += 2) {
-		if ((registers_dump[18 * player_call + i] & 0xe0) == 0xe0)
-			registers_dump[18 * player_call + i] &= 0xbf;
-		if ((registers_dump[18 * player_call + i + 9] & 0xe0) == 0xe0)
-			registers_dump[18 * player_call + i + 9] &= 0xbf;
-	}
 	int hash = 0;
 	for (int i = 0; i < 18; i++)
-		hash += registers_dump[18 * player_call + i];
+		hash += REGISTERS_DUMP[18 * player_call + i];
+	return hash;
+}
+
+static uint64_t get_frame_hash(int frame)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < 18; i++) {
+		hash ^= REGISTERS_DUMP[18 * frame + i];
+		hash *= HASH_BASE;
+	}
 	return hash;
 }
 
@@ -288,13 +606,74 @@ static int get_byte_hash(int frame)
 	return res;
 }
 
-static void compute_entrophy(int frames)
+static void print_fingerprint(int start_frame, int frames)
+{
+	if (current_job != NULL) {
+		char *p = malloc(frames * 2 + 1);
+		if (p == NULL)
+			out_of_memory();
+		current_job->fingerprint = p;
+		for (int i = 0; i < frames; i++)
+			p += sprintf(p, "%02x", get_byte_hash(start_frame + i));
+		*p = '\0';
+		return;
+	}
+	for (int i = 0; i < frames; i++)
+		printf("%02x", get_byte_hash(start_frame + i));
+	printf("\n");
+}
+
+static uint64_t mix_hash(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static void compute_minhash(int frames)
 {
-	if (long_fingerprint) {
-		for (int i = 0; i < frame; i++)
-			printf("%02x", get_byte_hash(i));
-		printf("\n");
+	uint32_t *minhash = malloc(MINHASH_COUNT * sizeof(uint32_t));
+	if (minhash == NULL)
+		out_of_memory();
+	for (int i = 0; i < MINHASH_COUNT; i++)
+		minhash[i] = UINT32_MAX;
+	/* Frames that repeat the previous one are skipped, so that a different tempo
+	   of note changes or a longer initial silence doesn't change the shingles. */
+	uint64_t window[SHINGLE_FRAMES];
+	int distinct_frames = 0;
+	for (int f = 0; f < frames; f++) {
+		uint64_t hash = get_frame_hash(f);
+		if (distinct_frames > 0 && hash == window[(distinct_frames - 1) % SHINGLE_FRAMES])
+			continue;
+		window[distinct_frames++ % SHINGLE_FRAMES] = hash;
+		if (distinct_frames >= SHINGLE_FRAMES) {
+			uint64_t shingle = 0;
+			for (int i = distinct_frames - SHINGLE_FRAMES; i < distinct_frames; i++)
+				shingle = shingle * HASH_BASE + window[i % SHINGLE_FRAMES];
+			for (int i = 0; i < MINHASH_COUNT; i++) {
+				uint32_t value = (uint32_t) (mix_hash(shingle + i * 0x9e3779b97f4a7c15ULL) >> 32);
+				if (minhash[i] > value)
+					minhash[i] = value;
+			}
+		}
+	}
+	if (distinct_frames < SHINGLE_FRAMES) {
+		/* silence or a constant tone - nothing to compare */
+		free(minhash);
+		return;
 	}
+	current_job->minhash = minhash;
+}
+
+static void compute_entrophy(int frames)
+{
+	if (current_job != NULL && (index_fp != NULL || index_entries != NULL))
+		compute_minhash(frames);
+	else if (long_fingerprint)
+		print_fingerprint(0, frame);
 	else {
 		int entrophy_counters[256] = { 0 };
 		int emaxvalue = 0;
@@ -321,9 +700,7 @@ static void compute_entrophy(int frames)
 			}
 		}
 
-		for (int i = 0; i < ENTROPHY_LEN; i++)
-			printf("%02x", get_byte_hash(i + emaxframe));
-		printf("\n");
+		print_fingerprint(emaxframe, ENTROPHY_LEN);
 	}
 }
 
@@ -347,15 +724,18 @@ static void scan_song(int song)
 {
 	if (!ASAP_PlaySong(asap, song, -1)) {
 		fprintf(stderr, "asapscan: PlaySong failed\n");
+		if (current_job != NULL)
+			current_job->failed = true;
 		return;
 	}
 	int silence_run = 0;
-	int running_hash = 0;
-	if (acid)
-		scan_frames = seconds_to_frames(ASAPInfo_GetDuration(&asap->moduleInfo, song) / 1000);
-	for (int i = 0; i < 1 << HASH_BITS; i++)
-		hash_first[i] = -1;
-	for (frame = 0; frame < scan_frames; frame++) {
+	/* the song's own duration, without changing the limit for the next songs */
+	int song_frames = scan_frames;
+	if (acid || ((cpu_trace & CPU_TRACE_PROFILE) != 0 && ASAPInfo_GetDuration(&asap->moduleInfo, song) > 0))
+		song_frames = seconds_to_frames(ASAPInfo_GetDuration(&asap->moduleInfo, song) / 1000);
+	if (detect_time)
+		LoopDetector_Start(&asap->detector, song_frames, loop_check_frames);
+	for (frame = 0; frame < song_frames; frame++) {
 		ASAP_Do6502Frame(asap);
 		if (dump) {
 			printf("%6.2f: ", (double) frame * CYCLES_PER_FRAME / MAIN_CLOCK);
@@ -386,7 +766,7 @@ static void scan_song(int song)
 			}
 		}
 		if (detect_time) {
-			if (store_pokeys(frame)) {
+			if (LoopDetector_StoreFrame(&asap->detector, frame, &asap->pokeys)) {
 				silence_run++;
 				if (silence_run >= silence_frames && /* do not trigger at the initial silence */ silence_run < frame) {
 					if (fingerprint)
@@ -398,47 +778,21 @@ static void scan_song(int song)
 			}
 			else
 				silence_run = 0;
-			if (frame >= loop_check_frames) {
-				int second_frame = frame - loop_check_frames;
-				running_hash &= (1 << HASH_BITS) - 1;
-				/* Now running_hash is for the last loop_check_player_calls player calls before player_call. */
-				for (int first_frame = hash_first[running_hash]; first_frame >= 0; first_frame = hash_next[first_frame]) {
-					if (has_loop_at(first_frame, second_frame)) {
-						int loop_len = second_frame - first_frame;
-						if (loop_len >= loop_min_frames) {
-							if (fingerprint)
-								compute_entrophy(second_frame);
-							else
-								print_time(second_frame, true);
-							return;
-						}
-						if (loop_len == 1) {
-							/* POKEY registers do not change - probably an ultrasound */
-							if (fingerprint)
-								compute_entrophy(first_frame);
-							else
-								print_time(first_frame, false);
-							return;
-						}
-					}
-				}
-				/* Insert into hashtable. */
-				if (hash_first[running_hash] >= 0)
-					hash_next[hash_last[running_hash]] = second_frame;
+			int end_frame = LoopDetector_FindLoop(&asap->detector, frame, loop_min_frames);
+			if (end_frame >= 0) {
+				/* a loop, or POKEY registers do not change - probably an ultrasound */
+				if (fingerprint)
+					compute_entrophy(end_frame);
 				else
-					hash_first[running_hash] = second_frame;
-				hash_next[second_frame] = -1;
-				hash_last[running_hash] = second_frame;
-				/* Update running_hash. */
-				running_hash -= get_hash(second_frame);
+					print_time(end_frame, asap->detector.loop);
+				return;
 			}
-			running_hash += get_hash(frame);
 		}
 	}
 	if (detect_time) {
 		if (fingerprint)
 			compute_entrophy(loop_check_frames);
-		else
+		else if (current_job == NULL)
 			printf("No silence or loop detected in song %d\n", song);
 	}
 	if (acid) {
@@ -478,14 +832,529 @@ static void scan_song(int song)
 	}
 }
 
+/* Formats a duration like the TIME tag written by ASAPWriter. */
+static void format_duration(char *result, int duration)
+{
+	int len = sprintf(result, "%02d:%02d", duration / 60000, duration / 1000 % 60);
+	duration %= 1000;
+	if (duration % 10 != 0)
+		sprintf(result + len, ".%03d", duration);
+	else if (duration != 0)
+		sprintf(result + len, ".%02d", duration / 10);
+}
+
+/* Replaces target with the completely written temp_file. */
+static bool replace_file(const char *temp_file, const char *target)
+{
+#ifdef _WIN32
+	return MoveFileExA(temp_file, target, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	struct stat st;
+	if (stat(target, &st) == 0)
+		chmod(temp_file, st.st_mode & 07777);
+	return rename(temp_file, target) == 0;
+#endif
+}
+
+/* Rewrites the TIME tags at the end of the header of a SAP file.
+   asapscan is built without ASAPWriter, so this edits the text header
+   and keeps all other tags and the binary part as they are.
+   The new file is written next to the original and renamed over it,
+   so that a failed write leaves the original intact.
+   Returns false if the file couldn't be written. */
+static bool write_sap_times(const char *input_file, const ASAPInfo *info, const uint8_t *module, int module_len)
+{
+	int header_len = 0;
+	while (header_len + 1 < module_len && (module[header_len] != 0xff || module[header_len + 1] != 0xff)) {
+		const uint8_t *eol = memchr(module + header_len, '\n', module_len - header_len);
+		if (eol == NULL)
+			return false;
+		header_len = (int) (eol - module) + 1;
+	}
+	size_t input_file_len = strlen(input_file);
+	char *temp_file = malloc(input_file_len + 5);
+	if (temp_file == NULL)
+		out_of_memory();
+	memcpy(temp_file, input_file, input_file_len);
+	memcpy(temp_file + input_file_len, ".tmp", 5);
+	FILE *fp = fopen(temp_file, "wb");
+	if (fp == NULL) {
+		free(temp_file);
+		return false;
+	}
+	bool ok = true;
+	for (int i = 0; i < header_len; ) {
+		int line_len = (int) ((const uint8_t *) memchr(module + i, '\n', header_len - i) - (module + i)) + 1;
+		if (memcmp(module + i, "TIME ", 5) != 0)
+			ok &= (int) fwrite(module + i, 1, line_len, fp) == line_len;
+		i += line_len;
+	}
+	for (int song = 0; song < ASAPInfo_GetSongs(info); song++) {
+		int duration = ASAPInfo_GetDuration(info, song);
+		if (duration < 0 || duration >= 100 * 60 * 1000)
+			break;
+		char s[10];
+		format_duration(s, duration);
+		ok &= fprintf(fp, "TIME %s%s\r\n", s, ASAPInfo_GetLoop(info, song) ? " LOOP" : "") > 0;
+	}
+	ok &= (int) fwrite(module + header_len, 1, module_len - header_len, fp) == module_len - header_len;
+	ok &= fclose(fp) == 0;
+	if (ok)
+		ok = replace_file(temp_file, input_file);
+	if (!ok)
+		remove(temp_file);
+	free(temp_file);
+	return ok;
+}
+
+/* Called without the jobs lock, once all subsongs of the file have been scanned. */
+static bool write_times(const char *input_file, const ScanJob *file_jobs, int count)
+{
+	const char *ext = strrchr(input_file, '.');
+	if (ext == NULL || strcasecmp(ext, ".sap") != 0) {
+		fprintf(stderr, "asapscan: %s: can only write TIME to SAP files\n", input_file);
+		return false;
+	}
+	FILE *fp = fopen(input_file, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "asapscan: %s: cannot open\n", input_file);
+		return false;
+	}
+	/* one byte more, to detect files that wouldn't be written back completely */
+	uint8_t *module = malloc(ASAPInfo_MAX_MODULE_LENGTH + 1);
+	ASAPInfo *info = ASAPInfo_New();
+	if (module == NULL || info == NULL)
+		out_of_memory();
+	int module_len = (int) fread(module, 1, ASAPInfo_MAX_MODULE_LENGTH + 1, fp);
+	fclose(fp);
+	if (module_len > ASAPInfo_MAX_MODULE_LENGTH) {
+		fprintf(stderr, "asapscan: %s: file too long to rewrite\n", input_file);
+		ASAPInfo_Delete(info);
+		free(module);
+		return false;
+	}
+	bool changed = false;
+	if (ASAPInfo_Load(info, input_file, module, module_len)) {
+		for (int i = 0; i < count; i++) {
+			const ScanJob *job = file_jobs + i;
+			if (!job->failed && job->duration >= 0) {
+				ASAPInfo_SetDuration(info, job->song, job->duration);
+				ASAPInfo_SetLoop(info, job->song, job->loop);
+				changed = true;
+			}
+		}
+	}
+	bool ok = true;
+	if (changed && !write_sap_times(input_file, info, module, module_len)) {
+		fprintf(stderr, "asapscan: %s: cannot write\n", input_file);
+		ok = false;
+	}
+	ASAPInfo_Delete(info);
+	free(module);
+	return ok;
+}
+
+static void print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		unsigned char c = (unsigned char) *s;
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < ' ')
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static uint64_t get_band_key(const uint32_t *minhash, int band)
+{
+	uint64_t key = band;
+	for (int i = band * MINHASH_ROWS; i < (band + 1) * MINHASH_ROWS; i++)
+		key = key * HASH_BASE + minhash[i];
+	return key;
+}
+
+static int compare_index_buckets(const void *p1, const void *p2)
+{
+	const IndexBucket *b1 = (const IndexBucket *) p1;
+	const IndexBucket *b2 = (const IndexBucket *) p2;
+	if (b1->key != b2->key)
+		return b1->key < b2->key ? -1 : 1;
+	return b1->entry - b2->entry;
+}
+
+static bool parse_index_line(IndexEntry *entry, char *line)
+{
+	for (int i = 0; i < MINHASH_COUNT; i++) {
+		char hex[9];
+		memcpy(hex, line + i * 8, 8);
+		hex[8] = '\0';
+		char *end;
+		entry->minhash[i] = (uint32_t) strtoul(hex, &end, 16);
+		if (end != hex + 8)
+			return false;
+	}
+	line += MINHASH_COUNT * 8;
+	char *end;
+	if (*line++ != '\t')
+		return false;
+	entry->song = (int) strtol(line, &end, 10);
+	if (end == line || *end != '\t')
+		return false;
+	line = end + 1;
+	line[strcspn(line, "\r\n")] = '\0';
+	entry->file = strdup(line);
+	if (entry->file == NULL)
+		out_of_memory();
+	return true;
+}
+
+static void load_index(const char *index_file)
+{
+	FILE *fp = fopen(index_file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "asapscan: %s: cannot open\n", index_file);
+		exit(1);
+	}
+	static char line[MINHASH_COUNT * 8 + 16 + FILENAME_MAX];
+	int capacity = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (index_count >= capacity) {
+			capacity = capacity == 0 ? 1024 : capacity * 2;
+			index_entries = realloc(index_entries, capacity * sizeof(IndexEntry));
+			if (index_entries == NULL)
+				out_of_memory();
+		}
+		if (!parse_index_line(index_entries + index_count, line)) {
+			fprintf(stderr, "asapscan: %s: invalid line %d\n", index_file, index_count + 1);
+			exit(1);
+		}
+		index_count++;
+	}
+	fclose(fp);
+	if (index_entries == NULL) {
+		/* empty index */
+		index_entries = malloc(sizeof(IndexEntry));
+		if (index_entries == NULL)
+			out_of_memory();
+	}
+	for (int band = 0; band < MINHASH_BANDS; band++) {
+		IndexBucket *buckets = malloc((index_count + 1) * sizeof(IndexBucket));
+		if (buckets == NULL)
+			out_of_memory();
+		for (int i = 0; i < index_count; i++) {
+			buckets[i].key = get_band_key(index_entries[i].minhash, band);
+			buckets[i].entry = i;
+		}
+		qsort(buckets, index_count, sizeof(IndexBucket), compare_index_buckets);
+		index_buckets[band] = buckets;
+	}
+	index_matched = malloc((index_count + 1) * sizeof(int));
+	if (index_matched == NULL)
+		out_of_memory();
+	for (int i = 0; i < index_count; i++)
+		index_matched[i] = -1;
+}
+
+static void free_index(void)
+{
+	for (int i = 0; i < index_count; i++)
+		free(index_entries[i].file);
+	free(index_entries);
+	for (int band = 0; band < MINHASH_BANDS; band++)
+		free(index_buckets[band]);
+	free(index_matched);
+}
+
+static void write_index_entry(const ScanJob *job)
+{
+	for (int i = 0; i < MINHASH_COUNT; i++)
+		fprintf(index_fp, "%08x", job->minhash[i]);
+	fprintf(index_fp, "\t%d\t%s\n", job->song, input_files[job->file]);
+}
+
+/* Called with the jobs lock held, so index_matched can be shared. */
+static void print_similar(const ScanJob *job, int job_index)
+{
+	const char *input_file = input_files[job->file];
+	bool first = true;
+	for (int band = 0; band < MINHASH_BANDS; band++) {
+		IndexBucket *buckets = index_buckets[band];
+		uint64_t key = get_band_key(job->minhash, band);
+		int left = 0;
+		int right = index_count;
+		while (left < right) {
+			int mid = (left + right) >> 1;
+			if (buckets[mid].key < key)
+				left = mid + 1;
+			else
+				right = mid;
+		}
+		for (; left < index_count && buckets[left].key == key; left++) {
+			int i = buckets[left].entry;
+			if (index_matched[i] == job_index)
+				continue;
+			index_matched[i] = job_index;
+			const IndexEntry *entry = index_entries + i;
+			if (entry->song == job->song && strcmp(entry->file, input_file) == 0)
+				continue;
+			int equal = 0;
+			for (int j = 0; j < MINHASH_COUNT; j++)
+				equal += entry->minhash[j] == job->minhash[j];
+			if (equal < MINHASH_THRESHOLD)
+				continue;
+			if (json) {
+				if (!first)
+					printf(",");
+				printf("{\"file\":");
+				print_json_string(entry->file);
+				printf(",\"song\":%d,\"similarity\":%.2f}", entry->song, (double) equal / MINHASH_COUNT);
+			}
+			else {
+				if (input_files_count > 1)
+					printf("%s: ", input_file);
+				printf("song %d: %3d%% %s song %d\n", job->song, equal * 100 / MINHASH_COUNT, entry->file, entry->song);
+			}
+			first = false;
+		}
+	}
+}
+
+static void print_job(const ScanJob *job)
+{
+	const char *input_file = input_files[job->file];
+	if (index_fp != NULL) {
+		if (job->minhash != NULL)
+			write_index_entry(job);
+		return;
+	}
+	if (index_entries != NULL) {
+		if (job->minhash == NULL)
+			return;
+		if (json) {
+			printf("{\"file\":");
+			print_json_string(input_file);
+			printf(",\"song\":%d,\"similar\":[", job->song);
+			print_similar(job, (int) (job - jobs));
+			printf("]}\n");
+		}
+		else
+			print_similar(job, (int) (job - jobs));
+		return;
+	}
+	if (json) {
+		printf("{\"file\":");
+		print_json_string(input_file);
+		printf(",\"song\":%d", job->song);
+		if (job->failed)
+			printf(",\"error\":true");
+		else if (job->fingerprint != NULL)
+			printf(",\"fingerprint\":\"%s\"", job->fingerprint);
+		else if (job->duration >= 0) {
+			printf(",\"time\":\"");
+			print_duration(job->duration);
+			printf("\",\"loop\":%s", job->loop ? "true" : "false");
+		}
+		else
+			printf(",\"time\":null");
+		printf("}\n");
+		return;
+	}
+	if (job->failed)
+		return;
+	if (input_files_count > 1)
+		printf("%s: ", input_file);
+	if (job->fingerprint != NULL)
+		printf("%s\n", job->fingerprint);
+	else if (job->duration >= 0) {
+		printf("TIME ");
+		print_duration(job->duration);
+		printf("%s\n", job->loop ? " LOOP" : "");
+	}
+	else
+		printf("No silence or loop detected in song %d\n", job->song);
+}
+
+/* Called with the jobs lock held. Prints finished jobs in input order. */
+static void print_jobs(void)
+{
+	while (jobs_printed < jobs_count && jobs[jobs_printed].done) {
+		ScanJob *job = jobs + jobs_printed++;
+		print_job(job);
+		free(job->fingerprint);
+		job->fingerprint = NULL;
+		free(job->minhash);
+		job->minhash = NULL;
+	}
+	fflush(stdout);
+}
+
+#ifdef _WIN32
+static CRITICAL_SECTION jobs_lock;
+#define init_jobs_lock()  InitializeCriticalSection(&jobs_lock)
+#define lock_jobs()       EnterCriticalSection(&jobs_lock)
+#define unlock_jobs()     LeaveCriticalSection(&jobs_lock)
+#else
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+#define init_jobs_lock()
+#define lock_jobs()       pthread_mutex_lock(&jobs_lock)
+#define unlock_jobs()     pthread_mutex_unlock(&jobs_lock)
+#endif
+
+static void scan_jobs(void)
+{
+	asap = ASAP_New();
+	if (asap == NULL)
+		out_of_memory();
+	for (;;) {
+		lock_jobs();
+		int i = jobs_next++;
+		unlock_jobs();
+		if (i >= jobs_count)
+			break;
+		ScanJob *job = jobs + i;
+		/* Reload for every subsong, because players may modify their memory.
+		   This way the result doesn't depend on which thread scanned which song before. */
+		const char *input_file = input_files[job->file];
+		if (ASAP_LoadFiles(asap, input_file, ASAPFileLoader_GetStdio())) {
+			start_scan();
+			current_job = job;
+			scan_song(job->song);
+			current_job = NULL;
+		}
+		else {
+			fprintf(stderr, "asapscan: %s: cannot open\n", input_file);
+			job->failed = true;
+		}
+		lock_jobs();
+		job->done = true;
+		if (job->failed)
+			exit_code = 1;
+		print_jobs();
+		/* The worker that finishes the last subsong of a file writes its TIME tags.
+		   Jobs of a file are adjacent and only read once done. */
+		const ScanJob *file_jobs = NULL;
+		int file_jobs_count = 0;
+		if (write_back) {
+			file_jobs = job;
+			while (file_jobs > jobs && file_jobs[-1].file == job->file)
+				file_jobs--;
+			const ScanJob *file_end = job + 1;
+			while (file_end < jobs + jobs_count && file_end->file == job->file)
+				file_end++;
+			file_jobs_count = (int) (file_end - file_jobs);
+			for (int j = 0; j < file_jobs_count; j++) {
+				if (!file_jobs[j].done)
+					file_jobs_count = 0;
+			}
+		}
+		unlock_jobs();
+		if (file_jobs_count > 0 && !write_times(input_file, file_jobs, file_jobs_count)) {
+			lock_jobs();
+			exit_code = 1;
+			unlock_jobs();
+		}
+	}
+	ASAP_Delete(asap);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI scan_thread(LPVOID arg)
+{
+	scan_jobs();
+	return 0;
+}
+#else
+static void *scan_thread(void *arg)
+{
+	scan_jobs();
+	return NULL;
+}
+#endif
+
+static int scan_files(int song, int threads)
+{
+	/* Load each file once to find its subsongs, so that they are scanned in parallel, too. */
+	asap = ASAP_New();
+	jobs = malloc(input_files_count * sizeof(ScanJob));
+	if (asap == NULL || jobs == NULL)
+		out_of_memory();
+	int jobs_capacity = input_files_count;
+	for (int file = 0; file < input_files_count; file++) {
+		int songs = 1;
+		if (!ASAP_LoadFiles(asap, input_files[file], ASAPFileLoader_GetStdio())) {
+			/* let the worker report the error in order */
+		}
+		else if (song < 0)
+			songs = asap->moduleInfo.songs;
+		if (jobs_count + songs > jobs_capacity) {
+			jobs_capacity = (jobs_count + songs) * 2;
+			jobs = realloc(jobs, jobs_capacity * sizeof(ScanJob));
+			if (jobs == NULL)
+				out_of_memory();
+		}
+		for (int i = 0; i < songs; i++) {
+			ScanJob *job = jobs + jobs_count++;
+			job->file = file;
+			job->song = song >= 0 ? song : i;
+			job->done = false;
+			job->failed = false;
+			job->duration = -1;
+			job->loop = false;
+			job->fingerprint = NULL;
+			job->minhash = NULL;
+		}
+	}
+	ASAP_Delete(asap);
+
+	if (threads > jobs_count)
+		threads = jobs_count;
+	init_jobs_lock();
+#ifdef _WIN32
+	HANDLE *handles = malloc(threads * sizeof(HANDLE));
+#else
+	pthread_t *handles = malloc(threads * sizeof(pthread_t));
+#endif
+	if (handles == NULL)
+		out_of_memory();
+	/* the main thread is the first worker */
+	int started = 1;
+	for (; started < threads; started++) {
+#ifdef _WIN32
+		handles[started] = CreateThread(NULL, 0, scan_thread, NULL, 0, NULL);
+		if (handles[started] == NULL)
+			break;
+#else
+		if (pthread_create(handles + started, NULL, scan_thread, NULL) != 0)
+			break;
+#endif
+	}
+	scan_jobs();
+	for (int i = 1; i < started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+#else
+		pthread_join(handles[i], NULL);
+#endif
+	}
+	free(handles);
+	free(jobs);
+	return exit_code;
+}
+
 int main(int argc, char **argv)
 {
-	const char *input_file = NULL;
 	int song = -1;
-	int scan_seconds = 15 * 60;
-	int silence_seconds = 5;
-	int loop_check_seconds = 3 * 60;
-	int loop_min_seconds = 5;
+	int threads = 1;
+	const char *index_file = NULL;
+	bool index_add = false;
+	input_files = malloc(argc * sizeof(input_files[0]));
+	if (input_files == NULL)
+		out_of_memory();
 
 	for (int i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "-d") == 0)
@@ -494,6 +1363,11 @@ int main(int argc, char **argv)
 			detect_time = fingerprint = true;
 		else if (strcmp(argv[i], "-l") == 0)
 			detect_time = fingerprint = long_fingerprint = true;
+		else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "-m") == 0) {
+			index_add = argv[i][1] == 'i';
+			index_file = argv[++i];
+			detect_time = fingerprint = long_fingerprint = true;
+		}
 		else if (strcmp(argv[i], "-f") == 0)
 			features = FEATURE_CHECK;
 		else if (strcmp(argv[i], "-t") == 0)
@@ -506,47 +1380,67 @@ int main(int argc, char **argv)
 			print_time_at_pc = (int) strtol(argv[++i], NULL, 16);
 			cpu_trace |= CPU_TRACE_PC_TIME;
 		}
+		else if (strcmp(argv[i], "-P") == 0 || strcmp(argv[i], "-F") == 0) {
+			profile_collapsed = argv[i][1] == 'F';
+			cpu_trace |= CPU_TRACE_PROFILE;
+		}
 		else if (strcmp(argv[i], "-s") == 0)
 			song = atoi(argv[++i]);
 		else if (strcmp(argv[i], "-a") == 0)
 			acid = true;
+		else if (strcmp(argv[i], "-j") == 0)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-J") == 0)
+			json = true;
+		else if (strcmp(argv[i], "-w") == 0)
+			write_back = true;
 		else if (strcmp(argv[i], "-v") == 0) {
 			printf("asapscan " ASAPInfo_VERSION "\n");
 			return 0;
 		}
-		else {
-			if (input_file != NULL) {
-				print_help();
-				return 1;
-			}
-			input_file = argv[i];
-		}
+		else
+			input_files[input_files_count++] = argv[i];
 	}
-	if (dump + features + detect_time + cpu_trace + acid == 0 || input_file == NULL) {
+	if (dump + features + detect_time + cpu_trace + acid == 0 || input_files_count == 0 || threads < 1) {
 		print_help();
 		return 1;
 	}
+	if (input_files_count > 1 || threads > 1 || json || write_back || index_file != NULL) {
+		if (!detect_time || dump || features != 0 || cpu_trace != 0 || acid || (write_back && fingerprint)) {
+			print_help();
+			return 1;
+		}
+		if (index_add) {
+			index_fp = fopen(index_file, "a");
+			if (index_fp == NULL) {
+				fprintf(stderr, "asapscan: %s: cannot write\n", index_file);
+				return 1;
+			}
+		}
+		else if (index_file != NULL)
+			load_index(index_file);
+		scan_files(song, threads);
+		if (index_fp != NULL && fclose(index_fp) != 0) {
+			fprintf(stderr, "asapscan: %s: write error\n", index_file);
+			return 1;
+		}
+		if (index_entries != NULL)
+			free_index();
+		return exit_code;
+	}
+
+	const char *input_file = input_files[0];
 	asap = ASAP_New();
 	if (!ASAP_LoadFiles(asap, input_file, ASAPFileLoader_GetStdio())) {
 		fprintf(stderr, "asapscan: %s: cannot open\n", input_file);
 		return 1;
 	}
-	scan_frames = seconds_to_frames(scan_seconds);
-	silence_frames = seconds_to_frames(silence_seconds);
-	loop_check_frames = seconds_to_frames(loop_check_seconds);
-	loop_min_frames = seconds_to_frames(loop_min_seconds);
-	registers_dump = malloc(scan_frames * 18);
-	hash_next = malloc(scan_frames * sizeof(hash_next[0]));
-	if (registers_dump == NULL || hash_next == NULL) {
-		fprintf(stderr, "asapscan: out of memory\n");
-		return 1;
-	}
+	start_scan();
 	if (song >= 0)
 		scan_song(song);
 	else
 		for (song = 0; song < asap->moduleInfo.songs; song++)
 			scan_song(song);
-	free(registers_dump);
 	if (features != 0) {
 		if ((features & FEATURE_15_KHZ) != 0)
 			printf("15 kHz clock\n");
@@ -565,5 +1459,7 @@ int main(int argc, char **argv)
 				print_unofficial_mnemonic(i);
 		}
 	}
+	if ((cpu_trace & CPU_TRACE_PROFILE) != 0)
+		print_profile();
 	return exit_code;
 }
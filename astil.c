@@ -21,9 +21,16 @@
  * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/stat.h>
+#endif
 #include "astil.h"
 
 #define ASTIL_MAX_TEXT_LENGTH  100
@@ -52,6 +59,41 @@ struct ASTIL
 	ASTILCover covers[ASTIL_MAX_COVERS];
 };
 
+typedef struct
+{
+	const unsigned char *p;
+	const unsigned char *end;
+} ASTILReader;
+
+/* STIL.txt kept in memory, with an index of its lines that start with a slash:
+   filenames and directories. */
+typedef struct
+{
+	char filename[FILENAME_MAX];
+	int64_t size;
+	int64_t mtime;
+	const unsigned char *text;
+	int textLen;
+	int textStart; /* after the UTF-8 BOM */
+	int nEntries;
+	int *entryOffsets;
+	int *entryNext;
+	int *hashHeads;
+	int hashMask;
+} ASTILDatabase;
+
+static ASTILDatabase database;
+
+#ifdef _WIN32
+static SRWLOCK lock = SRWLOCK_INIT;
+#define ASTIL_Lock()  AcquireSRWLockExclusive(&lock)
+#define ASTIL_Unlock()  ReleaseSRWLockExclusive(&lock)
+#else
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define ASTIL_Lock()  pthread_mutex_lock(&lock)
+#define ASTIL_Unlock()  pthread_mutex_unlock(&lock)
+#endif
+
 ASTIL *ASTIL_New(void)
 {
 	ASTIL *self = (ASTIL *) calloc(1, sizeof(ASTIL));
@@ -73,19 +115,16 @@ static int ASTIL_FindPreviousSlash(const char *filename, int pos)
 	return -1;
 }
 
-static bool ASTIL_ReadUTF8BOM(FILE *fp)
+static int ASTIL_GetC(ASTILReader *reader)
 {
-	if (getc(fp) == 0xef && getc(fp) == 0xbb && getc(fp) == 0xbf)
-		return true;
-	fseek(fp, 0, SEEK_SET);
-	return false;
+	return reader->p < reader->end ? *reader->p++ : EOF;
 }
 
-static int ASTIL_ReadLine(FILE *fp, char *result)
+static int ASTIL_ReadLine(ASTILReader *reader, char *result)
 {
 	int len = 0;
 	for (;;) {
-		int c = getc(fp);
+		int c = ASTIL_GetC(reader);
 		switch (c) {
 		case EOF:
 			result[0] = '\0';
@@ -105,29 +144,166 @@ static int ASTIL_ReadLine(FILE *fp, char *result)
 	}
 }
 
-static int ASTIL_MatchFilename(const char *line, const char *filename)
+static bool ASTIL_MatchFilename(const char *line, const char *filename, int len)
+{
+	for (int i = 0; i < len; i++) {
+		int c = filename[i];
+		if (line[i] != (c == '\\' ? '/' : c))
+			return false;
+	}
+	return line[len] == '\0';
+}
+
+static unsigned ASTIL_HashFilename(const char *filename, int len)
+{
+	unsigned hash = 2166136261U;
+	for (int i = 0; i < len; i++) {
+		int c = filename[i];
+		hash = (hash ^ (unsigned char) (c == '\\' ? '/' : c)) * 16777619U;
+	}
+	return hash;
+}
+
+static bool ASTILDatabase_GetFileIdentity(const char *filename, int64_t *size, int64_t *mtime)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &data)
+	 || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		return false;
+	*size = (int64_t) data.nFileSizeHigh << 32 | data.nFileSizeLow;
+	*mtime = (int64_t) data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat st;
+	if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+#endif
+	return true;
+}
+
+static void ASTILDatabase_Close(ASTILDatabase *self)
+{
+	free((void *) self->text);
+	free(self->entryOffsets);
+	free(self->entryNext);
+	free(self->hashHeads);
+	memset(self, 0, sizeof(ASTILDatabase));
+}
+
+/* Reads the whole file rather than mapping it: if STIL.txt was replaced
+   while mapped, reading it would crash the player. */
+static bool ASTILDatabase_Load(ASTILDatabase *self, const char *filename, int size)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+		return false;
+	unsigned char *text = (unsigned char *) malloc(size + 1);
+	bool ok = text != NULL && (int) fread(text, 1, size, fp) == size;
+	fclose(fp);
+	if (!ok) {
+		free(text);
+		return false;
+	}
+	self->text = text;
+	self->textLen = size;
+	return true;
+}
+
+static int ASTILDatabase_Find(const ASTILDatabase *self, const char *filename, int len)
 {
-	for (int len = 0; ; len++) {
-		int c = line[len];
-		if (c == filename[len]) {
-			if (c == '\0')
-				return -1;
+	if (len > ASTIL_MAX_TEXT_LENGTH)
+		return -1;
+	for (int i = self->hashHeads[ASTIL_HashFilename(filename, len) & self->hashMask]; i >= 0; i = self->entryNext[i]) {
+		ASTILReader reader = { self->text + self->entryOffsets[i], self->text + self->textLen };
+		char line[ASTIL_MAX_TEXT_LENGTH + 1];
+		ASTIL_ReadLine(&reader, line);
+		if (ASTIL_MatchFilename(line, filename, len))
+			return self->entryOffsets[i];
+	}
+	return -1;
+}
+
+static bool ASTILDatabase_BuildIndex(ASTILDatabase *self)
+{
+	ASTILReader reader = { self->text, self->text + self->textLen };
+	if (self->textLen >= 3 && memcmp(self->text, "\xef\xbb\xbf", 3) == 0)
+		reader.p += 3;
+	self->textStart = (int) (reader.p - self->text);
+
+	int capacity = 1024;
+	self->entryOffsets = (int *) malloc(capacity * sizeof(int));
+	if (self->entryOffsets == NULL)
+		return false;
+	char line[ASTIL_MAX_TEXT_LENGTH + 1];
+	for (;;) {
+		int offset = (int) (reader.p - self->text);
+		if (ASTIL_ReadLine(&reader, line) < 0)
+			break;
+		if (line[0] != '/')
+			continue;
+		if (self->nEntries == capacity) {
+			capacity <<= 1;
+			int *entryOffsets = (int *) realloc(self->entryOffsets, capacity * sizeof(int));
+			if (entryOffsets == NULL)
+				return false;
+			self->entryOffsets = entryOffsets;
 		}
-		else if (c == '/' && filename[len] == '\\') {
+		self->entryOffsets[self->nEntries++] = offset;
+	}
+
+	int hashSize = 1024;
+	while (hashSize < 2 * self->nEntries)
+		hashSize <<= 1;
+	self->hashMask = hashSize - 1;
+	self->hashHeads = (int *) malloc(hashSize * sizeof(int));
+	self->entryNext = (int *) malloc((self->nEntries + 1) * sizeof(int));
+	if (self->hashHeads == NULL || self->entryNext == NULL)
+		return false;
+	memset(self->hashHeads, -1, hashSize * sizeof(int));
+	for (int i = 0; i < self->nEntries; i++) {
+		reader.p = self->text + self->entryOffsets[i];
+		int len = ASTIL_ReadLine(&reader, line);
+		/* like a sequential scan, find the first of repeated lines */
+		if (ASTILDatabase_Find(self, line, len) < 0) {
+			unsigned hash = ASTIL_HashFilename(line, len) & self->hashMask;
+			self->entryNext[i] = self->hashHeads[hash];
+			self->hashHeads[hash] = i;
 		}
-		else
-			return len;
 	}
+	return true;
+}
+
+static bool ASTILDatabase_Open(ASTILDatabase *self, const char *filename)
+{
+	int64_t size;
+	int64_t mtime;
+	if (!ASTILDatabase_GetFileIdentity(filename, &size, &mtime))
+		return false;
+	if (self->text != NULL && self->size == size && self->mtime == mtime && strcmp(self->filename, filename) == 0)
+		return true;
+	ASTILDatabase_Close(self);
+	if (size > 0x7fffffff || !ASTILDatabase_Load(self, filename, (int) size))
+		return false;
+	if (!ASTILDatabase_BuildIndex(self)) {
+		ASTILDatabase_Close(self);
+		return false;
+	}
+	strcpy(self->filename, filename);
+	self->size = size;
+	self->mtime = mtime;
+	return true;
 }
 
-static void ASTIL_ReadComment(FILE *fp, char *line, char *comment)
+static void ASTIL_ReadComment(ASTILReader *reader, char *line, char *comment)
 {
-	int len = ASTIL_ReadLine(fp, line);
+	int len = ASTIL_ReadLine(reader, line);
 	if (len >= 9 && memcmp(line, "COMMENT: ", 9) == 0) {
 		len -= 9;
 		memcpy(comment, line + 9, len + 1);
 		for (;;) {
-			int len2 = ASTIL_ReadLine(fp, line);
+			int len2 = ASTIL_ReadLine(reader, line);
 			if (len2 >= 9 && memcmp(line, "         ", 9) == 0) {
 				if (len < ASTIL_MAX_COMMENT_LENGTH - ASTIL_MAX_TEXT_LENGTH) {
 					comment[len++] = '\n';
@@ -157,9 +333,9 @@ static int ASTIL_ParseInt(const char *s, int *pos)
 	return result;
 }
 
-static bool ASTIL_ReadUntilSongNo(FILE *fp, char *line)
+static bool ASTIL_ReadUntilSongNo(ASTILReader *reader, char *line)
 {
-	while (ASTIL_ReadLine(fp, line) > 0) {
+	while (ASTIL_ReadLine(reader, line) > 0) {
 		if (line[0] == '(' && line[1] == '#')
 			return true;
 	}
@@ -185,7 +361,7 @@ static void ASTILCover_SetText(char *result, const char *src)
 		strcpy(result, src);
 }
 
-static void ASTILCover_Load(ASTILCover *self, FILE *fp, char *line)
+static void ASTILCover_Load(ASTILCover *self, ASTILReader *reader, char *line)
 {
 	self->startSeconds = -1;
 	self->endSeconds = -1;
@@ -210,13 +386,13 @@ static void ASTILCover_Load(ASTILCover *self, FILE *fp, char *line)
 	ASTILCover_SetText(self->titleAndSource, line + 9);
 	self->artist[0] = '\0';
 	self->comment[0] = '\0';
-	if (ASTIL_ReadLine(fp, line) >= 9 && memcmp(line, " ARTIST: ", 9) == 0) {
+	if (ASTIL_ReadLine(reader, line) >= 9 && memcmp(line, " ARTIST: ", 9) == 0) {
 		ASTILCover_SetText(self->artist, line + 9);
-		ASTIL_ReadComment(fp, line, self->comment);
+		ASTIL_ReadComment(reader, line, self->comment);
 	}
 }
 
-static void ASTIL_ReadStilBlock(ASTIL *self, FILE *fp, char *line)
+static void ASTIL_ReadStilBlock(ASTIL *self, ASTILReader *reader, char *line)
 {
 	for (;;) {
 		if (memcmp(line, "   NAME: ", 9) == 0)
@@ -225,18 +401,17 @@ static void ASTIL_ReadStilBlock(ASTIL *self, FILE *fp, char *line)
 			strcpy(self->author, line + 9);
 		else
 			break;
-		if (ASTIL_ReadLine(fp, line) < 9)
+		if (ASTIL_ReadLine(reader, line) < 9)
 			return;
 	}
 	while (self->nCovers < ASTIL_MAX_COVERS && memcmp(line, "  TITLE: ", 9) == 0) {
 		ASTILCover *cover = self->covers + self->nCovers++;
-		ASTILCover_Load(cover, fp, line);
+		ASTILCover_Load(cover, reader, line);
 	}
 }
 
-bool ASTIL_Load(ASTIL *self, const char *filename, int song)
+static void ASTIL_Clear(ASTIL *self)
 {
-	int lastSlash = ASTIL_FindPreviousSlash(filename, (int) strlen(filename));
 	self->nCovers = 0;
 	self->stilFilename[0] = '\0';
 	self->title[0] = '\0';
@@ -244,53 +419,89 @@ bool ASTIL_Load(ASTIL *self, const char *filename, int song)
 	self->directoryComment[0] = '\0';
 	self->fileComment[0] = '\0';
 	self->songComment[0] = '\0';
+}
+
+static void ASTIL_ReadSong(ASTIL *self, int fileOffset, int song)
+{
+	ASTILReader reader = { database.text + fileOffset, database.text + database.textLen };
+	char line[ASTIL_MAX_TEXT_LENGTH + 1];
+	ASTIL_ReadLine(&reader, line); /* the filename */
+	ASTIL_ReadComment(&reader, line, self->fileComment);
+	if (line[0] == '(' && line[1] == '#') {
+		do {
+			int i = 2;
+			if (ASTIL_ParseInt(line, &i) - 1 == song && line[i] == ')' && line[i + 1] == '\0') {
+				ASTIL_ReadComment(&reader, line, self->songComment);
+				ASTIL_ReadStilBlock(self, &reader, line);
+				break;
+			}
+		} while (ASTIL_ReadUntilSongNo(&reader, line));
+	}
+	else
+		ASTIL_ReadStilBlock(self, &reader, line);
+}
+
+/* Loads songs firstSong to firstSong+count-1 into stils, looking up STIL.txt once. */
+static bool ASTIL_LoadRange(ASTIL * const *stils, const char *filename, int firstSong, int count)
+{
+	ASTIL *self = stils[0];
+	for (int i = 0; i < count; i++)
+		ASTIL_Clear(stils[i]);
+	int lastSlash = ASTIL_FindPreviousSlash(filename, (int) strlen(filename));
 	if (lastSlash < 0 || lastSlash >= FILENAME_MAX - 14) /* strlen("/Docs/STIL.txt") */
 		return false;
 	memcpy(self->stilFilename, filename, lastSlash + 1);
+	ASTIL_Lock();
 	int rootSlash;
-	FILE *fp;
 	for (rootSlash = lastSlash; ; rootSlash = ASTIL_FindPreviousSlash(filename, rootSlash)) {
 		if (rootSlash < 0) {
+			ASTIL_Unlock();
 			self->stilFilename[0] = '\0';
 			return false;
 		}
 		strcpy(self->stilFilename + rootSlash + 1, "Docs/STIL.txt");
 		self->stilFilename[rootSlash + 5] = self->stilFilename[rootSlash]; /* copy dir separator - slash or backslash */
-		fp = fopen(self->stilFilename, "rb");
-		if (fp != NULL)
+		if (ASTILDatabase_Open(&database, self->stilFilename))
 			break;
 		strcpy(self->stilFilename + rootSlash + 1, "STIL.txt");
-		fp = fopen(self->stilFilename, "rb");
-		if (fp != NULL)
+		if (ASTILDatabase_Open(&database, self->stilFilename))
 			break;
 	}
-	self->isUTF8 = ASTIL_ReadUTF8BOM(fp);
-	char line[ASTIL_MAX_TEXT_LENGTH + 1];
-	while (ASTIL_ReadLine(fp, line) >= 0) {
-		int len = ASTIL_MatchFilename(line, filename + rootSlash);
-		if (len == -1) {
-			ASTIL_ReadComment(fp, line, self->fileComment);
-			if (line[0] == '(' && line[1] == '#') {
-				do {
-					int i = 2;
-					if (ASTIL_ParseInt(line, &i) - 1 == song && line[i] == ')' && line[i + 1] == '\0') {
-						ASTIL_ReadComment(fp, line, self->songComment);
-						ASTIL_ReadStilBlock(self, fp, line);
-						break;
-					}
-				} while (ASTIL_ReadUntilSongNo(fp, line));
-			}
-			else
-				ASTIL_ReadStilBlock(self, fp, line);
-			break;
+	self->isUTF8 = database.textStart > 0;
+	const char *path = filename + rootSlash;
+	int fileOffset = ASTILDatabase_Find(&database, path, (int) strlen(path));
+	/* the directory comment precedes the files */
+	int directoryOffset = ASTILDatabase_Find(&database, path, lastSlash - rootSlash + 1);
+	if (directoryOffset >= 0 && (fileOffset < 0 || directoryOffset < fileOffset)) {
+		ASTILReader reader = { database.text + directoryOffset, database.text + database.textLen };
+		char line[ASTIL_MAX_TEXT_LENGTH + 1];
+		ASTIL_ReadLine(&reader, line);
+		ASTIL_ReadComment(&reader, line, self->directoryComment);
+	}
+	for (int i = 0; i < count; i++) {
+		ASTIL *stil = stils[i];
+		if (i > 0) {
+			strcpy(stil->stilFilename, self->stilFilename);
+			stil->isUTF8 = self->isUTF8;
+			strcpy(stil->directoryComment, self->directoryComment);
 		}
-		if (len == lastSlash - rootSlash + 1 && line[len] == '\0')
-			ASTIL_ReadComment(fp, line, self->directoryComment);
+		if (fileOffset >= 0)
+			ASTIL_ReadSong(stil, fileOffset, firstSong + i);
 	}
-	fclose(fp);
+	ASTIL_Unlock();
 	return true;
 }
 
+bool ASTIL_Load(ASTIL *self, const char *filename, int song)
+{
+	return ASTIL_LoadRange(&self, filename, song, 1);
+}
+
+bool ASTIL_LoadSongs(ASTIL * const *stils, int songs, const char *filename)
+{
+	return songs > 0 && ASTIL_LoadRange(stils, filename, 0, songs);
+}
+
 const char *ASTIL_GetStilFilename(const ASTIL *self)
 {
 	return self->stilFilename;
@@ -36,6 +36,9 @@ typedef struct ASTILCover ASTILCover;
 ASTIL *ASTIL_New(void);
 void ASTIL_Delete(ASTIL *self);
 bool ASTIL_Load(ASTIL *self, const char *filename, int song);
+/* Loads songs 0 to songs-1 of the file into stils[0] to stils[songs-1],
+   looking up the file in STIL.txt once. */
+bool ASTIL_LoadSongs(ASTIL * const *stils, int songs, const char *filename);
 const char *ASTIL_GetStilFilename(const ASTIL *self);
 /* If true, the following strings are expected to be UTF-8 encoded,
    otherwise it's an old STIL.txt, ASCII or Windows-1250 maybe? */
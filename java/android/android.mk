@@ -116,6 +116,6 @@ android-push-asapconv: java/android/asapconv
 	$(ADB) -d push java/android/asapconv /data/local/tmp/
 .PHONY: android-push-asapconv
 
-java/android/asapconv: $(call src,asapconv.c asap.[ch])
+java/android/asapconv: $(call src,asapconv.c asap-flac.[ch] asap-parallel.[ch] asap.[ch])
 	$(ANDROID_CC)
 CLEAN += java/android/asapconv
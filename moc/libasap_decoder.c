@@ -29,29 +29,50 @@
 #include "files.h"
 
 #include "asap.h"
+#include "asap-durationthread.h"
+#include "asap-metacache.h"
+#include "asap-pcmcache.h"
 
 #define BITS_PER_SAMPLE      16
 #define DEFAULT_SONG_LENGTH  -1
+#define SAMPLE_FORMAT        (BITS_PER_SAMPLE == 8 ? ASAPSampleFormat_U8 : ASAPSampleFormat_S16_L_E)
 
 typedef struct {
 	ASAP *asap;
+	ASAPPcmCache *pcm_cache;
+	unsigned char *module;
+	ssize_t module_len;
 	int duration;
+	ASAPDurationThread *detect; /* detecting the duration while playing */
 	struct decoder_error error;
 } ASAP_Decoder;
 
+static unsigned char *asap_read_file(const char *filename, ssize_t *module_len)
+{
+	struct io_stream *s = io_open(filename, 0);
+	if (s == NULL)
+		return NULL;
+	*module_len = io_file_size(s);
+	unsigned char *module = (unsigned char *) xmalloc(*module_len);
+	*module_len = io_read(s, module, *module_len);
+	io_close(s);
+	return module;
+}
+
 static bool asap_load(ASAP_Decoder *d, const char *filename)
 {
 	d->asap = NULL;
+	d->pcm_cache = NULL;
+	d->detect = NULL;
 	decoder_error_init(&d->error);
-	struct io_stream *s = io_open(filename, 0);
-	if (s == NULL) {
+	ssize_t module_len;
+	unsigned char *module = asap_read_file(filename, &module_len);
+	d->module = module;
+	d->module_len = module_len;
+	if (module == NULL) {
 		decoder_error(&d->error, ERROR_FATAL, 0, "Can't open %s", filename);
 		return false;
 	}
-	ssize_t module_len = io_file_size(s);
-	unsigned char *module = (unsigned char *) xmalloc(module_len);
-	module_len = io_read(s, module, module_len);
-	io_close(s);
 
 	d->asap = ASAP_New();
 	if (d->asap == NULL) {
@@ -59,15 +80,20 @@ static bool asap_load(ASAP_Decoder *d, const char *filename)
 		return false;
 	}
 
-	bool ok = ASAP_Load(d->asap, filename, module, module_len);
-	free(module);
-	if (!ok) {
+	if (!ASAP_Load(d->asap, filename, module, module_len)) {
 		decoder_error(&d->error, ERROR_FATAL, 0, "Unsupported file format");
 		return false;
 	}
 	const ASAPInfo *info = ASAP_GetInfo(d->asap);
 	int song = ASAPInfo_GetDefaultSong(info);
 	int duration = ASAPInfo_GetDuration(info, song);
+	if (duration < 0) {
+		ASAPMetadata metadata;
+		if (ASAPMetaCache_GetModule(module, module_len, &metadata) && metadata.durations[song] >= 0)
+			duration = metadata.durations[song];
+		else
+			d->detect = ASAPDurationThread_Start(filename, true, module, module_len, song, 15 * 60, 5);
+	}
 	if (duration < 0)
 		duration = DEFAULT_SONG_LENGTH * 1000;
 	d->duration = duration;
@@ -77,52 +103,103 @@ static bool asap_load(ASAP_Decoder *d, const char *filename)
 static void asap_close(void *data)
 {
 	ASAP_Decoder *d = (ASAP_Decoder *) data;
+	ASAPDurationThread_Delete(d->detect);
+	ASAPPcmCache_Delete(d->pcm_cache);
 	ASAP_Delete(d->asap);
+	free(d->module);
 	free(d);
 }
 
 static void *asap_open(const char *uri)
 {
 	ASAP_Decoder *d = (ASAP_Decoder *) xmalloc(sizeof(ASAP_Decoder));
-	if (!asap_load(d, uri) || !ASAP_PlaySong(d->asap, ASAPInfo_GetDefaultSong(ASAP_GetInfo(d->asap)), d->duration)) {
+	if (!asap_load(d, uri)) {
+		asap_close(d);
+		return NULL;
+	}
+	/* the rendered audio is cached if $ASAP_PCM_CACHE is set */
+	d->pcm_cache = ASAPPcmCache_PlaySong(d->asap, d->module, d->module_len, ASAPInfo_GetDefaultSong(ASAP_GetInfo(d->asap)), d->duration, 0, SAMPLE_FORMAT);
+	if (d->pcm_cache == NULL) {
 		asap_close(d);
 		return NULL;
 	}
 	return d;
 }
 
+/* Returns the duration found in the background or -1. */
+static int asap_get_detected_duration(const ASAP_Decoder *d)
+{
+	int duration;
+	if (d->detect == NULL || !ASAPDurationThread_GetDuration(d->detect, &duration))
+		return -1;
+	return duration;
+}
+
 static int asap_decode(void *data, char *buf, int buf_len, struct sound_params *sound_params)
 {
 	ASAP_Decoder *d = (ASAP_Decoder *) data;
-	sound_params->channels = ASAPInfo_GetChannels(ASAP_GetInfo(d->asap));
+	int channels = ASAPInfo_GetChannels(ASAP_GetInfo(d->asap));
+	sound_params->channels = channels;
 	sound_params->rate = ASAP_SAMPLE_RATE;
 	sound_params->fmt = BITS_PER_SAMPLE == 8 ? SFMT_U8 : (SFMT_S16 | SFMT_LE);
-	return ASAP_Generate(d->asap, (unsigned char *) buf, buf_len, BITS_PER_SAMPLE == 8 ? ASAPSampleFormat_U8 : ASAPSampleFormat_S16_L_E);
+	/* the song was started without a duration, end it at the detected one */
+	int duration = asap_get_detected_duration(d);
+	if (duration >= 0) {
+		int64_t blocks = (int64_t) duration * ASAP_SAMPLE_RATE / 1000 - ASAP_GetBlocksPlayed(d->asap);
+		if (blocks <= 0)
+			return 0;
+		if (buf_len > blocks * channels * (BITS_PER_SAMPLE / 8))
+			buf_len = (int) blocks * channels * (BITS_PER_SAMPLE / 8);
+	}
+	return ASAPPcmCache_Generate(d->pcm_cache, (unsigned char *) buf, buf_len);
 }
 
 static int asap_seek(void *data, int sec)
 {
 	ASAP_Decoder *d = (ASAP_Decoder *) data;
-	ASAP_Seek(d->asap, sec * 1000);
+	ASAPPcmCache_Seek(d->pcm_cache, sec * 1000);
 	return sec;
 }
 
+static bool asap_get_metadata(const char *file, ASAPMetadata *metadata)
+{
+	if (ASAPMetaCache_GetFile(file, metadata))
+		return true;
+	/* Only parse the module: no emulator for playlist loads. */
+	ssize_t module_len;
+	unsigned char *module = asap_read_file(file, &module_len);
+	if (module == NULL)
+		return false;
+	ASAPInfo *info = ASAPInfo_New();
+	bool ok = info != NULL && ASAPInfo_LoadMetadata(info, file, module, module_len);
+	if (ok) {
+		/* tags only show the default song */
+		ASAPInfo_AnalyzeSong(info, module, ASAPInfo_GetDefaultSong(info));
+		ASAPMetaCache_Put(file, module, module_len, info);
+		/* durations detected during playback are in the cache */
+		if (!ASAPMetaCache_GetModule(module, module_len, metadata))
+			ASAPMetadata_SetInfo(metadata, info);
+	}
+	ASAPInfo_Delete(info);
+	free(module);
+	return ok;
+}
+
 static void asap_info(const char *file, struct file_tags *tags, const int tags_sel)
 {
-	ASAP_Decoder d;
-	if (asap_load(&d, file)) {
-		if ((tags_sel & TAGS_COMMENTS) != 0) {
-			const ASAPInfo *info = ASAP_GetInfo(d.asap);
-			tags->title = xstrdup(ASAPInfo_GetTitleOrFilename(info));
-			tags->artist = xstrdup(ASAPInfo_GetAuthor(info));
-			tags->filled |= TAGS_COMMENTS;
-		}
-		if ((tags_sel & TAGS_TIME) != 0) {
-			tags->time = d.duration / 1000;
-			tags->filled |= TAGS_TIME;
-		}
+	ASAPMetadata metadata;
+	if (!asap_get_metadata(file, &metadata))
+		return;
+	if ((tags_sel & TAGS_COMMENTS) != 0) {
+		tags->title = xstrdup(metadata.title[0] != '\0' ? metadata.title : file);
+		tags->artist = xstrdup(metadata.author);
+		tags->filled |= TAGS_COMMENTS;
+	}
+	if ((tags_sel & TAGS_TIME) != 0) {
+		int duration = metadata.durations[metadata.defaultSong];
+		tags->time = duration >= 0 ? duration / 1000 : DEFAULT_SONG_LENGTH;
+		tags->filled |= TAGS_TIME;
 	}
-	ASAP_Delete(d.asap);
 }
 
 static int asap_get_bitrate(void *data)
@@ -133,7 +210,8 @@ static int asap_get_bitrate(void *data)
 static int asap_get_duration(void *data)
 {
 	const ASAP_Decoder *d = (const ASAP_Decoder *) data;
-	return d->duration / 1000;
+	int duration = asap_get_detected_duration(d);
+	return (duration >= 0 ? duration : d->duration) / 1000;
 }
 
 static void asap_get_error(void *data, struct decoder_error *error)
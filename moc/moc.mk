@@ -10,8 +10,8 @@ endif
 asap-moc: libasap_decoder.so
 .PHONY: asap-moc
 
-libasap_decoder.so: $(call src,moc/libasap_decoder.c asap.[ch])
-	$(DO_CC) -I$(MOC_INCLUDE)
+libasap_decoder.so: $(call src,moc/libasap_decoder.c asap.[ch] asap-durationthread.[ch] asap-metacache.[ch] asap-pcmcache.[ch])
+	$(DO_CC) -I$(MOC_INCLUDE) -pthread
 CLEAN += libasap_decoder.so
 
 install-moc: libasap_decoder.so
@@ -17,7 +17,10 @@ kernel void asap2wav(constant char *filenames, global const uchar *modules, glob
 	if (ASAP_Load(&asap, filenames + workload->filename_offset, modules + workload->module_offset, workload->module_len)
 	 && ASAP_PlaySong(&asap, max(workload->song, 0), workload->duration)) {
 		int header_len = ASAP_GetWavHeader(&asap, wav, ASAPSampleFormat_S16_L_E, false);
-		ASAP_Generate(&asap, wav + header_len, workload->wav_len - header_len, ASAPSampleFormat_S16_L_E);
+		int wav_len = header_len + ASAP_Generate(&asap, wav + header_len, workload->wav_len - header_len, ASAPSampleFormat_S16_L_E);
+		/* the song may end before the length in the WAV header */
+		for (; wav_len < workload->wav_len; wav_len++)
+			wav[wav_len] = 0;
 	}
 	else
 		wav[0] = '\0';
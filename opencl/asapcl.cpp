@@ -21,17 +21,24 @@
  * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <thread>
 #include <vector>
 
+#ifndef ASAPCL_NO_OPENCL
 #define CL_TARGET_OPENCL_VERSION 200
 #include <CL/cl.h>
+#endif
 
 #include "asap.h"
 
+#ifndef ASAPCL_NO_OPENCL
 void check_error(int err)
 {
 	if (err != CL_SUCCESS) {
@@ -39,38 +46,43 @@ void check_error(int err)
 		exit(1);
 	}
 }
+#endif
 
+// Same layout as in asap2wav-kernel.cl.
 struct ASAP_Workload
 {
-	cl_long wav_offset;
-	cl_int wav_len;
-	cl_int filename_offset;
-	cl_int module_offset;
-	cl_int module_len;
-	cl_int song;
-	cl_int duration;
+	int64_t wav_offset;
+	int32_t wav_len;
+	int32_t filename_offset;
+	int32_t module_offset;
+	int32_t module_len;
+	int32_t song;
+	int32_t duration;
 	ASAP_Workload() = default;
-	ASAP_Workload(cl_long wav_offset, cl_int wav_len, cl_int filename_offset, cl_int module_offset, cl_int module_len, cl_int song, cl_int duration)
+	ASAP_Workload(int64_t wav_offset, int32_t wav_len, int32_t filename_offset, int32_t module_offset, int32_t module_len, int32_t song, int32_t duration)
 		: wav_offset(wav_offset), wav_len(wav_len), filename_offset(filename_offset), module_offset(module_offset), module_len(module_len), song(song), duration(duration) {
 	}
 };
 
-int main(int argc, char **argv)
+#ifndef ASAPCL_NO_OPENCL
+static bool run_opencl(const std::vector<char> &filenames, const std::vector<uint8_t> &modules, const std::vector<ASAP_Workload> &workloads, uint8_t *wavs, size_t wavs_len)
 {
 	cl_platform_id platform;
 	cl_uint num;
-	check_error(clGetPlatformIDs(1, &platform, &num));
-	if (num == 0) {
+	cl_int err = clGetPlatformIDs(1, &platform, &num);
+	if (err == -1001 /* CL_PLATFORM_NOT_FOUND_KHR */ || (err == CL_SUCCESS && num == 0)) {
 		fprintf(stderr, "No OpenCL platforms\n");
-		return 1;
+		return false;
 	}
+	check_error(err);
 
 	cl_device_id device;
-	check_error(clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &device, &num));
-	if (num == 0) {
+	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &device, &num);
+	if (err == CL_DEVICE_NOT_FOUND || (err == CL_SUCCESS && num == 0)) {
 		fprintf(stderr, "No OpenCL device\n");
-		return 1;
+		return false;
 	}
+	check_error(err);
 
 	size_t size;
 	check_error(clGetDeviceInfo(device, CL_DEVICE_NAME, 0, nullptr, &size));
@@ -81,7 +93,6 @@ int main(int argc, char **argv)
 	const cl_context_properties properties[] = {
 		CL_CONTEXT_PLATFORM, (cl_context_properties) platform, 0
 	};
-	cl_int err;
 	cl_context context = clCreateContext(properties, 1, &device, nullptr, nullptr, &err);
 	check_error(err);
 
@@ -97,10 +108,114 @@ int main(int argc, char **argv)
 		std::unique_ptr<char[]> log(new char[size]);
 		check_error(clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, log.get(), nullptr));
 		fprintf(stderr, "OpenCL build error:\n%s", log.get());
-		return 1;
+		exit(1);
 	}
 	check_error(err);
 
+	cl_kernel kernel = clCreateKernel(program, "asap2wav", &err);
+	check_error(err);
+
+	cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, nullptr, &err);
+	check_error(err);
+
+	cl_mem filenames_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_HOST_NO_ACCESS, filenames.size(), const_cast<char *>(filenames.data()), &err);
+	check_error(err);
+	check_error(clSetKernelArg(kernel, 0, sizeof(filenames_buffer), &filenames_buffer));
+
+	cl_mem modules_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_HOST_NO_ACCESS, modules.size(), const_cast<uint8_t *>(modules.data()), &err);
+	check_error(err);
+	check_error(clSetKernelArg(kernel, 1, sizeof(modules_buffer), &modules_buffer));
+
+	cl_mem wavs_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, wavs_len, nullptr, &err);
+	check_error(err);
+	check_error(clSetKernelArg(kernel, 2, sizeof(wavs_buffer), &wavs_buffer));
+
+	cl_mem workloads_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_HOST_NO_ACCESS, workloads.size() * sizeof(ASAP_Workload), const_cast<ASAP_Workload *>(workloads.data()), &err);
+	check_error(err);
+	check_error(clSetKernelArg(kernel, 3, sizeof(workloads_buffer), &workloads_buffer));
+
+	const size_t dim = workloads.size();
+	check_error(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &dim, nullptr, 0, nullptr, nullptr));
+
+	check_error(clEnqueueReadBuffer(queue, wavs_buffer, false, 0, wavs_len, wavs, 0, nullptr, nullptr));
+
+	check_error(clFinish(queue));
+	check_error(clReleaseMemObject(workloads_buffer));
+	check_error(clReleaseMemObject(wavs_buffer));
+	check_error(clReleaseMemObject(modules_buffer));
+	check_error(clReleaseMemObject(filenames_buffer));
+	check_error(clReleaseCommandQueue(queue));
+	check_error(clReleaseKernel(kernel));
+	check_error(clReleaseProgram(program));
+	check_error(clReleaseContext(context));
+	return true;
+}
+#endif
+
+// Same work as the asap2wav kernel, for one workload.
+static void render_cpu(ASAP *asap, const char *filename, const uint8_t *module, const ASAP_Workload &workload, uint8_t *wav)
+{
+	if (ASAP_Load(asap, filename, module, workload.module_len)
+	 && ASAP_PlaySong(asap, std::max(workload.song, 0), workload.duration)) {
+		int header_len = ASAP_GetWavHeader(asap, wav, ASAPSampleFormat_S16_L_E, false);
+		int wav_len = header_len + ASAP_Generate(asap, wav + header_len, workload.wav_len - header_len, ASAPSampleFormat_S16_L_E);
+		// the song may end before the length in the WAV header
+		memset(wav + wav_len, 0, workload.wav_len - wav_len);
+	}
+	else
+		wav[0] = '\0';
+}
+
+// Runs the workloads on a pool of CPU threads.
+static void run_cpu(const std::vector<char> &filenames, const std::vector<uint8_t> &modules, const std::vector<ASAP_Workload> &workloads, uint8_t *wavs, int threads)
+{
+	// Start the longest songs first, so that the threads finish at about the same time.
+	std::vector<const ASAP_Workload *> order(workloads.size());
+	for (size_t i = 0; i < workloads.size(); i++)
+		order[i] = &workloads[i];
+	std::sort(order.begin(), order.end(), [](const ASAP_Workload *a, const ASAP_Workload *b) { return a->wav_len > b->wav_len; });
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		ASAP *asap = ASAP_New();
+		for (size_t i; (i = next++) < order.size(); ) {
+			const ASAP_Workload &workload = *order[i];
+			uint8_t *wav = wavs + workload.wav_offset;
+			if (asap == nullptr)
+				wav[0] = '\0';
+			else
+				render_cpu(asap, filenames.data() + workload.filename_offset, modules.data() + workload.module_offset, workload, wav);
+		}
+		ASAP_Delete(asap);
+	};
+	std::vector<std::thread> pool;
+	for (int i = 1; i < threads; i++)
+		pool.emplace_back(worker);
+	worker();
+	for (std::thread &thread : pool)
+		thread.join();
+}
+
+int main(int argc, char **argv)
+{
+	bool cpu = false;
+	int threads = std::thread::hardware_concurrency();
+	int argi = 1;
+	for (; argi < argc && argv[argi][0] == '-'; argi++) {
+		if (strcmp(argv[argi], "--cpu") == 0)
+			cpu = true;
+		else if (strncmp(argv[argi], "--threads=", 10) == 0) {
+			cpu = true;
+			threads = atoi(argv[argi] + 10);
+		}
+		else {
+			fprintf(stderr, "Usage: asapcl [--cpu] [--threads=N] INPUTFILE...\n");
+			return 1;
+		}
+	}
+	if (threads <= 0)
+		threads = 1;
+
 	int exit_code = 0;
 
 	fprintf(stderr, "Loading files\n");
@@ -110,7 +225,7 @@ int main(int argc, char **argv)
 	size_t wavs_len = 0;
 
 	ASAPInfo *info = ASAPInfo_New();
-	for (int argi = 1; argi < argc; argi++) {
+	for (; argi < argc; argi++) {
 		const char *input_file = argv[argi];
 		FILE *fp = fopen(input_file, "rb");
 		if (fp == NULL) {
@@ -144,43 +259,16 @@ int main(int argc, char **argv)
 	ASAPInfo_Delete(info);
 	fprintf(stderr, "Emulating %zu songs\n", workloads.size());
 
-	cl_kernel kernel = clCreateKernel(program, "asap2wav", &err);
-	check_error(err);
-
-	cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, nullptr, &err);
-	check_error(err);
-
-	cl_mem filenames_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_HOST_NO_ACCESS, filenames.size(), filenames.data(), &err);
-	check_error(err);
-	check_error(clSetKernelArg(kernel, 0, sizeof(filenames_buffer), &filenames_buffer));
-
-	cl_mem modules_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_HOST_NO_ACCESS, modules.size(), modules.data(), &err);
-	check_error(err);
-	check_error(clSetKernelArg(kernel, 1, sizeof(modules_buffer), &modules_buffer));
-
-	cl_mem wavs_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, wavs_len, nullptr, &err);
-	check_error(err);
-	check_error(clSetKernelArg(kernel, 2, sizeof(wavs_buffer), &wavs_buffer));
-
-	cl_mem workloads_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_HOST_NO_ACCESS, workloads.size() * sizeof(ASAP_Workload), workloads.data(), &err);
-	check_error(err);
-	check_error(clSetKernelArg(kernel, 3, sizeof(workloads_buffer), &workloads_buffer));
-
-	const size_t dim = workloads.size();
-	check_error(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &dim, nullptr, 0, nullptr, nullptr));
-
 	std::unique_ptr<uint8_t[]> wavs(new uint8_t[wavs_len]);
-	check_error(clEnqueueReadBuffer(queue, wavs_buffer, false, 0, wavs_len, wavs.get(), 0, nullptr, nullptr));
-
-	check_error(clFinish(queue));
-	check_error(clReleaseMemObject(workloads_buffer));
-	check_error(clReleaseMemObject(wavs_buffer));
-	check_error(clReleaseMemObject(modules_buffer));
-	check_error(clReleaseMemObject(filenames_buffer));
-	check_error(clReleaseCommandQueue(queue));
-	check_error(clReleaseKernel(kernel));
-	check_error(clReleaseProgram(program));
-	check_error(clReleaseContext(context));
+#ifdef ASAPCL_NO_OPENCL
+	(void) cpu; // no other choice
+	{
+#else
+	if (cpu || !run_opencl(filenames, modules, workloads, wavs.get(), wavs_len)) {
+#endif
+		fprintf(stderr, "Running on %d CPU threads\n", threads);
+		run_cpu(filenames, modules, workloads, wavs.get(), threads);
+	}
 
 	for (const ASAP_Workload &workload : workloads) {
 		const char *input_file = filenames.data() + workload.filename_offset;
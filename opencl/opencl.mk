@@ -10,8 +10,15 @@ endif
 opencl: opencl/asapcl
 .PHONY: opencl
 
+opencl-cpu: opencl/asapcl-cpu
+.PHONY: opencl-cpu
+
 opencl/asapcl: opencl/asapcl.cpp opencl/asap-cl.h asap.o asap.h
-	$(DO)$(CXX) $(CXXFLAGS) -o $@ $(INCLUDEOPTS) $< asap.o -lOpenCL
+	$(DO)$(CXX) $(CXXFLAGS) -o $@ $(INCLUDEOPTS) $< asap.o -lOpenCL -pthread
+
+opencl/asapcl-cpu: opencl/asapcl.cpp asap.o asap.h
+	$(DO)$(CXX) $(CXXFLAGS) -DASAPCL_NO_OPENCL -o $@ $(INCLUDEOPTS) $< asap.o -pthread
+CLEAN += opencl/asapcl-cpu
 
 opencl/asap-cl.h: opencl/asap.cl opencl/asap2wav-kernel.cl
 	$(DO)(echo 'R"CLC(' && cat $^ && echo ')CLC"') >$@
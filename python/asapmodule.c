@@ -0,0 +1,802 @@
+/*
+ * asapmodule.c - native CPython extension
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Drop-in replacement for the transpiled asap.py, with the same classes
+   and methods. Outputs go into any writable buffer, such as a bytearray,
+   a memoryview or a NumPy array. Emulation releases the GIL, so separate
+   ASAP objects can run in parallel threads. */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "asap.h"
+
+typedef struct
+{
+	PyObject_HEAD
+	ASAP *asap;
+	PyObject *info; /* ASAPInfoObject, created on first get_info */
+	int moduleLen; /* of the last successful load, bounds analyze_song */
+	bool busy; /* running without the GIL */
+} ASAPObject;
+
+typedef struct
+{
+	PyObject_HEAD
+	ASAPInfo *info;
+	ASAPObject *owner; /* NULL if info is owned by this object */
+	int moduleLen; /* of the last successful load if not owned */
+} ASAPInfoObject;
+
+static PyTypeObject ASAPType;
+static PyTypeObject ASAPInfoType;
+static PyObject *ASAPFormatException;
+static PyObject *ASAPArgumentException;
+static PyObject *ASAPSampleFormatType;
+
+static bool ASAPObject_CheckIdle(const ASAPObject *self)
+{
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "ASAP object used by another thread");
+		return false;
+	}
+	return true;
+}
+
+static bool ASAPObject_CheckSong(int song)
+{
+	if (song < 0 || song >= ASAPInfo_MAX_SONGS) {
+		PyErr_SetString(ASAPArgumentException, "Song out of range");
+		return false;
+	}
+	return true;
+}
+
+static bool ASAPObject_CheckFormat(int format)
+{
+	if (format < ASAPSampleFormat_U8 || format > ASAPSampleFormat_S16_B_E) {
+		PyErr_SetString(ASAPArgumentException, "Invalid sample format");
+		return false;
+	}
+	return true;
+}
+
+/* Gets a writable buffer of at least length bytes. */
+static bool ASAPObject_GetOutputBuffer(PyObject *object, Py_buffer *view, Py_ssize_t length)
+{
+	if (PyObject_GetBuffer(object, view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) != 0)
+		return false;
+	if (length < 0 || length > view->len) {
+		PyBuffer_Release(view);
+		PyErr_SetString(PyExc_ValueError, "Buffer too small");
+		return false;
+	}
+	return true;
+}
+
+static bool ASAPObject_GetModuleBuffer(PyObject *object, Py_buffer *view, Py_ssize_t moduleLen)
+{
+	if (PyObject_GetBuffer(object, view, PyBUF_C_CONTIGUOUS) != 0)
+		return false;
+	if (moduleLen < 0 || moduleLen > view->len || moduleLen > ASAPInfo_MAX_MODULE_LENGTH) {
+		PyBuffer_Release(view);
+		PyErr_SetString(ASAPFormatException, "Invalid module length");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *ASAPObject_RaiseFormat(const char *message)
+{
+	PyErr_SetString(ASAPFormatException, message);
+	return NULL;
+}
+
+static PyObject *ASAPObject_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	if (!PyArg_ParseTuple(args, ":ASAP"))
+		return NULL;
+	ASAPObject *self = (ASAPObject *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+	self->asap = ASAP_New();
+	self->info = NULL;
+	self->moduleLen = 0;
+	self->busy = false;
+	if (self->asap == NULL) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return (PyObject *) self;
+}
+
+static void ASAPObject_dealloc(ASAPObject *self)
+{
+	/* info holds a reference to us, so it is gone already */
+	ASAP_Delete(self->asap);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *ASAPObject_get_sample_rate(ASAPObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyLong_FromLong(ASAP_GetSampleRate(self->asap));
+}
+
+static PyObject *ASAPObject_set_sample_rate(ASAPObject *self, PyObject *args)
+{
+	int sampleRate;
+	if (!PyArg_ParseTuple(args, "i:set_sample_rate", &sampleRate) || !ASAPObject_CheckIdle(self))
+		return NULL;
+	ASAP_SetSampleRate(self->asap, sampleRate);
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPObject_detect_silence(ASAPObject *self, PyObject *args)
+{
+	int seconds;
+	if (!PyArg_ParseTuple(args, "i:detect_silence", &seconds) || !ASAPObject_CheckIdle(self))
+		return NULL;
+	ASAP_DetectSilence(self->asap, seconds);
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPObject_load(ASAPObject *self, PyObject *args)
+{
+	PyObject *filename;
+	PyObject *module;
+	Py_ssize_t moduleLen;
+	if (!PyArg_ParseTuple(args, "O&On:load", PyUnicode_FSConverter, &filename, &module, &moduleLen))
+		return NULL;
+	Py_buffer view;
+	bool ok = ASAPObject_CheckIdle(self) && ASAPObject_GetModuleBuffer(module, &view, moduleLen);
+	if (ok) {
+		ok = ASAP_Load(self->asap, PyBytes_AS_STRING(filename), (uint8_t const *) view.buf, (int) moduleLen);
+		PyBuffer_Release(&view);
+		self->moduleLen = ok ? (int) moduleLen : 0;
+		if (!ok)
+			ASAPObject_RaiseFormat("Unsupported file format");
+	}
+	Py_DECREF(filename);
+	if (!ok)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPObject_get_info(ASAPObject *self, PyObject *Py_UNUSED(ignored))
+{
+	if (self->info == NULL) {
+		ASAPInfoObject *info = PyObject_New(ASAPInfoObject, &ASAPInfoType);
+		if (info == NULL)
+			return NULL;
+		/* setters modify the information used by the emulator, like in asap.py */
+		info->info = (ASAPInfo *) ASAP_GetInfo(self->asap);
+		Py_INCREF(self);
+		info->owner = self;
+		info->moduleLen = 0;
+		/* don't keep a reference to avoid a cycle */
+		self->info = (PyObject *) info;
+		return (PyObject *) info;
+	}
+	Py_INCREF(self->info);
+	return self->info;
+}
+
+static PyObject *ASAPObject_mute_pokey_channels(ASAPObject *self, PyObject *args)
+{
+	int mask;
+	if (!PyArg_ParseTuple(args, "i:mute_pokey_channels", &mask) || !ASAPObject_CheckIdle(self))
+		return NULL;
+	ASAP_MutePokeyChannels(self->asap, mask);
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPObject_play_song(ASAPObject *self, PyObject *args)
+{
+	int song;
+	int duration;
+	if (!PyArg_ParseTuple(args, "ii:play_song", &song, &duration) || !ASAPObject_CheckIdle(self))
+		return NULL;
+	self->busy = true;
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = ASAP_PlaySong(self->asap, song, duration);
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	if (!ok) {
+		PyErr_SetString(ASAPArgumentException, "Song out of range");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPObject_get_blocks_played(ASAPObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyLong_FromLong(ASAP_GetBlocksPlayed(self->asap));
+}
+
+static PyObject *ASAPObject_get_position(ASAPObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyLong_FromLong(ASAP_GetPosition(self->asap));
+}
+
+static PyObject *ASAPObject_seek_sample(ASAPObject *self, PyObject *args)
+{
+	int block;
+	if (!PyArg_ParseTuple(args, "i:seek_sample", &block) || !ASAPObject_CheckIdle(self))
+		return NULL;
+	self->busy = true;
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = ASAP_SeekSample(self->asap, block);
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	if (!ok)
+		return ASAPObject_RaiseFormat("Seek failed");
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPObject_seek(ASAPObject *self, PyObject *args)
+{
+	int position;
+	if (!PyArg_ParseTuple(args, "i:seek", &position) || !ASAPObject_CheckIdle(self))
+		return NULL;
+	self->busy = true;
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = ASAP_Seek(self->asap, position);
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	if (!ok)
+		return ASAPObject_RaiseFormat("Seek failed");
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPObject_get_wav_header(ASAPObject *self, PyObject *args)
+{
+	PyObject *buffer;
+	int format;
+	int metadata;
+	if (!PyArg_ParseTuple(args, "Oip:get_wav_header", &buffer, &format, &metadata)
+	 || !ASAPObject_CheckIdle(self) || !ASAPObject_CheckFormat(format))
+		return NULL;
+	/* the longest header has all metadata and the loop */
+	uint8_t header[44 + 12 + 3 * (8 + ASAPInfo_MAX_TEXT_LENGTH + 1) + 68];
+	int length = ASAP_GetWavHeader(self->asap, header, (ASAPSampleFormat) format, metadata != 0);
+	Py_buffer view;
+	if (!ASAPObject_GetOutputBuffer(buffer, &view, length))
+		return NULL;
+	memcpy(view.buf, header, length);
+	PyBuffer_Release(&view);
+	return PyLong_FromLong(length);
+}
+
+static PyObject *ASAPObject_generate(ASAPObject *self, PyObject *args)
+{
+	PyObject *buffer;
+	int bufferLen;
+	int format;
+	if (!PyArg_ParseTuple(args, "Oii:generate", &buffer, &bufferLen, &format)
+	 || !ASAPObject_CheckIdle(self) || !ASAPObject_CheckFormat(format))
+		return NULL;
+	Py_buffer view;
+	if (!ASAPObject_GetOutputBuffer(buffer, &view, bufferLen))
+		return NULL;
+	self->busy = true;
+	int length;
+	Py_BEGIN_ALLOW_THREADS
+	length = ASAP_Generate(self->asap, (uint8_t *) view.buf, bufferLen, (ASAPSampleFormat) format);
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	PyBuffer_Release(&view);
+	return PyLong_FromLong(length);
+}
+
+static PyObject *ASAPObject_get_pokey_channel_volume(ASAPObject *self, PyObject *args)
+{
+	int channel;
+	if (!PyArg_ParseTuple(args, "i:get_pokey_channel_volume", &channel))
+		return NULL;
+	if (channel < 0 || channel > 7) {
+		PyErr_SetString(ASAPArgumentException, "Invalid channel");
+		return NULL;
+	}
+	return PyLong_FromLong(ASAP_GetPokeyChannelVolume(self->asap, channel));
+}
+
+static PyObject *ASAPObject_detect_duration(ASAPObject *self, PyObject *args)
+{
+	int song;
+	int maxSeconds;
+	int silenceSeconds;
+	if (!PyArg_ParseTuple(args, "iii:detect_duration", &song, &maxSeconds, &silenceSeconds) || !ASAPObject_CheckIdle(self))
+		return NULL;
+	self->busy = true;
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = ASAP_DetectDuration(self->asap, song, maxSeconds, silenceSeconds);
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	if (!ok) {
+		PyErr_SetString(ASAPArgumentException, "Invalid song or duration");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPObject_get_loop_start_block(ASAPObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyLong_FromLong(ASAP_GetLoopStartBlock(self->asap));
+}
+
+static PyObject *ASAPObject_get_loop_end_block(ASAPObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyLong_FromLong(ASAP_GetLoopEndBlock(self->asap));
+}
+
+static PyMethodDef ASAPObject_methods[] = {
+	{ "get_sample_rate", (PyCFunction) ASAPObject_get_sample_rate, METH_NOARGS, "Returns the output sample rate." },
+	{ "set_sample_rate", (PyCFunction) ASAPObject_set_sample_rate, METH_VARARGS, "Sets the output sample rate." },
+	{ "detect_silence", (PyCFunction) ASAPObject_detect_silence, METH_VARARGS, "Enables silence detection." },
+	{ "load", (PyCFunction) ASAPObject_load, METH_VARARGS, "Loads music data (\"module\")." },
+	{ "get_info", (PyCFunction) ASAPObject_get_info, METH_NOARGS, "Returns information about the loaded module." },
+	{ "mute_pokey_channels", (PyCFunction) ASAPObject_mute_pokey_channels, METH_VARARGS, "Mutes the selected POKEY channels." },
+	{ "play_song", (PyCFunction) ASAPObject_play_song, METH_VARARGS, "Prepares playback of the specified song of the loaded module." },
+	{ "get_blocks_played", (PyCFunction) ASAPObject_get_blocks_played, METH_NOARGS, "Returns current playback position in blocks." },
+	{ "get_position", (PyCFunction) ASAPObject_get_position, METH_NOARGS, "Returns current playback position in milliseconds." },
+	{ "seek_sample", (PyCFunction) ASAPObject_seek_sample, METH_VARARGS, "Changes the playback position." },
+	{ "seek", (PyCFunction) ASAPObject_seek, METH_VARARGS, "Changes the playback position." },
+	{ "get_wav_header", (PyCFunction) ASAPObject_get_wav_header, METH_VARARGS, "Fills leading bytes of the specified buffer with WAV file header." },
+	{ "generate", (PyCFunction) ASAPObject_generate, METH_VARARGS, "Fills the specified buffer with generated samples." },
+	{ "get_pokey_channel_volume", (PyCFunction) ASAPObject_get_pokey_channel_volume, METH_VARARGS, "Returns POKEY channel volume - an integer between 0 and 15." },
+	{ "detect_duration", (PyCFunction) ASAPObject_detect_duration, METH_VARARGS, "Detects duration of the specified song by emulation." },
+	{ "get_loop_start_block", (PyCFunction) ASAPObject_get_loop_start_block, METH_NOARGS, "Returns the block where the detected loop of the current song starts." },
+	{ "get_loop_end_block", (PyCFunction) ASAPObject_get_loop_end_block, METH_NOARGS, "Returns the block where the detected loop of the current song ends." },
+	{ NULL }
+};
+
+static PyTypeObject ASAPType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "asap.ASAP",
+	.tp_doc = "Main API of the Another Slight Atari Player.",
+	.tp_basicsize = sizeof(ASAPObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = ASAPObject_new,
+	.tp_dealloc = (destructor) ASAPObject_dealloc,
+	.tp_methods = ASAPObject_methods
+};
+
+static PyObject *ASAPInfoObject_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	if (!PyArg_ParseTuple(args, ":ASAPInfo"))
+		return NULL;
+	ASAPInfoObject *self = (ASAPInfoObject *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+	self->info = ASAPInfo_New();
+	self->owner = NULL;
+	self->moduleLen = 0;
+	if (self->info == NULL) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return (PyObject *) self;
+}
+
+static void ASAPInfoObject_dealloc(ASAPInfoObject *self)
+{
+	if (self->owner != NULL) {
+		self->owner->info = NULL;
+		Py_DECREF(self->owner);
+	}
+	else
+		ASAPInfo_Delete(self->info);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static bool ASAPInfoObject_CheckIdle(const ASAPInfoObject *self)
+{
+	return self->owner == NULL || ASAPObject_CheckIdle(self->owner);
+}
+
+static PyObject *ASAPInfoObject_GetString(const char *s)
+{
+	if (s == NULL)
+		Py_RETURN_NONE;
+	return PyUnicode_DecodeLatin1(s, strlen(s), NULL);
+}
+
+static PyObject *ASAPInfoObject_DoLoad(ASAPInfoObject *self, PyObject *args, const char *format, bool (*load)(ASAPInfo *, const char *, uint8_t const *, int))
+{
+	PyObject *filename;
+	PyObject *module;
+	Py_ssize_t moduleLen;
+	if (!PyArg_ParseTuple(args, format, PyUnicode_FSConverter, &filename, &module, &moduleLen))
+		return NULL;
+	Py_buffer view;
+	bool ok = ASAPInfoObject_CheckIdle(self) && ASAPObject_GetModuleBuffer(module, &view, moduleLen);
+	if (ok) {
+		ok = load(self->info, PyBytes_AS_STRING(filename), (uint8_t const *) view.buf, (int) moduleLen);
+		PyBuffer_Release(&view);
+		self->moduleLen = ok ? (int) moduleLen : 0;
+		if (!ok)
+			ASAPObject_RaiseFormat("Unsupported file format");
+	}
+	Py_DECREF(filename);
+	if (!ok)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPInfoObject_load(ASAPInfoObject *self, PyObject *args)
+{
+	return ASAPInfoObject_DoLoad(self, args, "O&On:load", ASAPInfo_Load);
+}
+
+static PyObject *ASAPInfoObject_load_metadata(ASAPInfoObject *self, PyObject *args)
+{
+	return ASAPInfoObject_DoLoad(self, args, "O&On:load_metadata", ASAPInfo_LoadMetadata);
+}
+
+static PyObject *ASAPInfoObject_analyze_song(ASAPInfoObject *self, PyObject *args)
+{
+	PyObject *module;
+	int song;
+	if (!PyArg_ParseTuple(args, "Oi:analyze_song", &module, &song) || !ASAPInfoObject_CheckIdle(self))
+		return NULL;
+	/* AnalyzeSong doesn't bound its reads, so the module must be at least as long as loaded */
+	int moduleLen = self->owner != NULL ? self->owner->moduleLen : self->moduleLen;
+	if (moduleLen == 0)
+		return ASAPObject_RaiseFormat("No module loaded");
+	Py_buffer view;
+	if (!ASAPObject_GetModuleBuffer(module, &view, moduleLen))
+		return NULL;
+	bool ok = ASAPInfo_AnalyzeSong(self->info, (uint8_t const *) view.buf, song);
+	PyBuffer_Release(&view);
+	if (!ok) {
+		PyErr_SetString(ASAPArgumentException, "Song out of range");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPInfoObject_DoSetString(ASAPInfoObject *self, PyObject *args, const char *format, bool (*set)(ASAPInfo *, const char *))
+{
+	const char *value;
+	if (!PyArg_ParseTuple(args, format, &value) || !ASAPInfoObject_CheckIdle(self))
+		return NULL;
+	if (!set(self->info, value))
+		return ASAPObject_RaiseFormat("Invalid character");
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPInfoObject_set_author(ASAPInfoObject *self, PyObject *args)
+{
+	return ASAPInfoObject_DoSetString(self, args, "s:set_author", ASAPInfo_SetAuthor);
+}
+
+static PyObject *ASAPInfoObject_set_title(ASAPInfoObject *self, PyObject *args)
+{
+	return ASAPInfoObject_DoSetString(self, args, "s:set_title", ASAPInfo_SetTitle);
+}
+
+static PyObject *ASAPInfoObject_set_date(ASAPInfoObject *self, PyObject *args)
+{
+	return ASAPInfoObject_DoSetString(self, args, "s:set_date", ASAPInfo_SetDate);
+}
+
+#define ASAPInfoObject_STRING_GETTER(name, function) \
+	static PyObject *ASAPInfoObject_##name(ASAPInfoObject *self, PyObject *Py_UNUSED(ignored)) \
+	{ \
+		return ASAPInfoObject_GetString(function(self->info)); \
+	}
+
+#define ASAPInfoObject_INT_GETTER(name, function) \
+	static PyObject *ASAPInfoObject_##name(ASAPInfoObject *self, PyObject *Py_UNUSED(ignored)) \
+	{ \
+		return PyLong_FromLong(function(self->info)); \
+	}
+
+#define ASAPInfoObject_BOOL_GETTER(name, function) \
+	static PyObject *ASAPInfoObject_##name(ASAPInfoObject *self, PyObject *Py_UNUSED(ignored)) \
+	{ \
+		return PyBool_FromLong(function(self->info)); \
+	}
+
+ASAPInfoObject_STRING_GETTER(get_author, ASAPInfo_GetAuthor)
+ASAPInfoObject_STRING_GETTER(get_title, ASAPInfo_GetTitle)
+ASAPInfoObject_STRING_GETTER(get_title_or_filename, ASAPInfo_GetTitleOrFilename)
+ASAPInfoObject_STRING_GETTER(get_date, ASAPInfo_GetDate)
+ASAPInfoObject_STRING_GETTER(get_original_module_ext, ASAPInfo_GetOriginalModuleExt)
+ASAPInfoObject_INT_GETTER(get_year, ASAPInfo_GetYear)
+ASAPInfoObject_INT_GETTER(get_month, ASAPInfo_GetMonth)
+ASAPInfoObject_INT_GETTER(get_day_of_month, ASAPInfo_GetDayOfMonth)
+ASAPInfoObject_INT_GETTER(get_channels, ASAPInfo_GetChannels)
+ASAPInfoObject_INT_GETTER(get_songs, ASAPInfo_GetSongs)
+ASAPInfoObject_INT_GETTER(get_default_song, ASAPInfo_GetDefaultSong)
+ASAPInfoObject_INT_GETTER(get_type_letter, ASAPInfo_GetTypeLetter)
+ASAPInfoObject_INT_GETTER(get_player_rate_scanlines, ASAPInfo_GetPlayerRateScanlines)
+ASAPInfoObject_INT_GETTER(get_player_rate_hz, ASAPInfo_GetPlayerRateHz)
+ASAPInfoObject_INT_GETTER(get_music_address, ASAPInfo_GetMusicAddress)
+ASAPInfoObject_INT_GETTER(get_init_address, ASAPInfo_GetInitAddress)
+ASAPInfoObject_INT_GETTER(get_player_address, ASAPInfo_GetPlayerAddress)
+ASAPInfoObject_INT_GETTER(get_covox_address, ASAPInfo_GetCovoxAddress)
+ASAPInfoObject_INT_GETTER(get_sap_header_length, ASAPInfo_GetSapHeaderLength)
+ASAPInfoObject_BOOL_GETTER(is_ntsc, ASAPInfo_IsNtsc)
+ASAPInfoObject_BOOL_GETTER(can_set_ntsc, ASAPInfo_CanSetNtsc)
+
+static PyObject *ASAPInfoObject_set_default_song(ASAPInfoObject *self, PyObject *args)
+{
+	int song;
+	if (!PyArg_ParseTuple(args, "i:set_default_song", &song) || !ASAPInfoObject_CheckIdle(self))
+		return NULL;
+	if (!ASAPInfo_SetDefaultSong(self->info, song)) {
+		PyErr_SetString(ASAPArgumentException, "Song out of range");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPInfoObject_get_duration(ASAPInfoObject *self, PyObject *args)
+{
+	int song;
+	if (!PyArg_ParseTuple(args, "i:get_duration", &song) || !ASAPObject_CheckSong(song))
+		return NULL;
+	return PyLong_FromLong(ASAPInfo_GetDuration(self->info, song));
+}
+
+static PyObject *ASAPInfoObject_get_loop(ASAPInfoObject *self, PyObject *args)
+{
+	int song;
+	if (!PyArg_ParseTuple(args, "i:get_loop", &song) || !ASAPObject_CheckSong(song))
+		return NULL;
+	return PyBool_FromLong(ASAPInfo_GetLoop(self->info, song));
+}
+
+static PyObject *ASAPInfoObject_get_loop_start(ASAPInfoObject *self, PyObject *args)
+{
+	int song;
+	if (!PyArg_ParseTuple(args, "i:get_loop_start", &song) || !ASAPObject_CheckSong(song))
+		return NULL;
+	return PyLong_FromLong(ASAPInfo_GetLoopStart(self->info, song));
+}
+
+static PyObject *ASAPInfoObject_DoSetSongInt(ASAPInfoObject *self, PyObject *args, const char *format, bool (*set)(ASAPInfo *, int, int))
+{
+	int song;
+	int value;
+	if (!PyArg_ParseTuple(args, format, &song, &value) || !ASAPInfoObject_CheckIdle(self))
+		return NULL;
+	if (!set(self->info, song, value)) {
+		PyErr_SetString(ASAPArgumentException, "Song out of range");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPInfoObject_set_duration(ASAPInfoObject *self, PyObject *args)
+{
+	return ASAPInfoObject_DoSetSongInt(self, args, "ii:set_duration", ASAPInfo_SetDuration);
+}
+
+static PyObject *ASAPInfoObject_set_loop_start(ASAPInfoObject *self, PyObject *args)
+{
+	return ASAPInfoObject_DoSetSongInt(self, args, "ii:set_loop_start", ASAPInfo_SetLoopStart);
+}
+
+static PyObject *ASAPInfoObject_set_loop(ASAPInfoObject *self, PyObject *args)
+{
+	int song;
+	int loop;
+	if (!PyArg_ParseTuple(args, "ip:set_loop", &song, &loop) || !ASAPInfoObject_CheckIdle(self))
+		return NULL;
+	if (!ASAPInfo_SetLoop(self->info, song, loop != 0)) {
+		PyErr_SetString(ASAPArgumentException, "Song out of range");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPInfoObject_set_ntsc(ASAPInfoObject *self, PyObject *args)
+{
+	int ntsc;
+	if (!PyArg_ParseTuple(args, "p:set_ntsc", &ntsc) || !ASAPInfoObject_CheckIdle(self))
+		return NULL;
+	ASAPInfo_SetNtsc(self->info, ntsc != 0);
+	Py_RETURN_NONE;
+}
+
+static PyObject *ASAPInfoObject_parse_duration(PyObject *Py_UNUSED(cls), PyObject *args)
+{
+	const char *s;
+	if (!PyArg_ParseTuple(args, "s:parse_duration", &s))
+		return NULL;
+	int duration = ASAPInfo_ParseDuration(s);
+	if (duration < 0)
+		return ASAPObject_RaiseFormat("Invalid duration");
+	return PyLong_FromLong(duration);
+}
+
+static PyObject *ASAPInfoObject_is_our_file(PyObject *Py_UNUSED(cls), PyObject *args)
+{
+	PyObject *filename;
+	if (!PyArg_ParseTuple(args, "O&:is_our_file", PyUnicode_FSConverter, &filename))
+		return NULL;
+	bool result = ASAPInfo_IsOurFile(PyBytes_AS_STRING(filename));
+	Py_DECREF(filename);
+	return PyBool_FromLong(result);
+}
+
+static PyObject *ASAPInfoObject_is_our_ext(PyObject *Py_UNUSED(cls), PyObject *args)
+{
+	const char *ext;
+	if (!PyArg_ParseTuple(args, "s:is_our_ext", &ext))
+		return NULL;
+	return PyBool_FromLong(ASAPInfo_IsOurExt(ext));
+}
+
+static PyObject *ASAPInfoObject_get_ext_description(PyObject *Py_UNUSED(cls), PyObject *args)
+{
+	const char *ext;
+	if (!PyArg_ParseTuple(args, "s:get_ext_description", &ext))
+		return NULL;
+	const char *description = ASAPInfo_GetExtDescription(ext);
+	if (description == NULL)
+		return ASAPObject_RaiseFormat("Unknown extension");
+	return ASAPInfoObject_GetString(description);
+}
+
+static PyMethodDef ASAPInfoObject_methods[] = {
+	{ "load", (PyCFunction) ASAPInfoObject_load, METH_VARARGS, "Loads file information." },
+	{ "load_metadata", (PyCFunction) ASAPInfoObject_load_metadata, METH_VARARGS, "Loads file information, deferring the analysis of song lengths." },
+	{ "analyze_song", (PyCFunction) ASAPInfoObject_analyze_song, METH_VARARGS, "Computes length of the specified song if load_metadata deferred it." },
+	{ "get_author", (PyCFunction) ASAPInfoObject_get_author, METH_NOARGS, "Returns author's name." },
+	{ "set_author", (PyCFunction) ASAPInfoObject_set_author, METH_VARARGS, "Sets author's name." },
+	{ "get_title", (PyCFunction) ASAPInfoObject_get_title, METH_NOARGS, "Returns music title." },
+	{ "set_title", (PyCFunction) ASAPInfoObject_set_title, METH_VARARGS, "Sets music title." },
+	{ "get_title_or_filename", (PyCFunction) ASAPInfoObject_get_title_or_filename, METH_NOARGS, "Returns music title or filename." },
+	{ "get_date", (PyCFunction) ASAPInfoObject_get_date, METH_NOARGS, "Returns music creation date." },
+	{ "set_date", (PyCFunction) ASAPInfoObject_set_date, METH_VARARGS, "Sets music creation date." },
+	{ "get_year", (PyCFunction) ASAPInfoObject_get_year, METH_NOARGS, "Returns music creation year." },
+	{ "get_month", (PyCFunction) ASAPInfoObject_get_month, METH_NOARGS, "Returns music creation month (1-12)." },
+	{ "get_day_of_month", (PyCFunction) ASAPInfoObject_get_day_of_month, METH_NOARGS, "Returns day of month of the music creation date." },
+	{ "get_channels", (PyCFunction) ASAPInfoObject_get_channels, METH_NOARGS, "Returns 1 for mono or 2 for stereo." },
+	{ "get_songs", (PyCFunction) ASAPInfoObject_get_songs, METH_NOARGS, "Returns number of songs in the file." },
+	{ "get_default_song", (PyCFunction) ASAPInfoObject_get_default_song, METH_NOARGS, "Returns 0-based index of the \"main\" song." },
+	{ "set_default_song", (PyCFunction) ASAPInfoObject_set_default_song, METH_VARARGS, "Sets the 0-based index of the \"main\" song." },
+	{ "get_duration", (PyCFunction) ASAPInfoObject_get_duration, METH_VARARGS, "Returns length of the specified song." },
+	{ "set_duration", (PyCFunction) ASAPInfoObject_set_duration, METH_VARARGS, "Sets length of the specified song." },
+	{ "get_loop", (PyCFunction) ASAPInfoObject_get_loop, METH_VARARGS, "Returns information whether the specified song loops." },
+	{ "set_loop", (PyCFunction) ASAPInfoObject_set_loop, METH_VARARGS, "Sets information whether the specified song loops." },
+	{ "get_loop_start", (PyCFunction) ASAPInfoObject_get_loop_start, METH_VARARGS, "Returns position of the specified song where its loop starts." },
+	{ "set_loop_start", (PyCFunction) ASAPInfoObject_set_loop_start, METH_VARARGS, "Sets position of the specified song where its loop starts." },
+	{ "is_ntsc", (PyCFunction) ASAPInfoObject_is_ntsc, METH_NOARGS, "Returns True for an NTSC song and False for a PAL song." },
+	{ "can_set_ntsc", (PyCFunction) ASAPInfoObject_can_set_ntsc, METH_NOARGS, "Returns True if NTSC can be set or removed." },
+	{ "set_ntsc", (PyCFunction) ASAPInfoObject_set_ntsc, METH_VARARGS, "Marks a SAP file as NTSC or PAL." },
+	{ "get_type_letter", (PyCFunction) ASAPInfoObject_get_type_letter, METH_NOARGS, "Returns the letter argument for the TYPE SAP tag." },
+	{ "get_player_rate_scanlines", (PyCFunction) ASAPInfoObject_get_player_rate_scanlines, METH_NOARGS, "Returns player routine rate in Atari scanlines." },
+	{ "get_player_rate_hz", (PyCFunction) ASAPInfoObject_get_player_rate_hz, METH_NOARGS, "Returns approximate player routine rate in Hz." },
+	{ "get_music_address", (PyCFunction) ASAPInfoObject_get_music_address, METH_NOARGS, "Returns the address of the module." },
+	{ "get_init_address", (PyCFunction) ASAPInfoObject_get_init_address, METH_NOARGS, "Returns the address of the initialization routine." },
+	{ "get_player_address", (PyCFunction) ASAPInfoObject_get_player_address, METH_NOARGS, "Returns the address of the player routine." },
+	{ "get_covox_address", (PyCFunction) ASAPInfoObject_get_covox_address, METH_NOARGS, "Returns the address of the COVOX chip." },
+	{ "get_sap_header_length", (PyCFunction) ASAPInfoObject_get_sap_header_length, METH_NOARGS, "Returns length of the SAP header in bytes." },
+	{ "get_original_module_ext", (PyCFunction) ASAPInfoObject_get_original_module_ext, METH_NOARGS, "Returns the extension of the original module format." },
+	{ "parse_duration", (PyCFunction) ASAPInfoObject_parse_duration, METH_VARARGS | METH_STATIC, "Returns the number of milliseconds represented by the given string." },
+	{ "is_our_file", (PyCFunction) ASAPInfoObject_is_our_file, METH_VARARGS | METH_STATIC, "Checks whether the filename represents a module type supported by ASAP." },
+	{ "is_our_ext", (PyCFunction) ASAPInfoObject_is_our_ext, METH_VARARGS | METH_STATIC, "Checks whether the filename extension represents a module type supported by ASAP." },
+	{ "get_ext_description", (PyCFunction) ASAPInfoObject_get_ext_description, METH_VARARGS | METH_STATIC, "Returns human-readable description of the filename extension." },
+	{ NULL }
+};
+
+static PyTypeObject ASAPInfoType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "asap.ASAPInfo",
+	.tp_doc = "Information about a music file.",
+	.tp_basicsize = sizeof(ASAPInfoObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = ASAPInfoObject_new,
+	.tp_dealloc = (destructor) ASAPInfoObject_dealloc,
+	.tp_methods = ASAPInfoObject_methods
+};
+
+static bool ASAPModule_AddConstant(PyTypeObject *type, const char *name, PyObject *value)
+{
+	if (value == NULL)
+		return false;
+	int result = PyDict_SetItemString(type->tp_dict, name, value);
+	Py_DECREF(value);
+	return result == 0;
+}
+
+static bool ASAPModule_AddConstants(void)
+{
+	return ASAPModule_AddConstant(&ASAPType, "SAMPLE_RATE", PyLong_FromLong(ASAP_SAMPLE_RATE))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "VERSION_MAJOR", PyLong_FromLong(ASAPInfo_VERSION_MAJOR))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "VERSION_MINOR", PyLong_FromLong(ASAPInfo_VERSION_MINOR))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "VERSION_MICRO", PyLong_FromLong(ASAPInfo_VERSION_MICRO))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "VERSION_PATCH", PyLong_FromLong(ASAPInfo_VERSION_PATCH))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "VERSION", ASAPInfoObject_GetString(ASAPInfo_VERSION))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "YEARS", ASAPInfoObject_GetString(ASAPInfo_YEARS))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "CREDITS", ASAPInfoObject_GetString(ASAPInfo_CREDITS))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "COPYRIGHT", ASAPInfoObject_GetString(ASAPInfo_COPYRIGHT))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "MAX_MODULE_LENGTH", PyLong_FromLong(ASAPInfo_MAX_MODULE_LENGTH))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "MAX_TEXT_LENGTH", PyLong_FromLong(ASAPInfo_MAX_TEXT_LENGTH))
+		&& ASAPModule_AddConstant(&ASAPInfoType, "MAX_SONGS", PyLong_FromLong(ASAPInfo_MAX_SONGS));
+}
+
+/* Creates ASAPSampleFormat as an IntEnum, like in asap.py. */
+static PyObject *ASAPModule_CreateSampleFormat(void)
+{
+	PyObject *enumModule = PyImport_ImportModule("enum");
+	if (enumModule == NULL)
+		return NULL;
+	PyObject *result = PyObject_CallMethod(enumModule, "IntEnum", "s[(si)(si)(si)]", "ASAPSampleFormat",
+		"U8", ASAPSampleFormat_U8, "S16_L_E", ASAPSampleFormat_S16_L_E, "S16_B_E", ASAPSampleFormat_S16_B_E);
+	Py_DECREF(enumModule);
+	if (result == NULL)
+		return NULL;
+	PyObject *moduleName = PyUnicode_FromString("asap");
+	if (moduleName == NULL || PyObject_SetAttrString(result, "__module__", moduleName) != 0)
+		Py_CLEAR(result);
+	Py_XDECREF(moduleName);
+	return result;
+}
+
+static int ASAPModule_AddObject(PyObject *module, const char *name, PyObject *value)
+{
+	Py_INCREF(value);
+	if (PyModule_AddObject(module, name, value) != 0) {
+		Py_DECREF(value);
+		return -1;
+	}
+	return 0;
+}
+
+static struct PyModuleDef ASAPModule = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "asap",
+	.m_doc = "Another Slight Atari Player.",
+	.m_size = -1
+};
+
+PyMODINIT_FUNC PyInit_asap(void)
+{
+	if (PyType_Ready(&ASAPType) < 0 || PyType_Ready(&ASAPInfoType) < 0 || !ASAPModule_AddConstants())
+		return NULL;
+	PyObject *module = PyModule_Create(&ASAPModule);
+	if (module == NULL)
+		return NULL;
+	ASAPFormatException = PyErr_NewException("asap.ASAPFormatException", NULL, NULL);
+	ASAPArgumentException = PyErr_NewException("asap.ASAPArgumentException", NULL, NULL);
+	ASAPSampleFormatType = ASAPModule_CreateSampleFormat();
+	if (ASAPFormatException == NULL || ASAPArgumentException == NULL || ASAPSampleFormatType == NULL
+	 || ASAPModule_AddObject(module, "ASAPFormatException", ASAPFormatException) != 0
+	 || ASAPModule_AddObject(module, "ASAPArgumentException", ASAPArgumentException) != 0
+	 || ASAPModule_AddObject(module, "ASAPSampleFormat", ASAPSampleFormatType) != 0
+	 || ASAPModule_AddObject(module, "ASAP", (PyObject *) &ASAPType) != 0
+	 || ASAPModule_AddObject(module, "ASAPInfo", (PyObject *) &ASAPInfoType) != 0) {
+		Py_DECREF(module);
+		return NULL;
+	}
+	return module;
+}
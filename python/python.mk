@@ -1,12 +1,23 @@
+PYTHON = python3
+
 # no user-configurable paths below this line
 
 ifndef DO
 $(error Use "Makefile" instead of "python.mk")
 endif
 
+PYTHON_EXT_SUFFIX = $(shell $(PYTHON) -c "import sysconfig; print(sysconfig.get_config_var('EXT_SUFFIX'))")
+
 python: python/asap.py
 .PHONY: python
 
+python-native: python/asap$(PYTHON_EXT_SUFFIX)
+.PHONY: python-native
+
 python/asap.py: $(call src,asap.fu asap6502.fu asapinfo.fu cpu6502.fu pokey.fu) $(ASM6502_PLAYERS_OBX)
 	$(FUT)
 CLEAN += python/asap.py
+
+python/asap$(PYTHON_EXT_SUFFIX): $(call src,python/asapmodule.c asap.[ch])
+	$(DO_CC) -pthread $(shell $(PYTHON)-config --includes)
+CLEAN += python/asap$(PYTHON_EXT_SUFFIX)
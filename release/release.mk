@@ -63,7 +63,7 @@ CLEANDIR += release/osx
 release/osx/plugins:
 	$(DO)ln -s /Applications/VLC.app/Contents/MacOS/plugins $@
 
-release/osx/asapconv: $(call src,asapconv.c asap-stdio.[ch] asap.[ch])
+release/osx/asapconv: $(call src,asapconv.c asap-flac.[ch] asap-parallel.[ch] asap-stdio.[ch] asap.[ch])
 	$(OSX_CC)
 
 release/osx/bin:
@@ -0,0 +1,558 @@
+/*
+ * asapbench.c - ASAP rendering benchmark
+ *
+ * Copyright (C) 2024  Piotr Fusik
+ *
+ * This file is part of ASAP (Another Slight Atari Player),
+ * see http://asap.sourceforge.net
+ *
+ * ASAP is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * ASAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ASAP; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "asap.h"
+
+#define BUF_SIZE 8192
+#define MAX_RATES 8
+#define MAX_BASELINE 1024
+
+/* parsed command line */
+static int arg_sample_rates[MAX_RATES] = { 44100 };
+static int arg_sample_rates_count = 1;
+static bool arg_formats[3] = { false, true, false }; /* indexed by ASAPSampleFormat */
+static int arg_repeat = 3;
+static int arg_seconds = -1;
+static bool arg_json = false;
+static const char *arg_output = NULL;
+static const char *arg_baseline = NULL;
+static int arg_threshold = 5;
+
+static const char * const format_names[3] = { "u8", "s16le", "s16be" };
+
+typedef struct {
+	double ns;
+	int64_t instructions; /* -1 if not available */
+	int64_t cycles;
+} StageTime;
+
+typedef struct {
+	char file[FILENAME_MAX];
+	int sample_rate;
+	const char *format;
+	double seconds;
+	int64_t samples;
+	StageTime total; /* Generate: 6502, POKEY, filter and sample conversion */
+	StageTime emulate; /* GenerateDeltas: 6502 and POKEY only */
+	StageTime filter; /* FilterDeltas on the output of GenerateDeltas */
+} BenchResult;
+
+static FILE *output_fp;
+static bool first_result = true;
+
+typedef struct {
+	char key[FILENAME_MAX + 32];
+	double ns_per_sample;
+} BaselineEntry;
+
+static BaselineEntry baseline[MAX_BASELINE];
+static int baseline_count = 0;
+static int regressions = 0;
+
+static void print_help(void)
+{
+	printf(
+		"Usage: asapbench [OPTIONS] INPUTFILE...\n"
+		"Renders the default song of each INPUTFILE and reports its speed.\n"
+		"@LISTFILE reads input file names from LISTFILE, one per line.\n"
+		"Options:\n"
+		"-R RATES    --sample-rate=RATES  Comma-separated sample rates (default 44100)\n"
+		"-f FORMATS  --format=FORMATS     Comma-separated u8, s16le, s16be (default s16le)\n"
+		"-n COUNT    --repeat=COUNT       Report the fastest of COUNT runs (default 3)\n"
+		"-t SECONDS  --time=SECONDS       Render SECONDS instead of the song duration\n"
+		"-o FILE     --output=FILE        Write results to FILE instead of standard output\n"
+		"            --json               Write JSON instead of CSV\n"
+		"-c FILE     --compare=FILE       Compare with a CSV written earlier\n"
+		"-T PERCENT  --threshold=PERCENT  Report slowdowns above PERCENT (default 5)\n"
+		"-h          --help               Display this information\n"
+		"-v          --version            Display version information\n"
+		"Exits with status 2 if any slowdown is above the threshold.\n"
+	);
+}
+
+static void fatal_error(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "asapbench: ");
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+	exit(1);
+}
+
+static int parse_int(const char *s, const char *description, int min_value, int max_value)
+{
+	char *end;
+	long result = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || result < min_value || result > max_value)
+		fatal_error("invalid %s: %s", description, s);
+	return (int) result;
+}
+
+static void set_sample_rates(const char *s)
+{
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%s", s);
+	arg_sample_rates_count = 0;
+	for (char *p = strtok(buf, ","); p != NULL; p = strtok(NULL, ",")) {
+		if (arg_sample_rates_count >= MAX_RATES)
+			fatal_error("too many sample rates");
+		arg_sample_rates[arg_sample_rates_count++] = parse_int(p, "sample rate", 1000, 65535);
+	}
+	if (arg_sample_rates_count == 0)
+		fatal_error("no sample rates");
+}
+
+static void set_formats(const char *s)
+{
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%s", s);
+	memset(arg_formats, 0, sizeof(arg_formats));
+	bool any = false;
+	for (char *p = strtok(buf, ","); p != NULL; p = strtok(NULL, ",")) {
+		int format;
+		for (format = 0; ; format++) {
+			if (format == 3)
+				fatal_error("invalid sample format: %s", p);
+			if (strcmp(p, format_names[format]) == 0)
+				break;
+		}
+		arg_formats[format] = true;
+		any = true;
+	}
+	if (!any)
+		fatal_error("no sample formats");
+}
+
+static double get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Hardware counters of this thread, if the kernel lets us read them. */
+static int perf_instructions_fd = -1;
+static int perf_cycles_fd = -1;
+
+static void perf_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	perf_instructions_fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	perf_cycles_fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (perf_instructions_fd < 0 || perf_cycles_fd < 0) {
+		if (perf_instructions_fd >= 0)
+			close(perf_instructions_fd);
+		if (perf_cycles_fd >= 0)
+			close(perf_cycles_fd);
+		perf_instructions_fd = perf_cycles_fd = -1;
+		fprintf(stderr, "asapbench: hardware counters unavailable, not reporting instructions per cycle\n");
+	}
+#endif
+}
+
+static void stage_clear(StageTime *stage)
+{
+	stage->ns = 0;
+	stage->instructions = 0;
+	stage->cycles = 0;
+}
+
+static double stage_start(void)
+{
+#ifdef __linux__
+	if (perf_instructions_fd >= 0) {
+		ioctl(perf_instructions_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_cycles_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_instructions_fd, PERF_EVENT_IOC_ENABLE, 0);
+		ioctl(perf_cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	return get_time_ns();
+}
+
+/* Adds the time and counters since stage_start to stage. */
+static void stage_stop(StageTime *stage, double start)
+{
+	stage->ns += get_time_ns() - start;
+	int64_t instructions = -1;
+	int64_t cycles = -1;
+#ifdef __linux__
+	if (perf_instructions_fd >= 0) {
+		ioctl(perf_instructions_fd, PERF_EVENT_IOC_DISABLE, 0);
+		ioctl(perf_cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_instructions_fd, &instructions, sizeof(int64_t)) != sizeof(int64_t)
+		 || read(perf_cycles_fd, &cycles, sizeof(int64_t)) != sizeof(int64_t))
+			instructions = cycles = -1;
+	}
+#endif
+	if (instructions < 0 || stage->instructions < 0)
+		stage->instructions = stage->cycles = -1;
+	else {
+		stage->instructions += instructions;
+		stage->cycles += cycles;
+	}
+}
+
+static void play(ASAP *asap, const char *input_file, int duration)
+{
+	const ASAPInfo *info = ASAP_GetInfo(asap);
+	if (!ASAP_PlaySong(asap, ASAPInfo_GetDefaultSong(info), duration))
+		fatal_error("%s: PlaySong failed", input_file);
+}
+
+/* Renders the whole song with Generate, returns the number of bytes generated. */
+static int64_t render(ASAP *asap, int format, StageTime *total)
+{
+	static uint8_t buffer[BUF_SIZE];
+	int64_t bytes = 0;
+	stage_clear(total);
+	double start = stage_start();
+	for (;;) {
+		int len = ASAP_Generate(asap, buffer, BUF_SIZE, (ASAPSampleFormat) format);
+		if (len == 0)
+			break;
+		bytes += len;
+	}
+	stage_stop(total, start);
+	return bytes;
+}
+
+/* Renders the whole song with GenerateDeltas, filtering each buffer
+   with FilterDeltas right away, and times both stages.
+   Returns the number of ints generated. */
+static int64_t render_stages(ASAP *asap, int format, StageTime *emulate, StageTime *filter)
+{
+	static int deltas[BUF_SIZE];
+	static uint8_t buffer[BUF_SIZE * 2];
+	int64_t total = 0;
+	stage_clear(emulate);
+	stage_clear(filter);
+	for (;;) {
+		double start = stage_start();
+		int len = ASAP_GenerateDeltas(asap, deltas, BUF_SIZE);
+		stage_stop(emulate, start);
+		if (len == 0)
+			break;
+		start = stage_start();
+		ASAP_FilterDeltas(asap, deltas, len, buffer, (ASAPSampleFormat) format);
+		stage_stop(filter, start);
+		total += len;
+	}
+	return total;
+}
+
+/* Runs arg_repeat times and keeps the fastest run. */
+static void render_best(ASAP *asap, const char *input_file, int duration, int format, BenchResult *result)
+{
+	for (int i = 0; i < arg_repeat; i++) {
+		StageTime total;
+		play(asap, input_file, duration);
+		render(asap, format, &total);
+		if (i == 0 || total.ns < result->total.ns)
+			result->total = total;
+	}
+	for (int i = 0; i < arg_repeat; i++) {
+		StageTime emulate;
+		StageTime filter;
+		play(asap, input_file, duration);
+		int64_t samples = render_stages(asap, format, &emulate, &filter) / ASAPInfo_GetChannels(ASAP_GetInfo(asap));
+		if (samples == 0)
+			fatal_error("%s: no samples generated", input_file);
+		if (i == 0 || emulate.ns + filter.ns < result->emulate.ns + result->filter.ns) {
+			result->samples = samples;
+			result->emulate = emulate;
+			result->filter = filter;
+		}
+	}
+}
+
+static void format_ipc(char *buf, const StageTime *stage)
+{
+	if (stage->instructions < 0 || stage->cycles <= 0)
+		buf[0] = '\0';
+	else
+		sprintf(buf, "%.3f", (double) stage->instructions / stage->cycles);
+}
+
+static void write_result(const BenchResult *r)
+{
+	double total_ns_per_sample = r->total.ns / r->samples;
+	double emulate_ns_per_sample = r->emulate.ns / r->samples;
+	double filter_ns_per_sample = r->filter.ns / r->samples;
+	double x_realtime = r->seconds * 1e9 / r->total.ns;
+	char total_ipc[32];
+	char emulate_ipc[32];
+	char filter_ipc[32];
+	format_ipc(total_ipc, &r->total);
+	format_ipc(emulate_ipc, &r->emulate);
+	format_ipc(filter_ipc, &r->filter);
+	if (arg_json) {
+		fprintf(output_fp, "%s\n\t{\"file\": \"", first_result ? "[" : ",");
+		for (const char *p = r->file; *p != '\0'; p++) {
+			if (*p == '"' || *p == '\\')
+				fputc('\\', output_fp);
+			fputc(*p, output_fp);
+		}
+		fprintf(output_fp, "\", \"sampleRate\": %d, \"format\": \"%s\", \"seconds\": %.3f, \"samples\": %lld, "
+			"\"xRealtime\": %.1f, \"nsPerSample\": %.2f, \"emulateNsPerSample\": %.2f, \"filterNsPerSample\": %.2f, "
+			"\"ipc\": %s, \"emulateIpc\": %s, \"filterIpc\": %s}",
+			r->sample_rate, r->format, r->seconds, (long long) r->samples,
+			x_realtime, total_ns_per_sample, emulate_ns_per_sample, filter_ns_per_sample,
+			total_ipc[0] != '\0' ? total_ipc : "null", emulate_ipc[0] != '\0' ? emulate_ipc : "null", filter_ipc[0] != '\0' ? filter_ipc : "null");
+	}
+	else {
+		if (first_result)
+			fprintf(output_fp, "file,sample_rate,format,seconds,samples,x_realtime,ns_per_sample,emulate_ns_per_sample,filter_ns_per_sample,ipc,emulate_ipc,filter_ipc\n");
+		fprintf(output_fp, "%s,%d,%s,%.3f,%lld,%.1f,%.2f,%.2f,%.2f,%s,%s,%s\n",
+			r->file, r->sample_rate, r->format, r->seconds, (long long) r->samples,
+			x_realtime, total_ns_per_sample, emulate_ns_per_sample, filter_ns_per_sample,
+			total_ipc, emulate_ipc, filter_ipc);
+	}
+	first_result = false;
+}
+
+static const char *get_basename(const char *filename)
+{
+	const char *p;
+	for (p = filename + strlen(filename); p > filename; p--) {
+		if (p[-1] == '/' || p[-1] == '\\')
+			break;
+	}
+	return p;
+}
+
+static void make_key(char *key, const char *file, int sample_rate, const char *format)
+{
+	sprintf(key, "%s,%d,%s", get_basename(file), sample_rate, format);
+}
+
+static void load_baseline(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL)
+		fatal_error("cannot open %s", filename);
+	char line[FILENAME_MAX + 256];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		/* file,sample_rate,format,seconds,samples,x_realtime,ns_per_sample,... */
+		char *fields[7];
+		int n = 0;
+		for (char *p = line; n < 7; p++) {
+			fields[n++] = p;
+			p = strchr(p, ',');
+			if (p == NULL)
+				break;
+			*p = '\0';
+		}
+		if (n < 7 || strcmp(fields[0], "file") == 0)
+			continue;
+		if (baseline_count >= MAX_BASELINE)
+			fatal_error("%s: too many results", filename);
+		BaselineEntry *entry = &baseline[baseline_count++];
+		make_key(entry->key, fields[0], atoi(fields[1]), fields[2]);
+		entry->ns_per_sample = atof(fields[6]);
+	}
+	fclose(fp);
+}
+
+static void compare_result(const BenchResult *r)
+{
+	char key[FILENAME_MAX + 32];
+	make_key(key, r->file, r->sample_rate, r->format);
+	for (int i = 0; i < baseline_count; i++) {
+		if (strcmp(baseline[i].key, key) == 0) {
+			double old_ns = baseline[i].ns_per_sample;
+			double new_ns = r->total.ns / r->samples;
+			double change = old_ns > 0 ? (new_ns - old_ns) * 100 / old_ns : 0;
+			bool regression = change > arg_threshold;
+			fprintf(stderr, "%-40s %8.2f -> %8.2f ns/sample %+6.1f%%%s\n", key, old_ns, new_ns, change, regression ? "  SLOWER" : "");
+			if (regression)
+				regressions++;
+			return;
+		}
+	}
+	fprintf(stderr, "%-40s not in baseline\n", key);
+}
+
+static void process_file(const char *input_file)
+{
+	FILE *fp = fopen(input_file, "rb");
+	if (fp == NULL)
+		fatal_error("cannot open %s", input_file);
+	static uint8_t module[ASAPInfo_MAX_MODULE_LENGTH];
+	int module_len = (int) fread(module, 1, sizeof(module), fp);
+	fclose(fp);
+
+	ASAP *asap = ASAP_New();
+	if (asap == NULL)
+		fatal_error("out of memory");
+	if (!ASAP_Load(asap, input_file, module, module_len))
+		fatal_error("%s: unsupported file", input_file);
+	const ASAPInfo *info = ASAP_GetInfo(asap);
+	int duration = arg_seconds > 0 ? arg_seconds * 1000 : ASAPInfo_GetDuration(info, ASAPInfo_GetDefaultSong(info));
+	if (duration <= 0)
+		duration = 180000;
+
+	for (int r = 0; r < arg_sample_rates_count; r++) {
+		BenchResult result;
+		snprintf(result.file, sizeof(result.file), "%s", input_file);
+		result.sample_rate = arg_sample_rates[r];
+		result.seconds = duration / 1000.0;
+		ASAP_SetSampleRate(asap, result.sample_rate);
+		for (int format = 0; format < 3; format++) {
+			if (!arg_formats[format])
+				continue;
+			result.format = format_names[format];
+			render_best(asap, input_file, duration, format, &result);
+			write_result(&result);
+			if (arg_baseline != NULL)
+				compare_result(&result);
+		}
+	}
+	ASAP_Delete(asap);
+}
+
+static void process_list(const char *list_file)
+{
+	FILE *fp = fopen(list_file, "r");
+	if (fp == NULL)
+		fatal_error("cannot open %s", list_file);
+	char line[FILENAME_MAX];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (len > 0)
+			process_file(line);
+	}
+	fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *options_error = "no input files";
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (arg[0] != '-') {
+			if (output_fp == NULL) {
+				if (arg_output == NULL)
+					output_fp = stdout;
+				else {
+					output_fp = fopen(arg_output, "w");
+					if (output_fp == NULL)
+						fatal_error("cannot write %s", arg_output);
+				}
+				if (arg_baseline != NULL)
+					load_baseline(arg_baseline);
+				perf_open();
+			}
+			if (arg[0] == '@')
+				process_list(arg + 1);
+			else
+				process_file(arg);
+			options_error = NULL;
+			continue;
+		}
+		options_error = "options must be specified before the input file";
+#define is_opt(c)  (arg[1] == c && arg[2] == '\0')
+		if (is_opt('R'))
+			set_sample_rates(argv[++i]);
+		else if (strncmp(arg, "--sample-rate=", 14) == 0)
+			set_sample_rates(arg + 14);
+		else if (is_opt('f'))
+			set_formats(argv[++i]);
+		else if (strncmp(arg, "--format=", 9) == 0)
+			set_formats(arg + 9);
+		else if (is_opt('n'))
+			arg_repeat = parse_int(argv[++i], "repeat count", 1, 1000);
+		else if (strncmp(arg, "--repeat=", 9) == 0)
+			arg_repeat = parse_int(arg + 9, "repeat count", 1, 1000);
+		else if (is_opt('t'))
+			arg_seconds = parse_int(argv[++i], "time", 1, 3600);
+		else if (strncmp(arg, "--time=", 7) == 0)
+			arg_seconds = parse_int(arg + 7, "time", 1, 3600);
+		else if (is_opt('o'))
+			arg_output = argv[++i];
+		else if (strncmp(arg, "--output=", 9) == 0)
+			arg_output = arg + 9;
+		else if (strcmp(arg, "--json") == 0)
+			arg_json = true;
+		else if (is_opt('c'))
+			arg_baseline = argv[++i];
+		else if (strncmp(arg, "--compare=", 10) == 0)
+			arg_baseline = arg + 10;
+		else if (is_opt('T'))
+			arg_threshold = parse_int(argv[++i], "threshold", 0, 1000);
+		else if (strncmp(arg, "--threshold=", 12) == 0)
+			arg_threshold = parse_int(arg + 12, "threshold", 0, 1000);
+		else if (is_opt('h') || strcmp(arg, "--help") == 0) {
+			print_help();
+			options_error = NULL;
+		}
+		else if (is_opt('v') || strcmp(arg, "--version") == 0) {
+			printf("asapbench " ASAPInfo_VERSION "\n");
+			options_error = NULL;
+		}
+		else
+			fatal_error("unknown option: %s", arg);
+	}
+	if (options_error != NULL) {
+		fprintf(stderr, "asapbench: %s\n", options_error);
+		print_help();
+		return 1;
+	}
+	if (output_fp != NULL) {
+		if (arg_json && !first_result)
+			fprintf(output_fp, "\n]\n");
+		if (output_fp != stdout)
+			fclose(output_fp);
+	}
+	if (regressions > 0) {
+		fprintf(stderr, "asapbench: %d results slower than the baseline by more than %d%%\n", regressions, arg_threshold);
+		return 2;
+	}
+	return 0;
+}
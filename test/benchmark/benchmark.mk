@@ -1,4 +1,5 @@
 GME_PATH = ../game-music-emu
+BENCH_BASELINE = test/benchmark/baseline.csv
 SAP_PATH = ../sapLib
 WIN64_CC = $(DO)x86_64-w64-mingw32-gcc $(WIN_CARGS) $(filter-out %.h,$^)
 WIN64_CXX = $(DO)x86_64-w64-mingw32-g++ $(WIN_CARGS) $(filter-out %.h,$^)
@@ -18,6 +19,18 @@ test/benchmark/sap_benchmark.exe: $(call src,test/benchmark/sap_benchmark.cpp as
 	$(WIN64_CXX)
 CLEAN += test/benchmark/sap_benchmark.exe
 
+bench: test/benchmark/asapbench
+	./test/benchmark/asapbench -o test/benchmark/asapbench.csv $(if $(wildcard $(BENCH_BASELINE)),-c $(BENCH_BASELINE)) $(srcdir)test/benchmark/*.sap
+.PHONY: bench
+
+bench-baseline: test/benchmark/asapbench
+	./test/benchmark/asapbench -o $(BENCH_BASELINE) $(srcdir)test/benchmark/*.sap
+.PHONY: bench-baseline
+
+test/benchmark/asapbench: $(call src,test/benchmark/asapbench.c asap.[ch])
+	$(DO_CC)
+CLEAN += test/benchmark/asapbench test/benchmark/asapbench.csv
+
 profile: gmon.out
 	gprof -bpQ test/benchmark/asapconv-profile.exe
 
@@ -25,6 +38,6 @@ gmon.out: test/benchmark/asapconv-profile.exe
 	$(DO)./test/benchmark/asapconv-profile.exe -b -o .wav test/benchmark/Drunk_Chessboard.sap
 CLEAN += gmon.out
 
-test/benchmark/asapconv-profile.exe: $(call src,asapconv.c asap-stdio.[ch] asap.[ch])
+test/benchmark/asapconv-profile.exe: $(call src,asapconv.c asap-flac.[ch] asap-parallel.[ch] asap-stdio.[ch] asap.[ch])
 	$(WIN64_CC:-s=) -no-pie -pg
 CLEAN += test/benchmark/asapconv-profile.exe
@@ -34,6 +34,8 @@
 #include <vlc_plugin.h>
 
 #include "asap.h"
+#include "asap-durationthread.h"
+#include "asap-metacache.h"
 
 #define BITS_PER_SAMPLE  16
 #define BUFFER_BYTES  4096
@@ -41,21 +43,44 @@
 struct demux_sys_t
 {
 	ASAP *asap;
+	uint8_t *module;
+	int module_len;
 	es_out_id_t *es;
 	date_t pts;
 	int bytes_per_frame;
 	int duration;
+	ASAPDurationThread *detect; /* detecting the duration while playing */
 };
 
+/* Returns the duration, possibly found in the background. */
+static int GetDuration(const demux_sys_t *sys)
+{
+	int duration;
+	if (sys->detect != NULL && ASAPDurationThread_GetDuration(sys->detect, &duration) && duration >= 0)
+		return duration;
+	return sys->duration;
+}
+
 static int Demux(demux_t *demux)
 {
 	demux_sys_t *sys = demux->p_sys;
 
+	int len = BUFFER_BYTES;
+	int duration = GetDuration(sys);
+	if (duration >= 0 && sys->duration < 0) {
+		/* the song was started without a duration, end it at the detected one */
+		int64_t blocks = (int64_t) duration * ASAP_SAMPLE_RATE / 1000 - ASAP_GetBlocksPlayed(sys->asap);
+		if (blocks <= 0)
+			return 0;
+		if (len > blocks * sys->bytes_per_frame)
+			len = (int) blocks * sys->bytes_per_frame;
+	}
+
 	block_t *block = block_Alloc(BUFFER_BYTES);
 	if (unlikely(block == NULL))
 		return 0;
 
-	int len = ASAP_Generate(sys->asap, block->p_buffer, BUFFER_BYTES,
+	len = ASAP_Generate(sys->asap, block->p_buffer, len,
 		BITS_PER_SAMPLE == 16 ? ASAPSampleFormat_S16_L_E : ASAPSampleFormat_U8);
 	if (len <= 0) {
 		block_Release(block);
@@ -73,6 +98,22 @@ static bool PlaySong(demux_t *demux, demux_sys_t *sys, int song)
 {
 	const ASAPInfo *info = ASAP_GetInfo(sys->asap);
 	int duration = ASAPInfo_GetDuration(info, song);
+	ASAPDurationThread_Delete(sys->detect);
+	sys->detect = NULL;
+	if (duration < 0) {
+		ASAPMetadata metadata;
+		if (ASAPMetaCache_GetModule(sys->module, sys->module_len, &metadata) && metadata.durations[song] >= 0)
+			duration = metadata.durations[song];
+		else {
+			sys->detect = ASAPDurationThread_Start(
+#ifdef vlc_stream_NewURL /* VLC 3.0+ */
+				demux->s->psz_url,
+#else
+				demux->psz_file,
+#endif
+				false, sys->module, sys->module_len, song, 15 * 60, 5);
+		}
+	}
 	if (!ASAP_PlaySong(sys->asap, song, duration))
 		return false;
 	sys->duration = duration;
@@ -87,25 +128,28 @@ static int Control(demux_t *demux, int query, va_list args)
 
 	switch (query) {
 		case DEMUX_GET_POSITION: {
-			if (sys->duration <= 0)
+			int duration = GetDuration(sys);
+			if (duration <= 0)
 				return VLC_EGENERIC;
 			double *v = va_arg(args, double *);
-			*v = (double) ASAP_GetPosition(sys->asap) / sys->duration;
+			*v = (double) ASAP_GetPosition(sys->asap) / duration;
 			return VLC_SUCCESS;
 		}
 		case DEMUX_SET_POSITION: {
-			if (sys->duration <= 0)
+			int duration = GetDuration(sys);
+			if (duration <= 0)
 				return VLC_EGENERIC;
 			double v = va_arg(args, double);
-			if (v < 0 || v > 1 || !ASAP_Seek(sys->asap, (int) (v * sys->duration)))
+			if (v < 0 || v > 1 || !ASAP_Seek(sys->asap, (int) (v * duration)))
 				return VLC_EGENERIC;
 			return VLC_SUCCESS;
 		}
 		case DEMUX_GET_LENGTH: {
-			if (sys->duration <= 0)
+			int duration = GetDuration(sys);
+			if (duration <= 0)
 				return VLC_EGENERIC;
 			int64_t *v = va_arg(args, int64_t *);
-			*v = sys->duration * INT64_C(1000);
+			*v = duration * INT64_C(1000);
 			return VLC_SUCCESS;
 		}
 		case DEMUX_GET_TIME: {
@@ -233,11 +277,16 @@ static int Open(vlc_object_t *obj)
 		free(module);
 		return VLC_EGENERIC;
 	}
-	free(module);
+	/* kept for looking up durations in the metadata cache */
+	sys->module = module;
+	sys->module_len = (int) module_len;
+	sys->detect = NULL;
 	const ASAPInfo *info = ASAP_GetInfo(sys->asap);
 	int song = ASAPInfo_GetDefaultSong(info);
 	if (!PlaySong(demux, sys, song)) {
+		ASAPDurationThread_Delete(sys->detect);
 		ASAP_Delete(sys->asap);
+		free(sys->module);
 		free(sys);
 		return VLC_EGENERIC;
 	}
@@ -266,7 +315,9 @@ static void Close(vlc_object_t *obj)
 	demux_t *demux = (demux_t *) obj;
 	demux_sys_t *sys = demux->p_sys;
 
+	ASAPDurationThread_Delete(sys->detect);
 	ASAP_Delete(sys->asap);
+	free(sys->module);
 	free(sys);
 }
 
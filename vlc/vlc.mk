@@ -19,8 +19,8 @@ endif
 asap-vlc: libasap_plugin.so
 .PHONY: asap-vlc
 
-libasap_plugin.so: $(call src,vlc/libasap_plugin.c asap.[ch])
-	$(DO_CC) $(VLC_CFLAGS)
+libasap_plugin.so: $(call src,vlc/libasap_plugin.c asap.[ch] asap-durationthread.[ch] asap-metacache.[ch])
+	$(DO_CC) $(VLC_CFLAGS) -pthread
 CLEAN += libasap_plugin.so
 
 install-vlc: libasap_plugin.so
@@ -36,8 +36,8 @@ uninstall-vlc:
 asap-vlc-osx: libasap_plugin.dylib
 .PHONY: asap-vlc-osx
 
-libasap_plugin.dylib: $(call src,vlc/libasap_plugin.c asap.[ch])
-	$(OSX_CC) $(VLC_OSX_CFLAGS)
+libasap_plugin.dylib: $(call src,vlc/libasap_plugin.c asap.[ch] asap-durationthread.[ch] asap-metacache.[ch])
+	$(OSX_CC) $(VLC_OSX_CFLAGS) -pthread
 CLEAN += libasap_plugin.dylib
 
 install-vlc-osx: libasap_plugin.dylib
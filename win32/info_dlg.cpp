@@ -74,20 +74,20 @@ bool loadModule(const wchar_t *filename, BYTE *module, int *module_len, const wc
 		const AutoCharFn atr_fn(atr_filename);
 		AATR *disk = AATRStdio_New(atr_fn);
 		if (disk != NULL) {
-			AATRDirectory *directory = AATRDirectory_New();
-			if (directory != NULL) {
-				AATRDirectory_OpenRoot(directory, disk);
+			/* the index is kept for the next songs from the same image */
+			const AATRIndex *index = AATRStdio_GetIndex(disk);
+			if (index != NULL) {
 				const AutoChar hash(hashW);
-				if (AATRDirectory_FindEntryRecursively(directory, hash + 1) && !AATRDirectory_IsEntryDirectory(directory)) {
+				int file = AATRIndex_FindFile(index, hash + 1);
+				if (file >= 0) {
 					AATRFileStream *stream = AATRFileStream_New();
 					if (stream != NULL) {
-						AATRFileStream_Open(stream, directory);
+						AATRFileStream_OpenIndexed(stream, disk, index, file);
 						*module_len = AATRFileStream_Read(stream, module, 0, ASAPInfo_MAX_MODULE_LENGTH);
 						ok = *module_len >= 0;
 						AATRFileStream_Delete(stream);
 					}
 				}
-				AATRDirectory_Delete(directory);
 			}
 			AATRStdio_Delete(disk);
 		}
@@ -31,19 +31,19 @@ mingw: $(addprefix win32/,asapconv.exe libasap.a asapscan.exe wasap.exe bass_asa
 
 # asapconv
 
-win32/asapconv.exe win32/x64/asapconv.exe: $(call src,asapconv.c asap-stdio.[ch] asap.[ch])
+win32/asapconv.exe win32/x64/asapconv.exe: $(call src,asapconv.c asap-flac.[ch] asap-parallel.[ch] asap-stdio.[ch] asap.[ch])
 	$(WIN_CC) -DHAVE_LIBMP3LAME -DHAVE_LIBMP3LAME_DLL
 CLEAN += win32/asapconv.exe win32/x64/asapconv.exe
 
-win32/asapconv-static-lame.exe win32/x64/asapconv-static-lame.exe: $(call src,asapconv.c asap-stdio.[ch] asap.[ch])
+win32/asapconv-static-lame.exe win32/x64/asapconv-static-lame.exe: $(call src,asapconv.c asap-flac.[ch] asap-parallel.[ch] asap-stdio.[ch] asap.[ch])
 	$(WIN_CC) -DHAVE_LIBMP3LAME -lmp3lame
 CLEAN += win32/asapconv-static-lame.exe win32/x64/asapconv-static-lame.exe
 
-win32/asapconv-no-lame.exe win32/x64/asapconv-no-lame.exe: $(call src,asapconv.c asap-stdio.[ch] asap.[ch])
+win32/asapconv-no-lame.exe win32/x64/asapconv-no-lame.exe: $(call src,asapconv.c asap-flac.[ch] asap-parallel.[ch] asap-stdio.[ch] asap.[ch])
 	$(WIN_CC)
 CLEAN += win32/asapconv-no-lame.exe win32/x64/asapconv-no-lame.exe
 
-win32/msvc/asapconv.exe win32/msvc/x64/asapconv.exe: $(call src,asapconv.c asap-stdio.[ch] asap.[ch])
+win32/msvc/asapconv.exe win32/msvc/x64/asapconv.exe: $(call src,asapconv.c asap-flac.[ch] asap-parallel.[ch] asap-stdio.[ch] asap.[ch])
 	$(WIN_CL) -DHAVE_LIBMP3LAME -DHAVE_LIBMP3LAME_DLL
 CLEAN += win32/msvc/asapconv.exe win32/msvc/x64/asapconv.exe
 
@@ -91,11 +91,11 @@ CLEAN += win32/wasap/wasap-res.o win32/x64/wasap-res.o
 
 # VLC
 
-win32/libasap_plugin.dll: $(call src,vlc/libasap_plugin.c asap.[ch]) win32/libasap_plugin-res.o
+win32/libasap_plugin.dll: $(call src,vlc/libasap_plugin.c asap.[ch] asap-durationthread.[ch] asap-metacache.[ch]) win32/libasap_plugin-res.o
 	$(WIN_CC:-static=-static-libgcc) -I$(VLC_INCLUDE) -L$(VLC_LIB32) -lvlccore
 CLEAN += win32/libasap_plugin.dll
 
-win32/x64/libasap_plugin.dll: $(call src,vlc/libasap_plugin.c asap.[ch]) win32/x64/libasap_plugin-res.o
+win32/x64/libasap_plugin.dll: $(call src,vlc/libasap_plugin.c asap.[ch] asap-durationthread.[ch] asap-metacache.[ch]) win32/x64/libasap_plugin-res.o
 	$(WIN_CC:-static=-static-libgcc) -I$(VLC_INCLUDE) -L$(VLC_LIB64) -lvlccore
 CLEAN += win32/x64/libasap_plugin.dll
 
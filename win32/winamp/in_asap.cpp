@@ -40,6 +40,8 @@
 
 #include "aatr-stdio.h"
 #include "asap.h"
+#include "asap-tracecache.h"
+#include "asap-metacache.h"
 #include "..\info_dlg.h"
 #include "..\settings_dlg.h"
 #include "win32\resource.h"
@@ -209,37 +211,33 @@ static void expandFileSongs(HWND playlistWnd, int index, ASAPInfo *info)
 		AATR *disk = AATRStdio_New(fi.file);
 		if (disk != NULL) {
 			bool found = false;
-			AATRRecursiveLister *lister = AATRRecursiveLister_New();
-			if (lister != NULL) {
-				AATRFileStream *stream = AATRFileStream_New();
-				if (stream != NULL) {
-					size_t atr_fn_len = strlen(fi.file);
-					fi.file[atr_fn_len++] = '#';
-					AATRRecursiveLister_Open(lister, disk);
-					for (;;) {
-						const char *inside_fn = AATRRecursiveLister_NextFile(lister);
-						if (inside_fn == NULL)
-							break;
-						if (ASAPInfo_IsOurFile(inside_fn)) {
-							AATRFileStream_Open(stream, AATRRecursiveLister_GetDirectory(lister));
-							module_len = AATRFileStream_Read(stream, module, 0, sizeof(module));
-							if (ASAPInfo_Load(info, inside_fn, module, module_len)) {
-								size_t inside_fn_len = strlen(inside_fn);
-								if (atr_fn_len + inside_fn_len + 4 <= sizeof(fi.file)) {
-									memcpy(fi.file + atr_fn_len, inside_fn, inside_fn_len + 1);
-									if (!found) {
-										found = true;
-										SendMessage(playlistWnd, WM_WA_IPC, IPC_PE_DELETEINDEX, index);
-									}
-									addFileSongs(playlistWnd, &fi, info, &index);
+			/* the index is kept for playing the songs added here */
+			const AATRIndex *atr_index = AATRStdio_GetIndex(disk);
+			AATRFileStream *stream = AATRFileStream_New();
+			if (atr_index != NULL && stream != NULL) {
+				size_t atr_fn_len = strlen(fi.file);
+				fi.file[atr_fn_len++] = '#';
+				int files = AATRIndex_GetFileCount(atr_index);
+				for (int file = 0; file < files; file++) {
+					const char *inside_fn = AATRIndex_GetPath(atr_index, file);
+					if (ASAPInfo_IsOurFile(inside_fn)) {
+						AATRFileStream_OpenIndexed(stream, disk, atr_index, file);
+						module_len = AATRFileStream_Read(stream, module, 0, sizeof(module));
+						if (ASAPInfo_Load(info, inside_fn, module, module_len)) {
+							size_t inside_fn_len = strlen(inside_fn);
+							if (atr_fn_len + inside_fn_len + 4 <= sizeof(fi.file)) {
+								memcpy(fi.file + atr_fn_len, inside_fn, inside_fn_len + 1);
+								if (!found) {
+									found = true;
+									SendMessage(playlistWnd, WM_WA_IPC, IPC_PE_DELETEINDEX, index);
 								}
+								addFileSongs(playlistWnd, &fi, info, &index);
 							}
 						}
 					}
-					AATRFileStream_Delete(stream);
 				}
-				AATRRecursiveLister_Delete(lister);
 			}
+			AATRFileStream_Delete(stream);
 			AATRStdio_Delete(disk);
 			/* Prevent Winamp crash:
 			   1. Play anything.
@@ -789,6 +787,16 @@ static char* appendStil(char* p, const char* prefix, const char* value)
 	return p;
 }
 
+// same as getSongDuration, for a song with a known duration in the cache
+static int getCachedSongDuration(const ASAPMetadata* metadata, const int song)
+{
+	if (play_loops && metadata->loops[song])
+	{
+		return (1000 * song_length);
+	}
+	return metadata->durations[song];
+}
+
 static int get_metadata(const char* filename, const ASAPInfo* info, int song,
 						BYTE *the_module, const int the_module_len,
 						const char* data, wchar_t* dest, const int destlen)
@@ -1073,6 +1081,30 @@ extern "C" __declspec(dllexport) int winampGetExtendedFileInfoW(const wchar_t *f
 		}
 	}
 
+	// detecting the durations is slow, so answer them from the
+	// cache shared with the other players without loading the file
+	const bool length_seconds = SameStrA(data, "length_seconds");
+	if (!reset && (length_seconds || SameStrA(data, "length")))
+	{
+		const AutoCharFn cache_file(filename);
+		ASAPMetadata metadata;
+		if ((!last_info_filename || !SameStrA(cache_file, last_info_filename)) &&
+			ASAPMetaCache_GetFile(cache_file, &metadata))
+		{
+			const int song = ((title_song < 0) ? metadata.defaultSong : title_song);
+			// playlist loads cache the metadata without analyzing the songs,
+			// so only use durations that are known and load the file otherwise
+			if ((song < metadata.songs) && (metadata.durations[song] >= 0))
+			{
+				int ret = 0;
+				const int length = getCachedSongDuration(&metadata, song);
+				I2WStrLen((!length_seconds ? length : (length / 1000)), dest, destlen, &ret);
+				LeaveCriticalSection(&g_info_cs);
+				return ret;
+			}
+		}
+	}
+
 	static BYTE* title_module;
 	static int title_module_len;
 	static ASAPInfo* title_info;
@@ -1111,6 +1143,10 @@ extern "C" __declspec(dllexport) int winampGetExtendedFileInfoW(const wchar_t *f
 				{
 					clean_up = true;
 				}
+				else if (hash == NULL)
+				{
+					ASAPMetaCache_Put(file, title_module, title_module_len, title_info);
+				}
 			}
 		}
 		else
@@ -1146,12 +1182,18 @@ extern "C" __declspec(dllexport) int winampGetExtendedFileInfoW(const wchar_t *f
 struct ExtendedRead
 {
 	ExtendedRead() : asap(ASAP_New()), info(NULL), module((BYTE*)calloc(sizeof(BYTE),
-										  ASAPInfo_MAX_MODULE_LENGTH)), module_len(0)
+										  ASAPInfo_MAX_MODULE_LENGTH)), module_len(0), trace_cache(NULL)
 	{
 	}
 
 	~ExtendedRead()
 	{
+		if (trace_cache != NULL)
+		{
+			ASAPTraceCache_Delete(trace_cache);
+			trace_cache = NULL;
+		}
+
 		if (asap != NULL)
 		{
 			ASAP_Delete(asap);
@@ -1163,6 +1205,7 @@ struct ExtendedRead
 	const ASAPInfo* info;
 	BYTE* module;
 	int module_len = 0;
+	ASAPTraceCache* trace_cache;
 };
 
 extern "C" __declspec(dllexport) intptr_t winampGetExtendedRead_openW(const wchar_t* fn, int* size, int* bps, int* nch, int* srate)
@@ -1185,7 +1228,12 @@ extern "C" __declspec(dllexport) intptr_t winampGetExtendedRead_openW(const wcha
 						song = ASAPInfo_GetDefaultSong(e->info);
 					}
 
-					if (ASAP_PlaySong(e->asap, song, getSongDurationInternal(e->info, song, e->asap)))
+					// transcoding tends to open the same modules over
+					// and over so replay the recorded POKEY writes if we can
+					ASAP_SetSampleRate(e->asap, sample_rate);
+					e->trace_cache = ASAPTraceCache_PlaySong(e->asap, e->module, e->module_len, song,
+															 getSongDurationInternal(e->info, song, e->asap));
+					if (e->trace_cache != NULL)
 					{
 						ASAP_MutePokeyChannels(e->asap, 0);
 
@@ -1226,31 +1274,43 @@ extern "C" __declspec(dllexport) void winampGetExtendedRead_close(intptr_t handl
 	}
 }
 
-const int get_songs_count(const char* fn, const wchar_t* inside_fn, AATRRecursiveLister* lister, AATRFileStream* stream, int *songs)
+// stream is the file already opened on an ATR disk image, or NULL to load inside_fn
+const int get_songs_count(const char* fn, const wchar_t* inside_fn, AATRFileStream* stream, int *songs)
 {
 	if (ASAPInfo_IsOurFile(fn))
 	{
-		ASAPInfo* playlist_info = ASAPInfo_New();
-		if (playlist_info != NULL)
+		ASAPMetadata metadata;
+		if (!stream && ASAPMetaCache_GetFile(fn, &metadata))
 		{
-			if (lister != NULL)
+			if (songs)
 			{
-				AATRFileStream_Open(stream, AATRRecursiveLister_GetDirectory(lister));
+				*songs += metadata.songs;
 			}
+			return true;
+		}
 
+		ASAPInfo* playlist_info = ASAPInfo_New();
+		if (playlist_info != NULL)
+		{
 			BYTE* playlist_module = (BYTE*)SafeMalloc(ASAPInfo_MAX_MODULE_LENGTH);
 			if (playlist_module != NULL)
 			{
-				int playlist_module_len = (lister ? AATRFileStream_Read(stream, playlist_module, 0,
+				int playlist_module_len = (stream ? AATRFileStream_Read(stream, playlist_module, 0,
 																  ASAPInfo_MAX_MODULE_LENGTH) : 0);
 
-				if ((!lister ? loadModule(inside_fn, playlist_module, &playlist_module_len, NULL) : true) &&
-									 ASAPInfo_Load(playlist_info, fn, playlist_module, playlist_module_len))
+				// only the number of songs is needed, so don't analyze their durations
+				if ((!stream ? loadModule(inside_fn, playlist_module, &playlist_module_len, NULL) : true) &&
+									 ASAPInfo_LoadMetadata(playlist_info, fn, playlist_module, playlist_module_len))
 				{
 					if (songs)
 					{
 						*songs += ASAPInfo_GetSongs(playlist_info);
 					}
+
+					if (!stream)
+					{
+						ASAPMetaCache_Put(fn, playlist_module, playlist_module_len, playlist_info);
+					}
 				}
 				SafeFree(playlist_module);
 			}
@@ -1267,29 +1327,26 @@ extern "C" __declspec(dllexport) int GetSubSongInfo(const wchar_t* filename)
 	extractSongNumber(filename, inside_fn);
 	int songs = 0;
 	const AutoCharFn fn(inside_fn);
-	if (!get_songs_count(fn, inside_fn, NULL, NULL, &songs) && isATR(filename))
+	if (!get_songs_count(fn, inside_fn, NULL, &songs) && isATR(filename))
 	{
 		AATR *disk = AATRStdio_New(fn);
 		if (disk != NULL) {
-			AATRRecursiveLister *lister = AATRRecursiveLister_New();
-			if (lister != NULL) {
-				AATRFileStream *stream = AATRFileStream_New();
-				if (stream != NULL)
+			const AATRIndex *index = AATRStdio_GetIndex(disk);
+			AATRFileStream *stream = AATRFileStream_New();
+			if (index != NULL && stream != NULL)
+			{
+				const int files = AATRIndex_GetFileCount(index);
+				for (int file = 0; file < files; file++)
 				{
-					AATRRecursiveLister_Open(lister, disk);
-					for (;;)
+					const char *atr_inside_fn = AATRIndex_GetPath(index, file);
+					if (ASAPInfo_IsOurFile(atr_inside_fn))
 					{
-						const char *inside_fn = AATRRecursiveLister_NextFile(lister);
-						if (inside_fn == NULL)
-						{
-							break;
-						}
-						songs += get_songs_count(fn, NULL, lister, stream, &songs);
+						AATRFileStream_OpenIndexed(stream, disk, index, file);
+						get_songs_count(atr_inside_fn, NULL, stream, &songs);
 					}
-					AATRFileStream_Delete(stream);
 				}
-				AATRRecursiveLister_Delete(lister);
 			}
+			AATRFileStream_Delete(stream);
 			AATRStdio_Delete(disk);
 		}
 	}
@@ -36,6 +36,7 @@
 #include <xmms/util.h>
 
 #include "asap.h"
+#include "asap-metacache.h"
 
 #define BITS_PER_SAMPLE  16
 #define BUFFERED_BLOCKS  512
@@ -101,21 +102,28 @@ static bool asap_load_file(const char *filename)
 	return true;
 }
 
-static ASAPInfo *asap_get_info(const char *filename)
+static bool asap_get_metadata(const char *filename, ASAPMetadata *metadata)
 {
+	if (ASAPMetaCache_GetFile(filename, metadata))
+		return true;
 	if (!asap_load_file(filename))
-		return NULL;
+		return false;
 	ASAPInfo *info = ASAPInfo_New();
 	if (info == NULL)
-		return NULL;
-	if (!ASAPInfo_Load(info, filename, module, module_len)) {
-		ASAPInfo_Delete(info);
-		return NULL;
+		return false;
+	bool ok = ASAPInfo_LoadMetadata(info, filename, module, module_len);
+	if (ok) {
+		/* the playlist only shows the default song */
+		ASAPInfo_AnalyzeSong(info, module, ASAPInfo_GetDefaultSong(info));
+		ASAPMetaCache_Put(filename, module, module_len, info);
+		if (!ASAPMetaCache_GetModule(module, module_len, metadata))
+			ASAPMetadata_SetInfo(metadata, info);
 	}
-	return info;
+	ASAPInfo_Delete(info);
+	return ok;
 }
 
-static char *asap_get_title(const char *filename, const ASAPInfo *info)
+static char *asap_get_title(const char *filename, const ASAPMetadata *metadata)
 {
 	char *path = g_strdup(filename);
 	char *filepart = strrchr(path, '/');
@@ -131,22 +139,20 @@ static char *asap_get_title(const char *filename, const ASAPInfo *info)
 
 	TitleInput *title_input;
 	XMMS_NEW_TITLEINPUT(title_input);
-	const char *p = ASAPInfo_GetAuthor(info);
-	if (p[0] != '\0')
-		title_input->performer = (gchar *) p;
-	title_input->track_name = (gchar *) ASAPInfo_GetTitleOrFilename(info);
-	int year = ASAPInfo_GetYear(info);
-	if (year > 0)
-		title_input->year = year;
-	p = ASAPInfo_GetDate(info);
-	if (p[0] != '\0')
-		title_input->date = (gchar *) p;
+	const char *title_or_filename = metadata->title[0] != '\0' ? metadata->title : filename;
+	if (metadata->author[0] != '\0')
+		title_input->performer = (gchar *) metadata->author;
+	title_input->track_name = (gchar *) title_or_filename;
+	if (metadata->year > 0)
+		title_input->year = metadata->year;
+	if (metadata->date[0] != '\0')
+		title_input->date = (gchar *) metadata->date;
 	title_input->file_name = g_basename(filename);
 	title_input->file_ext = ext;
 	title_input->file_path = path;
 	char *title = xmms_get_titlestring(xmms_get_gentitle_format(), title_input);
 	if (title == NULL)
-		title = g_strdup(ASAPInfo_GetTitleOrFilename(info));
+		title = g_strdup(title_or_filename);
 
 	g_free(path);
 	return title;
@@ -195,13 +201,17 @@ static void asap_play_file(char *filename)
 		return;
 	const ASAPInfo *info = ASAP_GetInfo(asap);
 	int song = ASAPInfo_GetDefaultSong(info);
-	int duration = ASAPInfo_GetDuration(info, song);
+	ASAPMetadata metadata;
+	/* the cache may know the duration of a song without TIME */
+	if (!ASAPMetaCache_GetModule(module, module_len, &metadata))
+		ASAPMetadata_SetInfo(&metadata, info);
+	int duration = metadata.durations[song];
 	if (!ASAP_PlaySong(asap, song, duration))
 		return;
 	channels = ASAPInfo_GetChannels(info);
 	if (!mod.output->open_audio(BITS_PER_SAMPLE == 8 ? FMT_U8 : FMT_S16_LE, ASAP_SAMPLE_RATE, channels))
 		return;
-	char *title = asap_get_title(filename, info);
+	char *title = asap_get_title(filename, &metadata);
 	mod.set_info(title, duration, BITS_PER_SAMPLE * 1000, ASAP_SAMPLE_RATE, channels);
 	g_free(title);
 	seek_to = -1;
@@ -241,28 +251,26 @@ static int asap_get_time(void)
 
 static void asap_get_song_info(char *filename, char **title, int *length)
 {
-	ASAPInfo *info = asap_get_info(filename);
-	if (info == NULL)
+	ASAPMetadata metadata;
+	if (!asap_get_metadata(filename, &metadata))
 		return;
-	*title = asap_get_title(filename, info);
-	*length = ASAPInfo_GetDuration(info, ASAPInfo_GetDefaultSong(info));
-	ASAPInfo_Delete(info);
+	*title = asap_get_title(filename, &metadata);
+	*length = metadata.durations[metadata.defaultSong];
 }
 
 static void asap_file_info_box(char *filename)
 {
-	ASAPInfo *info = asap_get_info(filename);
-	if (info == NULL)
+	ASAPMetadata metadata;
+	if (!asap_get_metadata(filename, &metadata))
 		return;
 	char s[3 * ASAPInfo_MAX_TEXT_LENGTH + 100];
 	char *p = asap_stpcpy(s, "Author: ");
-	p = asap_stpcpy(p, ASAPInfo_GetAuthor(info));
+	p = asap_stpcpy(p, metadata.author);
 	p = asap_stpcpy(p, "\nName: ");
-	p = asap_stpcpy(p, ASAPInfo_GetTitle(info));
+	p = asap_stpcpy(p, metadata.title);
 	p = asap_stpcpy(p, "\nDate: ");
-	p = asap_stpcpy(p, ASAPInfo_GetDate(info));
+	p = asap_stpcpy(p, metadata.date);
 	*p = '\0';
-	ASAPInfo_Delete(info);
 	asap_show_message("File information", s);
 }
 
@@ -12,7 +12,7 @@ endif
 asap-xmms: libasap-xmms.so
 .PHONY: asap-xmms
 
-libasap-xmms.so: $(call src,xmms/libasap-xmms.c asap.[ch])
+libasap-xmms.so: $(call src,xmms/libasap-xmms.c asap.[ch] asap-metacache.[ch])
 	$(DO_CC) $(XMMS_CFLAGS) -Wl,--version-script=$(srcdir)xmms/libasap-xmms.map $(XMMS_LIBS)
 CLEAN += libasap-xmms.so
 
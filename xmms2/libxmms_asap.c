@@ -25,6 +25,7 @@
 #include <xmms/xmms_log.h>
 
 #include "asap.h"
+#include "asap-metacache.h"
 
 static void set_str(xmms_xform_t *xform, const char *key, const char *val)
 {
@@ -52,6 +53,10 @@ static gboolean xmms_asap_init(xmms_xform_t *xform)
 	const ASAPInfo *info = ASAP_GetInfo(asap);
 	int song = ASAPInfo_GetDefaultSong(info);
 	int duration = ASAPInfo_GetDuration(info, song);
+	ASAPMetadata metadata;
+	/* another player may have detected the duration of a song without TIME */
+	if (duration < 0 && ASAPMetaCache_GetModule(module, moduleLen, &metadata))
+		duration = metadata.durations[song];
 	if (!ASAP_PlaySong(asap, song, duration)) {
 		ASAP_Delete(asap);
 		return FALSE;
@@ -10,7 +10,7 @@ endif
 asap-xmms2: libxmms_asap.so
 .PHONY: asap-xmms2
 
-libxmms_asap.so: $(call src,xmms2/libxmms_asap.c xmms2/xmms_configuration.h asap.[ch])
+libxmms_asap.so: $(call src,xmms2/libxmms_asap.c xmms2/xmms_configuration.h asap.[ch] asap-metacache.[ch])
 	$(DO_CC) $(XMMS2_CFLAGS)
 CLEAN += libxmms_asap.so
 